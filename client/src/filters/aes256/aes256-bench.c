@@ -0,0 +1,178 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Encrypts and decrypts the same data with the legacy CBC format and the
+ * chunked GCM format (single and multi threaded), checks the roundtrip
+ * and reports the throughput of each */
+
+#include "default.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include "sx.h"
+
+#define DEFAULT_SIZE_MB 256
+/* libsx feeds filters with buffers of this size */
+#define IO_SIZE 8192
+
+extern sxc_filter_t sxc_filter;
+
+static double timediff(const struct timeval *start, const struct timeval *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static int run(const char *cfgdir, const unsigned char *cfg, unsigned int cfg_len, sxf_mode_t mode, const unsigned char *in, size_t insize, unsigned char *out, size_t outmax, size_t *outsize)
+{
+    sxf_action_t action = SXF_ACTION_NORMAL;
+    size_t pos = 0, done = 0, n;
+    void *ctx = NULL;
+    ssize_t got;
+
+    if(sxc_filter.data_prepare(NULL, &ctx, "bench", cfgdir, cfg, cfg_len, mode))
+	return -1;
+    while(pos < insize) {
+	n = insize - pos > IO_SIZE ? IO_SIZE : insize - pos;
+	if(pos + n == insize)
+	    action = SXF_ACTION_DATA_END;
+	do {
+	    if(done + IO_SIZE > outmax) {
+		fprintf(stderr, "Output buffer too small\n");
+		sxc_filter.data_finish(NULL, &ctx, mode);
+		return -1;
+	    }
+	    got = sxc_filter.data_process(NULL, ctx, in + pos, n, out + done, IO_SIZE, mode, &action);
+	    if(got < 0) {
+		sxc_filter.data_finish(NULL, &ctx, mode);
+		return -1;
+	    }
+	    done += got;
+	} while(action == SXF_ACTION_REPEAT);
+	pos += n;
+    }
+    if(sxc_filter.data_finish(NULL, &ctx, mode))
+	return -1;
+    *outsize = done;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct {
+	const char *name;
+	const char *format;
+	unsigned int threads;
+    } tests[] = {
+	{ "cbc (legacy)", "1", 1 },
+	{ "gcm", "2", 1 },
+	{ "gcm", "2", 0 }
+    };
+    unsigned char *plain, *enc, *dec, key[64], cfg[17];
+    size_t size, encmax, encsize, decsize, i;
+    char cfgdir[] = "/tmp/aes256-bench-XXXXXX", keyfile[sizeof(cfgdir) + 4], threads[16];
+    struct timeval t0, t1, t2;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int fd, ret = 1;
+
+    size = (argc > 1 ? atoi(argv[1]) : DEFAULT_SIZE_MB) * 1024UL * 1024UL;
+    if(!size) {
+	fprintf(stderr, "Usage: %s [size_in_MB]\n", argv[0]);
+	return 1;
+    }
+    if(ncpus < 1)
+	ncpus = 1;
+    tests[2].threads = ncpus;
+
+    /* worst case growth is the CBC format: 80 bytes per 16KB block */
+    encmax = size + size / 128 + 2 * IO_SIZE + 1024;
+    plain = malloc(size);
+    enc = malloc(encmax);
+    dec = malloc(size + 2 * IO_SIZE);
+    if(!plain || !enc || !dec) {
+	fprintf(stderr, "Out of memory\n");
+	goto bench_err;
+    }
+    srandom(getpid());
+    for(i = 0; i < sizeof(key); i++)
+	key[i] = random();
+    for(i = 0; i < sizeof(cfg); i++)
+	cfg[i] = random();
+    for(i = 0; i < size; i++)
+	plain[i] = random();
+
+    /* nogenkey configuration, with the key file already in place */
+    if(!mkdtemp(cfgdir)) {
+	perror("mkdtemp");
+	goto bench_err;
+    }
+    snprintf(keyfile, sizeof(keyfile), "%s/key", cfgdir);
+    fd = open(keyfile, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0 || write(fd, key, sizeof(key)) != sizeof(key) || close(fd)) {
+	perror("key file");
+	goto bench_cleanup;
+    }
+
+    printf("Processing %lu MB in %u byte pieces\n", (unsigned long)(size / (1024 * 1024)), IO_SIZE);
+    for(i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+	snprintf(threads, sizeof(threads), "%u", tests[i].threads);
+	setenv("SX_AES256_FORMAT", tests[i].format, 1);
+	setenv("SX_AES256_THREADS", threads, 1);
+
+	gettimeofday(&t0, NULL);
+	if(run(cfgdir, cfg, sizeof(cfg), SXF_MODE_UPLOAD, plain, size, enc, encmax, &encsize)) {
+	    fprintf(stderr, "%s: encryption failed\n", tests[i].name);
+	    goto bench_cleanup;
+	}
+	gettimeofday(&t1, NULL);
+	if(run(cfgdir, cfg, sizeof(cfg), SXF_MODE_DOWNLOAD, enc, encsize, dec, size + 2 * IO_SIZE, &decsize)) {
+	    fprintf(stderr, "%s: decryption failed\n", tests[i].name);
+	    goto bench_cleanup;
+	}
+	gettimeofday(&t2, NULL);
+	if(decsize != size || memcmp(plain, dec, size)) {
+	    fprintf(stderr, "%s: decrypted data doesn't match the input\n", tests[i].name);
+	    goto bench_cleanup;
+	}
+	printf("%-13s %2u thread(s): encrypt %8.1f MB/s, decrypt %8.1f MB/s, size +%.2f%%\n", tests[i].name, tests[i].threads,
+	       size / timediff(&t0, &t1) / (1024 * 1024), size / timediff(&t1, &t2) / (1024 * 1024),
+	       (encsize - size) * 100.0 / size);
+    }
+    ret = 0;
+
+ bench_cleanup:
+    unlink(keyfile);
+    rmdir(cfgdir);
+ bench_err:
+    free(plain);
+    free(enc);
+    free(dec);
+    return ret;
+}
@@ -42,6 +42,7 @@
 #include <errno.h>
 
 #include "libsx/src/misc.h"
+#include "libsx/src/workpool.h"
 #include "sx.h"
 #include "crypt_blowfish.h"
 
@@ -58,6 +59,26 @@
 #define SALT_SIZE 16
 #define FP_SIZE (SALT_SIZE + KEY_SIZE)
 
+/* Chunked format (v2): a header followed by independently encrypted and
+ * authenticated chunks of CHUNK_SIZE bytes (the last one may be shorter,
+ * down to empty, and is always present so that truncation is detected).
+ * Each chunk is NONCE | AES-256-GCM(data) | TAG, the nonce is derived from
+ * the chunk index and contents, and the header, index and last-chunk flag
+ * are authenticated as AAD. Encrypted chunks have a fixed stride so any
+ * range can be located and decrypted on its own. Legacy (v1) files start
+ * with a random looking IV and are told apart by the header magic. */
+#define V2_MAGIC "SXAES256"
+#define V2_MAGIC_SIZE 8
+#define V2_VERSION 2
+#define V2_HDR_SIZE 16
+#define V2_CHUNK_SIZE 65536
+#define V2_MAX_CHUNK_SIZE (1024 * 1024)
+#define V2_NONCE_SIZE 12
+#define V2_TAG_SIZE 16
+#define V2_OVERHEAD (V2_NONCE_SIZE + V2_TAG_SIZE)
+#define V2_BATCH_CHUNKS 64
+#define V2_MAX_THREADS 16
+
 #ifdef HMAC_UPDATE_RETURNS_INT
 #define hmac_init_ex HMAC_Init_ex
 #define hmac_update HMAC_Update
@@ -68,6 +89,11 @@
 #define hmac_final(a, b, c) (HMAC_Final((a), (b), (c)), 1)
 #endif
 
+struct aes256_worker {
+    EVP_CIPHER_CTX cctx;
+    HMAC_CTX nhash;
+};
+
 struct aes256_ctx {
     EVP_CIPHER_CTX ectx, dctx;
     HMAC_CTX ivhash;
@@ -78,6 +104,19 @@ struct aes256_ctx {
     unsigned char blk[IV_SIZE + FILTER_BLOCK_SIZE + AES_BLOCK_SIZE + MAC_SIZE];
     char *keyfile;
     int decrypt_err;
+
+    /* chunked format */
+    sxf_mode_t mode;
+    int format;
+    unsigned char hdr[V2_HDR_SIZE];
+    unsigned int hdrbytes, hdr_done, chunk_size, finished;
+    unsigned char *ibuf, *obuf;
+    unsigned int ibytes, obytes, oleft, obase;
+    uint64_t chunkno;
+    struct aes256_worker *workers;
+    unsigned int nworkers;
+    sxi_workpool_t *pool;
+    unsigned int nchunks, last_final;
 };
 
 
@@ -331,6 +370,268 @@ static int aes256_shutdown(const sxf_handle_t *handle, void *ctx)
     return 0;
 }
 
+static unsigned int v2_in_chunk(const struct aes256_ctx *actx)
+{
+    return actx->mode == SXF_MODE_UPLOAD ? actx->chunk_size : actx->chunk_size + V2_OVERHEAD;
+}
+
+static unsigned int v2_out_chunk(const struct aes256_ctx *actx)
+{
+    return actx->mode == SXF_MODE_UPLOAD ? actx->chunk_size + V2_OVERHEAD : actx->chunk_size;
+}
+
+/* returns 0 on success, 1 on authentication failure, -1 on other errors */
+static int v2_chunk(void *ctx, unsigned int wid, unsigned int i)
+{
+	struct aes256_ctx *actx = ctx;
+	struct aes256_worker *w = &actx->workers[wid];
+	unsigned int in_chunk = v2_in_chunk(actx);
+	const unsigned char *in = actx->ibuf + (size_t) i * in_chunk;
+	unsigned char *out = actx->obuf + actx->obase + (size_t) i * v2_out_chunk(actx);
+	unsigned int len = i == actx->nchunks - 1 ? actx->ibytes - i * in_chunk : in_chunk;
+	unsigned char aad[9], mac[EVP_MAX_MD_SIZE];
+	uint64_t idx = actx->chunkno + i;
+	unsigned int j, maclen;
+	int outl, final;
+
+    for(j = 0; j < 8; j++)
+	aad[j] = idx >> (56 - 8 * j);
+    aad[8] = actx->last_final && i == actx->nchunks - 1;
+
+    if(actx->mode == SXF_MODE_UPLOAD) {
+	/* deterministic nonce: identical files still encrypt identically */
+	if(hmac_init_ex(&w->nhash, NULL, 0, NULL, NULL) != 1 ||
+	   hmac_update(&w->nhash, aad, sizeof(aad)) != 1 ||
+	   hmac_update(&w->nhash, in, len) != 1 ||
+	   hmac_final(&w->nhash, mac, &maclen) != 1 ||
+	   maclen < V2_NONCE_SIZE)
+	    return -1;
+	memcpy(out, mac, V2_NONCE_SIZE);
+	if(EVP_EncryptInit_ex(&w->cctx, NULL, NULL, NULL, out) != 1 ||
+	   EVP_EncryptUpdate(&w->cctx, NULL, &outl, actx->hdr, V2_HDR_SIZE) != 1 ||
+	   EVP_EncryptUpdate(&w->cctx, NULL, &outl, aad, sizeof(aad)) != 1 ||
+	   EVP_EncryptUpdate(&w->cctx, out + V2_NONCE_SIZE, &outl, in, len) != 1 ||
+	   EVP_EncryptFinal_ex(&w->cctx, out + V2_NONCE_SIZE + outl, &final) != 1 ||
+	   EVP_CIPHER_CTX_ctrl(&w->cctx, EVP_CTRL_GCM_GET_TAG, V2_TAG_SIZE, out + V2_NONCE_SIZE + len) != 1)
+	    return -1;
+    } else {
+	if(EVP_DecryptInit_ex(&w->cctx, NULL, NULL, NULL, in) != 1 ||
+	   EVP_DecryptUpdate(&w->cctx, NULL, &outl, actx->hdr, V2_HDR_SIZE) != 1 ||
+	   EVP_DecryptUpdate(&w->cctx, NULL, &outl, aad, sizeof(aad)) != 1 ||
+	   EVP_DecryptUpdate(&w->cctx, out, &outl, in + V2_NONCE_SIZE, len - V2_OVERHEAD) != 1 ||
+	   EVP_CIPHER_CTX_ctrl(&w->cctx, EVP_CTRL_GCM_SET_TAG, V2_TAG_SIZE, (void *) (in + len - V2_TAG_SIZE)) != 1)
+	    return -1;
+	if(EVP_DecryptFinal_ex(&w->cctx, out + outl, &final) != 1)
+	    return 1;
+    }
+    return 0;
+}
+
+static int v2_init(const sxf_handle_t *handle, struct aes256_ctx *actx)
+{
+	unsigned int i, nworkers = sxi_workpool_nthreads("SX_AES256_THREADS", V2_MAX_THREADS);
+	struct aes256_worker *w;
+
+    actx->format = V2_VERSION;
+    if(actx->mode == SXF_MODE_UPLOAD) {
+	actx->chunk_size = V2_CHUNK_SIZE;
+	memcpy(actx->hdr, V2_MAGIC, V2_MAGIC_SIZE);
+	actx->hdr[8] = V2_VERSION;
+	actx->hdr[12] = actx->chunk_size >> 24;
+	actx->hdr[13] = actx->chunk_size >> 16;
+	actx->hdr[14] = actx->chunk_size >> 8;
+	actx->hdr[15] = actx->chunk_size;
+    }
+
+    actx->ibuf = malloc((size_t) V2_BATCH_CHUNKS * v2_in_chunk(actx));
+    actx->obuf = malloc(V2_HDR_SIZE + (size_t) V2_BATCH_CHUNKS * v2_out_chunk(actx));
+    actx->workers = calloc(nworkers, sizeof(*actx->workers));
+    if(!actx->ibuf || !actx->obuf || !actx->workers) {
+	ERROR("OOM");
+	return -1;
+    }
+    actx->nworkers = nworkers;
+
+    for(i = 0; i < nworkers; i++) {
+	w = &actx->workers[i];
+	mlock(&w->cctx, sizeof(w->cctx));
+	EVP_CIPHER_CTX_init(&w->cctx);
+	HMAC_CTX_init(&w->nhash);
+	if(actx->mode == SXF_MODE_UPLOAD) {
+	    if(EVP_EncryptInit_ex(&w->cctx, EVP_aes_256_gcm(), NULL, actx->key + KEY_SIZE / 2, NULL) != 1 ||
+	       hmac_init_ex(&w->nhash, actx->key, KEY_SIZE / 2, EVP_sha256(), NULL) != 1) {
+		ERROR("Can't initialize encryption context");
+		return -1;
+	    }
+	} else if(EVP_DecryptInit_ex(&w->cctx, EVP_aes_256_gcm(), NULL, actx->key + KEY_SIZE / 2, NULL) != 1) {
+	    ERROR("Can't initialize decryption context");
+	    return -1;
+	}
+    }
+    actx->pool = sxi_workpool_new(nworkers, v2_chunk, actx);
+    if(!actx->pool) {
+	ERROR("Can't start worker threads");
+	return -1;
+    }
+    return 0;
+}
+
+static void v2_cleanup(struct aes256_ctx *actx)
+{
+	unsigned int i;
+
+    sxi_workpool_free(actx->pool);
+    actx->pool = NULL;
+    if(actx->workers) {
+	for(i = 0; i < actx->nworkers; i++) {
+	    struct aes256_worker *w = &actx->workers[i];
+	    EVP_CIPHER_CTX_cleanup(&w->cctx);
+	    HMAC_CTX_cleanup(&w->nhash);
+	    memset(&w->cctx, 0, sizeof(w->cctx));
+	    munlock(&w->cctx, sizeof(w->cctx));
+	}
+	free(actx->workers);
+	actx->workers = NULL;
+    }
+    if(actx->ibuf) {
+	memset(actx->ibuf, 0, (size_t) V2_BATCH_CHUNKS * v2_in_chunk(actx));
+	free(actx->ibuf);
+	actx->ibuf = NULL;
+    }
+    if(actx->obuf) {
+	memset(actx->obuf, 0, V2_HDR_SIZE + (size_t) V2_BATCH_CHUNKS * v2_out_chunk(actx));
+	free(actx->obuf);
+	actx->obuf = NULL;
+    }
+}
+
+static int v2_run_batch(const sxf_handle_t *handle, struct aes256_ctx *actx, int final)
+{
+	unsigned int in_chunk = v2_in_chunk(actx);
+	unsigned int n = (actx->ibytes + in_chunk - 1) / in_chunk;
+	int ret;
+
+    actx->obase = 0;
+    if(actx->mode == SXF_MODE_UPLOAD) {
+	if(!actx->hdr_done) {
+	    memcpy(actx->obuf, actx->hdr, V2_HDR_SIZE);
+	    actx->obase = V2_HDR_SIZE;
+	    actx->hdr_done = 1;
+	}
+	/* the stream always ends with a flagged chunk, empty for empty files */
+	if(final && !n)
+	    n = 1;
+	actx->obytes = actx->obase + actx->ibytes + n * V2_OVERHEAD;
+    } else {
+	if(final && !n) {
+	    ERROR("Incomplete data: missing last chunk");
+	    return -1;
+	}
+	if(n && actx->ibytes - (n - 1) * in_chunk < V2_OVERHEAD) {
+	    ERROR("Incomplete data: %u bytes", actx->ibytes - (n - 1) * in_chunk);
+	    return -1;
+	}
+	actx->obytes = actx->ibytes - n * V2_OVERHEAD;
+    }
+
+    actx->last_final = final;
+    actx->nchunks = n;
+    if(n && (ret = sxi_workpool_run(actx->pool, n))) {
+	if(ret > 0) {
+	    ERROR("Chunk authentication failed (Invalid password/key file or broken data)");
+	    actx->decrypt_err = 1;
+	} else {
+	    ERROR("Can't %s data chunk", actx->mode == SXF_MODE_UPLOAD ? "encrypt" : "decrypt");
+	}
+	return -1;
+    }
+    actx->chunkno += n;
+    actx->ibytes = 0;
+    actx->oleft = actx->obytes;
+    return 0;
+}
+
+static ssize_t v2_data_process(const sxf_handle_t *handle, struct aes256_ctx *actx, const void *in, size_t insize, void *out, size_t outsize, sxf_action_t *action)
+{
+	unsigned int cap = V2_BATCH_CHUNKS * v2_in_chunk(actx);
+	unsigned int bytes;
+	int more;
+
+    if(*action == SXF_ACTION_DATA_END)
+	actx->data_end = 1;
+
+    if(!actx->oleft && !actx->finished) {
+	bytes = insize - actx->data_in;
+	if(bytes > cap - actx->ibytes)
+	    bytes = cap - actx->ibytes;
+	memcpy(actx->ibuf + actx->ibytes, (const unsigned char *) in + actx->data_in, bytes);
+	actx->data_in += bytes;
+	actx->ibytes += bytes;
+	more = actx->data_in < insize;
+	if(actx->data_end && !more) {
+	    if(v2_run_batch(handle, actx, 1))
+		return -1;
+	    actx->finished = 1;
+	} else if(more) {
+	    /* batch full and more data follows: none of its chunks is the last one */
+	    if(v2_run_batch(handle, actx, 0))
+		return -1;
+	} else { /* need more input data */
+	    actx->data_in = 0;
+	    *action = SXF_ACTION_NORMAL;
+	    return 0;
+	}
+    }
+
+    bytes = actx->oleft < outsize ? actx->oleft : outsize;
+    memcpy(out, actx->obuf + actx->obytes - actx->oleft, bytes);
+    actx->oleft -= bytes;
+    if(actx->oleft || actx->data_in < insize) {
+	*action = SXF_ACTION_REPEAT;
+    } else {
+	actx->data_in = 0;
+	*action = actx->data_end ? SXF_ACTION_DATA_END : SXF_ACTION_NORMAL;
+    }
+    return bytes;
+}
+
+/* download: look at the first bytes to pick the format */
+static int v2_detect(const sxf_handle_t *handle, struct aes256_ctx *actx, const void *in, size_t insize, sxf_action_t *action)
+{
+	unsigned int bytes = insize - actx->data_in;
+
+    if(bytes > V2_HDR_SIZE - actx->hdrbytes)
+	bytes = V2_HDR_SIZE - actx->hdrbytes;
+    if(*action == SXF_ACTION_DATA_END)
+	actx->data_end = 1;
+    memcpy(actx->hdr + actx->hdrbytes, (const unsigned char *) in + actx->data_in, bytes);
+    actx->data_in += bytes;
+    actx->hdrbytes += bytes;
+    if(actx->hdrbytes < V2_HDR_SIZE && !actx->data_end)
+	return 0;
+
+    if(actx->hdrbytes == V2_HDR_SIZE && !memcmp(actx->hdr, V2_MAGIC, V2_MAGIC_SIZE)) {
+	if(actx->hdr[8] != V2_VERSION) {
+	    ERROR("Unsupported data format version %u", actx->hdr[8]);
+	    return -1;
+	}
+	actx->chunk_size = ((unsigned int) actx->hdr[12] << 24) | (actx->hdr[13] << 16) | (actx->hdr[14] << 8) | actx->hdr[15];
+	if(!actx->chunk_size || actx->chunk_size > V2_MAX_CHUNK_SIZE) {
+	    ERROR("Invalid chunk size %u", actx->chunk_size);
+	    return -1;
+	}
+	return v2_init(handle, actx);
+    }
+
+    /* legacy format: the bytes read so far are the beginning of the first block */
+    actx->format = 1;
+    memcpy(actx->in, actx->hdr, actx->hdrbytes);
+    actx->inbytes = actx->hdrbytes;
+    return 0;
+}
+
+static int aes256_data_finish(const sxf_handle_t *handle, void **ctx, sxf_mode_t mode);
+
 static int aes256_data_prepare(const sxf_handle_t *handle, void **ctx, const char *filename, const char *cfgdir, const void *cfgdata, unsigned int cfgdata_len, sxf_mode_t mode)
 {
 	struct aes256_ctx *actx;
@@ -456,6 +757,18 @@ static int aes256_data_prepare(const sxf_handle_t *handle, void **ctx, const cha
 
     *ctx = actx;
     memset(actx->ivmac, 0, sizeof(actx->ivmac));
+
+    actx->mode = mode;
+    if(mode == SXF_MODE_UPLOAD) {
+	/* SX_AES256_FORMAT=1 keeps writing the legacy format for older clients */
+	const char *fmt = getenv("SX_AES256_FORMAT");
+	if(fmt && atoi(fmt) == 1)
+	    actx->format = 1;
+	else if(v2_init(handle, actx)) {
+	    aes256_data_finish(handle, ctx, mode);
+	    return -1;
+	}
+    }
     return 0;
 }
 
@@ -477,6 +790,18 @@ static ssize_t aes256_data_process(const sxf_handle_t *handle, void *ctx, const
 	unsigned int bytes;
 	unsigned int bsize = mode == SXF_MODE_UPLOAD ? FILTER_BLOCK_SIZE : sizeof(actx->in);
 
+    if(!actx->format) {
+	if(v2_detect(handle, actx, in, insize, action))
+	    return -1;
+	if(!actx->format) {
+	    actx->data_in = 0;
+	    *action = SXF_ACTION_NORMAL;
+	    return 0;
+	}
+    }
+    if(actx->format == V2_VERSION)
+	return v2_data_process(handle, actx, in, insize, out, outsize, action);
+
     if(*action == SXF_ACTION_REPEAT && actx->data_out_left) {
 	if(actx->data_out_left > outsize) {
 	    memcpy(out, &actx->blk[actx->blkbytes - actx->data_out_left], outsize);
@@ -656,6 +981,7 @@ static int aes256_data_finish(const sxf_handle_t *handle, void **ctx, sxf_mode_t
 	struct aes256_ctx *actx = *ctx;
 
     if(actx) {
+	v2_cleanup(actx);
         HMAC_CTX_cleanup(&actx->hmac);
         HMAC_CTX_cleanup(&actx->ivhash);
 	if(mode == SXF_MODE_UPLOAD) {
@@ -681,12 +1007,12 @@ static int aes256_data_finish(const sxf_handle_t *handle, void **ctx, sxf_mode_t
 sxc_filter_t sxc_filter={
 /* int abi_version */		    SXF_ABI_VERSION,
 /* const char *shortname */	    "aes256",
-/* const char *shortdesc */	    "Encrypt data using AES-256-CBC-HMAC-512 mode.",
-/* const char *summary */	    "The filter automatically encrypts and decrypts all data using OpenSSL's AES-256 in CBC-HMAC-512 mode.",
+/* const char *shortdesc */	    "Encrypt data using AES-256-GCM mode.",
+/* const char *summary */	    "The filter automatically encrypts and decrypts all data using OpenSSL's AES-256 in GCM mode. Files stored in the older CBC-HMAC-512 format remain readable.",
 /* const char *options */	    "\n\tnogenkey (don't generate a key file when creating a volume)\n\tparanoid (don't use key files at all - always ask for a password)\n\tsalt:HEX (force given salt, HEX must be 32 chars long)",
 /* const char *uuid */		    "35a5404d-1513-4009-904c-6ee5b0cd8634",
 /* sxf_type_t type */		    SXF_TYPE_CRYPT,
-/* int version[2] */		    {1, 4},
+/* int version[2] */		    {1, 5},
 /* int (*init)(const sxf_handle_t *handle, void **ctx) */	    aes256_init,
 /* int (*shutdown)(const sxf_handle_t *handle, void *ctx) */    aes256_shutdown,
 /* int (*parse_cfgstr)(const char *cfgstr, void **cfgdata, unsigned int *cfgdata_len) */
@@ -29,16 +29,91 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "sx.h"
 #include "zlib.h"
+#include "libsx/src/workpool.h"
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
 
 #define ERROR(...)	sxc_filter_msg(handle, SX_LOG_ERR, __VA_ARGS__)
 
+/*
+ * Chunked format (all integers are big endian):
+ *
+ *   header:  "SXZC" | version (2) | algorithm | level | 0 | chunk size (32) | 0 (32)
+ *   chunks:  word (32) | data, where word is the stored length and has the
+ *            top bit set for chunks kept uncompressed
+ *   end:     0 (32)
+ *   index:   the word of every chunk (32 each)
+ *   footer:  original size (64) | number of chunks (32) | "SXZI"
+ *
+ * All chunks but the last hold chunk size bytes of original data, so the
+ * footer and the index are enough to locate and decode any range.
+ * Legacy zlib streams always start with a CMF byte with CM = 8 and can
+ * never begin with 'S'.
+ */
+#define V2_MAGIC "SXZC"
+#define V2_MAGIC_SIZE 4
+#define V2_VERSION 2
+#define V2_HDR_SIZE 16
+#define V2_CHUNK_SIZE (128 * 1024)
+#define V2_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+#define V2_RAW_CHUNK 0x80000000
+#define V2_FOOTER_MAGIC "SXZI"
+#define V2_FOOTER_SIZE 16
+#define V2_BATCH_CHUNKS 64
+#define V2_MAX_THREADS 16
+
+#define ALGO_ZLIB 1
+#define ALGO_ZSTD 2
+#define ALGO_LZ4 3
+
+enum v2_state { ST_HDR, ST_CHDR, ST_CDATA, ST_INDEX, ST_FOOTER, ST_DONE };
+
+/* per thread state, indexed by the pool worker slot */
+struct zcomp_worker {
+#ifdef HAVE_ZSTD_H
+    ZSTD_CCtx *zc;
+    ZSTD_DCtx *zd;
+#else
+    int unused;
+#endif
+};
+
+struct zcomp_chunk {
+    unsigned int in_len, out_len, raw;
+};
+
 struct zcomp_ctx {
     z_stream strm;
     int init, end, level;
+
+    /* chunked format */
+    sxf_mode_t mode;
+    int format, algo;
+    unsigned char hdr[V2_HDR_SIZE], field[V2_FOOTER_SIZE];
+    enum v2_state state;
+    unsigned int chunk_size, need, have, data_in, data_end, eof, finished;
+    unsigned char *ibuf, *obuf, *trailer;
+    unsigned int ibytes;
+    const unsigned char *optr;
+    size_t oleft;
+    struct zcomp_chunk chunks[V2_BATCH_CHUNKS];
+    unsigned int ncollected;
+    uint32_t *index;
+    uint64_t nindex, index_size, index_pos, rawsize;
+    struct zcomp_worker *workers;
+    unsigned int nworkers;
+    sxi_workpool_t *pool;
 };
 
 static int zcomp_init(const sxf_handle_t *handle, void **ctx)
@@ -47,22 +122,110 @@ static int zcomp_init(const sxf_handle_t *handle, void **ctx)
     return 0;
 }
 
-static int zcomp_configure(const sxf_handle_t *handle, const char *cfgstr, const char *cfgdir, void **cfgdata, unsigned int *cfgdata_len)
+/* "level:N" selects the legacy zlib stream, "algo:NAME[,level:N]" the chunked format */
+static int parse_cfg(const sxf_handle_t *handle, const char *cfg, unsigned int cfg_len, int *algo, int *level)
 {
-	const char *pt = cfgstr;
+	char buf[32], *pt, *end;
 
-    if(!pt)
-        return 0;
+    *algo = 0;
+    *level = 0;
+    if(!cfg)
+	return 0;
+    if(cfg_len >= sizeof(buf)) {
+	ERROR("Invalid configuration data");
+	return -1;
+    }
+    memcpy(buf, cfg, cfg_len);
+    buf[cfg_len] = 0;
+    pt = buf;
+
+    if(!strncmp(pt, "algo:", 5)) {
+	pt += 5;
+	if(!strncmp(pt, "zlib", 4)) {
+	    *algo = ALGO_ZLIB;
+	    pt += 4;
+	} else if(!strncmp(pt, "zstd", 4)) {
+	    *algo = ALGO_ZSTD;
+	    pt += 4;
+	} else if(!strncmp(pt, "lz4", 3)) {
+	    *algo = ALGO_LZ4;
+	    pt += 3;
+	} else {
+	    ERROR("Invalid compression algorithm");
+	    return -1;
+	}
+	if(!*pt)
+	    return 0;
+	if(*pt++ != ',') {
+	    ERROR("Invalid configuration data");
+	    return -1;
+	}
+    }
 
     if(strncmp(pt, "level:", 6)) {
 	ERROR("Invalid configuration data");
-	return 1;
+	return -1;
     }
     pt += 6;
-    if(atoi(pt) < 1 || atoi(pt) > 9) {
+    *level = strtol(pt, &end, 10);
+    if(end == pt || *end) {
 	ERROR("Invalid compression level");
-	return 1;
+	return -1;
+    }
+    switch(*algo) {
+	case ALGO_ZSTD:
+	    if(*level < 1 || *level > 19) {
+		ERROR("Invalid compression level (%d), zstd supports levels 1..19", *level);
+		return -1;
+	    }
+	    break;
+	case ALGO_LZ4:
+	    ERROR("The lz4 algorithm doesn't support compression levels");
+	    return -1;
+	default:
+	    if(*level < 1 || *level > 9) {
+		ERROR("Invalid compression level (%d)", *level);
+		return -1;
+	    }
+    }
+    return 0;
+}
+
+static int check_algo(const sxf_handle_t *handle, int algo)
+{
+    switch(algo) {
+	case ALGO_ZLIB:
+	    return 0;
+	case ALGO_ZSTD:
+#ifdef HAVE_ZSTD_H
+	    return 0;
+#else
+	    ERROR("This client was built without zstd support");
+	    return -1;
+#endif
+	case ALGO_LZ4:
+#ifdef HAVE_LZ4_H
+	    return 0;
+#else
+	    ERROR("This client was built without lz4 support");
+	    return -1;
+#endif
     }
+    ERROR("Unknown compression algorithm %d", algo);
+    return -1;
+}
+
+static int zcomp_configure(const sxf_handle_t *handle, const char *cfgstr, const char *cfgdir, void **cfgdata, unsigned int *cfgdata_len)
+{
+	int algo, level;
+
+    if(!cfgstr)
+        return 0;
+
+    if(parse_cfg(handle, cfgstr, strlen(cfgstr), &algo, &level))
+	return 1;
+    if(algo && check_algo(handle, algo))
+	return 1;
     *cfgdata = strdup(cfgstr);
     if(!*cfgdata) {
 	ERROR("OOM");
@@ -86,34 +249,476 @@ static int zcomp_shutdown(const sxf_handle_t *handle, void *ctx)
     return 0;
 }
 
-static int zcomp_data_prepare(const sxf_handle_t *handle, void **ctx, const char *filename, const char *cfgdir, const void *cfgdata, unsigned int cfgdata_len, sxf_mode_t mode)
+static int zcomp_data_finish(const sxf_handle_t *handle, void **ctx, sxf_mode_t mode);
+
+static void put32(unsigned char *b, uint32_t v)
 {
-	struct zcomp_ctx *zctx;
-	int level = Z_DEFAULT_COMPRESSION;
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
+}
 
-    if(cfgdata) {
-	if(cfgdata_len != 7 || strncmp(cfgdata, "level:", 6)) {
-	    ERROR("Invalid configuration data");
+static uint32_t get32(const unsigned char *b)
+{
+    return ((uint32_t) b[0] << 24) | ((uint32_t) b[1] << 16) | ((uint32_t) b[2] << 8) | b[3];
+}
+
+/* returns 0 on success, 1 if the result doesn't fit in outsize bytes, -1 on other errors */
+static int v2_compress(struct zcomp_ctx *zctx, struct zcomp_worker *w, const unsigned char *in, unsigned int insize, unsigned char *out, unsigned int outsize, unsigned int *outlen)
+{
+    if(zctx->algo == ALGO_ZLIB) {
+	    uLongf len = outsize;
+	    int ret = compress2(out, &len, in, insize, zctx->level);
+	if(ret == Z_BUF_ERROR)
+	    return 1;
+	if(ret != Z_OK)
+	    return -1;
+	*outlen = len;
+	return 0;
+    }
+#ifdef HAVE_ZSTD_H
+    if(zctx->algo == ALGO_ZSTD) {
+	    size_t len = ZSTD_compressCCtx(w->zc, out, outsize, in, insize, zctx->level);
+	if(ZSTD_isError(len))
+	    return ZSTD_getErrorCode(len) == ZSTD_error_dstSize_tooSmall ? 1 : -1;
+	*outlen = len;
+	return 0;
+    }
+#endif
+#ifdef HAVE_LZ4_H
+    if(zctx->algo == ALGO_LZ4) {
+	    int len = LZ4_compress_default((const char *) in, (char *) out, insize, outsize);
+	if(len <= 0)
+	    return 1;
+	*outlen = len;
+	return 0;
+    }
+#endif
+    return -1;
+}
+
+static int v2_decompress(struct zcomp_ctx *zctx, struct zcomp_worker *w, const unsigned char *in, unsigned int insize, unsigned char *out, unsigned int outsize, unsigned int *outlen)
+{
+    if(zctx->algo == ALGO_ZLIB) {
+	    uLongf len = outsize;
+	if(uncompress(out, &len, in, insize) != Z_OK)
+	    return -1;
+	*outlen = len;
+	return 0;
+    }
+#ifdef HAVE_ZSTD_H
+    if(zctx->algo == ALGO_ZSTD) {
+	    size_t len = ZSTD_decompressDCtx(w->zd, out, outsize, in, insize);
+	if(ZSTD_isError(len))
+	    return -1;
+	*outlen = len;
+	return 0;
+    }
+#endif
+#ifdef HAVE_LZ4_H
+    if(zctx->algo == ALGO_LZ4) {
+	    int len = LZ4_decompress_safe((const char *) in, (char *) out, insize, outsize);
+	if(len < 0)
+	    return -1;
+	*outlen = len;
+	return 0;
+    }
+#endif
+    return -1;
+}
+
+static int v2_chunk(void *ctx, unsigned int wid, unsigned int i)
+{
+	struct zcomp_ctx *zctx = ctx;
+	struct zcomp_worker *w = &zctx->workers[wid];
+	struct zcomp_chunk *c = &zctx->chunks[i];
+	const unsigned char *in = zctx->ibuf + (size_t) i * zctx->chunk_size;
+	unsigned char *out;
+	unsigned int len;
+	int ret;
+
+    if(zctx->mode == SXF_MODE_UPLOAD) {
+	out = zctx->obuf + (size_t) i * (zctx->chunk_size + 4);
+	/* anything that doesn't shrink is stored as is */
+	ret = c->in_len > 1 ? v2_compress(zctx, w, in, c->in_len, out + 4, c->in_len - 1, &len) : 1;
+	if(ret < 0)
+	    return -1;
+	if(ret) {
+	    memcpy(out + 4, in, c->in_len);
+	    put32(out, V2_RAW_CHUNK | c->in_len);
+	    len = c->in_len;
+	} else
+	    put32(out, len);
+	c->out_len = len + 4;
+    } else {
+	out = zctx->obuf + (size_t) i * zctx->chunk_size;
+	if(c->raw) {
+	    memcpy(out, in, c->in_len);
+	    c->out_len = c->in_len;
+	} else if(v2_decompress(zctx, w, in, c->in_len, out, zctx->chunk_size, &c->out_len))
 	    return -1;
+    }
+    return 0;
+}
+
+static int v2_init(const sxf_handle_t *handle, struct zcomp_ctx *zctx)
+{
+	unsigned int i, nworkers = sxi_workpool_nthreads("SX_ZCOMP_THREADS", V2_MAX_THREADS);
+	size_t out_chunk = zctx->mode == SXF_MODE_UPLOAD ? zctx->chunk_size + 4 : zctx->chunk_size;
+	struct zcomp_worker *w;
+
+    zctx->ibuf = malloc((size_t) V2_BATCH_CHUNKS * zctx->chunk_size);
+    zctx->obuf = malloc(V2_BATCH_CHUNKS * out_chunk);
+    zctx->workers = calloc(nworkers, sizeof(*zctx->workers));
+    if(!zctx->ibuf || !zctx->obuf || !zctx->workers) {
+	ERROR("OOM");
+	return -1;
+    }
+    zctx->nworkers = nworkers;
+
+    for(i = 0; i < nworkers; i++) {
+	w = &zctx->workers[i];
+#ifdef HAVE_ZSTD_H
+	if(zctx->algo == ALGO_ZSTD) {
+	    if(zctx->mode == SXF_MODE_UPLOAD)
+		w->zc = ZSTD_createCCtx();
+	    else
+		w->zd = ZSTD_createDCtx();
+	    if(!w->zc && !w->zd) {
+		ERROR("Can't initialize zstd context");
+		return -1;
+	    }
 	}
-	level = ((const char *) cfgdata)[6] - 48;
-	if(level < 1 || level > 9) {
-	    ERROR("Invalid compression level (%d)", level);
+#endif
+    }
+    zctx->pool = sxi_workpool_new(nworkers, v2_chunk, zctx);
+    if(!zctx->pool) {
+	ERROR("Can't start worker threads");
+	return -1;
+    }
+    return 0;
+}
+
+static void v2_cleanup(struct zcomp_ctx *zctx)
+{
+	unsigned int i;
+
+    sxi_workpool_free(zctx->pool);
+    zctx->pool = NULL;
+    if(zctx->workers) {
+	for(i = 0; i < zctx->nworkers; i++) {
+#ifdef HAVE_ZSTD_H
+	    ZSTD_freeCCtx(zctx->workers[i].zc);
+	    ZSTD_freeDCtx(zctx->workers[i].zd);
+#endif
+	}
+	free(zctx->workers);
+	zctx->workers = NULL;
+    }
+    free(zctx->ibuf);
+    zctx->ibuf = NULL;
+    free(zctx->obuf);
+    zctx->obuf = NULL;
+    free(zctx->trailer);
+    zctx->trailer = NULL;
+    free(zctx->index);
+    zctx->index = NULL;
+}
+
+static int v2_index_add(const sxf_handle_t *handle, struct zcomp_ctx *zctx, uint32_t word)
+{
+    if(zctx->nindex == zctx->index_size) {
+	    uint64_t size = zctx->index_size ? zctx->index_size * 2 : 1024;
+	    uint32_t *index = realloc(zctx->index, size * sizeof(*index));
+	if(!index) {
+	    ERROR("OOM");
+	    return -1;
+	}
+	zctx->index = index;
+	zctx->index_size = size;
+    }
+    zctx->index[zctx->nindex++] = word;
+    return 0;
+}
+
+static int v2_run_batch(const sxf_handle_t *handle, struct zcomp_ctx *zctx, unsigned int n)
+{
+	size_t slot = zctx->mode == SXF_MODE_UPLOAD ? zctx->chunk_size + 4 : zctx->chunk_size;
+	size_t pos = 0;
+	unsigned int i;
+
+    if(sxi_workpool_run(zctx->pool, n)) {
+	ERROR("Can't %s data chunk", zctx->mode == SXF_MODE_UPLOAD ? "compress" : "decompress");
+	return -1;
+    }
+    for(i = 0; i < n; i++) {
+	unsigned char *src = zctx->obuf + i * slot;
+	if(zctx->mode == SXF_MODE_UPLOAD) {
+	    if(v2_index_add(handle, zctx, get32(src)))
+		return -1;
+	    zctx->rawsize += zctx->chunks[i].in_len;
+	} else
+	    zctx->rawsize += zctx->chunks[i].out_len;
+	if(src != zctx->obuf + pos)
+	    memmove(zctx->obuf + pos, src, zctx->chunks[i].out_len);
+	pos += zctx->chunks[i].out_len;
+    }
+    zctx->optr = zctx->obuf;
+    zctx->oleft = pos;
+    zctx->ibytes = 0;
+    zctx->ncollected = 0;
+    return 0;
+}
+
+static int v2_trailer(const sxf_handle_t *handle, struct zcomp_ctx *zctx)
+{
+	size_t len = 4 + zctx->nindex * 4 + V2_FOOTER_SIZE;
+	unsigned char *pt;
+	uint64_t i;
+
+    zctx->trailer = malloc(len);
+    if(!zctx->trailer) {
+	ERROR("OOM");
+	return -1;
+    }
+    pt = zctx->trailer;
+    put32(pt, 0);
+    pt += 4;
+    for(i = 0; i < zctx->nindex; i++, pt += 4)
+	put32(pt, zctx->index[i]);
+    put32(pt, zctx->rawsize >> 32);
+    put32(pt + 4, zctx->rawsize);
+    put32(pt + 8, zctx->nindex);
+    memcpy(pt + 12, V2_FOOTER_MAGIC, 4);
+    zctx->optr = zctx->trailer;
+    zctx->oleft = len;
+    zctx->finished = 1;
+    return 1;
+}
+
+/* returns 1 when there's output to send, 0 when more input is needed, -1 on error */
+static int v2_fill_upload(const sxf_handle_t *handle, struct zcomp_ctx *zctx, const void *in, size_t insize)
+{
+	unsigned int cap = V2_BATCH_CHUNKS * zctx->chunk_size;
+	unsigned int bytes, n, i;
+
+    if(zctx->eof)
+	return v2_trailer(handle, zctx);
+
+    bytes = insize - zctx->data_in;
+    if(bytes > cap - zctx->ibytes)
+	bytes = cap - zctx->ibytes;
+    memcpy(zctx->ibuf + zctx->ibytes, (const unsigned char *) in + zctx->data_in, bytes);
+    zctx->data_in += bytes;
+    zctx->ibytes += bytes;
+    if(zctx->data_end && zctx->data_in == insize) {
+	zctx->eof = 1;
+	if(!zctx->ibytes)
+	    return v2_trailer(handle, zctx);
+    } else if(zctx->ibytes < cap)
+	return 0;
+
+    n = (zctx->ibytes + zctx->chunk_size - 1) / zctx->chunk_size;
+    for(i = 0; i < n; i++)
+	zctx->chunks[i].in_len = i == n - 1 ? zctx->ibytes - i * zctx->chunk_size : zctx->chunk_size;
+    return v2_run_batch(handle, zctx, n) ? -1 : 1;
+}
+
+static int v2_parse_header(const sxf_handle_t *handle, struct zcomp_ctx *zctx)
+{
+    memcpy(zctx->hdr, zctx->field, V2_HDR_SIZE);
+    if(zctx->hdr[4] != V2_VERSION) {
+	ERROR("Unsupported data format version %u", zctx->hdr[4]);
+	return -1;
+    }
+    zctx->algo = zctx->hdr[5];
+    if(check_algo(handle, zctx->algo))
+	return -1;
+    zctx->chunk_size = get32(zctx->hdr + 8);
+    if(!zctx->chunk_size || zctx->chunk_size > V2_MAX_CHUNK_SIZE) {
+	ERROR("Invalid chunk size %u", zctx->chunk_size);
+	return -1;
+    }
+    return v2_init(handle, zctx);
+}
+
+static int v2_fill_download(const sxf_handle_t *handle, struct zcomp_ctx *zctx, const void *in, size_t insize)
+{
+	const unsigned char *src = in;
+	unsigned char *dst;
+	unsigned int bytes;
+	uint32_t word;
+
+    while(zctx->data_in < insize && zctx->state != ST_DONE) {
+	bytes = insize - zctx->data_in;
+	if(bytes > zctx->need - zctx->have)
+	    bytes = zctx->need - zctx->have;
+	if(zctx->state == ST_CDATA)
+	    dst = zctx->ibuf + (size_t) zctx->ncollected * zctx->chunk_size;
+	else
+	    dst = zctx->field;
+	memcpy(dst + zctx->have, src + zctx->data_in, bytes);
+	zctx->data_in += bytes;
+	zctx->have += bytes;
+	if(zctx->have < zctx->need)
+	    break;
+	zctx->have = 0;
+
+	switch(zctx->state) {
+	    case ST_HDR:
+		if(v2_parse_header(handle, zctx))
+		    return -1;
+		zctx->state = ST_CHDR;
+		zctx->need = 4;
+		break;
+	    case ST_CHDR:
+		word = get32(zctx->field);
+		if(!word) {
+		    zctx->index_pos = 0;
+		    zctx->state = zctx->nindex ? ST_INDEX : ST_FOOTER;
+		    zctx->need = zctx->nindex ? 4 : V2_FOOTER_SIZE;
+		    if(zctx->ncollected)
+			return v2_run_batch(handle, zctx, zctx->ncollected) ? -1 : 1;
+		    break;
+		}
+		zctx->chunks[zctx->ncollected].in_len = word & ~V2_RAW_CHUNK;
+		zctx->chunks[zctx->ncollected].raw = (word & V2_RAW_CHUNK) != 0;
+		if(!zctx->chunks[zctx->ncollected].in_len || zctx->chunks[zctx->ncollected].in_len > zctx->chunk_size) {
+		    ERROR("Invalid chunk length %u", zctx->chunks[zctx->ncollected].in_len);
+		    return -1;
+		}
+		if(v2_index_add(handle, zctx, word))
+		    return -1;
+		zctx->state = ST_CDATA;
+		zctx->need = zctx->chunks[zctx->ncollected].in_len;
+		break;
+	    case ST_CDATA:
+		zctx->state = ST_CHDR;
+		zctx->need = 4;
+		if(++zctx->ncollected == V2_BATCH_CHUNKS)
+		    return v2_run_batch(handle, zctx, zctx->ncollected) ? -1 : 1;
+		break;
+	    case ST_INDEX:
+		if(get32(zctx->field) != zctx->index[zctx->index_pos]) {
+		    ERROR("Chunk index doesn't match the data");
+		    return -1;
+		}
+		if(++zctx->index_pos == zctx->nindex) {
+		    zctx->state = ST_FOOTER;
+		    zctx->need = V2_FOOTER_SIZE;
+		}
+		break;
+	    case ST_FOOTER:
+		if(memcmp(zctx->field + 12, V2_FOOTER_MAGIC, 4) ||
+		   (((uint64_t) get32(zctx->field) << 32) | get32(zctx->field + 4)) != zctx->rawsize ||
+		   get32(zctx->field + 8) != zctx->nindex) {
+		    ERROR("Invalid data footer");
+		    return -1;
+		}
+		zctx->state = ST_DONE;
+		break;
+	    case ST_DONE:
+		break;
+	}
+    }
+
+    if(zctx->state != ST_DONE) {
+	if(zctx->data_end && zctx->data_in == insize) {
+	    ERROR("Incomplete data");
 	    return -1;
 	}
+	return 0;
+    }
+    if(zctx->data_in < insize) {
+	ERROR("Unexpected data past the end of the stream");
+	return -1;
     }
+    zctx->finished = 1;
+    return 0;
+}
+
+static ssize_t v2_data_process(const sxf_handle_t *handle, struct zcomp_ctx *zctx, const void *in, size_t insize, void *out, size_t outsize, sxf_action_t *action)
+{
+	size_t bytes;
+	int ret;
+
+    if(*action == SXF_ACTION_DATA_END)
+	zctx->data_end = 1;
+
+    if(!zctx->oleft && !zctx->finished) {
+	if(zctx->mode == SXF_MODE_UPLOAD)
+	    ret = v2_fill_upload(handle, zctx, in, insize);
+	else
+	    ret = v2_fill_download(handle, zctx, in, insize);
+	if(ret < 0)
+	    return -1;
+	if(!ret) {
+	    zctx->data_in = 0;
+	    *action = SXF_ACTION_NORMAL;
+	    return 0;
+	}
+    }
+
+    bytes = zctx->oleft < outsize ? zctx->oleft : outsize;
+    memcpy(out, zctx->optr, bytes);
+    zctx->optr += bytes;
+    zctx->oleft -= bytes;
+    if(zctx->oleft || zctx->data_in < insize || (zctx->data_end && !zctx->finished)) {
+	*action = SXF_ACTION_REPEAT;
+    } else {
+	zctx->data_in = 0;
+	*action = zctx->data_end ? SXF_ACTION_DATA_END : SXF_ACTION_NORMAL;
+    }
+    return bytes;
+}
+
+static int zcomp_data_prepare(const sxf_handle_t *handle, void **ctx, const char *filename, const char *cfgdir, const void *cfgdata, unsigned int cfgdata_len, sxf_mode_t mode)
+{
+	struct zcomp_ctx *zctx;
+	int algo, level;
 
-    zctx = malloc(sizeof(struct zcomp_ctx));
+    if(parse_cfg(handle, cfgdata, cfgdata_len, &algo, &level))
+	return -1;
+
+    zctx = calloc(1, sizeof(struct zcomp_ctx));
     if(!zctx)
 	return -1;
 
     zctx->strm.zalloc = Z_NULL;
     zctx->strm.zfree = Z_NULL;
     zctx->strm.opaque = Z_NULL;
-    zctx->init = 0;
-    zctx->end = 0;
-    zctx->level = level;
-    zctx->end = 0;
+    zctx->mode = mode;
+
+    if(mode == SXF_MODE_UPLOAD && algo) {
+	if(check_algo(handle, algo)) {
+	    free(zctx);
+	    return -1;
+	}
+	if(!level)
+	    level = algo == ALGO_ZSTD ? 3 : Z_DEFAULT_COMPRESSION;
+	zctx->format = V2_VERSION;
+	zctx->algo = algo;
+	zctx->level = level;
+	zctx->chunk_size = V2_CHUNK_SIZE;
+	memcpy(zctx->hdr, V2_MAGIC, V2_MAGIC_SIZE);
+	zctx->hdr[4] = V2_VERSION;
+	zctx->hdr[5] = algo;
+	zctx->hdr[6] = level > 0 ? level : 0;
+	put32(zctx->hdr + 8, zctx->chunk_size);
+	zctx->optr = zctx->hdr;
+	zctx->oleft = V2_HDR_SIZE;
+	*ctx = zctx;
+	if(v2_init(handle, zctx)) {
+	    zcomp_data_finish(handle, ctx, mode);
+	    return -1;
+	}
+	return 0;
+    }
+
+    if(mode == SXF_MODE_UPLOAD)
+	zctx->format = 1;
+    zctx->level = level ? level : Z_DEFAULT_COMPRESSION;
 
     *ctx = zctx;
     return 0;
@@ -193,6 +798,21 @@ static ssize_t zcomp_data_decompress(const sxf_handle_t *handle, void *ctx, cons
 
 static ssize_t zcomp_data_process(const sxf_handle_t *handle, void *ctx, const void *in, size_t insize, void *out, size_t outsize, sxf_mode_t mode, sxf_action_t *action)
 {
+	struct zcomp_ctx *zctx = ctx;
+
+    if(mode == SXF_MODE_DOWNLOAD && !zctx->format) {
+	if(!insize && *action != SXF_ACTION_DATA_END)
+	    return 0;
+	if(insize && *(const unsigned char *) in == V2_MAGIC[0]) {
+	    zctx->format = V2_VERSION;
+	    zctx->state = ST_HDR;
+	    zctx->need = V2_HDR_SIZE;
+	} else
+	    zctx->format = 1;
+    }
+
+    if(zctx->format == V2_VERSION)
+	return v2_data_process(handle, zctx, in, insize, out, outsize, action);
     if(mode == SXF_MODE_UPLOAD)
 	return zcomp_data_compress(handle, ctx, in, insize, out, outsize, action);
     else
@@ -207,21 +827,39 @@ static int zcomp_data_finish(const sxf_handle_t *handle, void **ctx, sxf_mode_t
 	deflateEnd(&zctx->strm);
     else if(zctx->init == 2)
 	inflateEnd(&zctx->strm);
+    v2_cleanup(zctx);
 
     free(zctx);
     *ctx = NULL;
     return 0;
 }
 
+/* record the original size so that sxvol can report the compression ratio */
+static int zcomp_file_process(const sxf_handle_t *handle, void *ctx, const char *filename, sxc_meta_t *meta, const char *cfgdir, const void *cfgdata, unsigned int cfgdata_len, sxf_mode_t mode)
+{
+	struct stat sb;
+	unsigned char val[8];
+
+    if(mode != SXF_MODE_UPLOAD || stat(filename, &sb) == -1 || !S_ISREG(sb.st_mode))
+	return 0;
+    put32(val, (uint64_t) sb.st_size >> 32);
+    put32(val + 4, sb.st_size);
+    if(sxc_meta_setval(meta, "zcompRawSize", val, sizeof(val))) {
+	ERROR("Can't set file metadata");
+	return 1;
+    }
+    return 0;
+}
+
 sxc_filter_t sxc_filter={
 /* int abi_version */		    SXF_ABI_VERSION,
 /* const char *shortname */	    "zcomp",
-/* const char *shortdesc */	    "Compress files using zlib",
-/* const char *summary */	    "The filter automatically compresses and decompresses all data using zlib library.",
-/* const char *options */	    "level:N (N = 1..9)",
+/* const char *shortdesc */	    "Compress files using zlib, zstd or lz4",
+/* const char *summary */	    "The filter automatically compresses and decompresses all data. With the algo option the data is split into chunks which are compressed independently and in parallel.",
+/* const char *options */	    "level:N (zlib stream, N = 1..9), algo:zlib|zstd|lz4[,level:N] (chunked, N = 1..9 for zlib, 1..19 for zstd)",
 /* const char *uuid */		    "d5dbdf0a-fb17-4d1b-a9ce-4060317af5b5",
 /* sxf_type_t type */		    SXF_TYPE_COMPRESS,
-/* int version[2] */		    {1, 0},
+/* int version[2] */		    {1, 1},
 /* int (*init)(const sxf_handle_t *handle, void **ctx) */	    zcomp_init,
 /* int (*shutdown)(const sxf_handle_t *handle, void *ctx) */    zcomp_shutdown,
 /* int (*configure)(const char *cfgstr, const char *cfgdir, void **cfgdata, unsigned int *cfgdata_len) */
@@ -233,7 +871,7 @@ sxc_filter_t sxc_filter={
 /* int (*data_finish)(const sxf_handle_t *handle, void **ctx, sxf_mode_t mode) */
 				    zcomp_data_finish,
 /* int (*file_process)(const sxf_handle_t *handle, void *ctx, const char *filename, sxc_metalist_t **metalist, sxc_meta_t *meta, const char *cfgdir, const void *cfgdata, unsigned int cfgdata_len, sxf_mode_t mode) */
-				    NULL,
+				    zcomp_file_process,
 /* void (*file_notify)(const sxf_handle_t *handle, void *ctx, const void *cfgdata, unsigned int cfgdata_len, sxf_mode_t mode, const char *source_cluster, const char *source_volume, const char *source_path, const char *dest_cluster, const char *dest_volume, const char *dest_path) */
 				    NULL,
 /* int (*file_update)(const sxf_handle_t *handle, void *ctx, const void *cfgdata, unsigned int cfgdata_len, sxf_mode_t mode, sxc_file_t *source, sxc_file_t *dest, int recursive) */
@@ -48,9 +48,11 @@ const char *gengetopt_args_info_full_help[] = {
   "  -D, --debug                  Enable debug messages  (default=off)",
   "  -c, --config-dir=PATH        Path to SX configuration directory",
   "  -f, --filter-dir=PATH        Path to SX filter directory",
-  "      --total-conns-limit=INT  Limit number of connections  (default=`5')",
-  "      --host-conns-limit=INT   Limit number of connections with one host\n                                 (default=`2')",
+  "      --total-conns-limit=INT  Maximum number of connections  (default=`32')",
+  "      --host-conns-limit=INT   Maximum number of connections with one host\n                                 (default=`8')",
   "  -s, --dot-size=STRING        Use specified size for each dot printed with\n                                 file transfer progress (short: 1KB, long: 8KB,\n                                 scale: block size)",
+  "      --hash-threads=INT       Number of threads used to hash file contents\n                                 before upload  (default=`1')",
+  "      --http2                  Multiplex requests over HTTP/2 connections when\n                                 the cluster supports it  (default=off)",
     0
 };
 
@@ -116,6 +118,8 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->total_conns_limit_given = 0 ;
   args_info->host_conns_limit_given = 0 ;
   args_info->dot_size_given = 0 ;
+  args_info->hash_threads_given = 0 ;
+  args_info->http2_given = 0 ;
 }
 
 static
@@ -138,12 +142,15 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->config_dir_orig = NULL;
   args_info->filter_dir_arg = NULL;
   args_info->filter_dir_orig = NULL;
-  args_info->total_conns_limit_arg = 5;
+  args_info->total_conns_limit_arg = 32;
   args_info->total_conns_limit_orig = NULL;
-  args_info->host_conns_limit_arg = 2;
+  args_info->host_conns_limit_arg = 8;
   args_info->host_conns_limit_orig = NULL;
   args_info->dot_size_arg = NULL;
   args_info->dot_size_orig = NULL;
+  args_info->hash_threads_arg = 1;
+  args_info->hash_threads_orig = NULL;
+  args_info->http2_flag = 0;
   
 }
 
@@ -173,6 +180,8 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->total_conns_limit_help = gengetopt_args_info_full_help[14] ;
   args_info->host_conns_limit_help = gengetopt_args_info_full_help[15] ;
   args_info->dot_size_help = gengetopt_args_info_full_help[16] ;
+  args_info->hash_threads_help = gengetopt_args_info_full_help[17] ;
+  args_info->http2_help = gengetopt_args_info_full_help[18] ;
   
 }
 
@@ -325,6 +334,7 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->host_conns_limit_orig));
   free_string_field (&(args_info->dot_size_arg));
   free_string_field (&(args_info->dot_size_orig));
+  free_string_field (&(args_info->hash_threads_orig));
   
   
   for (i = 0; i < args_info->inputs_num; ++i)
@@ -400,6 +410,10 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "host-conns-limit", args_info->host_conns_limit_orig, 0);
   if (args_info->dot_size_given)
     write_into_file(outfile, "dot-size", args_info->dot_size_orig, 0);
+  if (args_info->hash_threads_given)
+    write_into_file(outfile, "hash-threads", args_info->hash_threads_orig, 0);
+  if (args_info->http2_given)
+    write_into_file(outfile, "http2", 0, 0 );
   
 
   i = EXIT_SUCCESS;
@@ -949,6 +963,8 @@ cmdline_parser_internal (
         { "total-conns-limit",	1, NULL, 0 },
         { "host-conns-limit",	1, NULL, 0 },
         { "dot-size",	1, NULL, 's' },
+        { "hash-threads",	1, NULL, 0 },
+        { "http2",	0, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
@@ -1117,33 +1133,59 @@ cmdline_parser_internal (
               goto failure;
           
           }
-          /* Limit number of connections.  */
+          /* Maximum number of connections.  */
           else if (strcmp (long_options[option_index].name, "total-conns-limit") == 0)
           {
           
           
             if (update_arg( (void *)&(args_info->total_conns_limit_arg), 
                  &(args_info->total_conns_limit_orig), &(args_info->total_conns_limit_given),
-                &(local_args_info.total_conns_limit_given), optarg, 0, "5", ARG_INT,
+                &(local_args_info.total_conns_limit_given), optarg, 0, "32", ARG_INT,
                 check_ambiguity, override, 0, 0,
                 "total-conns-limit", '-',
                 additional_error))
               goto failure;
           
           }
-          /* Limit number of connections with one host.  */
+          /* Maximum number of connections with one host.  */
           else if (strcmp (long_options[option_index].name, "host-conns-limit") == 0)
           {
           
           
             if (update_arg( (void *)&(args_info->host_conns_limit_arg), 
                  &(args_info->host_conns_limit_orig), &(args_info->host_conns_limit_given),
-                &(local_args_info.host_conns_limit_given), optarg, 0, "2", ARG_INT,
+                &(local_args_info.host_conns_limit_given), optarg, 0, "8", ARG_INT,
                 check_ambiguity, override, 0, 0,
                 "host-conns-limit", '-',
                 additional_error))
               goto failure;
           
+          }
+          /* Number of threads used to hash file contents before upload.  */
+          else if (strcmp (long_options[option_index].name, "hash-threads") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->hash_threads_arg), 
+                 &(args_info->hash_threads_orig), &(args_info->hash_threads_given),
+                &(local_args_info.hash_threads_given), optarg, 0, "1", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "hash-threads", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Multiplex requests over HTTP/2 connections when the cluster supports it.  */
+          else if (strcmp (long_options[option_index].name, "http2") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->http2_flag), 0, &(args_info->http2_given),
+                &(local_args_info.http2_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "http2", '-',
+                additional_error))
+              goto failure;
+          
           }
           
           break;
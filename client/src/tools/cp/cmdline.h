@@ -71,15 +71,20 @@ struct gengetopt_args_info
   char * filter_dir_arg;	/**< @brief Path to SX filter directory.  */
   char * filter_dir_orig;	/**< @brief Path to SX filter directory original value given at command line.  */
   const char *filter_dir_help; /**< @brief Path to SX filter directory help description.  */
-  int total_conns_limit_arg;	/**< @brief Limit number of connections (default='5').  */
-  char * total_conns_limit_orig;	/**< @brief Limit number of connections original value given at command line.  */
-  const char *total_conns_limit_help; /**< @brief Limit number of connections help description.  */
-  int host_conns_limit_arg;	/**< @brief Limit number of connections with one host (default='2').  */
-  char * host_conns_limit_orig;	/**< @brief Limit number of connections with one host original value given at command line.  */
-  const char *host_conns_limit_help; /**< @brief Limit number of connections with one host help description.  */
+  int total_conns_limit_arg;	/**< @brief Maximum number of connections (default='32').  */
+  char * total_conns_limit_orig;	/**< @brief Maximum number of connections original value given at command line.  */
+  const char *total_conns_limit_help; /**< @brief Maximum number of connections help description.  */
+  int host_conns_limit_arg;	/**< @brief Maximum number of connections with one host (default='8').  */
+  char * host_conns_limit_orig;	/**< @brief Maximum number of connections with one host original value given at command line.  */
+  const char *host_conns_limit_help; /**< @brief Maximum number of connections with one host help description.  */
   char * dot_size_arg;	/**< @brief Use specified size for each dot printed with file transfer progress (short: 1KB, long: 8KB, scale: block size).  */
   char * dot_size_orig;	/**< @brief Use specified size for each dot printed with file transfer progress (short: 1KB, long: 8KB, scale: block size) original value given at command line.  */
   const char *dot_size_help; /**< @brief Use specified size for each dot printed with file transfer progress (short: 1KB, long: 8KB, scale: block size) help description.  */
+  int hash_threads_arg;	/**< @brief Number of threads used to hash file contents before upload (default='1').  */
+  char * hash_threads_orig;	/**< @brief Number of threads used to hash file contents before upload original value given at command line.  */
+  const char *hash_threads_help; /**< @brief Number of threads used to hash file contents before upload help description.  */
+  int http2_flag;	/**< @brief Multiplex requests over HTTP/2 connections when the cluster supports it (default=off).  */
+  const char *http2_help; /**< @brief Multiplex requests over HTTP/2 connections when the cluster supports it help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int full_help_given ;	/**< @brief Whether full-help was given.  */
@@ -98,6 +103,8 @@ struct gengetopt_args_info
   unsigned int total_conns_limit_given ;	/**< @brief Whether total-conns-limit was given.  */
   unsigned int host_conns_limit_given ;	/**< @brief Whether host-conns-limit was given.  */
   unsigned int dot_size_given ;	/**< @brief Whether dot-size was given.  */
+  unsigned int hash_threads_given ;	/**< @brief Whether hash-threads was given.  */
+  unsigned int http2_given ;	/**< @brief Whether http2 was given.  */
 
   char **inputs ; /**< @brief unamed options (options without names) */
   unsigned inputs_num ; /**< @brief unamed options number */
@@ -738,6 +738,16 @@ int main(int argc, char **argv) {
         }
     }
 
+    if(cluster1 && args.http2_flag && sxc_cluster_set_http2(cluster1, 1)) {
+        fprintf(stderr, "ERROR: Failed to enable HTTP/2: %s\n", sxc_geterrmsg(sx));
+        goto main_err;
+    }
+
+    if(cluster1 && args.hash_threads_given && sxc_cluster_set_hash_threads(cluster1, args.hash_threads_arg < 0 ? 0 : args.hash_threads_arg)) {
+        fprintf(stderr, "ERROR: Failed to set number of hashing threads: %s\n", sxc_geterrmsg(sx));
+        goto main_err;
+    }
+
     if(limit && cluster1 && sxc_cluster_set_bandwidth_limit(sx, cluster1, limit)) {
         fprintf(stderr, "ERROR: Failed to set bandwidth limit to %s\n", args.bwlimit_arg);
         goto main_err;
@@ -822,6 +832,11 @@ int main(int argc, char **argv) {
             }
         }
 
+        if(cluster2 && args.http2_flag && sxc_cluster_set_http2(cluster2, 1)) {
+            fprintf(stderr, "ERROR: Failed to enable HTTP/2: %s\n", sxc_geterrmsg(sx));
+            goto main_err;
+        }
+
         if(limit && cluster2 && sxc_cluster_set_bandwidth_limit(sx, cluster2, limit)) {
             fprintf(stderr, "ERROR: Failed to set bandwidth limit to %s\n", args.bwlimit_arg);
             goto main_err;
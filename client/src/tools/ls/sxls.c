@@ -278,7 +278,7 @@ int main(int argc, char **argv) {
                 ret = 1;
             }
 	} else {
-	    sxc_cluster_lf_t *fl = sxc_cluster_listfiles(cluster, u->volume, u->path, args.recursive_flag, NULL, NULL, NULL, NULL, 0);
+	    sxc_cluster_lf_t *fl = sxc_cluster_listfiles_paged(cluster, u->volume, u->path, args.recursive_flag, NULL, NULL, NULL, 0);
 	    if(fl) {
 		while(1) {
 		    char *fname;
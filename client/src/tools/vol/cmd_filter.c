@@ -1,7 +1,7 @@
 /*
   File autogenerated by gengetopt version 2.22.6
   generated with the following command:
-  ggo --no-handle-version --no-handle-error --file-name=cmd_filter --func-name=filter_cmdline_parser --arg-struct-name=filter_args_info
+  ggo --unamed-opts --no-handle-version --no-handle-error --file-name=cmd_filter --func-name=filter_cmdline_parser --arg-struct-name=filter_args_info
 
   The developers of gengetopt consider the fixed text that goes in all
   gengetopt output files to be in the public domain:
@@ -27,7 +27,7 @@
 
 const char *filter_args_info_purpose = "";
 
-const char *filter_args_info_usage = "Usage: sxvol filter <OPTIONS>...";
+const char *filter_args_info_usage = "Usage: sxvol filter <OPTIONS>... [sx://[profile@]cluster/volume]";
 
 const char *filter_args_info_versiontext = "";
 
@@ -175,6 +175,9 @@ filter_cmdline_parser_init (struct filter_args_info *args_info)
   clear_given (args_info);
   clear_args (args_info);
   init_args_info (args_info);
+
+  args_info->inputs = 0;
+  args_info->inputs_num = 0;
 }
 
 void
@@ -213,7 +216,7 @@ free_string_field (char **s)
 static void
 filter_cmdline_parser_release (struct filter_args_info *args_info)
 {
-
+  unsigned int i;
   free_string_field (&(args_info->info_arg));
   free_string_field (&(args_info->info_orig));
   free_string_field (&(args_info->config_dir_arg));
@@ -222,6 +225,11 @@ filter_cmdline_parser_release (struct filter_args_info *args_info)
   free_string_field (&(args_info->filter_dir_orig));
   
   
+  for (i = 0; i < args_info->inputs_num; ++i)
+    free (args_info->inputs [i]);
+
+  if (args_info->inputs_num)
+    free (args_info->inputs);
 
   clear_given (args_info);
 }
@@ -618,6 +626,30 @@ filter_cmdline_parser_internal (
   if ( error_occurred )
     return (EXIT_FAILURE);
 
+  if (optind < argc)
+    {
+      int i = 0 ;
+      int found_prog_name = 0;
+      /* whether program name, i.e., argv[0], is in the remaining args
+         (this may happen with some implementations of getopt,
+          but surely not with the one included by gengetopt) */
+
+      i = optind;
+      while (i < argc)
+        if (argv[i++] == argv[0]) {
+          found_prog_name = 1;
+          break;
+        }
+      i = 0;
+
+      args_info->inputs_num = argc - optind - found_prog_name;
+      args_info->inputs =
+        (char **)(malloc ((args_info->inputs_num)*sizeof(char *))) ;
+      while (optind < argc)
+        if (argv[optind++] != argv[0])
+          args_info->inputs[ i++ ] = gengetopt_strdup (argv[optind-1]) ;
+    }
+
   return 0;
 
 failure:
@@ -197,6 +197,114 @@ static int setup_filters(sxc_client_t *sx, const char *fdir)
     return 0;
 }
 
+/* Compression filters store the original size of each file (as a big endian
+ * 64-bit integer) in the <shortname>RawSize file meta */
+static int filter_stats(sxc_client_t *sx, const char *name, const char *sxurl)
+{
+	const sxf_handle_t *filters;
+	const sxc_filter_t *filter = NULL;
+	sxc_cluster_t *cluster;
+	sxc_cluster_lf_t *lf = NULL;
+	sxc_file_t *file = NULL;
+	sxc_meta_t *vmeta = NULL, *fmeta;
+	sxc_uri_t *uri;
+	const void *mval;
+	unsigned int mval_len, nfiles = 0, nunknown = 0;
+	unsigned long long stored = 0, raw = 0;
+	char uuid[37], key[64], *fname;
+	int64_t fsize;
+	int count, i, n, ret = 1;
+
+    filters = sxc_filter_list(sx, &count);
+    for(i = 0; filters && i < count; i++) {
+	const sxc_filter_t *f = sxc_get_filter(&filters[i]);
+	if(!strcmp(f->shortname, name))
+	    filter = f;
+    }
+    if(!filter)
+	return 1;
+
+    cluster = getcluster_common(sx, sxurl, NULL, &uri);
+    if(!cluster)
+	return 1;
+
+    file = sxc_file_remote(cluster, uri->volume, NULL, NULL);
+    if(!file || !(vmeta = sxc_volumemeta_new(file))) {
+	fprintf(stderr, "ERROR: Can't get volume metadata: %s\n", sxc_geterrmsg(sx));
+	goto stats_err;
+    }
+    if(sxc_meta_getval(vmeta, "filterActive", &mval, &mval_len) || mval_len != 16) {
+	fprintf(stderr, "ERROR: Volume %s doesn't use any filter\n", uri->volume);
+	goto stats_err;
+    }
+    sxi_uuid_unparse(mval, uuid);
+    if(strcmp(uuid, filter->uuid)) {
+	fprintf(stderr, "ERROR: Volume %s doesn't use filter '%s'\n", uri->volume, name);
+	goto stats_err;
+    }
+    if(filter->type != SXF_TYPE_COMPRESS) {
+	printf("\nNo volume statistics available for filter '%s'\n", name);
+	ret = 0;
+	goto stats_err;
+    }
+
+    lf = sxc_cluster_listfiles_paged(cluster, uri->volume, NULL, 1, NULL, NULL, NULL, 0);
+    if(!lf) {
+	fprintf(stderr, "ERROR: Can't list files: %s\n", sxc_geterrmsg(sx));
+	goto stats_err;
+    }
+    snprintf(key, sizeof(key), "%sRawSize", filter->shortname);
+    while((n = sxc_cluster_listfiles_next(lf, &fname, &fsize, NULL, NULL)) > 0) {
+	    sxc_file_t *f;
+
+	if(!*fname || fname[strlen(fname) - 1] == '/') {
+	    free(fname);
+	    continue;
+	}
+	nfiles++;
+	f = sxc_file_remote(cluster, uri->volume, fname, NULL);
+	free(fname);
+	fmeta = f ? sxc_filemeta_new(f) : NULL;
+	sxc_file_free(f);
+	if(!fmeta) {
+	    fprintf(stderr, "ERROR: Can't get file metadata: %s\n", sxc_geterrmsg(sx));
+	    goto stats_err;
+	}
+	if(!sxc_meta_getval(fmeta, key, &mval, &mval_len) && mval_len == 8) {
+		const unsigned char *b = mval;
+		unsigned long long size = 0;
+	    for(i = 0; i < 8; i++)
+		size = (size << 8) | b[i];
+	    raw += size;
+	    stored += fsize;
+	} else
+	    nunknown++;
+	sxc_meta_free(fmeta);
+    }
+    if(n < 0) {
+	fprintf(stderr, "ERROR: Failed to list files: %s\n", sxc_geterrmsg(sx));
+	goto stats_err;
+    }
+
+    printf("\nVolume %s:\n", uri->volume);
+    printf("Files: %u (%u without size information)\n", nfiles, nunknown);
+    printf("Original size: %llu\n", raw);
+    printf("Stored size: %llu\n", stored);
+    if(stored)
+	printf("Compression ratio: %.2f\n", (double) raw / stored);
+    else
+	printf("Compression ratio: N/A\n");
+    ret = 0;
+
+ stats_err:
+    sxc_cluster_listfiles_free(lf);
+    sxc_meta_free(vmeta);
+    sxc_file_free(file);
+    sxc_free_uri(uri);
+    sxc_cluster_free(cluster);
+    return ret;
+}
+
 static int volume_create(sxc_client_t *sx, const char *owner)
 {
 	sxc_cluster_t *cluster;
@@ -570,9 +678,11 @@ int main(int argc, char **argv) {
 	    ret = filter_list(sx);
 	    if(!ret && argc == 2)
 		fprintf(stderr, "\nRun sxvol filter --info=<filtername> to get usage help for a specific filter.\n");
-	} else if(filter_args.info_given)
+	} else if(filter_args.info_given && filter_args.inputs_num <= 1) {
 	    ret = filter_info(sx, filter_args.info_arg);
-	else {
+	    if(!ret && filter_args.inputs_num)
+		ret = filter_stats(sx, filter_args.info_arg, filter_args.inputs[0]);
+	} else {
 	    filter_cmdline_parser_print_help();
 	    printf("\n");
 	    fprintf(stderr, "ERROR: Invalid arguments\n");
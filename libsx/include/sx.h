@@ -143,16 +143,28 @@ void sxc_cluster_listvolumes_free(sxc_cluster_lv_t *lv);
 
 typedef struct _sxc_cluster_lf_t sxc_cluster_lf_t;
 sxc_cluster_lf_t *sxc_cluster_listfiles(sxc_cluster_t *cluster, const char *volume, const char *glob_pattern, int recursive, int64_t *volume_used_size, int64_t *volume_size, unsigned int *replica_count, unsigned int *nfiles, int reverse);
+/* Same as sxc_cluster_listfiles() but the list is fetched in pages of page_size entries
+ * (0 for the default) while the entries are being consumed: the first entries are
+ * available right away and the memory used does not depend on the number of files.
+ * Entries can only be retrieved in order with sxc_cluster_listfiles_next() */
+sxc_cluster_lf_t *sxc_cluster_listfiles_paged(sxc_cluster_t *cluster, const char *volume, const char *glob_pattern, int recursive, int64_t *volume_used_size, int64_t *volume_size, unsigned int *replica_count, unsigned int page_size);
 int sxc_cluster_listfiles_next(sxc_cluster_lf_t *lf, char **file_name, int64_t *file_size, time_t *file_created_at, char **file_revision);
 int sxc_cluster_listfiles_prev(sxc_cluster_lf_t *lf, char **file_name, int64_t *file_size, time_t *file_created_at, char **file_revision);
 void sxc_cluster_listfiles_free(sxc_cluster_lf_t *lf);
 
 /*
- * Set active connections limits.
- * max_active - maximal number of running connections.
- * max_active_per_host - maximal number of running connections with each host.
+ * Set active connections limits. The actual limits are adjusted at runtime
+ * to the observed throughput and latency and never exceed these values.
+ * max_active - maximal number of running connections (0 - default).
+ * max_active_per_host - maximal number of running connections with each host (0 - default).
  */
 int sxc_cluster_set_conns_limit(sxc_cluster_t *cluster, unsigned int max_active, unsigned int max_active_per_host);
+/*
+ * Multiplex requests over one HTTP/2 connection per node. Nodes which don't
+ * negotiate HTTP/2 (or plain HTTP clusters) keep using HTTP/1.1.
+ */
+int sxc_cluster_set_http2(sxc_cluster_t *cluster, int enable);
+int sxc_cluster_set_hash_threads(sxc_cluster_t *cluster, unsigned int nthreads);
 
 /* Transfer direction */
 typedef enum { SXC_XFER_DIRECTION_DOWNLOAD = 1, SXC_XFER_DIRECTION_UPLOAD = 2, SXC_XFER_DIRECTION_BOTH = 3 } sxc_xfer_direction_t;
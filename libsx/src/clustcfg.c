@@ -41,7 +41,19 @@
 #include "jobpoll.h"
 #include "curlevents.h"
 #include "vcrypto.h"
+#include "sha1mb.h"
 #include "misc.h"
+#include "workpool.h"
+
+/* The block range being hashed by sxi_cluster_hashcalc_blocks() */
+struct hashcalc_batch {
+    const char *salt;
+    unsigned int salt_len;
+    const uint8_t *buffer;
+    unsigned int blocksize;
+    unsigned int nblocks;
+    char *hashes;
+};
 
 struct _sxc_cluster_t {
     sxc_client_t *sx;
@@ -50,6 +62,9 @@ struct _sxc_cluster_t {
     struct sxi_access *useprof;
     struct sxi_access *access;
     char *cafile;
+    unsigned int hash_threads;
+    sxi_workpool_t *hash_pool;
+    struct hashcalc_batch hash_batch;
 };
 
 
@@ -111,6 +126,7 @@ void sxc_cluster_free(sxc_cluster_t *cluster) {
 	    free(delme);
 	}
 	free(cluster->cafile);
+	sxi_workpool_free(cluster->hash_pool);
 	free(cluster);
     }
 }
@@ -1557,6 +1573,7 @@ struct cb_listfiles_ctx {
     int64_t volume_used_size;
     char *fname;
     char *frev;
+    char *lastname;
     struct cbl_file_t file;
     unsigned int replica;
     unsigned int nfiles;
@@ -1614,13 +1631,14 @@ static int yacb_listfiles_map_key(void *ctx, const unsigned char *s, size_t l) {
     if(yactx->state == LF_FILE) {
 	yactx->state = LF_FILECONTENT;
 	yactx->file.namelen = l;
-	yactx->fname = malloc(yactx->file.namelen);
+	yactx->fname = malloc(yactx->file.namelen + 1);
 	if(!yactx->fname) {
 	    CBDEBUG("OOM duplicating file name '%.*s'", (unsigned)l, s);
 	    sxi_cbdata_setsyserr(yactx->cbdata, SXE_EMEM, "Out of memory");
 	    return 0;
 	}
 	memcpy(yactx->fname, s, yactx->file.namelen);
+	yactx->fname[yactx->file.namelen] = '\0';
 	yactx->file.revlen = 0;
 	yactx->file.created_at = -1;
 	yactx->file.filesize = -1;
@@ -1789,7 +1807,9 @@ static int yacb_listfiles_end_map(void *ctx) {
 	    sxi_cbdata_setsyserr(yactx->cbdata, SXE_EWRITE, "Failed to write to temporary file");
 	    return 0;
 	}
-	free(yactx->fname);
+	/* Keep the last name around: it's where the next page of a paged listing starts */
+	free(yactx->lastname);
+	yactx->lastname = yactx->fname;
 	yactx->fname = NULL;
 	free(yactx->frev);
 	yactx->frev = NULL;
@@ -1840,6 +1860,8 @@ static int listfiles_setup_cb(curlev_context_t *cbdata, void *ctx, const char *h
     yactx->fname = NULL;
     free(yactx->frev);
     yactx->frev = NULL;
+    free(yactx->lastname);
+    yactx->lastname = NULL;
     yactx->file.filesize = -1;
     yactx->file.created_at = -1;
     yactx->file.namelen = 0;
@@ -1862,6 +1884,9 @@ static int listfiles_cb(curlev_context_t *cbdata, void *ctx, const void *data, s
 }
 
 
+/* Default number of entries requested at once by sxc_cluster_listfiles_paged() */
+#define LISTFILES_PAGE_SIZE 10000
+
 struct _sxc_cluster_lf_t {
     sxc_client_t *sx;
     char *fname;
@@ -1870,6 +1895,19 @@ struct _sxc_cluster_lf_t {
     int reverse;
     unsigned pattern_slashes;
     unsigned prefix_len;
+
+    /* Paged listing: the next page is received into page->f while f is read */
+    struct cb_listfiles_ctx *page;
+    char *page_fname;
+    sxi_query_async_t *inflight;
+    sxi_conns_t *conns;
+    sxi_hostlist_t volhosts;
+    char *volume;
+    char *pattern;
+    int recursive;
+    unsigned int page_size;
+    char *lastname; /* last entry of the current page */
+    char *skipname; /* last entry of the previous page */
 };
 
 unsigned sxi_count_slashes(const char *str)
@@ -1985,12 +2023,14 @@ sxc_cluster_lf_t *sxi_conns_listfiles(sxi_conns_t *conns, const char *volume, sx
     yctx.yh = NULL;
     yctx.fname = NULL;
     yctx.frev = NULL;
+    yctx.lastname = NULL;
 
     sxi_set_operation(sx, "list volume files", sxi_conns_get_sslname(conns), volume, NULL);
     qret = sxi_cluster_query(conns, volhosts, REQ_GET, url, NULL, 0, listfiles_setup_cb, listfiles_cb, &yctx);
     free(url);
     free(yctx.fname);
     free(yctx.frev);
+    free(yctx.lastname);
     if(qret != 200) {
         SXDEBUG("query returned %d", qret);
 	if(yctx.yh)
@@ -2027,7 +2067,7 @@ sxc_cluster_lf_t *sxi_conns_listfiles(sxi_conns_t *conns, const char *volume, sx
 	return NULL;
     }
 
-    ret = malloc(sizeof(*ret));
+    ret = calloc(1, sizeof(*ret));
     if(!ret) {
         SXDEBUG("OOM allocating results");
         sxi_seterr(sx, SXE_EMEM, "List failed: Out of memory");
@@ -2049,6 +2089,7 @@ sxc_cluster_lf_t *sxi_conns_listfiles(sxi_conns_t *conns, const char *volume, sx
     if(nfiles)
 	*nfiles = yctx.nfiles;
 
+    sxi_hostlist_init(&ret->volhosts);
     ret->sx = sx;
     ret->f = yctx.f;
     ret->fname = fname;
@@ -2074,11 +2115,221 @@ sxc_cluster_lf_t *sxc_cluster_listfiles(sxc_cluster_t *cluster, const char *volu
     return ret;
 }
 
+/* Requests the page following lf->lastname */
+static int listfiles_page_request(sxc_cluster_lf_t *lf) {
+    char *enc_vol = NULL, *enc_glob = NULL, *enc_after = NULL, *url = NULL;
+    sxc_client_t *sx = lf->sx;
+    unsigned int len;
+    int ret = -1;
+
+    if(!(enc_vol = sxi_urlencode(sx, lf->volume, 0)) ||
+       (lf->pattern && !(enc_glob = sxi_urlencode(sx, lf->pattern, 1))) ||
+       /* The server expects names without the leading slash here */
+       (lf->lastname && !(enc_after = sxi_urlencode(sx, lf->lastname + (*lf->lastname == '/'), 1)))) {
+	SXDEBUG("failed to encode list query");
+	goto page_request_out;
+    }
+
+    len = strlen(enc_vol) + lenof("?limit=") + 11 + 1;
+    if(enc_glob)
+	len += lenof("&filter=") + strlen(enc_glob);
+    if(lf->recursive)
+	len += lenof("&recursive");
+    if(enc_after)
+	len += lenof("&after=") + strlen(enc_after);
+    if(!(url = malloc(len))) {
+	SXDEBUG("OOM allocating url (%u bytes)", len);
+	sxi_seterr(sx, SXE_EMEM, "List failed: Out of memory");
+	goto page_request_out;
+    }
+    snprintf(url, len, "%s?limit=%u%s%s%s%s%s", enc_vol, lf->page_size,
+	     enc_glob ? "&filter=" : "", enc_glob ? enc_glob : "",
+	     lf->recursive ? "&recursive" : "",
+	     enc_after ? "&after=" : "", enc_after ? enc_after : "");
+
+    lf->inflight = sxi_cluster_query_start(lf->conns, &lf->volhosts, REQ_GET, url, NULL, 0, listfiles_setup_cb, listfiles_cb, lf->page, 0);
+    if(lf->inflight)
+	ret = 0;
+
+ page_request_out:
+    free(enc_vol);
+    free(enc_glob);
+    free(enc_after);
+    free(url);
+    return ret;
+}
+
+/* Waits for the page in flight, makes it the current one and,
+ * unless it was the last one, requests the next page */
+static int listfiles_page_next(sxc_cluster_lf_t *lf) {
+    struct cb_listfiles_ctx *yctx = lf->page;
+    sxc_client_t *sx = lf->sx;
+    FILE *f;
+    char *fname;
+    int qret;
+
+    qret = sxi_cluster_query_finish(lf->inflight);
+    lf->inflight = NULL;
+    if(qret != 200) {
+	SXDEBUG("query returned %d", qret);
+	return -1;
+    }
+
+    if(yajl_complete_parse(yctx->yh) != yajl_status_ok || yctx->state != LF_COMPLETE) {
+        if (yctx->state != LF_ERROR) {
+            SXDEBUG("JSON parsing failed");
+            sxi_seterr(sx, SXE_ECOMM, "List failed: Communication error");
+        }
+	return -1;
+    }
+
+    if(fflush(yctx->f) ||
+       ftruncate(fileno(yctx->f), ftell(yctx->f)) ||
+       fseek(yctx->f, 0, SEEK_SET)) {
+        sxi_seterr(sx, SXE_EWRITE, "List failed: Failed to write temporary data");
+	return -1;
+    }
+
+    f = lf->f;
+    lf->f = yctx->f;
+    yctx->f = f;
+    fname = lf->fname;
+    lf->fname = lf->page_fname;
+    lf->page_fname = fname;
+
+    /* A fake directory may span two pages: its entry is not repeated */
+    free(lf->skipname);
+    lf->skipname = lf->lastname;
+    lf->lastname = yctx->lastname;
+    yctx->lastname = NULL;
+
+    if(yctx->nfiles < lf->page_size || !lf->lastname)
+	return 0;
+
+    return listfiles_page_request(lf);
+}
+
+sxc_cluster_lf_t *sxc_cluster_listfiles_paged(sxc_cluster_t *cluster, const char *volume, const char *glob_pattern, int recursive, int64_t *volume_used_size, int64_t *volume_size, unsigned int *replica_count, unsigned int page_size) {
+    sxc_client_t *sx = sxi_cluster_get_client(cluster);
+    struct cb_listfiles_ctx *yctx;
+    sxc_cluster_lf_t *ret;
+
+    sxc_clearerr(sx);
+    if(!volume) {
+        SXDEBUG("NULL argument");
+        return NULL;
+    }
+
+    if(!(ret = calloc(1, sizeof(*ret))) || !(ret->page = calloc(1, sizeof(*ret->page)))) {
+        SXDEBUG("OOM allocating results");
+        sxi_seterr(sx, SXE_EMEM, "List failed: Out of memory");
+	free(ret);
+	return NULL;
+    }
+    sxi_hostlist_init(&ret->volhosts);
+    ret->sx = sx;
+    ret->conns = sxi_cluster_get_conns(cluster);
+    ret->recursive = recursive;
+    ret->page_size = page_size ? page_size : LISTFILES_PAGE_SIZE;
+    ret->want_relative = glob_pattern && *glob_pattern && glob_pattern[strlen(glob_pattern)-1] == '/';
+    ret->pattern_slashes = sxi_count_slashes(glob_pattern);
+
+    yctx = ret->page;
+    ya_init(&yctx->yacb);
+    yctx->yacb.yajl_start_map = yacb_listfiles_start_map;
+    yctx->yacb.yajl_map_key = yacb_listfiles_map_key;
+    yctx->yacb.yajl_number = yacb_listfiles_number;
+    yctx->yacb.yajl_string = yacb_listfiles_string;
+    yctx->yacb.yajl_end_map = yacb_listfiles_end_map;
+
+    if(!(ret->volume = strdup(volume)) ||
+       (glob_pattern && !(ret->pattern = strdup(glob_pattern)))) {
+        sxi_seterr(sx, SXE_EMEM, "List failed: Out of memory");
+	goto listfiles_paged_err;
+    }
+
+    if(sxi_locate_volume(ret->conns, volume, &ret->volhosts, NULL, NULL)) {
+        CFGDEBUG("Failed to locate volume %s", volume);
+	goto listfiles_paged_err;
+    }
+
+    if(!(ret->fname = sxi_make_tempfile(sx, NULL, &ret->f)) ||
+       !(ret->page_fname = sxi_make_tempfile(sx, NULL, &yctx->f))) {
+        SXDEBUG("failed to create temporary storage for file list");
+	goto listfiles_paged_err;
+    }
+
+    sxi_set_operation(sx, "list volume files", sxi_conns_get_sslname(ret->conns), volume, NULL);
+    if(listfiles_page_request(ret) || listfiles_page_next(ret))
+	goto listfiles_paged_err;
+
+    if(volume_used_size)
+        *volume_used_size = yctx->volume_used_size;
+    if(volume_size)
+	*volume_size = yctx->volume_size;
+    if(replica_count)
+	*replica_count = yctx->replica;
+
+    return ret;
+
+ listfiles_paged_err:
+    sxc_cluster_listfiles_free(ret);
+    return NULL;
+}
+
+static int listfiles_read(sxc_cluster_lf_t *lf, char **file_name, int64_t *file_size, time_t *file_created_at, char **file_revision);
+
+/* Returns the next entry of a paged listing, moving on to the next page as needed */
+static int listfiles_paged_read(sxc_cluster_lf_t *lf, char **file_name, int64_t *file_size, time_t *file_created_at, char **file_revision) {
+    char *name;
+    int ret;
+
+    while(1) {
+	ret = listfiles_read(lf, &name, file_size, file_created_at, file_revision);
+	if(ret < 0)
+	    return ret;
+	if(ret) {
+	    if(lf->skipname) {
+		int skip = !strcmp(name, lf->skipname);
+		free(lf->skipname);
+		lf->skipname = NULL;
+		if(skip) {
+		    free(name);
+		    if(file_revision) {
+			free(*file_revision);
+			*file_revision = NULL;
+		    }
+		    continue;
+		}
+	    }
+	    if(file_name)
+		*file_name = name;
+	    else
+		free(name);
+	    /* Keep the next page coming while the caller processes this entry */
+	    if(lf->inflight)
+		sxi_cluster_query_poll(lf->inflight);
+	    return 1;
+	}
+
+	/* Current page exhausted */
+	if(!lf->inflight)
+	    return 0;
+	if(listfiles_page_next(lf))
+	    return -1;
+    }
+}
+
 int sxc_cluster_listfiles_prev(sxc_cluster_lf_t *lf, char **file_name, int64_t *file_size, time_t *file_created_at, char **file_revision) {
     struct cbl_file_t file;
     long pos;
     sxc_client_t *sx = lf->sx;
 
+    if(lf->page) {
+	sxi_seterr(sx, SXE_EARG, "Cannot list backwards: paged listing");
+	return -1;
+    }
+
     pos = ftell(lf->f);
     if(pos < 0) {
 	SXDEBUG("error getting the current position in the result file");
@@ -2146,20 +2397,44 @@ int sxc_cluster_listfiles_prev(sxc_cluster_lf_t *lf, char **file_name, int64_t *
 }
 
 int sxc_cluster_listfiles_next(sxc_cluster_lf_t *lf, char **file_name, int64_t *file_size, time_t *file_created_at, char **file_revision) {
-    struct cbl_file_t file;
-    sxc_client_t *sx = lf->sx;
-    int ret = -1;
+    int ret;
 
     if(file_name)
 	*file_name = NULL;
     if(file_revision)
 	*file_revision = NULL;
 
-    if(lf->reverse) {
+    if(lf->reverse)
 	ret = sxc_cluster_listfiles_prev(lf, file_name, file_size, file_created_at, file_revision);
-	goto lfnext_out;
+    else if(lf->page)
+	ret = listfiles_paged_read(lf, file_name, file_size, file_created_at, file_revision);
+    else
+	ret = listfiles_read(lf, file_name, file_size, file_created_at, file_revision);
+
+    if(ret != 1) {
+	if(file_name) {
+	    free(*file_name);
+	    *file_name = NULL;
+	}
+	if(file_revision) {
+	    free(*file_revision);
+	    *file_revision = NULL;
+	}
     }
 
+    return ret;
+}
+
+static int listfiles_read(sxc_cluster_lf_t *lf, char **file_name, int64_t *file_size, time_t *file_created_at, char **file_revision) {
+    struct cbl_file_t file;
+    sxc_client_t *sx = lf->sx;
+    int ret = -1;
+
+    if(file_name)
+	*file_name = NULL;
+    if(file_revision)
+	*file_revision = NULL;
+
     if(!fread(&file, sizeof(file), 1, lf->f)) {
 	if(ferror(lf->f)) {
 	    SXDEBUG("error reading attributes from results file");
@@ -2243,6 +2518,28 @@ void sxc_cluster_listfiles_free(sxc_cluster_lf_t *lf) {
 	unlink(lf->fname);
 	free(lf->fname);
     }
+    if(lf->page) {
+	/* There's no way to cancel a query: wait for the page in flight */
+	if(lf->inflight)
+	    sxi_cluster_query_finish(lf->inflight);
+	if(lf->page->yh)
+	    yajl_free(lf->page->yh);
+	free(lf->page->fname);
+	free(lf->page->frev);
+	free(lf->page->lastname);
+	if(lf->page->f)
+	    fclose(lf->page->f);
+	free(lf->page);
+    }
+    if(lf->page_fname) {
+	unlink(lf->page_fname);
+	free(lf->page_fname);
+    }
+    sxi_hostlist_empty(&lf->volhosts);
+    free(lf->volume);
+    free(lf->pattern);
+    free(lf->lastname);
+    free(lf->skipname);
     free(lf);
 }
 
@@ -2250,6 +2547,83 @@ int sxi_cluster_hashcalc(const sxc_cluster_t *cluster, const void *buffer, unsig
     return sxi_conns_hashcalc(cluster->conns, buffer, len, hash);
 }
 
+/* Blocks hashed per sxi_sha1_calc_multi() call and per work pool chunk */
+#define HASHCALC_CHUNK_BLOCKS (4 * SXI_SHA1MB_LANES)
+
+static int hashcalc_chunk(void *ctx, unsigned int w, unsigned int i) {
+    struct hashcalc_batch *b = ctx;
+    const void *bufs[HASHCALC_CHUNK_BLOCKS];
+    unsigned char md[HASHCALC_CHUNK_BLOCKS * SXI_SHA1_BIN_LEN];
+    unsigned int j, first = i * HASHCALC_CHUNK_BLOCKS, n = MIN(HASHCALC_CHUNK_BLOCKS, b->nblocks - first);
+
+    for(j=0; j<n; j++)
+	bufs[j] = b->buffer + (uint64_t)(first + j) * b->blocksize;
+    if(sxi_sha1_calc_multi(b->salt, b->salt_len, bufs, b->blocksize, n, md))
+	return 1;
+    for(j=0; j<n; j++) {
+	char *hash = b->hashes + (first + j) * (SXI_SHA1_TEXT_LEN + 1);
+	sxi_bin2hex(md + j * SXI_SHA1_BIN_LEN, SXI_SHA1_BIN_LEN, hash);
+	hash[SXI_SHA1_TEXT_LEN] = '\0';
+    }
+    return 0;
+}
+
+#define MAX_HASH_THREADS 64
+int sxi_cluster_hashcalc_blocks(sxc_cluster_t *cluster, const void *buffer, unsigned int blocksize, unsigned int nblocks, char *hashes) {
+    struct hashcalc_batch *b;
+    unsigned int i, nchunks;
+    const char *uuid;
+    int ret = 0;
+
+    if(!cluster || !buffer || !hashes)
+	return 1;
+    if(!nblocks)
+	return 0;
+    uuid = sxi_conns_get_uuid(cluster->conns);
+    if(!uuid) {
+	cluster_err(SXE_EARG, "Cannot compute hash: No cluster uuid is set");
+	return 1;
+    }
+
+    b = &cluster->hash_batch;
+    b->salt = uuid;
+    b->salt_len = strlen(uuid);
+    b->buffer = buffer;
+    b->blocksize = blocksize;
+    b->nblocks = nblocks;
+    b->hashes = hashes;
+    nchunks = (nblocks + HASHCALC_CHUNK_BLOCKS - 1) / HASHCALC_CHUNK_BLOCKS;
+
+    /* The pool is started on first use and kept for the lifetime of the
+     * cluster; if it cannot be started the chunks are hashed inline */
+    if(cluster->hash_threads > 1 && !cluster->hash_pool)
+	cluster->hash_pool = sxi_workpool_new(cluster->hash_threads, hashcalc_chunk, b);
+    if(cluster->hash_pool && nchunks > 1)
+	ret = sxi_workpool_run(cluster->hash_pool, nchunks);
+    else
+	for(i=0; i<nchunks && !ret; i++)
+	    ret = hashcalc_chunk(b, 0, i);
+
+    if(ret)
+	cluster_err(SXE_ECRYPT, "Failed to calculate hash");
+    return ret;
+}
+
+int sxc_cluster_set_hash_threads(sxc_cluster_t *cluster, unsigned int nthreads) {
+    if(!cluster)
+	return 1;
+    if(!nthreads || nthreads > MAX_HASH_THREADS) {
+	cluster_err(SXE_EARG, "Invalid number of hashing threads: must be between 1 and %u", MAX_HASH_THREADS);
+	return 1;
+    }
+    if(nthreads != cluster->hash_threads) {
+	sxi_workpool_free(cluster->hash_pool);
+	cluster->hash_pool = NULL;
+    }
+    cluster->hash_threads = nthreads;
+    return 0;
+}
+
 sxc_cluster_t *sxc_cluster_load_and_update(sxc_client_t *sx, const char *cluster_name, const char *profile_name) {
     sxi_hostlist_t oldlist;
     int need_save = 0, n1, n2;
@@ -2874,3 +3248,10 @@ int sxc_cluster_set_conns_limit(sxc_cluster_t *cluster, unsigned int max_active,
 
     return sxi_conns_set_connections_limit(cluster->conns, max_active, max_active_per_host);
 }
+
+int sxc_cluster_set_http2(sxc_cluster_t *cluster, int enable) {
+    if(!cluster)
+        return 1;
+
+    return sxi_conns_set_http2(cluster->conns, enable);
+}
@@ -28,6 +28,9 @@
 sxc_client_t *sxi_cluster_get_client(const sxc_cluster_t *cluster);
 int sxi_is_valid_cluster(const sxc_cluster_t *cluster);
 int sxi_cluster_hashcalc(const sxc_cluster_t *cluster, const void *buffer, unsigned int len, char *hash);
+/* Hashes nblocks consecutive blocks, spreading the work across the cluster's
+ * hashing thread pool; hashes receives nblocks NUL terminated hex strings */
+int sxi_cluster_hashcalc_blocks(sxc_cluster_t *cluster, const void *buffer, unsigned int blocksize, unsigned int nblocks, char *hashes);
 sxc_cluster_lf_t *sxi_cluster_list_local_files(sxc_client_t *sx, const char *path, int recursive, unsigned int *nfiles);
 sxc_cluster_lf_t *sxi_conns_listfiles(sxi_conns_t *conns, const char *volume, sxi_hostlist_t *volhosts, const char *glob_pattern, int recursive, int64_t *volume_used_size, int64_t *volume_size, unsigned int *replica_count, unsigned int *nfiles, int reverse, int sizeOnly);
 char *sxi_urlencode(sxc_client_t *sx, const char *string, int encode_slash);
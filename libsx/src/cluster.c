@@ -592,91 +592,158 @@ int64_t sxi_generic_get_xfer_to_ul(const struct generic_ctx *ctx) {
     return ctx && ctx->xfer_stat ? ctx->to_ul : 0;
 }
 
-int sxi_cluster_query_track(sxi_conns_t *conns, const sxi_hostlist_t *hlist, enum sxi_cluster_verb verb, const char *query,
-                            void *content, size_t content_size, cluster_setupcb setup_callback, cluster_datacb callback,
-                            void *context, int track_xfer)
-{
-    unsigned int i, clock_fixed = 0;
-    long status = -1;
-    unsigned hostcount;
+struct _sxi_query_async_t {
+    sxi_conns_t *conns;
+    const sxi_hostlist_t *hlist;
+    enum sxi_cluster_verb verb;
+    char *query;
+    void *content;
+    size_t content_size;
     struct generic_ctx gctx;
+    curlev_context_t *cbdata;
     sxi_retry_t *retry;
+    unsigned int hostidx, hostcount, clock_fixed, inflight;
+};
+
+/* Sends the query to the current host of the list */
+static int query_async_send(sxi_query_async_t *q) {
+    sxi_conns_t *conns = q->conns;
+    const char *host;
+
+    if(q->hostidx >= q->hostcount)
+	return -1;
+
+    sxi_cbdata_reset(q->cbdata);
+
+    /* clear errors: we're retrying on next host */
+    if (sxi_retry_check(q->retry, q->hostidx))
+	return -1;
+
+    host = sxi_hostlist_get_host(q->hlist, q->hostidx);
+    sxi_retry_msg(sxi_conns_get_client(conns), q->retry, host);
+
+    conns->clock_drifted = 0;
+    if(sxi_cluster_query_ev(q->cbdata, conns, host, q->verb, q->query, q->content, q->content_size,
+			    wrap_setup_callback, wrap_data_callback) == -1)
+	return -1;
+
+    q->inflight = 1;
+    return 0;
+}
+
+sxi_query_async_t *sxi_cluster_query_start(sxi_conns_t *conns, const sxi_hostlist_t *hlist, enum sxi_cluster_verb verb, const char *query,
+					    void *content, size_t content_size, cluster_setupcb setup_callback, cluster_datacb callback,
+					    void *context, int track_xfer)
+{
+    sxi_query_async_t *q;
 
     if(!hlist)
 	    hlist = &conns->hlist;
-    hostcount = sxi_hostlist_get_count(hlist);
 
-    if (!hostcount) {
+    if (!sxi_hostlist_get_count(hlist) || !query) {
 	CLSTDEBUG("called with unexpected NULL or empty arguments");
 	conns_err(SXE_EARG, "Cluster query failed: Invalid argument");
-	return -1;
+	return NULL;
     }
 
-    gctx.setup_callback = setup_callback;
-    gctx.callback = callback;
-    gctx.context = context;
+    if(!(q = calloc(1, sizeof(*q))) || !(q->query = strdup(query))) {
+	free(q);
+	conns_err(SXE_EMEM, "Cluster query failed: Out of memory");
+	return NULL;
+    }
+    q->conns = conns;
+    q->hlist = hlist;
+    q->hostcount = sxi_hostlist_get_count(hlist);
+    q->verb = verb;
+    q->content = content;
+    q->content_size = content_size;
+    q->gctx.setup_callback = setup_callback;
+    q->gctx.callback = callback;
+    q->gctx.context = context;
     if(track_xfer)
-        gctx.xfer_stat = sxi_conns_get_xfer_stat(conns);
-    else
-        gctx.xfer_stat = NULL;
-    curlev_context_t *cbdata = sxi_cbdata_create_generic(conns, NULL, &gctx);
+        q->gctx.xfer_stat = sxi_conns_get_xfer_stat(conns);
 
-    if (!cbdata) {
+    q->cbdata = sxi_cbdata_create_generic(conns, NULL, &q->gctx);
+    if (!q->cbdata) {
 	conns_err(SXE_EMEM, "Cluster query failed: Out of memory allocating context");
-	return -1;
+	free(q->query);
+	free(q);
+	return NULL;
     }
-    retry = sxi_retry_init(cbdata, RCTX_CBDATA);
-    if (!retry) {
-        sxi_cbdata_seterr(cbdata, SXE_EMEM, "Could not allocate retry");
-        sxi_cbdata_unref(&cbdata);
-        return -1;
+    q->retry = sxi_retry_init(q->cbdata, RCTX_CBDATA);
+    if (!q->retry) {
+        sxi_cbdata_seterr(q->cbdata, SXE_EMEM, "Could not allocate retry");
+        sxi_cbdata_unref(&q->cbdata);
+	free(q->query);
+	free(q);
+        return NULL;
     }
-    for(i=0; i<hostcount; i++) {
-	int rc;
-	sxi_cbdata_reset(cbdata);
 
-	/* clear errors: we're retrying on next host */
-	if (sxi_retry_check(retry, i))
-	    break;
+    /* A failure here is reported by sxi_cluster_query_finish() */
+    query_async_send(q);
+    return q;
+}
 
-	const char *host = sxi_hostlist_get_host(hlist, i);
-	sxi_retry_msg(sxi_conns_get_client(conns), retry, host);
+int sxi_cluster_query_poll(sxi_query_async_t *q) {
+    if(!q)
+	return -1;
+    if(q->inflight && !sxi_cbdata_is_finished(q->cbdata) && sxi_curlev_poll_immediate(q->conns->curlev))
+	return -1;
+    return !q->inflight || sxi_cbdata_is_finished(q->cbdata);
+}
 
-	conns->clock_drifted = 0;
-	rc = sxi_cluster_query_ev(cbdata, conns, host, verb, query, content, content_size,
-				  wrap_setup_callback, wrap_data_callback);
-	if (rc == -1)
-	    break;
+int sxi_cluster_query_finish(sxi_query_async_t *q) {
+    sxi_conns_t *conns;
+    long status = -1;
 
-	if (sxi_cbdata_wait(cbdata, conns->curlev, &status))
-	    break;
+    if(!q)
+	return -1;
 
-	if(status == 401 && !clock_fixed && conns->clock_drifted) {
-	    clock_fixed = 1; /* Only try to fix the clock once per request */
-	    i--;
-	    sxi_cbdata_clearerr(cbdata);
-	    continue;
-	}
+    conns = q->conns;
+    while(q->inflight) {
+	q->inflight = 0;
+	if (sxi_cbdata_wait(q->cbdata, conns->curlev, &status))
+	    break;
 
-	/* Break out on success or if the failure is non retriable */
-	if((status == 200) ||
-	   (status / 100 == 4 && status != 404 && status != 408 && status != 410 && status != 429))
+	if(status == 401 && !q->clock_fixed && conns->clock_drifted) {
+	    q->clock_fixed = 1; /* Only try to fix the clock once per request */
+	    sxi_cbdata_clearerr(q->cbdata);
+	} else if((status == 200) ||
+		  (status / 100 == 4 && status != 404 && status != 408 && status != 410 && status != 429)) {
+	    /* Break out on success or if the failure is non retriable */
 	    break;
+	} else
+	    q->hostidx++;
+
+	query_async_send(q);
     }
 
-    if(i==hostcount && status != 200)
-        CLSTDEBUG("All %d hosts returned failure", sxi_hostlist_get_count(hlist));
+    if(q->hostidx >= q->hostcount && status != 200)
+        CLSTDEBUG("All %d hosts returned failure", q->hostcount);
 
-    if (sxi_retry_done(&retry) && status == 200) {
+    if (sxi_retry_done(&q->retry) && status == 200) {
         /* error encountered in retry_done, even though status was successful
          * do not change status in other cases, we want to return an actual
          * http status code if we have it on an error */
         status = -1;
     }
-    sxi_cbdata_unref(&cbdata);
+    sxi_cbdata_unref(&q->cbdata);
+    free(q->query);
+    free(q);
     return status;
 }
 
+int sxi_cluster_query_track(sxi_conns_t *conns, const sxi_hostlist_t *hlist, enum sxi_cluster_verb verb, const char *query,
+                            void *content, size_t content_size, cluster_setupcb setup_callback, cluster_datacb callback,
+                            void *context, int track_xfer)
+{
+    sxi_query_async_t *q = sxi_cluster_query_start(conns, hlist, verb, query, content, content_size,
+						   setup_callback, callback, context, track_xfer);
+    if(!q)
+	return -1;
+    return sxi_cluster_query_finish(q);
+}
+
 int sxi_cluster_query(sxi_conns_t *conns, const sxi_hostlist_t *hlist, enum sxi_cluster_verb verb, const char *query, void *content, size_t content_size, cluster_setupcb setup_callback, cluster_datacb callback, void *context) {
     return sxi_cluster_query_track(conns, hlist, verb, query, content, content_size, setup_callback, callback, context, 0);
 }
@@ -966,6 +1033,13 @@ int sxi_conns_set_connections_limit(sxi_conns_t *conns, unsigned int max_active,
     return sxi_curlev_set_conns_limit(conns->curlev, max_active, max_active_per_host);
 }
 
+int sxi_conns_set_http2(sxi_conns_t *conns, int enable) {
+    if(!conns || !conns->curlev)
+        return 1;
+
+    return sxi_curlev_set_http2(conns->curlev, enable);
+}
+
 /* Set progress statistics information */
 int sxi_conns_set_xfer_stat(sxi_conns_t *conns, sxc_xfer_stat_t *xfer_stat) {
     if(!conns)
@@ -61,6 +61,15 @@ typedef int (*cluster_datacb)(curlev_context_t *cbdata, void *context, const voi
 typedef int (*cluster_setupcb)(curlev_context_t *cbdata, void *context, const char *host);
 int sxi_cluster_query(sxi_conns_t *conns, const sxi_hostlist_t *hlist, enum sxi_cluster_verb verb, const char *query, void *content, size_t content_size, cluster_setupcb setup_callback, cluster_datacb data_callback, void *context);
 int sxi_cluster_query_track(sxi_conns_t *conns, const sxi_hostlist_t *hlist, enum sxi_cluster_verb verb, const char *query, void *content, size_t content_size, cluster_setupcb setup_callback, cluster_datacb data_callback, void *context, int track_xfer);
+
+/* Asynchronous version of sxi_cluster_query_track(): the query is sent right away,
+ * sxi_cluster_query_poll() makes progress without blocking (returns 1 once done) and
+ * sxi_cluster_query_finish() waits for it (retrying on the other hosts), frees
+ * the handle and returns the http status */
+typedef struct _sxi_query_async_t sxi_query_async_t;
+sxi_query_async_t *sxi_cluster_query_start(sxi_conns_t *conns, const sxi_hostlist_t *hlist, enum sxi_cluster_verb verb, const char *query, void *content, size_t content_size, cluster_setupcb setup_callback, cluster_datacb data_callback, void *context, int track_xfer);
+int sxi_cluster_query_poll(sxi_query_async_t *q);
+int sxi_cluster_query_finish(sxi_query_async_t *q);
 int sxi_conns_hashcalc(sxi_conns_t *conns, const void *buffer, unsigned int len, char *hash);
 int sxi_conns_hashcalc_core(sxc_client_t *sx, const void *salt, unsigned salt_len, const void *buffer, unsigned int len, char *hash);
 int sxi_cluster_query_ev(curlev_context_t *cbdata,
@@ -91,6 +100,9 @@ int sxi_conns_internally_secure(sxi_conns_t *conns);
 /* Set active connections limits */
 int sxi_conns_set_connections_limit(sxi_conns_t *conns, unsigned int max_active, unsigned int max_active_per_host);
 
+/* Use HTTP/2 multiplexing where the nodes support it */
+int sxi_conns_set_http2(sxi_conns_t *conns, int enable);
+
 struct generic_ctx;
 
 /* Set information about current generic transfer */
@@ -764,14 +764,96 @@ typedef struct {
 #define MAX_EVENTS                              64
 #define MAX_ACTIVE_CONNECTIONS                  5
 #define MAX_ACTIVE_PER_HOST                     2
+/* Default ceilings for the adaptive limits */
+#define MAX_ADAPTIVE_CONNECTIONS                32
+#define MAX_ADAPTIVE_PER_HOST                   8
+
+/*
+ * AIMD controller for a connections limit. After each window of finished
+ * requests the limit grows by one if requests had to wait for it. It is
+ * halved when transfers fail, and cut by a quarter when latency grows
+ * without a matching gain in throughput.
+ */
+struct conn_ctl {
+    unsigned int limit; /* Current limit */
+    unsigned int max; /* Ceiling */
+    unsigned int done; /* Requests finished in the current window */
+    unsigned int errors; /* Failed requests in the current window */
+    int saturated; /* Requests were queued because of this limit */
+    double bytes; /* Bytes transferred in the current window */
+    double latency; /* Sum of request times in the current window */
+    double base_latency; /* Lowest average request time seen */
+    double last_rate; /* Throughput of the previous window */
+    struct timeval start; /* Current window start */
+};
+
+static void conn_ctl_init(struct conn_ctl *ctl, unsigned int limit, unsigned int max) {
+    memset(ctl, 0, sizeof(*ctl));
+    ctl->max = max;
+    ctl->limit = limit < max ? limit : max;
+    gettimeofday(&ctl->start, NULL);
+}
+
+static void conn_ctl_set_max(struct conn_ctl *ctl, unsigned int max) {
+    ctl->max = max;
+    if(ctl->limit > max)
+        ctl->limit = max;
+}
+
+/* Account a finished request, return 1 if the limit has changed */
+static int conn_ctl_update(struct conn_ctl *ctl, double bytes, double latency, int failed) {
+    struct timeval now;
+    double elapsed, rate, avg;
+    unsigned int limit = ctl->limit;
+
+    ctl->done++;
+    ctl->bytes += bytes;
+    ctl->latency += latency;
+    if(failed)
+        ctl->errors++;
+    if(ctl->done < 2 * ctl->limit + 2)
+        return 0;
+
+    gettimeofday(&now, NULL);
+    elapsed = sxi_timediff(&now, &ctl->start);
+    rate = elapsed > 0 ? ctl->bytes / elapsed : 0;
+    avg = ctl->latency / ctl->done;
+    if(!ctl->base_latency || avg < ctl->base_latency)
+        ctl->base_latency = avg;
+    else /* Slowly follow changing network conditions */
+        ctl->base_latency += (avg - ctl->base_latency) / 16;
+
+    if(ctl->errors)
+        limit /= 2;
+    else if(avg > 2 * ctl->base_latency && rate < ctl->last_rate * 1.1)
+        limit -= limit > 3 ? limit / 4 : 1;
+    else if(ctl->saturated && limit < ctl->max)
+        limit++;
+    if(!limit)
+        limit = 1;
+
+    ctl->last_rate = rate;
+    ctl->done = 0;
+    ctl->errors = 0;
+    ctl->saturated = 0;
+    ctl->bytes = 0;
+    ctl->latency = 0;
+    ctl->start = now;
+    if(limit == ctl->limit)
+        return 0;
+    ctl->limit = limit;
+    return 1;
+}
 
 /* Hold information about active connections for each host */
 struct host_info {
     char *host;
     unsigned int active;
+    int multiplexed; /* Host replied over HTTP/2 */
+    struct conn_ctl ctl;
 };
 
-static struct host_info *host_active_info_new(const char *host) {
+static struct host_info *host_active_info_new(const char *host, unsigned int limit, unsigned int max) {
     struct host_info *info = malloc(sizeof(struct host_info));
     if(!info) {
         return NULL;
@@ -784,6 +866,8 @@ static struct host_info *host_active_info_new(const char *host) {
     }
 
     info->active = 0;
+    info->multiplexed = 0;
+    conn_ctl_init(&info->ctl, limit, max);
     return info;
 }
 
@@ -802,7 +886,8 @@ typedef struct {
     sxc_client_t *sx;
     struct ev_queue *queue; /* Queued connections */
     unsigned int max_active_total; /* Total number of active connections */
-    unsigned int max_active_per_host; /* Number of active connections that each node can connect */
+    unsigned int max_active_per_host; /* Ceiling for the number of active connections with each node */
+    struct conn_ctl ctl; /* Adapts max_active_total */
     curlev_t *active; /* Connections that are currently used */
     unsigned int active_count; /* Number of active connections */
     sxi_ht *hosts; /* Hold struct host_active_info structures */
@@ -968,7 +1053,7 @@ static int ev_queue_length(ev_queue_t *q) {
     return q->length;
 }
 
-/* Return 1 if cURL event destination host hold less than pool->max_active_per_host */
+/* Return 1 if cURL event destination host hold less than its connections limit */
 static int check_host_active_count(const connection_pool_t *pool,  const curlev_t *ev) {
     struct host_info *host = NULL;
 
@@ -981,7 +1066,7 @@ static int check_host_active_count(const connection_pool_t *pool,  const curlev_
         return -1;
     }
 
-    return host->active < pool->max_active_per_host ? 1 : 0;
+    return host->active < host->ctl.limit ? 1 : 0;
 }
 
 /* Get new connection pool instance */
@@ -998,8 +1083,9 @@ static connection_pool_t *connection_pool_new(sxc_client_t *sx) {
     }
 
     pool->sx = sx;
-    pool->max_active_total = MAX_ACTIVE_CONNECTIONS;
-    pool->max_active_per_host = MAX_ACTIVE_PER_HOST;
+    conn_ctl_init(&pool->ctl, MAX_ACTIVE_CONNECTIONS, MAX_ADAPTIVE_CONNECTIONS);
+    pool->max_active_total = pool->ctl.limit;
+    pool->max_active_per_host = MAX_ADAPTIVE_PER_HOST;
 
     pool->active = calloc(MAX_EVENTS, sizeof(*pool->active));
     if(!pool->active) {
@@ -1064,6 +1150,7 @@ struct curl_events {
     char *savefile;
     int saved, quiet;
     int disable_proxy;
+    int http2; /* Multiplex requests over HTTP/2 where the server supports it */
 
     /* Connections pool handle connections shared between hosts */
     connection_pool_t *conn_pool;
@@ -1178,36 +1265,69 @@ int64_t sxi_curlev_get_bandwidth_limit(const curl_events_t *e) {
     return e->bandwidth.local_limit;
 }
 
-static int queue_next_inactive(curl_events_t *e);
+/* Set ceilings for the adaptive connections limits */
 int sxi_curlev_set_conns_limit(curl_events_t *e, unsigned int max_active, unsigned int max_active_per_host) {
+    struct host_info *host = NULL;
+
     if(!e)
         return 1;
 
     /* Check and fallback to defaults if necessary */
-    if(!max_active) max_active = MAX_ACTIVE_CONNECTIONS;
-    if(!max_active_per_host) max_active_per_host = MAX_ACTIVE_PER_HOST;
+    if(!max_active) max_active = MAX_ADAPTIVE_CONNECTIONS;
+    if(!max_active_per_host) max_active_per_host = MAX_ADAPTIVE_PER_HOST;
+    if(max_active > MAX_EVENTS) max_active = MAX_EVENTS;
 
-    e->conn_pool->max_active_per_host = max_active_per_host;
-    /* 
-     * If maximal number of running connections is not increased, simply wait for current
-     * connections to finish. 
+    /*
+     * Limits only shrink here, if they are now above the ceiling. Running
+     * connections are not interrupted, new ones wait for them to finish.
      */
-    if(max_active > e->conn_pool->max_active_total) {
-        int ret = 0;
+    e->conn_pool->max_active_per_host = max_active_per_host;
+    sxi_ht_enum_reset(e->conn_pool->hosts);
+    while(!sxi_ht_enum_getnext(e->conn_pool->hosts, NULL, NULL, (const void **)&host))
+        conn_ctl_set_max(&host->ctl, host->multiplexed ? max_active : max_active_per_host);
+    conn_ctl_set_max(&e->conn_pool->ctl, max_active);
+    e->conn_pool->max_active_total = e->conn_pool->ctl.limit;
+    EVENTSDEBUG(e, "Connections limit ceilings: %u per host, %u total", max_active_per_host, max_active);
+    return 0;
+}
+
+/* Feed the limits controllers with a finished transfer */
+static void update_conns_limits(curl_events_t *e, struct host_info *host, CURL *curl, const struct recv_context *rctx) {
+    double ul = 0, dl = 0, t = 0;
+    int overload, changed;
+
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD, &ul);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &dl);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &t);
+
+    /* Any error counts against the host, only timeouts and overloaded nodes against the total */
+    overload = rctx->rc == CURLE_OPERATION_TIMEDOUT || rctx->reply_status == 503 || rctx->reply_status == 429;
+    changed = 0;
+#if LIBCURL_VERSION_NUM >= 0x073200
+    if(e->http2 && !host->multiplexed && rctx->rc == CURLE_OK) {
+        long version = 0;
+
         /*
-         * Maximal number of running connections has been increased, we have to dequeue existing
-         * but not running connections.
+         * Requests to a HTTP/2 host are streams on a single connection, let them
+         * grow up to the total limit. Other hosts keep the HTTP/1.1 limits.
          */
-        e->conn_pool->max_active_total = max_active;
-        while(e->conn_pool->active_count < e->conn_pool->max_active_total) {
-            ret = queue_next_inactive(e);
-            if(!ret) /* This happens if no events are queued or all events reached per-host limit */
-                break;
+        curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+        if(version == CURL_HTTP_VERSION_2_0) {
+            host->multiplexed = 1;
+            conn_ctl_set_max(&host->ctl, e->conn_pool->ctl.max);
+            host->ctl.limit = host->ctl.max;
+            sxi_info(e->conn_pool->sx, "Multiplexing requests to %s over HTTP/2", host->host);
+            changed = 1;
         }
-    } else {
-        e->conn_pool->max_active_total = max_active;
     }
-    return 0;
+#endif
+    changed |= conn_ctl_update(&host->ctl, ul + dl, t, overload || rctx->rc != CURLE_OK);
+    if(conn_ctl_update(&e->conn_pool->ctl, ul + dl, t, overload)) {
+        e->conn_pool->max_active_total = e->conn_pool->ctl.limit;
+        changed = 1;
+    }
+    if(changed)
+        sxi_info(e->conn_pool->sx, "Connections limit: %u for %s, %u total", host->ctl.limit, host->host, e->conn_pool->max_active_total);
 }
 
 static int curl_check(curlev_t *e, CURLcode code, const char *msg)
@@ -1355,6 +1475,43 @@ void sxi_curlev_set_verbose(curl_events_t *ev, int is_verbose)
         ev->verbose = is_verbose;
 }
 
+int sxi_curlev_set_http2(curl_events_t *e, int enable) {
+    sxc_client_t *sx;
+    CURLMcode rc;
+
+    if(!e)
+        return 1;
+    sx = sxi_conns_get_client(e->conns);
+    if(!enable) {
+        e->http2 = 0;
+#if LIBCURL_VERSION_NUM >= 0x071000
+        rc = curl_multi_setopt(e->multi, CURLMOPT_PIPELINING, 0L);
+        if(curlm_check(NULL, rc, "set pipelining") == -1) {
+            sxi_seterr(sx, SXE_ECURL, "Failed to disable multiplexing");
+            return 1;
+        }
+#endif
+        return 0;
+    }
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    if(!(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2)) {
+        sxi_seterr(sx, SXE_EARG, "HTTP/2 is not supported by libcurl");
+        return 1;
+    }
+    rc = curl_multi_setopt(e->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    if(curlm_check(NULL, rc, "set multiplexing") == -1) {
+        sxi_seterr(sx, SXE_ECURL, "Failed to enable multiplexing");
+        return 1;
+    }
+    e->http2 = 1;
+    return 0;
+#else
+    (void)rc;
+    sxi_seterr(sx, SXE_EARG, "HTTP/2 requires libcurl 7.47.0 or newer");
+    return 1;
+#endif
+}
+
 #if LIBCURL_VERSION_NUM < 0x071c00
 #include <sys/select.h>
 #include <sys/time.h>
@@ -1612,6 +1769,17 @@ static int easy_set_default_opt(curl_events_t *e, curlev_t *ev)
     if (curl_check(ev,rc,"disable global timeout") == -1)
         return -1;
 
+#if LIBCURL_VERSION_NUM >= 0x072f00
+    /* HTTP/2 is only negotiated over TLS, hosts without it fall back to HTTP/1.1 */
+    rc = curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, e->http2 ? (long)CURL_HTTP_VERSION_2TLS : (long)CURL_HTTP_VERSION_1_1);
+    if (curl_check(ev,rc,"set CURLOPT_HTTP_VERSION") == -1)
+        return -1;
+    /* wait for a connection that can be multiplexed instead of opening a new one */
+    rc = curl_easy_setopt(curl, CURLOPT_PIPEWAIT, e->http2 ? 1L : 0L);
+    if (curl_check(ev,rc,"set CURLOPT_PIPEWAIT") == -1)
+        return -1;
+#endif
+
     /* otherwise it tries SSLv2 on < 7.18.1 and fails to connect to
      * SSLv3/TLSv1 */
     rc = curl_easy_setopt(curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1);
@@ -2011,7 +2179,7 @@ static int enqueue_request(curl_events_t *e, curlev_t *ev, int re)
     /* Get information about active connections for each host */
     if(sxi_ht_get(e->conn_pool->hosts, (void*)ev->host, strlen(ev->host), (void**)&host) || !host) {
         /* Host could not be found, add given host */
-        host = host_active_info_new(ev->host);
+        host = host_active_info_new(ev->host, MAX_ACTIVE_PER_HOST, e->conn_pool->max_active_per_host);
         if(!host) {
             SXDEBUG("OOM Could not allocate memory for host");
             return -1;
@@ -2024,7 +2192,7 @@ static int enqueue_request(curl_events_t *e, curlev_t *ev, int re)
         }
     }
 
-    if (e->conn_pool->active_count < e->conn_pool->max_active_total && host->active < e->conn_pool->max_active_per_host) {
+    if (e->conn_pool->active_count < e->conn_pool->max_active_total && host->active < host->ctl.limit) {
         unsigned i;
         /* reuse previous easy handle to reuse the connection and prevent
          * TIME_WAIT issues */
@@ -2082,6 +2250,10 @@ static int enqueue_request(curl_events_t *e, curlev_t *ev, int re)
            EVDEBUG(ev, "Could not add event to a queue");
            return -1;
         }
+        if(e->conn_pool->active_count >= e->conn_pool->max_active_total)
+            e->conn_pool->ctl.saturated = 1;
+        if(host->active >= host->ctl.limit)
+            host->ctl.saturated = 1;
         EVDEBUG(ev, "queued now: %d", ev_queue_length(e->conn_pool->queue));
         EVDEBUG(ev, "Enqueued request to existing host %s", ev->host);
     }
@@ -2362,6 +2534,7 @@ int sxi_curlev_poll_immediate(curl_events_t *e)
                 struct recv_context *rctx = &ev->ctx->recv_ctx;
                 struct host_info *host = NULL;
                 int xfer_err = SXE_NOERROR;
+                int queued;
 
                 curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &rctx->reply_status);
                 rctx->errbuf[sizeof(rctx->errbuf)-1] = 0;
@@ -2449,9 +2622,12 @@ int sxi_curlev_poll_immediate(curl_events_t *e)
                 host->active--;
                 /* Update global active connections counter */
                 e->conn_pool->active_count--;
+                update_conns_limits(e, host, msg->easy_handle, rctx);
  
                 urldup = strdup(url);
-                queue_next_inactive(e);
+                /* Limits may have grown, start as many queued requests as they allow */
+                queued = ev_queue_length(e->conn_pool->queue);
+                while(queued-- > 0 && queue_next_inactive(e) > 0);
                 sxi_cbdata_finish(e, &ctx, urldup, ev->error);
                 free(urldup);
             } else {
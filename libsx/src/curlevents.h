@@ -63,6 +63,8 @@ int sxi_curlev_has_cafile(curl_events_t *ev);
 int sxi_curlev_set_save_rootCA(curl_events_t *ev, const char *filename, int quiet);
 int sxi_curlev_is_saved(curl_events_t *ev);
 void sxi_curlev_set_verbose(curl_events_t *ev, int is_verbose);
+/* Multiplex requests over HTTP/2 connections (with fallback to HTTP/1.1) */
+int sxi_curlev_set_http2(curl_events_t *e, int enable);
 void sxi_curlev_done(curl_events_t **c);
 int sxi_curlev_add_get(curl_events_t *e, const request_headers_t *headers, const reply_t *reply);
 int sxi_curlev_add_head(curl_events_t *e, const request_headers_t *headers,
@@ -243,6 +243,8 @@ static int skip_xfer(sxc_cluster_t *cluster, int64_t bytes) {
 
 /* Download table is at most 5MB and allows for up to 128GB of uniq content */
 #define BLOCKS_PER_TABLE 131072
+/* Intermediate data buffered on disk when streaming through a filter or to a pipe */
+#define STREAM_BATCH_SIZE (64 * 1024 * 1024)
 #define INITIAL_HASH_ITEMS MIN(BLOCKS_PER_TABLE, 256)
 #define cluster_err(...) sxi_seterr(sxi_cluster_get_client(cluster), __VA_ARGS__)
 #define cluster_syserr(...) sxi_setsyserr(sxi_cluster_get_client(cluster), __VA_ARGS__)
@@ -622,6 +624,11 @@ static int load_hosts_for_hash(sxc_client_t *sx, FILE *f, const char *hash, sxi_
  * UPLOAD_THRESHOLD should be multiple of UPLOAD_CHUNK_SIZE */
 #define UPLOAD_PART_THRESHOLD (132 * 1024 * 1024)
 
+/* Blocks are read and hashed up to this many bytes at a time, so that the
+ * hashing threads get enough blocks to share even with SX_BS_LARGE; it must
+ * be a multiple of SX_BS_LARGE */
+#define UPLOAD_HASH_WINDOW (16 * SX_BS_LARGE)
+
 struct need_hash {
     off_t off;
     sxi_hostlist_t upload_hosts;
@@ -660,7 +667,6 @@ struct file_upload_ctx {
     int qret;
     unsigned blocksize;
     unsigned max_part_blocks;
-    char buf[SX_BS_LARGE];
     int upload_started;
     struct timeval t1;
     struct timeval t2;
@@ -989,6 +995,26 @@ static ssize_t pread_hard(int fd, void *buf, size_t count, off_t offset) {
     return ret;
 }
 
+static ssize_t read_hard(int fd, void *buf, size_t count) {
+    char *dest = (char *)buf;
+    ssize_t ret = 0;
+
+    while(count) {
+	ssize_t r = read(fd, dest, count);
+	if(r<0) {
+	    if(errno == EINTR)
+		continue;
+	    return r;
+	}
+	if(!r)
+	    break;
+	dest += r;
+	count -= r;
+	ret += r;
+    }
+    return ret;
+}
+
 static ssize_t write_hard(int fd, const void *buf, size_t count)
 {
     const uint8_t *wbuf = buf;
@@ -1490,6 +1516,8 @@ static int multi_part_compute_hash_ev(struct file_upload_ctx *yctx)
     off_t start = yctx->pos;
     unsigned part_size = yctx->end - yctx->pos;
     sxc_meta_t *fmeta;
+    char *buf, *hexhashes;
+    unsigned window;
     yctx->last_pos = yctx->pos;
 
     if(yctx->pos == 0) {
@@ -1509,39 +1537,62 @@ static int multi_part_compute_hash_ev(struct file_upload_ctx *yctx)
         return -1;
     }
 
+    window = MIN(UPLOAD_HASH_WINDOW, MAX(part_size, 1) + SX_BS_LARGE - 1) / SX_BS_LARGE * SX_BS_LARGE;
+    buf = malloc(window);
+    hexhashes = malloc((window / yctx->blocksize) * (SXI_SHA1_TEXT_LEN + 1));
+    if(!buf || !hexhashes) {
+        SXDEBUG("failed to allocate hashes buffer");
+        sxi_seterr(sx, SXE_EMEM, "Out of memory");
+        free(buf);
+        free(hexhashes);
+        return -1;
+    }
+
     /* TODO; for last partial block upload all hashes */
     do {
         /* hash_chunk -> finish cb -> hash_chunk ... */
-        unsigned i, remaining;
+        unsigned i, remaining, toread;
         SXDEBUG("pos:%lld",(long long)yctx->pos);
-        n = pread_hard(yctx->fd, yctx->buf, sizeof(yctx->buf), yctx->pos);
+        /* Read whole SX_BS_LARGE units so that a part boundary is never
+         * crossed, and the source growing past its end is still noticed */
+        toread = MIN(window, MAX(yctx->end - yctx->pos, 1) + SX_BS_LARGE - 1) / SX_BS_LARGE * SX_BS_LARGE;
+        n = pread_hard(yctx->fd, buf, toread, yctx->pos);
         if (n < 0) {
             SXDEBUG("failed to read from source file");
             sxi_setsyserr(sx, SXE_EREAD, "Block upload failed while reading source file");
+            free(buf);
+            free(hexhashes);
             return -1;
         }
         /* set partial block to zero */
         remaining = yctx->blocksize - n % yctx->blocksize;
         if (remaining < yctx->blocksize)
-            memset(yctx->buf + n, 0, remaining);
+            memset(buf + n, 0, remaining);
         yctx->pos += n;
         if (yctx->pos > yctx->end || (!n && yctx->pos != yctx->end)) {
             SXDEBUG("source file changed while being read");
             sxi_seterr(sx, SXE_EREAD, "Copy failed: Source file changed while being read");
+            free(buf);
+            free(hexhashes);
+            return -1;
+        }
+        /* Hash the whole read-ahead buffer up front (possibly in parallel),
+         * then feed the results in order */
+        if (sxi_cluster_hashcalc_blocks(yctx->cluster, buf, yctx->blocksize, (n + yctx->blocksize - 1) / yctx->blocksize, hexhashes)) {
+            SXDEBUG("failed to compute hash for block");
+            free(buf);
+            free(hexhashes);
             return -1;
         }
         for (i=0;i<n;i += yctx->blocksize) {
-	    char hexhash[SXI_SHA1_TEXT_LEN+1];
+	    const char *hexhash = hexhashes + (i / yctx->blocksize) * (SXI_SHA1_TEXT_LEN + 1);
             size_t block;
 
-            if (sxi_cluster_hashcalc(yctx->cluster, yctx->buf + i, yctx->blocksize, hexhash)) {
-                SXDEBUG("failed to compute hash for block");
-                return -1;
-            }
-	    hexhash[SXI_SHA1_TEXT_LEN] = '\0';
 	    yctx->query = sxi_fileadd_proto_addhash(sx, yctx->query, hexhash);
 	    if(!yctx->query) {
 		SXDEBUG("failed to add hash");
+		free(buf);
+		free(hexhashes);
 		return -1;
 	    }
 
@@ -1551,10 +1602,14 @@ static int multi_part_compute_hash_ev(struct file_upload_ctx *yctx)
             SXDEBUG("%p, hash %s: block %ld, %lld", (const void*)yctx, hexhash, (long)block, (long long)yctx->current.offsets[block]);
             if(sxi_ht_add(yctx->current.hashes, hexhash, SXI_SHA1_TEXT_LEN, &yctx->current.offsets[block])) {
                 SXDEBUG("failed to add hash offset");
+                free(buf);
+                free(hexhashes);
                 return -1;
             }
         }
     } while (n > 0 && yctx->pos < yctx->end);
+    free(buf);
+    free(hexhashes);
 
     yctx->query = sxi_fileadd_proto_end(sx, yctx->query, fmeta);
     if(!yctx->query) {
@@ -1842,6 +1897,7 @@ static int local_to_remote_begin(sxc_file_t *source, sxc_meta_t *fmeta, sxc_file
     const void *mval;
     unsigned int mval_len;
     struct filter_handle *fh = NULL;
+    char filter_uuid[37];
     int qret = -1;
     sxc_xfer_stat_t *xfer_stat = NULL;
 
@@ -1883,7 +1939,46 @@ static int local_to_remote_begin(sxc_file_t *source, sxc_meta_t *fmeta, sxc_file
         goto local_to_remote_err;
     }
 
-    if(!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode)) {
+    if(!(vmeta = sxc_meta_new(sx)))
+	goto local_to_remote_err;
+    /* TODO: multiplex the locate too! */
+    orig_fsz = fsz = st.st_size;
+    if ((qret = sxi_volume_info(sxi_cluster_get_conns(dest->cluster), dest->volume, &volhosts, &fsz, vmeta))) {
+	SXDEBUG("failed to locate destination volume");
+	goto local_to_remote_err;
+    }
+    if(fsz < 1024 || fsz > UPLOAD_CHUNK_SIZE) {
+	SXDEBUG("cannot handle the requested blocksize %lld", (long long int)fsz);
+	goto local_to_remote_err;
+    }
+    blocksize = fsz;
+
+    if(sxi_volume_cfg_check(sx, dest->cluster, vmeta, dest->volume)) {
+        /* filters wrong: don't recurse */
+        qret = 404;
+	goto local_to_remote_err;
+    }
+
+    if(!sxc_meta_getval(vmeta, "filterActive", &mval, &mval_len)) {
+	if(mval_len != 16) {
+	    sxi_seterr(sx, SXE_EFILTER, "Filter(s) enabled but can't handle metadata");
+            qret = 404;
+	    goto local_to_remote_err;
+	}
+	sxi_uuid_unparse(mval, filter_uuid);
+
+	fh = sxi_filter_gethandle(sx, mval);
+	if(!fh) {
+	    SXDEBUG("Filter ID %s required by destination volume not found", filter_uuid);
+	    sxi_seterr(sx, SXE_EFILTER, "Filter ID %s required by destination volume not found", filter_uuid);
+            qret = 404;
+	    goto local_to_remote_err;
+	}
+    }
+
+    /* Streams are dumped to a temporary file, unless a data filter
+     * is going to spool its output to one anyway */
+    if(!S_ISREG(st.st_mode) && !S_ISBLK(st.st_mode) && !(fh && fh->f->data_process)) {
 	sxc_file_t *tsource;
 	if(!(fname = sxi_tempfile_track(source->sx, NULL, &yctx->current.f))) {
 	    SXDEBUG("failed to generate stream dump file");
@@ -1917,29 +2012,9 @@ static int local_to_remote_begin(sxc_file_t *source, sxc_meta_t *fmeta, sxc_file
 	goto local_to_remote_err; /* cleanup, not necessarily an error */
     }
 
-    if(!(vmeta = sxc_meta_new(sx)))
-	goto local_to_remote_err;
-    /* TODO: multiplex the locate too! */
-    orig_fsz = fsz = st.st_size;
-    if ((qret = sxi_volume_info(sxi_cluster_get_conns(dest->cluster), dest->volume, &volhosts, &fsz, vmeta))) {
-	SXDEBUG("failed to locate destination volume");
-	goto local_to_remote_err;
-    }
-    if(fsz < 1024 || fsz > UPLOAD_CHUNK_SIZE) {
-	SXDEBUG("cannot handle the requested blocksize %lld", (long long int)fsz);
-	goto local_to_remote_err;
-    }
-    blocksize = fsz;
-
-    if(sxi_volume_cfg_check(sx, dest->cluster, vmeta, dest->volume)) {
-        /* filters wrong: don't recurse */
-        qret = 404;
-	goto local_to_remote_err;
-    }
-
-    if(!sxc_meta_getval(vmeta, "filterActive", &mval, &mval_len)) {
-	    char inbuff[8192], outbuff[8192], filter_uuid[37], cfgkey[37 + 5];
-	    ssize_t bread, bwrite;
+    if(fh) {
+	    char inbuff[2][8192], outbuff[8192], cfgkey[37 + 5], *cur, *next;
+	    ssize_t bread, nread, bwrite;
 	    sxf_action_t action = SXF_ACTION_NORMAL;
 	    FILE *tempfile = NULL;
 	    int td;
@@ -1949,21 +2024,6 @@ static int local_to_remote_begin(sxc_file_t *source, sxc_meta_t *fmeta, sxc_file
 	    char *fdir = NULL;
 	    int fret;
 
-	if(mval_len != 16) {
-	    sxi_seterr(sx, SXE_EFILTER, "Filter(s) enabled but can't handle metadata");
-            qret = 404;
-	    goto local_to_remote_err;
-	}
-	sxi_uuid_unparse(mval, filter_uuid);
-
-	fh = sxi_filter_gethandle(sx, mval);
-	if(!fh) {
-	    SXDEBUG("Filter ID %s required by destination volume not found", filter_uuid);
-	    sxi_seterr(sx, SXE_EFILTER, "Filter ID %s required by destination volume not found", filter_uuid);
-            qret = 404;
-	    goto local_to_remote_err;
-	}
-
 	snprintf(cfgkey, sizeof(cfgkey), "%s-cfg", filter_uuid);
 	sxc_meta_getval(vmeta, cfgkey, &cfgval, &cfgval_len);
 	if(cfgval_len && sxi_filter_add_cfg(fh, dest->volume, cfgval, cfgval_len))
@@ -2004,11 +2064,21 @@ static int local_to_remote_begin(sxc_file_t *source, sxc_meta_t *fmeta, sxc_file
 	    free(fdir);
 	    fdir = NULL;
 
-	    while((bread = read(s, inbuff, sizeof(inbuff))) > 0) {
-		if(lseek(s, 0, SEEK_CUR) == st.st_size)
+	    /* Read one buffer ahead so that the end of data is also
+	     * detected on streams of unknown size */
+	    cur = inbuff[0];
+	    next = inbuff[1];
+	    bread = read_hard(s, cur, sizeof(inbuff[0]));
+	    while(bread > 0) {
+		nread = read_hard(s, next, sizeof(inbuff[1]));
+		if(nread < 0) {
+		    bread = nread;
+		    break;
+		}
+		if(!nread)
 		    action = SXF_ACTION_DATA_END;
 		do {
-		    bwrite = fh->f->data_process(fh, fh->ctx, inbuff, bread, outbuff, sizeof(outbuff), SXF_MODE_UPLOAD, &action);
+		    bwrite = fh->f->data_process(fh, fh->ctx, cur, bread, outbuff, sizeof(outbuff), SXF_MODE_UPLOAD, &action);
 		    if(bwrite < 0) {
 			sxi_seterr(sx, SXE_EFILTER, "Filter ID %s failed to process input data", filter_uuid);
 			fclose(tempfile);
@@ -2024,6 +2094,17 @@ static int local_to_remote_begin(sxc_file_t *source, sxc_meta_t *fmeta, sxc_file
 			goto local_to_remote_err;
 		    }
 		} while(action == SXF_ACTION_REPEAT);
+		bread = nread;
+		cur = next;
+		next = next == inbuff[0] ? inbuff[1] : inbuff[0];
+	    }
+	    if(bread < 0) {
+		SXDEBUG("failed to read from source file");
+		sxi_setsyserr(sx, SXE_EREAD, "Copy failed: Failed to read source file");
+		fclose(tempfile);
+		if(fh->f->data_finish)
+		    fh->f->data_finish(fh, &fh->ctx, SXF_MODE_UPLOAD);
+		goto local_to_remote_err;
 	    }
 	    if(fclose(tempfile)) {
 		sxi_setsyserr(sx, SXE_EWRITE, "Filter failed: Can't close temporary file");
@@ -3565,9 +3646,9 @@ static int remote_to_local(sxc_file_t *source, sxc_file_t *dest, int recursive)
     struct stat st;
     int64_t filesize;
     int ret = 1, rd = -1, d = -1, fail = 0, fret;
-    unsigned int blocksize;
+    unsigned int blocksize, batch_blocks;
     off_t curoff = 0;
-    FILE *hf = NULL, *tf;
+    FILE *hf = NULL, *tf, *ff = NULL;
     const char *dstname;
     int dstexisted;
     sxf_action_t action = SXF_ACTION_NORMAL;
@@ -3622,22 +3703,6 @@ static int remote_to_local(sxc_file_t *source, sxc_file_t *dest, int recursive)
 	sxi_setsyserr(sx, SXE_EREAD, "failed to stat destination file %s", dstname);
 	goto remote_to_local_err;
     }
-    if(strcmp(dest->path, "/dev/stdout") && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) || !strcmp(dest->path, "/dev/null"))) {
-        /* regular files, block devices, and not stdout: write directly */
-	if(strcmp(dest->path, "/dev/null") && ftruncate(d, filesize)) {
-	    SXDEBUG("failed to set destination file size to %llu", (long long unsigned)filesize);
-	    sxi_setsyserr(sx, SXE_EWRITE, "cannot write to destination file %s", dstname);
-	    goto remote_to_local_err;
-	}
-    } else {
-        /* stdout and other devices: use tempfile */
-	if(!(tempdst = sxi_tempfile_track(dest->sx, NULL, &tf))) {
-	    SXDEBUG("failed to generate intermediate file");
-	    goto remote_to_local_err;
-	}
-	rd = d;
-	d = fileno(tf);
-    }
 
     if(!(hosts = sxi_ht_new(dest->sx, INITIAL_HASH_ITEMS))) {
 	SXDEBUG("failed to create hosts table");
@@ -3672,13 +3737,6 @@ static int remote_to_local(sxc_file_t *source, sxc_file_t *dest, int recursive)
 		goto remote_to_local_err;
 	}
 
-	if(tempdst && fh->f->data_prepare) {
-	    if(fh->f->data_prepare(fh, &fh->ctx, source->path, filter_cfgdir, cfgval, cfgval_len, SXF_MODE_DOWNLOAD)) {
-		sxi_seterr(sx, SXE_EFILTER, "Filter ID %s failed to initialize itself", filter_uuid);
-		goto remote_to_local_err;
-	    }
-	}
-
 	fmeta = sxc_filemeta_new(source);
 
 	if(fh->f->file_update) {
@@ -3693,12 +3751,58 @@ static int remote_to_local(sxc_file_t *source, sxc_file_t *dest, int recursive)
 	}
     }
 
+    if(!(fh && fh->f->data_process) && strcmp(dest->path, "/dev/stdout") && (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode) || !strcmp(dest->path, "/dev/null"))) {
+        /* regular files, block devices, and not stdout: write directly */
+	if(strcmp(dest->path, "/dev/null") && ftruncate(d, filesize)) {
+	    SXDEBUG("failed to set destination file size to %llu", (long long unsigned)filesize);
+	    sxi_setsyserr(sx, SXE_EWRITE, "cannot write to destination file %s", dstname);
+	    goto remote_to_local_err;
+	}
+	batch_blocks = BLOCKS_PER_TABLE;
+    } else {
+        /* stdout, other devices and filtered data: download in batches
+	 * into an intermediate file and stream each batch to the output */
+	if(!(tempdst = sxi_tempfile_track(dest->sx, NULL, &tf))) {
+	    SXDEBUG("failed to generate intermediate file");
+	    goto remote_to_local_err;
+	}
+	if(fh && fh->f->data_process && S_ISREG(st.st_mode)) {
+	    /* filter output goes next to the destination and replaces it when complete */
+	    char *destpath = strdup(dest->path);
+	    if(!destpath) {
+		SXDEBUG("OOM strdup(dest->path)");
+		sxi_seterr(sx, SXE_EMEM, "Filter failed: Out of memory");
+		goto remote_to_local_err;
+	    }
+	    tempfilter = sxi_tempfile_track(sx, dirname(destpath), &ff);
+	    free(destpath);
+	    if(!tempfilter) {
+		SXDEBUG("Failed to generate filter temporary file");
+		goto remote_to_local_err;
+	    }
+	    close(d);
+	    d = fileno(ff);
+	}
+	rd = d;
+	d = fileno(tf);
+	batch_blocks = STREAM_BATCH_SIZE / blocksize;
+	if(!batch_blocks)
+	    batch_blocks = 1;
+    }
+
+    if(fh && tempdst && fh->f->data_prepare) {
+	if(fh->f->data_prepare(fh, &fh->ctx, source->path, filter_cfgdir, cfgval, cfgval_len, SXF_MODE_DOWNLOAD)) {
+	    sxi_seterr(sx, SXE_EFILTER, "Filter ID %s failed to initialize itself", filter_uuid);
+	    goto remote_to_local_err;
+	}
+    }
+
     while(!feof(hf)) {
 	sxi_hostlist_t *hostlist;
 	char ha[42];
 	unsigned int i;
 	off_t shiftoff = tempdst ? curoff : 0;
-        unsigned nhashes = MIN(BLOCKS_PER_TABLE, (filesize + blocksize - 1)/ blocksize);
+        unsigned nhashes = MIN(batch_blocks, (filesize + blocksize - 1)/ blocksize);
         sxc_xfer_stat_t *xfer_stat = NULL;
 
         batch_hashes_free(&bh);
@@ -3714,7 +3818,7 @@ static int remote_to_local(sxc_file_t *source, sxc_file_t *dest, int recursive)
             goto remote_to_local_err;
         }
 
-	for(i=0; i<BLOCKS_PER_TABLE; i++) {
+	for(i=0; i<batch_blocks; i++) {
 	    if(!fread(ha, 40, 1, hf)) {
 		if(ferror(hf)) {
 		    SXDEBUG("failed to read hash");
@@ -3826,7 +3930,7 @@ static int remote_to_local(sxc_file_t *source, sxc_file_t *dest, int recursive)
 		    break;
 		}
 		f_got += got;
-		if(f_got == f_size)
+		if(f_got == f_size && curoff >= filesize)
 		    action = SXF_ACTION_DATA_END;
 		while(got) {
 		    if(fh && fh->f->data_process) {
@@ -3882,88 +3986,19 @@ static int remote_to_local(sxc_file_t *source, sxc_file_t *dest, int recursive)
     if(fail)
 	goto remote_to_local_err;
 
-    if(fh && fh->f->data_process && !tempdst) {
-	char inbuff[8192], *destpath;
-	ssize_t bread, bwrite;
-	FILE *tempfile = NULL;
-	ssize_t f_size, f_got = 0;
-        /* FIXME: filter processing should be done once the download has
-         * finished!! */
-
-	destpath = strdup(dest->path);
-	if(!destpath) {
-	    SXDEBUG("OOM strdup(dest->path)");
-	    sxi_setsyserr(sx, SXE_EMEM, "Filter failed: OOM");
-	    goto remote_to_local_err;
-	}
-	if(!(tempfilter = sxi_tempfile_track(sx, dirname(destpath), &tempfile))) {
-	    SXDEBUG("Failed to generate filter temporary file");
-	    free(destpath);
-	    goto remote_to_local_err;
-	}
-	free(destpath);
-	if(fh->f->data_prepare) {
-	    if(fh->f->data_prepare(fh, &fh->ctx, source->path, filter_cfgdir, cfgval, cfgval_len, SXF_MODE_DOWNLOAD)) {
-		sxi_seterr(sx, SXE_EFILTER, "Filter ID %s failed to initialize itself", filter_uuid);
-		fclose(tempfile);
-		goto remote_to_local_err;
-	    }
-	}
-	f_size = lseek(d, 0, SEEK_END);
-	lseek(d, 0, SEEK_SET);
-	while((bread = read(d, inbuff, sizeof(inbuff))) > 0) {
-	    f_got += bread;
-	    if(f_got == f_size)
-		action = SXF_ACTION_DATA_END;
-
-	    do {
-		bwrite = fh->f->data_process(fh, fh->ctx, inbuff, bread, outbuff, sizeof(outbuff), SXF_MODE_DOWNLOAD, &action);
-		if(bwrite < 0) {
-		    sxi_seterr(sx, SXE_EFILTER, "Filter ID %s failed to process input data", filter_uuid);
-		    fclose(tempfile);
-		    if(fh->f->data_finish)
-			fh->f->data_finish(fh, &fh->ctx, SXF_MODE_DOWNLOAD);
-		    goto remote_to_local_err;
-		}
-		if(fwrite(outbuff, 1, bwrite, tempfile) != (size_t) bwrite) {
-		    sxi_setsyserr(sx, SXE_EWRITE, "Filter ID %s failed: Can't write to temporary file", filter_uuid);
-		    fclose(tempfile);
-		    if(fh->f->data_finish)
-			fh->f->data_finish(fh, &fh->ctx, SXF_MODE_DOWNLOAD);
-		    goto remote_to_local_err;
-		}
-	    } while(action == SXF_ACTION_REPEAT);
-	}
-	if(fclose(tempfile)) {
-	    sxi_seterr(sx, SXE_EWRITE, "Filter ID %s failed: Can't close temporary file", filter_uuid);
+    if(tempfilter) {
+	rd = -1;
+	fret = fclose(ff);
+	ff = NULL;
+	if(fret) {
+	    sxi_setsyserr(sx, SXE_EWRITE, "Filter ID %s failed: Can't close temporary file", filter_uuid);
 	    goto remote_to_local_err;
 	}
-	if(fh->f->data_finish) {
-	    if(fh->f->data_finish(fh, &fh->ctx, SXF_MODE_DOWNLOAD)) {
-		sxi_seterr(sx, SXE_EFILTER, "Filter ID %s failed to clean up itself", filter_uuid);
-		goto remote_to_local_err;
-	    }
-	}
-
-        if (d != STDOUT_FILENO)
-            close(d);
-	d = -1;
-	if(dstexisted && stat(dest->path, &st) == -1) {
-	    sxi_setsyserr(sx, SXE_EREAD, "failed to stat destination file %s", dest->path);
+	if(rename(tempfilter, dest->path)) {
+	    SXDEBUG("can't rename temporary file");
+	    sxi_setsyserr(sx, SXE_EWRITE, "Filter ID %s failed: Can't rename temporary file", filter_uuid);
 	    goto remote_to_local_err;
 	}
-	if(!dstexisted || S_ISREG(st.st_mode)) {
-	    if(rename(tempfilter, dest->path)) {
-		SXDEBUG("can't rename temporary file");
-		sxi_setsyserr(sx, SXE_EWRITE, "Filter ID %s failed: Can't rename temporary file", filter_uuid);
-		goto remote_to_local_err;
-	    }
-	} else {
-            /* FIXME: this doesn't preserve attributes */
-	    if(file_to_file(sx, tempfilter, dest->path, NULL))
-		goto remote_to_local_err;
-	    unlink(tempfilter);
-	}
 	sxi_tempfile_untrack(sx, tempfilter);
 	tempfilter = NULL;
     }
@@ -4012,7 +4047,9 @@ remote_to_local_err:
 	d = rd;
     }
 
-    if(d>=0 && d != STDOUT_FILENO)
+    if(ff)
+	fclose(ff);
+    else if(d>=0 && d != STDOUT_FILENO)
 	close(d);
 
     if(tempfilter) {
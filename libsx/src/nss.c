@@ -235,6 +235,12 @@ int sxi_crypto_check_ver(struct sxi_logger *l)
     return 0;
 }
 
+int sxi_crypto_threads_init(void)
+{
+    /* NSS does its own locking */
+    return 0;
+}
+
 void sxi_sha256(const unsigned char *d, size_t n,unsigned char *md)
 {
     unsigned len;
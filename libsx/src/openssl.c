@@ -28,6 +28,7 @@
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/x509.h>
+#include <pthread.h>
 
 #ifdef HMAC_UPDATE_RETURNS_INT
 #define hmac_init_ex HMAC_Init_ex
@@ -165,6 +166,40 @@ int sxi_crypto_check_ver(struct sxi_logger *l)
     return 0;
 }
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static pthread_mutex_t *ssl_locks;
+
+static void ssl_locking_cb(int mode, int n, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock(&ssl_locks[n]);
+    else
+        pthread_mutex_unlock(&ssl_locks[n]);
+}
+
+static unsigned long ssl_id_cb(void)
+{
+    return (unsigned long)pthread_self();
+}
+#endif
+
+int sxi_crypto_threads_init(void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    int i, n = CRYPTO_num_locks();
+    if (ssl_locks || CRYPTO_get_locking_callback())
+        return 0;
+    ssl_locks = malloc(n * sizeof(*ssl_locks));
+    if (!ssl_locks)
+        return -1;
+    for (i = 0; i < n; i++)
+        pthread_mutex_init(&ssl_locks[i], NULL);
+    CRYPTO_set_id_callback(ssl_id_cb);
+    CRYPTO_set_locking_callback(ssl_locking_cb);
+#endif
+    return 0;
+}
+
 void sxi_report_crypto(sxc_client_t *sx)
 {
     sxi_report_library_int(sx, "OpenSSL", SSLEAY_VERSION_NUMBER, SSLeay(), 0x10000000, 0x100000, 0x1000);
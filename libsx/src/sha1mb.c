@@ -0,0 +1,196 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Multi-buffer SHA1: hashes several independent, equally sized buffers at
+ * once by running one SHA1 state per SIMD lane. Each lane computes
+ * SHA1(salt || buffer), same as sxi_sha1_calc(). */
+
+#include "default.h"
+#include <string.h>
+#include <stdint.h>
+
+#include "vcrypto.h"
+#include "sha1mb.h"
+
+#if defined(__GNUC__) && (__GNUC__ >= 6 || defined(__clang__))
+
+#define LANES SXI_SHA1MB_LANES
+typedef uint32_t vu32 __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+struct mb_lane {
+    const uint8_t *buf;
+    uint8_t tmp[64];
+};
+
+struct mb_job {
+    const uint8_t *salt;
+    unsigned int salt_len;
+    unsigned int len;
+    uint64_t total;
+    unsigned int nblocks;
+};
+
+static inline uint32_t be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+/* Returns the b-th 64 byte block of salt || buf || padding for a lane */
+static const uint8_t *mb_block(const struct mb_job *job, struct mb_lane *lane, unsigned int b) {
+    uint64_t start = (uint64_t)b * 64, pos;
+    unsigned int i;
+
+    if(start >= job->salt_len && start + 64 <= job->total)
+	return lane->buf + (start - job->salt_len);
+
+    for(i=0; i<64; i++) {
+	pos = start + i;
+	if(pos < job->salt_len)
+	    lane->tmp[i] = job->salt[pos];
+	else if(pos < job->total)
+	    lane->tmp[i] = lane->buf[pos - job->salt_len];
+	else if(pos == job->total)
+	    lane->tmp[i] = 0x80;
+	else
+	    lane->tmp[i] = 0;
+    }
+    if(b == job->nblocks - 1) {
+	uint64_t bits = job->total * 8;
+	for(i=0; i<8; i++)
+	    lane->tmp[63 - i] = bits >> (i * 8);
+    }
+    return lane->tmp;
+}
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(__clang__)
+/* Builds an AVX2 variant next to the baseline (SSE2) one and picks the
+ * right one at load time */
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void mb_run(const struct mb_job *job, struct mb_lane *lanes, uint8_t *md) {
+    vu32 h0, h1, h2, h3, h4, w[16];
+    unsigned int b, t, l;
+
+    for(l=0; l<LANES; l++) {
+	h0[l] = 0x67452301;
+	h1[l] = 0xefcdab89;
+	h2[l] = 0x98badcfe;
+	h3[l] = 0x10325476;
+	h4[l] = 0xc3d2e1f0;
+    }
+
+    for(b=0; b<job->nblocks; b++) {
+	vu32 a = h0, bb = h1, c = h2, d = h3, e = h4, tmp;
+
+	for(l=0; l<LANES; l++) {
+	    const uint8_t *p = mb_block(job, &lanes[l], b);
+	    for(t=0; t<16; t++)
+		w[t][l] = be32(p + t * 4);
+	}
+
+#define MB_ROUND(F, K) do {						\
+	    if(t >= 16) {							\
+		tmp = w[(t-3) & 15] ^ w[(t-8) & 15] ^ w[(t-14) & 15] ^ w[t & 15]; \
+		w[t & 15] = ROL(tmp, 1);					\
+	    }								\
+	    tmp = ROL(a, 5) + (F) + e + (K) + w[t & 15];		\
+	    e = d;							\
+	    d = c;							\
+	    c = ROL(bb, 30);						\
+	    bb = a;							\
+	    a = tmp;							\
+	} while(0)
+
+	for(t=0; t<20; t++)
+	    MB_ROUND((bb & c) | (~bb & d), 0x5a827999);
+	for(; t<40; t++)
+	    MB_ROUND(bb ^ c ^ d, 0x6ed9eba1);
+	for(; t<60; t++)
+	    MB_ROUND((bb & c) | (bb & d) | (c & d), 0x8f1bbcdc);
+	for(; t<80; t++)
+	    MB_ROUND(bb ^ c ^ d, 0xca62c1d6);
+#undef MB_ROUND
+	h0 += a;
+	h1 += bb;
+	h2 += c;
+	h3 += d;
+	h4 += e;
+    }
+
+    for(l=0; l<LANES; l++) {
+	uint32_t out[5] = { h0[l], h1[l], h2[l], h3[l], h4[l] };
+	uint8_t *o = md + l * SXI_SHA1_BIN_LEN;
+	for(t=0; t<5; t++) {
+	    o[t*4] = out[t] >> 24;
+	    o[t*4+1] = out[t] >> 16;
+	    o[t*4+2] = out[t] >> 8;
+	    o[t*4+3] = out[t];
+	}
+    }
+}
+
+int sxi_sha1_calc_multi(const void *salt, unsigned salt_len, const void *const *buffers, unsigned int len, unsigned int count, unsigned char *md) {
+    struct mb_lane lanes[LANES];
+    uint8_t lanemd[LANES * SXI_SHA1_BIN_LEN];
+    struct mb_job job;
+    unsigned int i, l;
+
+    if(!buffers || !md || (salt_len && !salt))
+	return 1;
+
+    job.salt = salt;
+    job.salt_len = salt_len;
+    job.len = len;
+    job.total = (uint64_t)salt_len + len;
+    job.nblocks = (job.total + 8) / 64 + 1;
+
+    for(i=0; i + 1 < count; i += LANES) {
+	unsigned int n = MIN(LANES, count - i);
+	/* Idle lanes just rehash the last buffer */
+	for(l=0; l<LANES; l++)
+	    lanes[l].buf = buffers[i + MIN(l, n - 1)];
+	mb_run(&job, lanes, lanemd);
+	memcpy(md + i * SXI_SHA1_BIN_LEN, lanemd, n * SXI_SHA1_BIN_LEN);
+    }
+    /* A lone buffer is better served by the scalar code */
+    if(i < count && sxi_sha1_calc(salt, salt_len, buffers[i], len, md + i * SXI_SHA1_BIN_LEN))
+	return 1;
+    return 0;
+}
+
+#else
+
+int sxi_sha1_calc_multi(const void *salt, unsigned salt_len, const void *const *buffers, unsigned int len, unsigned int count, unsigned char *md) {
+    unsigned int i;
+
+    if(!buffers || !md)
+	return 1;
+    for(i=0; i<count; i++)
+	if(sxi_sha1_calc(salt, salt_len, buffers[i], len, md + i * SXI_SHA1_BIN_LEN))
+	    return 1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,32 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _SHA1MB_H
+#define _SHA1MB_H
+
+/* Number of buffers hashed in parallel; callers get the best throughput
+ * by passing multiples of this */
+#define SXI_SHA1MB_LANES 8
+
+/* Hashes count buffers of len bytes each, every one prefixed by salt, and
+ * stores the count binary digests back to back in md.
+ * Returns 0 on success. */
+int sxi_sha1_calc_multi(const void *salt, unsigned salt_len, const void *const *buffers, unsigned int len, unsigned int count, unsigned char *md);
+
+#endif
@@ -20,6 +20,8 @@
 #include "sxlog.h"
 
 int sxi_crypto_check_ver(struct sxi_logger *l);
+/* Must be called before the library is used from more than one thread */
+int sxi_crypto_threads_init(void);
 
 typedef struct sxi_hmac_sha1_ctx sxi_hmac_sha1_ctx;
 sxi_hmac_sha1_ctx *sxi_hmac_sha1_init(void);
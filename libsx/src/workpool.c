@@ -0,0 +1,168 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Batch worker pool shared by the chunked filter formats: every batch is a
+ * set of independent chunks picked up in order by the pool threads and by
+ * the caller itself, which then waits for the stragglers. */
+
+#include "default.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "workpool.h"
+
+struct workpool_thread {
+    sxi_workpool_t *pool;
+    unsigned int id;
+    pthread_t tid;
+};
+
+struct _sxi_workpool_t {
+    sxi_workpool_cb cb;
+    void *ctx;
+    struct workpool_thread *threads;
+    unsigned int nthreads, started;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond, done_cond;
+    unsigned int nchunks, next_chunk, pending;
+    int batch_err, shutdown;
+};
+
+unsigned int sxi_workpool_nthreads(const char *env, unsigned int max)
+{
+    const char *val = env ? getenv(env) : NULL;
+    long n;
+
+    if(val)
+	n = atol(val);
+    else
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1)
+	n = 1;
+    if(n > max)
+	n = max;
+    return n;
+}
+
+/* called with the lock held, returns with the lock held */
+static void workpool_take(sxi_workpool_t *pool, unsigned int w)
+{
+    unsigned int i = pool->next_chunk++;
+    int err;
+
+    pthread_mutex_unlock(&pool->lock);
+    err = pool->cb(pool->ctx, w, i);
+    pthread_mutex_lock(&pool->lock);
+    if(err && !pool->batch_err)
+	pool->batch_err = err;
+    pool->pending--;
+}
+
+static void *workpool_thread(void *arg)
+{
+    struct workpool_thread *t = arg;
+    sxi_workpool_t *pool = t->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+	while(!pool->shutdown && pool->next_chunk >= pool->nchunks)
+	    pthread_cond_wait(&pool->work_cond, &pool->lock);
+	if(pool->shutdown)
+	    break;
+	workpool_take(pool, t->id);
+	if(!pool->pending)
+	    pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+sxi_workpool_t *sxi_workpool_new(unsigned int nthreads, sxi_workpool_cb cb, void *ctx)
+{
+    sxi_workpool_t *pool;
+    unsigned int i;
+
+    if(!cb || !nthreads)
+	return NULL;
+    pool = calloc(1, sizeof(*pool));
+    if(!pool)
+	return NULL;
+    pool->cb = cb;
+    pool->ctx = ctx;
+    pool->nthreads = nthreads;
+    pool->threads = calloc(nthreads, sizeof(*pool->threads));
+    if(!pool->threads) {
+	free(pool);
+	return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    /* slot 0 is the thread calling sxi_workpool_run() */
+    for(i = 1; i < nthreads; i++) {
+	pool->threads[i].pool = pool;
+	pool->threads[i].id = i;
+	if(pthread_create(&pool->threads[i].tid, NULL, workpool_thread, &pool->threads[i])) {
+	    sxi_workpool_free(pool);
+	    return NULL;
+	}
+	pool->started = i;
+    }
+    return pool;
+}
+
+int sxi_workpool_run(sxi_workpool_t *pool, unsigned int nchunks)
+{
+    int err;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->nchunks = nchunks;
+    pool->next_chunk = 0;
+    pool->pending = nchunks;
+    pool->batch_err = 0;
+    pthread_cond_broadcast(&pool->work_cond);
+    while(pool->next_chunk < pool->nchunks)
+	workpool_take(pool, 0);
+    while(pool->pending)
+	pthread_cond_wait(&pool->done_cond, &pool->lock);
+    err = pool->batch_err;
+    pthread_mutex_unlock(&pool->lock);
+    return err;
+}
+
+void sxi_workpool_free(sxi_workpool_t *pool)
+{
+    unsigned int i;
+
+    if(!pool)
+	return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for(i = 1; i <= pool->started; i++)
+	pthread_join(pool->threads[i].tid, NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,44 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef _WORKPOOL_H
+#define _WORKPOOL_H
+
+typedef struct _sxi_workpool_t sxi_workpool_t;
+
+/* Processes chunk i of the current batch on worker slot w (0 is the calling
+ * thread). A nonzero return value fails the batch. */
+typedef int (*sxi_workpool_cb)(void *ctx, unsigned int w, unsigned int i);
+
+/* Number of threads to use: the value of the env variable if set, otherwise
+ * the number of online CPUs, clamped to 1..max */
+unsigned int sxi_workpool_nthreads(const char *env, unsigned int max);
+
+/* Starts nthreads - 1 threads; the caller is the remaining worker.
+ * Returns NULL on failure. */
+sxi_workpool_t *sxi_workpool_new(unsigned int nthreads, sxi_workpool_cb cb, void *ctx);
+
+/* Runs chunks 0..nchunks-1 and waits for them to complete.
+ * Returns 0 or the first error returned by the callback. */
+int sxi_workpool_run(sxi_workpool_t *pool, unsigned int nchunks);
+
+/* Stops and joins the threads */
+void sxi_workpool_free(sxi_workpool_t *pool);
+
+#endif
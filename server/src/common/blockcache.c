@@ -0,0 +1,294 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#include "default.h"
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <errno.h>
+
+#include "blockcache.h"
+#include "log.h"
+
+/* Each size class is a set associative table: a hash maps to one set of
+ * BC_WAYS slots and, on insertion, the least recently used slot in the set
+ * is recycled. Writers hold the lock of the set they change, lookups take
+ * no lock at all: every slot carries a sequence number which is odd while
+ * the slot is being rewritten, and a lookup which finds it changed across
+ * its copy of the data treats the slot as a miss. */
+#define BC_WAYS 4
+#define BC_CLASSES 3
+
+struct bc_entry {
+    sx_hash_t hash;
+    volatile uint32_t seq;
+    uint32_t valid;
+    uint64_t lastuse;
+};
+
+struct bc_set {
+    volatile pid_t lock;
+    struct bc_entry e[BC_WAYS];
+};
+
+struct bc_class {
+    unsigned int bs;
+    unsigned int nsets;
+    uint64_t sets_off;
+    uint64_t data_off;
+};
+
+struct bc_header {
+    uint64_t tick;
+    sx_blockcache_stats_t stats;
+    struct bc_class cls[BC_CLASSES];
+};
+
+static struct bc_header *bc;
+static uint64_t bc_mapsize;
+
+static void bc_lock(struct bc_set *set) {
+    pid_t self = getpid();
+    unsigned int spins = 0;
+
+    while(!__sync_bool_compare_and_swap(&set->lock, 0, self)) {
+	/* The owner may have been killed while holding the lock: the
+	 * critical sections are short, so only check every now and then */
+	if(!(++spins % 1024)) {
+	    pid_t owner = set->lock;
+	    if(owner && kill(owner, 0) && errno == ESRCH) {
+		WARN("Recovering block cache lock from dead process %d", (int)owner);
+		__sync_bool_compare_and_swap(&set->lock, owner, 0);
+	    }
+	}
+	sched_yield();
+    }
+}
+
+static void bc_unlock(struct bc_set *set) {
+    __sync_lock_release(&set->lock);
+}
+
+/* Marks a slot as being rewritten (also if a dead writer left it so) and
+ * returns the sequence number to pass to bc_write_end() */
+static uint32_t bc_write_begin(struct bc_entry *e) {
+    uint32_t seq = e->seq | 1;
+    e->seq = seq;
+    __sync_synchronize();
+    return seq;
+}
+
+static void bc_write_end(struct bc_entry *e, uint32_t seq) {
+    __sync_synchronize();
+    e->seq = seq + 1;
+}
+
+static struct bc_class *bc_getclass(unsigned int bs) {
+    unsigned int i;
+
+    if(!bc)
+	return NULL;
+    for(i=0; i<BC_CLASSES; i++)
+	if(bc->cls[i].bs == bs)
+	    return bc->cls[i].nsets ? &bc->cls[i] : NULL;
+    return NULL;
+}
+
+static unsigned int bc_setidx(const struct bc_class *c, const sx_hash_t *hash) {
+    uint32_t h;
+    /* The leading bytes are used to pick the hash db, use different ones */
+    memcpy(&h, &hash->b[sizeof(hash->b) - sizeof(h)], sizeof(h));
+    return h % c->nsets;
+}
+
+static struct bc_set *bc_set(const struct bc_class *c, unsigned int set) {
+    return (struct bc_set *)((uint8_t *)bc + c->sets_off) + set;
+}
+
+static uint8_t *bc_data(const struct bc_class *c, unsigned int set, unsigned int way) {
+    return (uint8_t *)bc + c->data_off + ((uint64_t)set * BC_WAYS + way) * c->bs;
+}
+
+int sx_blockcache_init(uint64_t size) {
+    const unsigned int sizes[BC_CLASSES] = { SX_BS_SMALL, SX_BS_MEDIUM, SX_BS_LARGE };
+    uint64_t off, share;
+    unsigned int i;
+
+    if(bc) {
+	WARN("Block cache already initialized");
+	return -1;
+    }
+    if(!size)
+	return 0;
+
+    /* Each size class gets an equal share of the cache */
+    share = size / BC_CLASSES;
+    off = sizeof(struct bc_header);
+    bc_mapsize = off;
+    for(i=0; i<BC_CLASSES; i++) {
+	uint64_t nsets = share / ((uint64_t)sizes[i] * BC_WAYS + sizeof(struct bc_set));
+	if(nsets > 0xffffffff)
+	    nsets = 0xffffffff;
+	bc_mapsize += nsets * ((uint64_t)sizes[i] * BC_WAYS + sizeof(struct bc_set));
+    }
+
+    bc = mmap(NULL, bc_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(bc == MAP_FAILED) {
+	PWARN("Failed to allocate %llu bytes for the block cache", (unsigned long long)bc_mapsize);
+	bc = NULL;
+	return -1;
+    }
+    /* Anonymous mappings come zero filled: all entries are invalid */
+    bc->stats.size = bc_mapsize;
+    for(i=0; i<BC_CLASSES; i++) {
+	struct bc_class *c = &bc->cls[i];
+	c->bs = sizes[i];
+	c->nsets = share / ((uint64_t)sizes[i] * BC_WAYS + sizeof(struct bc_set));
+	c->sets_off = off;
+	off += (uint64_t)c->nsets * sizeof(struct bc_set);
+    }
+    for(i=0; i<BC_CLASSES; i++) {
+	struct bc_class *c = &bc->cls[i];
+	c->data_off = off;
+	off += (uint64_t)c->nsets * BC_WAYS * c->bs;
+	DEBUG("Block cache: %u slots for %u byte blocks", c->nsets * BC_WAYS, c->bs);
+    }
+    INFO("Block cache enabled (%llu MB)", (unsigned long long)(bc_mapsize >> 20));
+    return 0;
+}
+
+void sx_blockcache_done(void) {
+    if(!bc)
+	return;
+    munmap(bc, bc_mapsize);
+    bc = NULL;
+    bc_mapsize = 0;
+}
+
+int sx_blockcache_get(unsigned int bs, const sx_hash_t *hash, uint8_t *buf) {
+    struct bc_class *c = bc_getclass(bs);
+    struct bc_entry *e;
+    unsigned int set, way;
+
+    if(!c || !hash || !buf)
+	return 0;
+
+    set = bc_setidx(c, hash);
+    e = bc_set(c, set)->e;
+    for(way=0; way<BC_WAYS; way++) {
+	uint32_t seq = e[way].seq;
+	if(seq & 1)
+	    continue; /* Being rewritten */
+	__sync_synchronize();
+	if(!e[way].valid || memcmp(&e[way].hash, hash, sizeof(*hash)))
+	    continue;
+	memcpy(buf, bc_data(c, set, way), bs);
+	__sync_synchronize();
+	if(e[way].seq != seq)
+	    break; /* Recycled while copying */
+	e[way].lastuse = __sync_add_and_fetch(&bc->tick, 1);
+	__sync_fetch_and_add(&bc->stats.hits, 1);
+	return 1;
+    }
+    __sync_fetch_and_add(&bc->stats.misses, 1);
+    return 0;
+}
+
+void sx_blockcache_put(unsigned int bs, const sx_hash_t *hash, const uint8_t *data) {
+    struct bc_class *c = bc_getclass(bs);
+    struct bc_set *s;
+    struct bc_entry *e;
+    unsigned int set, way, victim = 0;
+    uint32_t seq;
+
+    if(!c || !hash || !data)
+	return;
+
+    set = bc_setidx(c, hash);
+    s = bc_set(c, set);
+    e = s->e;
+    bc_lock(s);
+    for(way=0; way<BC_WAYS; way++) {
+	if(!e[way].valid || (e[way].seq & 1)) {
+	    victim = way;
+	    break;
+	}
+	if(!memcmp(&e[way].hash, hash, sizeof(*hash))) {
+	    /* Raced with another process: the data is content addressed */
+	    e[way].lastuse = __sync_add_and_fetch(&bc->tick, 1);
+	    bc_unlock(s);
+	    return;
+	}
+	if(e[way].lastuse < e[victim].lastuse)
+	    victim = way;
+    }
+    if(way == BC_WAYS)
+	__sync_fetch_and_add(&bc->stats.evictions, 1);
+    seq = bc_write_begin(&e[victim]);
+    e[victim].valid = 0;
+    memcpy(bc_data(c, set, victim), data, bs);
+    memcpy(&e[victim].hash, hash, sizeof(*hash));
+    e[victim].valid = 1;
+    e[victim].lastuse = __sync_add_and_fetch(&bc->tick, 1);
+    bc_write_end(&e[victim], seq);
+    bc_unlock(s);
+    __sync_fetch_and_add(&bc->stats.inserts, 1);
+}
+
+void sx_blockcache_drop(unsigned int bs, const sx_hash_t *hash) {
+    struct bc_class *c = bc_getclass(bs);
+    struct bc_set *s;
+    unsigned int way;
+
+    if(!c || !hash)
+	return;
+
+    s = bc_set(c, bc_setidx(c, hash));
+    bc_lock(s);
+    for(way=0; way<BC_WAYS; way++) {
+	struct bc_entry *e = &s->e[way];
+	if(e->valid && !memcmp(&e->hash, hash, sizeof(*hash))) {
+	    uint32_t seq = bc_write_begin(e);
+	    e->valid = 0;
+	    bc_write_end(e, seq);
+	    __sync_fetch_and_add(&bc->stats.drops, 1);
+	    break;
+	}
+    }
+    bc_unlock(s);
+}
+
+int sx_blockcache_stats(sx_blockcache_stats_t *stats) {
+    if(!bc || !stats)
+	return -1;
+    /* Counters are updated independently, a snapshot may be slightly skewed */
+    memcpy(stats, &bc->stats, sizeof(*stats));
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "default.h"
+#include "../libsx/src/sxproto.h"
+
+/* Bounded block cache shared by all the processes forked after
+ * sx_blockcache_init(); entries are keyed by (blocksize, hash) and hold a
+ * copy of the block data. When no cache was set up, lookups always miss
+ * and all the other calls are no-ops. */
+
+typedef struct {
+    uint64_t size;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t drops;
+} sx_blockcache_stats_t;
+
+int sx_blockcache_init(uint64_t size);
+void sx_blockcache_done(void);
+int sx_blockcache_get(unsigned int bs, const sx_hash_t *hash, uint8_t *buf);
+void sx_blockcache_put(unsigned int bs, const sx_hash_t *hash, const uint8_t *data);
+void sx_blockcache_drop(unsigned int bs, const sx_hash_t *hash);
+int sx_blockcache_stats(sx_blockcache_stats_t *stats);
+
+#endif
@@ -25,9 +25,13 @@
  *  this exception statement from your version.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE 1 /* fallocate */
+#endif
 #include "default.h"
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/file.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -46,12 +50,16 @@
 #include "qsort.h"
 #include "utils.h"
 #include "blob.h"
+#include "blockcache.h"
 #include "../libsx/src/vcrypto.h"
+#include "../libsx/src/sha1mb.h"
 #include "../libsx/src/clustcfg.h"
 #include "../libsx/src/cluster.h"
 
-#define HASHDBS 16
-#define METADBS 16
+#define HASHDBS_DEFAULT 16
+#define METADBS_DEFAULT 16
+#define HASHDBS_MAX 32
+#define METADBS_MAX 32
 #define GCDBS 1
 /* NOTE: HASHFS_VERSION must be kept below 15 bytes */
 #define HASHFS_VERSION "SX-Storage 1.6"
@@ -130,6 +138,20 @@ int sx_hashfs_hash_buf(const void *salt, unsigned int salt_len, const void *buf,
 }
 #define hash_buf sx_hashfs_hash_buf
 
+int sx_hashfs_hash_bufs(const void *salt, unsigned int salt_len, const void *const *bufs, unsigned int buf_len, unsigned int count, sx_hash_t *hashes) {
+    uint8_t md[4 * SXI_SHA1MB_LANES * SXI_SHA1_BIN_LEN];
+    unsigned int i, j, n;
+
+    for(i=0; i<count; i += n) {
+	n = MIN(4 * SXI_SHA1MB_LANES, count - i);
+	if(sxi_sha1_calc_multi(salt, salt_len, bufs + i, buf_len, n, md))
+	    return 1;
+	for(j=0; j<n; j++)
+	    memcpy(hashes[i + j].b, md + j * SXI_SHA1_BIN_LEN, SXI_SHA1_BIN_LEN);
+    }
+    return 0;
+}
+
 #define CREATE_DB(DBTYPE) \
 do { \
     sqlite3 *handle = NULL;\
@@ -202,8 +224,225 @@ do { \
 } while(0)
 
 
+/* Blocks whose reservations or use counters drop are queued in gc_candidates
+ * and only those are examined by the incremental GC passes; freed datafile
+ * slots are queued in reclaim until their space is released; blocks_blockno
+ * lets compaction find the block stored in a given slot */
+static int create_gc_tables(sxi_db_t *db) {
+    const char *schema[] = {
+	"CREATE TABLE IF NOT EXISTS gc_candidates (blockid INTEGER NOT NULL PRIMARY KEY)",
+	"CREATE TRIGGER IF NOT EXISTS gc_unreserve AFTER DELETE ON reservations BEGIN INSERT OR IGNORE INTO gc_candidates(blockid) VALUES(OLD.blockid); END",
+	"CREATE TRIGGER IF NOT EXISTS gc_unuse AFTER INSERT ON use WHEN NEW.used <= 0 BEGIN INSERT OR IGNORE INTO gc_candidates(blockid) VALUES(NEW.blockid); END",
+	"CREATE TRIGGER IF NOT EXISTS gc_dropuse AFTER DELETE ON use BEGIN INSERT OR IGNORE INTO gc_candidates(blockid) VALUES(OLD.blockid); END",
+	"CREATE TABLE IF NOT EXISTS reclaim (blocknumber INTEGER NOT NULL PRIMARY KEY)",
+	"CREATE TRIGGER IF NOT EXISTS reclaim_free AFTER INSERT ON avail BEGIN INSERT OR IGNORE INTO reclaim(blocknumber) VALUES(NEW.blocknumber); END",
+	"CREATE TRIGGER IF NOT EXISTS reclaim_reuse AFTER DELETE ON avail BEGIN DELETE FROM reclaim WHERE blocknumber = OLD.blocknumber; END",
+	"CREATE INDEX IF NOT EXISTS blocks_blockno ON blocks(blockno)"
+    };
+    sqlite3_stmt *q = NULL;
+    unsigned int i;
+
+    for(i=0; i<sizeof(schema)/sizeof(schema[0]); i++) {
+	if(qprep(db, &q, schema[i]) || qstep_noret(q)) {
+	    qnullify(q);
+	    return -1;
+	}
+	qnullify(q);
+    }
+    return 0;
+}
+
+static int create_metadb(const char *path, unsigned int ndb, sx_uuid_t *cluster, sxi_db_t **dbp) {
+    sxi_db_t *db = NULL;
+    sqlite3_stmt *q = NULL;
+    char dbitem[64];
+
+    sprintf(dbitem, "metadb_%08x", ndb);
+    CREATE_DB(dbitem);
+    qnullify(q); /* q is now prepared for hashfs insertions */
+
+    /* Create META tables */
+    if(qprep(db, &q, "CREATE TABLE files (fid INTEGER NOT NULL PRIMARY KEY, volume_id INTEGER NOT NULL, name TEXT ("STRIFY(SXLIMIT_MAX_FILENAME_LEN)") NOT NULL, size INTEGER NOT NULL, rev TEXT (56) NOT NULL, content BLOB NOT NULL, UNIQUE(volume_id, name, rev DESC))") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+    if(qprep(db, &q, "CREATE TABLE fmeta (file_id INTEGER NOT NULL REFERENCES files(fid) ON DELETE CASCADE ON UPDATE CASCADE, key TEXT ("STRIFY(SXLIMIT_META_MAX_KEY_LEN)") NOT NULL, value BLOB ("STRIFY(SXLIMIT_META_MAX_VALUE_LEN)") NOT NULL, PRIMARY KEY(file_id, key))") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+    if(qprep(db, &q, "CREATE TABLE relocs (file_id INTEGER NOT NULL PRIMARY KEY, dest BLOB("STRIFY(UUID_BINARY_SIZE)") NOT NULL)") || qstep_noret(q)) /* NO FK for better normal use performance */
+	goto create_hashfs_fail;
+    qnullify(q);
+
+    if(dbp)
+	*dbp = db;
+    else
+	qclose(&db);
+    return 0;
+
+create_hashfs_fail:
+    sqlite3_finalize(q);
+    qclose(&db);
+    return -1;
+}
+
+static int create_hashdb(const char *path, unsigned int hs, unsigned int ndb, sx_uuid_t *cluster, sxi_db_t **dbp) {
+    sxi_db_t *db = NULL;
+    sqlite3_stmt *q = NULL;
+    char dbitem[64];
+
+    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[hs], ndb);
+    CREATE_DB(dbitem);
+    sqlite3_reset(q); /* q is now prepared for hashfs insertions */
+    if(qbind_text(q, ":k", "block_size") || qbind_int(q, ":v", bsz[hs]) || qstep_noret(q))
+	goto create_hashfs_fail;
+    sqlite3_reset(q);
+    if(qbind_text(q, ":k", "next_blockno") || qbind_int(q, ":v", 1) || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+
+    /* Create HASH tables */
+    if(qprep(db, &q, "CREATE TABLE blocks (\
+	id INTEGER PRIMARY KEY NOT NULL,\
+	hash BLOB("STRIFY(SXI_SHA1_BIN_LEN)") NOT NULL,\
+	blockno INTEGER,\
+	created_at INTEGER,\
+	UNIQUE(hash))") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+    /* if(qprep(db, &q, "CREATE INDEX blockno ON blocks(id, blockno)") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);*/
+
+    if(qprep(db, &q, "CREATE TABLE reservations (\
+	blockid INTEGER NOT NULL REFERENCES blocks(id) ON DELETE CASCADE ON UPDATE CASCADE,\
+	reserveid BLOB("STRIFY(SXI_SHA1_BIN_LEN)") NOT NULL,\
+	ttl INTEGER NOT NULL,\
+	PRIMARY KEY(blockid, reserveid))") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+    if(qprep(db, &q, "CREATE INDEX idx_reserve ON reservations(reserveid, blockid)") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+    if(qprep(db, &q, "CREATE INDEX idx_res_ttl ON reservations(ttl)") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+
+    /* TODO: put this into GC_%x.db
+     * >0: inuse
+     * <0: delete
+     * */
+    if(qprep(db, &q, "CREATE TABLE operations (\
+	blockid INTEGER NOT NULL REFERENCES blocks(id) ON DELETE CASCADE ON UPDATE CASCADE,\
+	tokenid BLOB("STRIFY(SXI_SHA1_BIN_LEN)") NOT NULL,\
+	replica INTEGER NOT NULL,\
+	op INTEGER NOT NULL,\
+	ttl INTEGER NOT NULL,\
+	PRIMARY KEY(blockid, tokenid, replica, op))") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+    if(qprep(db, &q, "CREATE INDEX idx_ttl ON operations(ttl)") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+
+    /* age = rebalance/hdist version
+     * */
+    if(qprep(db, &q, "CREATE TABLE use (\
+	blockid INTEGER NOT NULL REFERENCES blocks(id) ON DELETE CASCADE ON UPDATE CASCADE,\
+	replica INTEGER NOT NULL,\
+	age INTEGER NOT NULL,\
+	used INTEGER NOT NULL,\
+	PRIMARY KEY(blockid, replica, age))") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+
+    /* Create freelist table */
+    if(qprep(db, &q, "CREATE TABLE avail (blocknumber INTEGER NOT NULL PRIMARY KEY ASC)") || qstep_noret(q))
+	goto create_hashfs_fail;
+    qnullify(q);
+
+    if(create_gc_tables(db))
+	goto create_hashfs_fail;
+
+    if(dbp)
+	*dbp = db;
+    else
+	qclose(&db);
+    return 0;
+
+create_hashfs_fail:
+    sqlite3_finalize(q);
+    qclose(&db);
+    return -1;
+}
+
+/* Creates a datafile and writes its header block, returns the open fd or -1 */
+static int create_datafile(const char *path, unsigned int hs, unsigned int ndb, const sx_uuid_t *cluster) {
+    char *hdr;
+    int fd;
+
+    if(!(hdr = wrap_calloc(1, bsz[hs])))
+	return -1;
+    fd = creat(path, 0666);
+    if(fd < 0) {
+	PCRIT("Cannot create data file %s", path);
+	free(hdr);
+	return -1;
+    }
+    sprintf(hdr, "%-16sdatafile_%c_%08x             %08x", HASHFS_VERSION, sizedirs[hs], ndb, bsz[hs]);
+    memcpy(hdr+64, cluster->binary, sizeof(cluster->binary));
+    if(write_block(fd, hdr, 0, bsz[hs])) {
+	close(fd);
+	fd = -1;
+    }
+    free(hdr);
+    return fd;
+}
+
 static int qlog_set = 0;
-rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size) {
+
+#define STORAGE_LOCK_FILE "node.lock"
+
+/* The running node and online compaction hold a shared lock on the storage,
+ * offline maintenance (resharding, shard placement) holds an exclusive one */
+int sx_storage_lock(const char *dir, int exclusive) {
+    char *path;
+    int fd;
+
+    if(!dir) {
+	NULLARG();
+	return -1;
+    }
+    if(!(path = wrap_malloc(strlen(dir) + sizeof(STORAGE_LOCK_FILE) + 1)))
+	return -1;
+    sprintf(path, "%s/%s", dir, STORAGE_LOCK_FILE);
+    /* Read only, so that the node can lock a file created by root */
+    fd = open(path, O_RDONLY | O_CREAT, 0644);
+    if(fd < 0) {
+	PWARN("Failed to open the storage lock %s", path);
+	msg_set_reason("Cannot open the storage lock %s", path);
+	free(path);
+	return -1;
+    }
+    if(flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB)) {
+	if(errno == EWOULDBLOCK)
+	    msg_set_reason(exclusive ? "The node is running, stop it first" : "The storage is locked by an offline operation");
+	else {
+	    PWARN("Failed to lock %s", path);
+	    msg_set_reason("Cannot lock the storage");
+	}
+	close(fd);
+	free(path);
+	return -1;
+    }
+    free(path);
+    return fd;
+}
+
+void sx_storage_unlock(int fd) {
+    if(fd >= 0)
+	close(fd);
+}
+
+rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size, unsigned int hashdbs, unsigned int metadbs) {
     unsigned int dirlen, i, j;
     sxi_db_t *db = NULL;
     sqlite3_stmt *q = NULL;
@@ -216,6 +455,11 @@ rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int k
 	return EINVAL;
     }
 
+    if(!hashdbs || hashdbs > HASHDBS_MAX || !metadbs || metadbs > METADBS_MAX) {
+	CRIT("Invalid number of database shards (must be between 1 and %u)", HASHDBS_MAX);
+	return EINVAL;
+    }
+
     if(ssl_version_check())
 	return FAIL_EINIT;
 
@@ -239,9 +483,15 @@ rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int k
     sqlite3_reset(q);
     if(qbind_text(q, ":k", "current_dist") || qbind_blob(q, ":v", "", 0) || qstep_noret(q))
 	goto create_hashfs_fail;
+    sqlite3_reset(q);
+    if(qbind_text(q, ":k", "hashdbs") || qbind_int(q, ":v", hashdbs) || qstep_noret(q))
+	goto create_hashfs_fail;
+    sqlite3_reset(q);
+    if(qbind_text(q, ":k", "metadbs") || qbind_int(q, ":v", metadbs) || qstep_noret(q))
+	goto create_hashfs_fail;
 
     /* Set the path to the file dbs */
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<metadbs; i++) {
 	sprintf(dbitem, "metadb_%08x", i);
 	sprintf(path, "f%08x.db", i);
 	sqlite3_reset(q);
@@ -251,7 +501,7 @@ rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int k
 
     /* Set the path to the block dbs */
     for(j = 0; j < SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
+	for(i=0; i<hashdbs; i++) {
 	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], i);
 	    sprintf(path, "h%c%08x.db", sizedirs[j], i);
 	    sqlite3_reset(q);
@@ -333,118 +583,26 @@ rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int k
     qclose(&db);
 
     /* --- META dbs --- */
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<metadbs; i++) {
 	sprintf(path, "%s/f%08x.db", dir, i);
-	sprintf(dbitem, "metadb_%08x", i);
-	CREATE_DB(dbitem);
-	qnullify(q); /* q is now prepared for hashfs insertions */
-
-	/* Create META tables */
-	if(qprep(db, &q, "CREATE TABLE files (fid INTEGER NOT NULL PRIMARY KEY, volume_id INTEGER NOT NULL, name TEXT ("STRIFY(SXLIMIT_MAX_FILENAME_LEN)") NOT NULL, size INTEGER NOT NULL, rev TEXT (56) NOT NULL, content BLOB NOT NULL, UNIQUE(volume_id, name, rev DESC))") || qstep_noret(q))
-	    goto create_hashfs_fail;
-	qnullify(q);
-	if(qprep(db, &q, "CREATE TABLE fmeta (file_id INTEGER NOT NULL REFERENCES files(fid) ON DELETE CASCADE ON UPDATE CASCADE, key TEXT ("STRIFY(SXLIMIT_META_MAX_KEY_LEN)") NOT NULL, value BLOB ("STRIFY(SXLIMIT_META_MAX_VALUE_LEN)") NOT NULL, PRIMARY KEY(file_id, key))") || qstep_noret(q))
+	if(create_metadb(path, i, cluster, NULL))
 	    goto create_hashfs_fail;
-	qnullify(q);
-	if(qprep(db, &q, "CREATE TABLE relocs (file_id INTEGER NOT NULL PRIMARY KEY, dest BLOB("STRIFY(UUID_BINARY_SIZE)") NOT NULL)") || qstep_noret(q)) /* NO FK for better normal use performance */
-	    goto create_hashfs_fail;
-	qnullify(q);
-
-	qclose(&db);
     }
 
     /* --- HASH dbs --- */
     for(j = 0; j < SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
+	for(i=0; i<hashdbs; i++) {
 	    int fd;
 
 	    sprintf(path, "%s/h%c%08x.db", dir, sizedirs[j], i);
-	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], i);
-	    CREATE_DB(dbitem);
-	    sqlite3_reset(q); /* q is now prepared for hashfs insertions */
-	    if(qbind_text(q, ":k", "block_size") || qbind_int(q, ":v", bsz[j]) || qstep_noret(q))
-		goto create_hashfs_fail;
-	    sqlite3_reset(q);
-	    if(qbind_text(q, ":k", "next_blockno") || qbind_int(q, ":v", 1) || qstep_noret(q))
-		goto create_hashfs_fail;
-	    qnullify(q);
-
-	    /* Create HASH tables */
-	    if(qprep(db, &q, "CREATE TABLE blocks (\
-                id INTEGER PRIMARY KEY NOT NULL,\
-                hash BLOB("STRIFY(SXI_SHA1_BIN_LEN)") NOT NULL,\
-                blockno INTEGER,\
-                created_at INTEGER,\
-                UNIQUE(hash))") || qstep_noret(q))
-		goto create_hashfs_fail;
-	    qnullify(q);
-            /* if(qprep(db, &q, "CREATE INDEX blockno ON blocks(id, blockno)") || qstep_noret(q))
-                goto create_hashfs_fail;
-            qnullify(q);*/
-
-            if(qprep(db, &q, "CREATE TABLE reservations (\
-                blockid INTEGER NOT NULL REFERENCES blocks(id) ON DELETE CASCADE ON UPDATE CASCADE,\
-                reserveid BLOB("STRIFY(SXI_SHA1_BIN_LEN)") NOT NULL,\
-                ttl INTEGER NOT NULL,\
-                PRIMARY KEY(blockid, reserveid))") || qstep_noret(q))
-                goto create_hashfs_fail;
-            qnullify(q);
-            if(qprep(db, &q, "CREATE INDEX idx_reserve ON reservations(reserveid, blockid)") || qstep_noret(q))
-                goto create_hashfs_fail;
-            qnullify(q);
-            if(qprep(db, &q, "CREATE INDEX idx_res_ttl ON reservations(ttl)") || qstep_noret(q))
-                goto create_hashfs_fail;
-            qnullify(q);
-
-            /* TODO: put this into GC_%x.db
-             * >0: inuse
-             * <0: delete
-             * */
-            if(qprep(db, &q, "CREATE TABLE operations (\
-                blockid INTEGER NOT NULL REFERENCES blocks(id) ON DELETE CASCADE ON UPDATE CASCADE,\
-                tokenid BLOB("STRIFY(SXI_SHA1_BIN_LEN)") NOT NULL,\
-                replica INTEGER NOT NULL,\
-                op INTEGER NOT NULL,\
-                ttl INTEGER NOT NULL,\
-                PRIMARY KEY(blockid, tokenid, replica, op))") || qstep_noret(q))
-                goto create_hashfs_fail;
-            qnullify(q);
-            if(qprep(db, &q, "CREATE INDEX idx_ttl ON operations(ttl)") || qstep_noret(q))
-                goto create_hashfs_fail;
-            qnullify(q);
-
-            /* age = rebalance/hdist version
-             * */
-            if(qprep(db, &q, "CREATE TABLE use (\
-                blockid INTEGER NOT NULL REFERENCES blocks(id) ON DELETE CASCADE ON UPDATE CASCADE,\
-                replica INTEGER NOT NULL,\
-                age INTEGER NOT NULL,\
-                used INTEGER NOT NULL,\
-                PRIMARY KEY(blockid, replica, age))") || qstep_noret(q))
-                goto create_hashfs_fail;
-            qnullify(q);
-
-	    /* Create freelist table */
-	    if(qprep(db, &q, "CREATE TABLE avail (blocknumber INTEGER NOT NULL PRIMARY KEY ASC)") || qstep_noret(q))
+	    if(create_hashdb(path, j, i, cluster, NULL))
 		goto create_hashfs_fail;
-	    qnullify(q);
-
-	    qclose(&db);
 
 	    /* Create DATA files */
 	    sprintf(path, "%s/h%c%08x.bin", dir, sizedirs[j], i);
-	    fd = creat(path, 0666);
-	    if(fd < 0) {
-		PCRIT("Cannot create data file %s", path);
-		goto create_hashfs_fail;
-	    }
-	    memset(path, 0, bsz[j]);
-	    sprintf(path, "%-16sdatafile_%c_%08x             %08x", HASHFS_VERSION, sizedirs[j], i, bsz[j]);
-	    memcpy(path+64, cluster->binary, sizeof(cluster->binary));
-	    if(write_block(fd, path, 0, bsz[j])) {
-		close(fd);
+	    fd = create_datafile(path, j, i, cluster);
+	    if(fd < 0)
 		goto create_hashfs_fail;
-	    }
 	    if(close(fd)) {
 		PCRIT("Cannot close data file %s", path);
 		goto create_hashfs_fail;
@@ -534,7 +692,7 @@ static int qopen(const char *path, sxi_db_t **dbp, const char *dbtype, sx_uuid_t
     }
     if (!(*dbp = qnew(handle)))
         goto qopen_fail;
-    if(sqlite3_busy_timeout(handle, db_busy_timeout * 1000)) {
+    if(qbusy_timeout(*dbp, db_busy_timeout * 1000)) {
 	CRIT("Failed to set timeout on database %s: %s", path, sqlite3_errmsg(handle));
 	goto qopen_fail;
     }
@@ -596,12 +754,135 @@ qopen_fail:
     return 1;
 }
 
+/* Per shard statements, prepared on first use by qb_stmt() and qm_stmt():
+ * each process only pays for the statements it actually runs */
+enum qb_id {
+    QB_NEXTAVAIL,
+    QB_NEXTALLOC,
+    QB_ADD,
+    QB_SETFREE,
+    QB_GC1,
+    QB_GET,
+    QB_BUMPAVAIL,
+    QB_BUMPALLOC,
+    QB_MODUSE,
+    QB_OP,
+    QB_RESERVE,
+    QB_DEL_RESERVE,
+    QB_GET_META,
+    QB_REBALANCE,
+    QB_ADD_RESERVE,
+    QB_FIND_UNUSED,
+    QB_FIND_BAD,
+    QB_FIND_CAND,
+    QB_FIND_BAD_CAND,
+    QB_GC_DEQUEUE,
+    QB_RECLAIM_LIST,
+    QB_RECLAIM_DONE,
+    QB_DELETEOLD,
+    QB_FIND_EXPIRED_RESERVATION,
+    QB_FIND_EXPIRED_RESERVATION2,
+    QB_FIND_EXPIRED_OPS,
+    QB_GC_RESERVE,
+    QB_GC_RESERVE2,
+    QB_GC_OP,
+    QB_STMTS
+};
+
+static const char *qb_sql[QB_STMTS] = {
+    [QB_NEXTAVAIL] = "SELECT blocknumber FROM avail ORDER BY blocknumber ASC LIMIT 1",
+    [QB_NEXTALLOC] = "SELECT value FROM hashfs WHERE key = 'next_blockno'",
+    [QB_ADD] = "UPDATE blocks SET blockno=:next, created_at = :now WHERE hash=:hash",
+    [QB_SETFREE] = "INSERT OR IGNORE INTO avail VALUES(:blockno)",
+    [QB_GC1] = "DELETE FROM blocks WHERE id = :blockid",
+    [QB_GET] = "SELECT blockno FROM blocks WHERE hash = :hash AND blockno IS NOT NULL",
+    [QB_BUMPAVAIL] = "DELETE FROM avail WHERE blocknumber = :next",
+    [QB_BUMPALLOC] = "UPDATE hashfs SET value = value + 1 WHERE key = 'next_blockno'",
+    [QB_MODUSE] = "INSERT OR REPLACE INTO use(blockid, replica, age, used) SELECT id, :replica, :age, COALESCE((SELECT used + :used FROM use WHERE blockid=id AND replica=:replica AND age=:age), :used) FROM blocks WHERE hash = :hash",
+    [QB_OP] = "INSERT OR IGNORE INTO operations(blockid, tokenid, replica, op, ttl) SELECT id, :tokenid, :replica, :op, :ttl FROM blocks WHERE hash = :hash",
+    [QB_RESERVE] = "INSERT OR REPLACE INTO reservations(blockid, reserveid, ttl) SELECT id, :reserveid, :ttl FROM blocks WHERE hash = :hash",
+    [QB_DEL_RESERVE] = "DELETE FROM reservations WHERE reserveid=:reserveid AND blockid=(SELECT id FROM blocks WHERE hash=:hash)",
+    [QB_GET_META] = "SELECT replica, SUM(used) FROM use WHERE blockid=:blockid AND age < :current_age GROUP BY replica",
+    [QB_REBALANCE] = "SELECT id, hash FROM blocks WHERE hash > :prevhash AND blockno IS NOT NULL",
+    [QB_ADD_RESERVE] = "INSERT OR IGNORE INTO blocks (hash) VALUES (:hash)",
+    [QB_FIND_UNUSED] = "SELECT id, blockno, hash FROM blocks LEFT JOIN use ON use.blockid=id AND used<>0 LEFT JOIN reservations ON reservations.blockid=id WHERE id > :last AND reservations.blockid IS NULL GROUP BY id HAVING SUM(used)=0 OR COUNT(use.blockid)=0 ORDER BY id;",
+    [QB_FIND_BAD] = "SELECT COUNT(blockid) FROM use GROUP BY blockid, replica HAVING SUM(used) < 0",
+    /* Same columns as QB_FIND_UNUSED plus whether the block can actually be freed */
+    [QB_FIND_CAND] = "SELECT gc_candidates.blockid, blockno, hash, blocks.id IS NOT NULL AND NOT EXISTS (SELECT 1 FROM reservations WHERE reservations.blockid = gc_candidates.blockid) AND COALESCE((SELECT SUM(used) FROM use WHERE use.blockid = gc_candidates.blockid AND used <> 0), 0) = 0 FROM gc_candidates LEFT JOIN blocks ON blocks.id = gc_candidates.blockid WHERE gc_candidates.blockid > :last ORDER BY gc_candidates.blockid",
+    [QB_FIND_BAD_CAND] = "SELECT COUNT(blockid) FROM use WHERE blockid IN (SELECT blockid FROM gc_candidates) GROUP BY blockid, replica HAVING SUM(used) < 0",
+    [QB_GC_DEQUEUE] = "DELETE FROM gc_candidates WHERE blockid = :blockid",
+    [QB_RECLAIM_LIST] = "SELECT blocknumber FROM reclaim ORDER BY blocknumber",
+    [QB_RECLAIM_DONE] = "DELETE FROM reclaim WHERE blocknumber <= :last",
+    /* hash moved,
+     * hashes that are not moved don't have the old counters deleted,
+     * and must be taken into account when GCing!
+     * this is to avoid updating the entire table during rebalance
+     * */
+    [QB_DELETEOLD] = "DELETE FROM use WHERE blockid=(SELECT id FROM blocks WHERE hash=:hash AND blockno IS NOT NULL) AND age < :current_age",
+    [QB_FIND_EXPIRED_RESERVATION] = "SELECT reserveid FROM reservations INNER JOIN blocks ON blockid=id AND created_at IS NOT NULL WHERE reserveid > :lastreserveid GROUP BY reserveid HAVING created_at < :expires OR created_at IS NULL ORDER BY reserveid LIMIT 1",
+    [QB_FIND_EXPIRED_RESERVATION2] = "SELECT ROWID from reservations WHERE ttl < :now AND ROWID>:lastrowid LIMIT 1",
+    [QB_FIND_EXPIRED_OPS] = "SELECT ROWID FROM operations WHERE ttl < :now LIMIT 1",
+    [QB_GC_RESERVE] = "DELETE FROM reservations WHERE reserveid=:reserveid",
+    [QB_GC_RESERVE2] = "DELETE FROM reservations WHERE ROWID=:rowid",
+    [QB_GC_OP] = "DELETE FROM operations WHERE ROWID=:rowid"
+};
+
+enum qm_id {
+    QM_INS,
+    QM_LIST,
+    QM_LISTREVS,
+    QM_GET,
+    QM_LISTREVS_REV,
+    QM_GETREV,
+    QM_OLDREVS,
+    QM_METAGET,
+    QM_METASET,
+    QM_METADEL,
+    QM_DELFILE,
+    QM_WIPERELOCS,
+    QM_ADDRELOCS,
+    QM_GETRELOC,
+    QM_DELRELOC,
+    QM_DELBYVOL,
+    QM_SUMFILESIZES,
+    QM_NEWEST,
+    QM_COUNT,
+    QM_LIST_REV_DEC,
+    QM_LIST_FILE,
+    QM_LISTIDX_NAME,
+    QM_STMTS
+};
+
+static const char *qm_sql[QM_STMTS] = {
+    [QM_INS] = "INSERT INTO files (volume_id, name, size, content, rev) VALUES (:volume, :name, :size, :hashes, :revision)",
+    [QM_LIST] = "SELECT name, size, rev FROM files WHERE volume_id = :volume AND name > :previous GROUP BY name HAVING rev = MAX(rev) ORDER BY name ASC LIMIT 1",
+    [QM_LISTREVS] = "SELECT size, rev FROM files WHERE volume_id = :volume AND name = :name AND rev > :previous ORDER BY rev ASC LIMIT 1",
+    [QM_GET] = "SELECT fid, size, content, rev FROM files WHERE volume_id = :volume AND name = :name GROUP BY name HAVING rev = MAX(rev) LIMIT 1",
+    [QM_LISTREVS_REV] = "SELECT size, rev FROM files WHERE volume_id = :volume AND name = :name AND (:previous IS NULL OR rev < :previous) ORDER BY rev DESC LIMIT 1",
+    [QM_GETREV] = "SELECT fid, size, content, rev FROM files WHERE volume_id = :volume AND name = :name AND rev = :revision LIMIT 1",
+    [QM_OLDREVS] = "SELECT rev, size, (SELECT COUNT(*) FROM files AS b WHERE b.volume_id = a.volume_id AND b.name = a.name), fid FROM files AS a WHERE a.volume_id = :volume AND a.name = :name ORDER BY rev ASC",
+    [QM_METAGET] = "SELECT key, value FROM fmeta WHERE file_id = :file",
+    [QM_METASET] = "INSERT OR REPLACE INTO fmeta (file_id, key, value) VALUES (:file, :key, :value)",
+    [QM_METADEL] = "DELETE FROM fmeta WHERE file_id = :file AND key = :key",
+    [QM_DELFILE] = "DELETE FROM files WHERE fid = :file",
+    [QM_WIPERELOCS] = "DELETE FROM relocs",
+    [QM_ADDRELOCS] = "INSERT INTO relocs (file_id, dest) SELECT fid, :node FROM files WHERE volume_id = :volid",
+    [QM_GETRELOC] = "SELECT file_id, dest, volume_id, name, size, rev, content FROM relocs LEFT JOIN files ON relocs.file_id = files.fid WHERE file_id > :prev",
+    [QM_DELRELOC] = "DELETE FROM relocs WHERE file_id = :fileid",
+    [QM_DELBYVOL] = "DELETE FROM files WHERE volume_id = :volid",
+    [QM_SUMFILESIZES] = "SELECT SUM(x) FROM (SELECT files.size + LENGTH(files.name) + SUM(COALESCE(LENGTH(fmeta.key) + LENGTH(fmeta.value),0)) AS x FROM files LEFT JOIN fmeta ON files.fid = fmeta.file_id WHERE files.volume_id = :volid GROUP BY files.fid)",
+    [QM_NEWEST] = "SELECT MAX(rev) FROM files WHERE volume_id = :volid",
+    [QM_COUNT] = "SELECT COUNT(rev) FROM files WHERE volume_id = :volid",
+    [QM_LIST_REV_DEC] = "SELECT size, rev, content FROM files WHERE volume_id=:volid AND name = :name AND rev < :maxrev ORDER BY rev DESC LIMIT 1",
+    [QM_LIST_FILE] = "SELECT size, rev, content, name FROM files WHERE volume_id=:volid AND name > :previous AND rev < :maxrev ORDER BY name ASC, rev DESC LIMIT 1",
+    [QM_LISTIDX_NAME] = "SELECT size, MAX(rev), COUNT(*) FROM files WHERE volume_id = :volume AND name = :name"
+};
+
 struct rebalance_iter {
     unsigned sizeidx;
     unsigned ndbidx;
     unsigned rebalance_ver;
     int retry_mode;
-    sqlite3_stmt *q[SIZES][HASHDBS];
     sqlite3_stmt *q_add;
     sqlite3_stmt *q_sel;
     sqlite3_stmt *q_remove;
@@ -648,6 +929,15 @@ struct _sx_hashfs_t {
     sqlite3_stmt *q_setvolcursize;
     sqlite3_stmt *q_getnodepushtime;
     sqlite3_stmt *q_setnodepushtime;
+    sqlite3_stmt *q_listidx_get;
+    sqlite3_stmt *q_listidx_set;
+    sqlite3_stmt *q_listidx_del;
+    sqlite3_stmt *q_listidx_wipe;
+    sqlite3_stmt *q_listidx_etag;
+    sqlite3_stmt *q_listidx_built;
+    sqlite3_stmt *q_listidx_unbuilt;
+    sqlite3_stmt *q_listidx_dirty;
+    int have_listidx;
 
     sxi_db_t *tempdb;
     sqlite3_stmt *qt_new;
@@ -667,55 +957,13 @@ struct _sx_hashfs_t {
     sqlite3_stmt *qt_flush;
     sqlite3_stmt *qt_gc_tokens;
 
-    sxi_db_t *metadb[METADBS];
-    sqlite3_stmt *qm_ins[METADBS];
-    sqlite3_stmt *qm_list[METADBS];
-    sqlite3_stmt *qm_listrevs[METADBS];
-    sqlite3_stmt *qm_listrevs_rev[METADBS];
-    unsigned char qm_list_done[METADBS];
+    sxi_db_t *metadb[METADBS_MAX];
+    sqlite3_stmt *qm[QM_STMTS][METADBS_MAX];
+    unsigned char qm_list_done[METADBS_MAX];
     uint64_t qm_list_queries;
-    sqlite3_stmt *qm_get[METADBS];
-    sqlite3_stmt *qm_getrev[METADBS];
-    sqlite3_stmt *qm_oldrevs[METADBS];
-    sqlite3_stmt *qm_metaget[METADBS];
-    sqlite3_stmt *qm_metaset[METADBS];
-    sqlite3_stmt *qm_metadel[METADBS];
-    sqlite3_stmt *qm_delfile[METADBS];
-    sqlite3_stmt *qm_wiperelocs[METADBS];
-    sqlite3_stmt *qm_addrelocs[METADBS];
-    sqlite3_stmt *qm_getreloc[METADBS];
-    sqlite3_stmt *qm_delreloc[METADBS];
-    sqlite3_stmt *qm_delbyvol[METADBS];
-    sqlite3_stmt *qm_sumfilesizes[METADBS];
-    sqlite3_stmt *qm_newest[METADBS];
-    sqlite3_stmt *qm_count[METADBS];
-    sqlite3_stmt *qm_list_rev_dec[METADBS];
-    sqlite3_stmt *qm_list_file[METADBS];
-
-    sxi_db_t *datadb[SIZES][HASHDBS];
-    sqlite3_stmt *qb_get[SIZES][HASHDBS];
-    sqlite3_stmt *qb_nextavail[SIZES][HASHDBS];
-    sqlite3_stmt *qb_nextalloc[SIZES][HASHDBS];
-    sqlite3_stmt *qb_add[SIZES][HASHDBS];
-    sqlite3_stmt *qb_setfree[SIZES][HASHDBS];
-    sqlite3_stmt *qb_gc1[SIZES][HASHDBS];
-    sqlite3_stmt *qb_bumpavail[SIZES][HASHDBS];
-    sqlite3_stmt *qb_bumpalloc[SIZES][HASHDBS];
-    sqlite3_stmt *qb_moduse[SIZES][HASHDBS];
-    sqlite3_stmt *qb_op[SIZES][HASHDBS];
-    sqlite3_stmt *qb_reserve[SIZES][HASHDBS];
-    sqlite3_stmt *qb_del_reserve[SIZES][HASHDBS];
-    sqlite3_stmt *qb_get_meta[SIZES][HASHDBS];
-    sqlite3_stmt *qb_deleteold[SIZES][HASHDBS];
-    sqlite3_stmt *qb_add_reserve[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_unused[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_bad[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_expired_reservation[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_expired_reservation2[SIZES][HASHDBS];
-    sqlite3_stmt *qb_find_expired_ops[SIZES][HASHDBS];
-    sqlite3_stmt *qb_gc_reserve[SIZES][HASHDBS];
-    sqlite3_stmt *qb_gc_reserve2[SIZES][HASHDBS];
-    sqlite3_stmt *qb_gc_op[SIZES][HASHDBS];
+
+    sxi_db_t *datadb[SIZES][HASHDBS_MAX];
+    sqlite3_stmt *qb[QB_STMTS][SIZES][HASHDBS_MAX];
 
     sxi_db_t *eventdb;
     sqlite3_stmt *qe_getjob;
@@ -754,6 +1002,7 @@ struct _sx_hashfs_t {
 
     sx_hashfs_file_t list_file;
     int list_recurse;
+    int list_fromidx;
     int64_t list_volid;
     /* 2*SXLIMIT because each char can be a wildcard that might need to be
      * escaped for an exact match */
@@ -797,7 +1046,8 @@ struct _sx_hashfs_t {
     int64_t relocid;
 
 
-    int datafd[SIZES][HASHDBS];
+    unsigned int hashdbs, metadbs;
+    int datafd[SIZES][HASHDBS_MAX];
     sx_uuid_t cluster_uuid, node_uuid; /* MODHDIST: store sx_node_t instead - see sx_hashfs_self */
     char version[16];
     sx_hash_t tokenkey;
@@ -812,12 +1062,52 @@ struct _sx_hashfs_t {
 
     char *dir;
     int gcver;
+    sx_hashfs_gc_stats_t gc_last;
+    int nopunch;
+    unsigned int gc_worker, gc_nworkers;
     int gc_wal_pages;
     struct rebalance_iter rit;
+    unsigned int lazy_preps;
+    double lazy_prep_time;
 };
 
+static sqlite3_stmt *qlazy(sx_hashfs_t *h, sxi_db_t *db, sqlite3_stmt **q, const char *query) {
+    struct timeval tv0, tv1;
+
+    gettimeofday(&tv0, NULL);
+    if(qprep(db, q, query)) {
+	WARN("Failed to prepare query \"%s\"", query);
+	*q = NULL;
+	return NULL;
+    }
+    gettimeofday(&tv1, NULL);
+    h->lazy_preps++;
+    h->lazy_prep_time += timediff(&tv0, &tv1);
+    return *q;
+}
+
+static unsigned int count_stmts(sxi_db_t *db) {
+    sqlite3_stmt *q = NULL;
+    unsigned int n = 0;
+
+    if(db)
+	while((q = sqlite3_next_stmt(db->handle, q)))
+	    n++;
+    return n;
+}
+
+static sqlite3_stmt *qb_stmt(sx_hashfs_t *h, enum qb_id id, unsigned int hs, unsigned int ndb) {
+    sqlite3_stmt *q = h->qb[id][hs][ndb];
+    return q ? q : qlazy(h, h->datadb[hs][ndb], &h->qb[id][hs][ndb], qb_sql[id]);
+}
+
+static sqlite3_stmt *qm_stmt(sx_hashfs_t *h, enum qm_id id, unsigned int ndb) {
+    sqlite3_stmt *q = h->qm[id][ndb];
+    return q ? q : qlazy(h, h->metadb[ndb], &h->qm[id][ndb], qm_sql[id]);
+}
+
 static void close_all_dbs(sx_hashfs_t *h) {
-    unsigned int i, j;
+    unsigned int i, j, k;
 
     sqlite3_finalize(h->qx_add);
     sqlite3_finalize(h->qx_hold);
@@ -846,59 +1136,18 @@ static void close_all_dbs(sx_hashfs_t *h) {
     qclose(&h->eventdb);
 
     for(j=0; j<SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
-	    sqlite3_finalize(h->qb_get[j][i]);
-	    sqlite3_finalize(h->qb_nextavail[j][i]);
-	    sqlite3_finalize(h->qb_nextalloc[j][i]);
-	    sqlite3_finalize(h->qb_add[j][i]);
-	    sqlite3_finalize(h->qb_setfree[j][i]);
-	    sqlite3_finalize(h->qb_gc1[j][i]);
-	    sqlite3_finalize(h->qb_bumpavail[j][i]);
-	    sqlite3_finalize(h->qb_bumpalloc[j][i]);
-            sqlite3_finalize(h->qb_moduse[j][i]);
-            sqlite3_finalize(h->qb_op[j][i]);
-            sqlite3_finalize(h->qb_reserve[j][i]);
-            sqlite3_finalize(h->qb_del_reserve[j][i]);
-            sqlite3_finalize(h->qb_get_meta[j][i]);
-            sqlite3_finalize(h->rit.q[j][i]);
-            sqlite3_finalize(h->qb_deleteold[j][i]);
-            sqlite3_finalize(h->qb_add_reserve[j][i]);
-            sqlite3_finalize(h->qb_find_unused[j][i]);
-            sqlite3_finalize(h->qb_find_bad[j][i]);
-            sqlite3_finalize(h->qb_find_expired_reservation[j][i]);
-            sqlite3_finalize(h->qb_find_expired_reservation2[j][i]);
-            sqlite3_finalize(h->qb_find_expired_ops[j][i]);
-            sqlite3_finalize(h->qb_gc_reserve[j][i]);
-            sqlite3_finalize(h->qb_gc_reserve2[j][i]);
-            sqlite3_finalize(h->qb_gc_op[j][i]);
+	for(i=0; i<h->hashdbs; i++) {
+	    for(k=0; k<QB_STMTS; k++)
+		sqlite3_finalize(h->qb[k][j][i]);
 	    qclose(&h->datadb[j][i]);
 
 	    if(h->datafd[j][i] >= 0)
 		close(h->datafd[j][i]);
 	}
     }
-    for(i=0; i<METADBS; i++) {
-	sqlite3_finalize(h->qm_ins[i]);
-	sqlite3_finalize(h->qm_list[i]);
-	sqlite3_finalize(h->qm_listrevs[i]);
-        sqlite3_finalize(h->qm_listrevs_rev[i]);
-	sqlite3_finalize(h->qm_get[i]);
-	sqlite3_finalize(h->qm_getrev[i]);
-	sqlite3_finalize(h->qm_oldrevs[i]);
-	sqlite3_finalize(h->qm_metaget[i]);
-	sqlite3_finalize(h->qm_metaset[i]);
-	sqlite3_finalize(h->qm_metadel[i]);
-	sqlite3_finalize(h->qm_delfile[i]);
-	sqlite3_finalize(h->qm_wiperelocs[i]);
-	sqlite3_finalize(h->qm_addrelocs[i]);
-	sqlite3_finalize(h->qm_getreloc[i]);
-	sqlite3_finalize(h->qm_delreloc[i]);
-	sqlite3_finalize(h->qm_delbyvol[i]);
-        sqlite3_finalize(h->qm_sumfilesizes[i]);
-        sqlite3_finalize(h->qm_newest[i]);
-        sqlite3_finalize(h->qm_count[i]);
-        sqlite3_finalize(h->qm_list_rev_dec[i]);
-        sqlite3_finalize(h->qm_list_file[i]);
+    for(i=0; i<h->metadbs; i++) {
+	for(k=0; k<QM_STMTS; k++)
+	    sqlite3_finalize(h->qm[k][i]);
 	qclose(&h->metadb[i]);
     }
 
@@ -917,6 +1166,14 @@ static void close_all_dbs(sx_hashfs_t *h) {
     sqlite3_finalize(h->q_setvolcursize);
     sqlite3_finalize(h->q_getnodepushtime);
     sqlite3_finalize(h->q_setnodepushtime);
+    sqlite3_finalize(h->q_listidx_get);
+    sqlite3_finalize(h->q_listidx_set);
+    sqlite3_finalize(h->q_listidx_del);
+    sqlite3_finalize(h->q_listidx_wipe);
+    sqlite3_finalize(h->q_listidx_etag);
+    sqlite3_finalize(h->q_listidx_built);
+    sqlite3_finalize(h->q_listidx_unbuilt);
+    sqlite3_finalize(h->q_listidx_dirty);
     sqlite3_finalize(h->q_onoffuser);
     sqlite3_finalize(h->q_gethdrev);
     sqlite3_finalize(h->q_getuser);
@@ -995,10 +1252,10 @@ void sx_hashfs_checkpoint_passive(sx_hashfs_t *h)
      * */
     qcheckpoint(h->db);
     qcheckpoint(h->tempdb);
-    for (i=0;i<METADBS;i++)
+    for (i=0;i<h->metadbs;i++)
         qcheckpoint(h->metadb[i]);
     for (i=0;i<SIZES;i++)
-        for (j=0;j<HASHDBS;j++)
+        for (j=0;j<h->hashdbs;j++)
             qcheckpoint(h->datadb[i][j]);
     qcheckpoint(h->eventdb);
     qcheckpoint(h->xferdb);
@@ -1008,6 +1265,30 @@ void sx_hashfs_checkpoint_gc(sx_hashfs_t *h)
 {
 }
 
+/* Enumerates all the databases of the node, NULL past the last one */
+sxi_db_t *sx_hashfs_db_at(sx_hashfs_t *h, unsigned int idx, char *name, unsigned int namelen)
+{
+    static const char *misc[] = { "hashfs", "tempdb", "eventdb", "xferdb" };
+    sxi_db_t *dbs[] = { h->db, h->tempdb, h->eventdb, h->xferdb };
+    unsigned int nmisc = sizeof(dbs) / sizeof(dbs[0]);
+
+    if(idx < nmisc) {
+	snprintf(name, namelen, "%s", misc[idx]);
+	return dbs[idx];
+    }
+    idx -= nmisc;
+    if(idx < h->metadbs) {
+	snprintf(name, namelen, "metadb_%08x", idx);
+	return h->metadb[idx];
+    }
+    idx -= h->metadbs;
+    if(idx < SIZES * h->hashdbs) {
+	snprintf(name, namelen, "hashdb_%c_%08x", sizedirs[idx / h->hashdbs], idx % h->hashdbs);
+	return h->datadb[idx / h->hashdbs][idx % h->hashdbs];
+    }
+    return NULL;
+}
+
 void sx_hashfs_checkpoint_xferdb(sx_hashfs_t *h)
 {
     qcheckpoint_idle(h->xferdb);
@@ -1258,7 +1539,10 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
     char *path, dbitem[64], dynqry[128];
     const char *str;
     sx_hashfs_t *h;
+    struct timeval tv0, tv1;
+    int r;
 
+    gettimeofday(&tv0, NULL);
     if(!dir || !(dirlen = strlen(dir))) {
 	CRIT("Bad path");
 	return NULL;
@@ -1323,6 +1607,31 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
     }
     strcpy(h->version, str);
 
+    /* Storage created before the shard count was configurable uses the defaults */
+    h->hashdbs = HASHDBS_DEFAULT;
+    h->metadbs = METADBS_DEFAULT;
+    sqlite3_reset(h->q_getval);
+    if(qbind_text(h->q_getval, ":k", "hashdbs"))
+	goto open_hashfs_fail;
+    r = qstep(h->q_getval);
+    if(r == SQLITE_ROW)
+	h->hashdbs = sqlite3_column_int(h->q_getval, 0);
+    else if(r != SQLITE_DONE)
+	goto open_hashfs_fail;
+    sqlite3_reset(h->q_getval);
+    if(qbind_text(h->q_getval, ":k", "metadbs"))
+	goto open_hashfs_fail;
+    r = qstep(h->q_getval);
+    if(r == SQLITE_ROW)
+	h->metadbs = sqlite3_column_int(h->q_getval, 0);
+    else if(r != SQLITE_DONE)
+	goto open_hashfs_fail;
+    sqlite3_reset(h->q_getval);
+    if(!h->hashdbs || h->hashdbs > HASHDBS_MAX || !h->metadbs || h->metadbs > METADBS_MAX) {
+	CRIT("Invalid number of database shards in storage (%u hash, %u meta)", h->hashdbs, h->metadbs);
+	goto open_hashfs_fail;
+    }
+
     if(qprep(h->db, &q, "SELECT key FROM users WHERE uid = 0 AND role = "STRIFY(ROLE_CLUSTER)" AND enabled = 1") || qstep_ret(q)) {
 	CRIT("Failed to retrieve cluster key from database");
 	goto open_hashfs_fail;
@@ -1424,6 +1733,42 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
     if(qprep(h->db, &h->q_setnodepushtime, "INSERT OR REPLACE INTO node_volume_updates VALUES (:node, :now)"))
         goto open_hashfs_fail;
 
+    /* The listing index is created on demand; once it exists it is kept up to date
+     * by every process, regardless of whether listings are served from it */
+    if(list_index) {
+	if(qprep(h->db, &q, "CREATE TABLE IF NOT EXISTS listidx (volume_id INTEGER NOT NULL REFERENCES volumes(vid) ON DELETE CASCADE ON UPDATE CASCADE, name TEXT ("STRIFY(SXLIMIT_MAX_FILENAME_LEN)") NOT NULL, size INTEGER NOT NULL, rev TEXT (56) NOT NULL, revs INTEGER NOT NULL, PRIMARY KEY(volume_id, name))") || qstep_noret(q))
+	    goto open_hashfs_fail;
+	qnullify(q);
+	if(qprep(h->db, &q, "CREATE TABLE IF NOT EXISTS listvols (volume_id INTEGER NOT NULL PRIMARY KEY REFERENCES volumes(vid) ON DELETE CASCADE ON UPDATE CASCADE, built INTEGER NOT NULL DEFAULT 0)") || qstep_noret(q))
+	    goto open_hashfs_fail;
+	qnullify(q);
+	if(qprep(h->db, &q, "CREATE TABLE IF NOT EXISTS listdirty (volume_id INTEGER NOT NULL REFERENCES volumes(vid) ON DELETE CASCADE ON UPDATE CASCADE, name TEXT ("STRIFY(SXLIMIT_MAX_FILENAME_LEN)") NOT NULL, PRIMARY KEY(volume_id, name))") || qstep_noret(q))
+	    goto open_hashfs_fail;
+	qnullify(q);
+    }
+    if(qprep(h->db, &q, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name IN ('listidx', 'listvols', 'listdirty')") || qstep_ret(q))
+	goto open_hashfs_fail;
+    h->have_listidx = sqlite3_column_int(q, 0) == 3;
+    qnullify(q);
+    if(h->have_listidx) {
+	if(qprep(h->db, &h->q_listidx_get, "SELECT name, size, rev FROM listidx WHERE volume_id = :volume AND name > :previous ORDER BY name ASC LIMIT 1"))
+	    goto open_hashfs_fail;
+	if(qprep(h->db, &h->q_listidx_set, "INSERT OR REPLACE INTO listidx (volume_id, name, size, rev, revs) VALUES (:volume, :name, :size, :rev, :revs)"))
+	    goto open_hashfs_fail;
+	if(qprep(h->db, &h->q_listidx_del, "DELETE FROM listidx WHERE volume_id = :volume AND name = :name"))
+	    goto open_hashfs_fail;
+	if(qprep(h->db, &h->q_listidx_wipe, "DELETE FROM listidx WHERE volume_id = :volume"))
+	    goto open_hashfs_fail;
+	if(qprep(h->db, &h->q_listidx_etag, "SELECT MAX(rev), COALESCE(SUM(revs), 0) FROM listidx WHERE volume_id = :volume"))
+	    goto open_hashfs_fail;
+	if(qprep(h->db, &h->q_listidx_built, "SELECT 1 FROM listvols WHERE volume_id = :volume AND built = 1"))
+	    goto open_hashfs_fail;
+	if(qprep(h->db, &h->q_listidx_unbuilt, "DELETE FROM listvols WHERE volume_id = :volume"))
+	    goto open_hashfs_fail;
+	if(qprep(h->db, &h->q_listidx_dirty, "INSERT OR IGNORE INTO listdirty (volume_id, name) SELECT volume_id, :name FROM listvols WHERE volume_id = :volume AND built = 0"))
+	    goto open_hashfs_fail;
+    }
+
     OPEN_DB("tempdb", &h->tempdb);
     /* needed for ON DELETE CASCADE to work */
     if(qprep(h->tempdb, &q, "PRAGMA foreign_keys = ON") || qstep_noret(q))
@@ -1469,69 +1814,21 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
     for(j=0; j<SIZES; j++) {
 	char hexsz[9];
 	sprintf(hexsz, "%08x", bsz[j]);
-	for(i=0; i<HASHDBS; i++) {
+	for(i=0; i<h->hashdbs; i++) {
 	    sprintf(dbitem, "hashdb_%c_%08x", sizedirs[j], i);
 	    OPEN_DB(dbitem, &h->datadb[j][i]);
             if(qprep(h->datadb[j][i], &q, "PRAGMA foreign_keys = ON") || qstep_noret(q))
                 goto open_hashfs_fail;
             qnullify(q);
-	    if(qprep(h->datadb[j][i], &h->qb_nextavail[j][i], "SELECT blocknumber FROM avail ORDER BY blocknumber ASC LIMIT 1"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_nextalloc[j][i], "SELECT value FROM hashfs WHERE key = 'next_blockno'"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_add[j][i], "UPDATE blocks SET blockno=:next, created_at = :now WHERE hash=:hash"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_setfree[j][i], "INSERT OR IGNORE INTO avail VALUES(:blockno)"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_gc1[j][i], "DELETE FROM blocks WHERE id = :blockid"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_get[j][i], "SELECT blockno FROM blocks WHERE hash = :hash AND blockno IS NOT NULL"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_bumpavail[j][i], "DELETE FROM avail WHERE blocknumber = :next"))
+	    /* Storage created before the GC queues and the slot index were introduced */
+	    if(qprep(h->datadb[j][i], &q, "SELECT COUNT(*) FROM sqlite_master WHERE (type = 'table' AND name IN ('gc_candidates', 'reclaim')) OR (type = 'index' AND name = 'blocks_blockno')") || qstep_ret(q))
 		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_bumpalloc[j][i], "UPDATE hashfs SET value = value + 1 WHERE key = 'next_blockno'"))
-		goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_moduse[j][i],
-                     "INSERT OR REPLACE INTO use(blockid, replica, age, used)\
-                     SELECT id, :replica, :age, \
-                        COALESCE((SELECT used + :used FROM use WHERE blockid=id AND replica=:replica AND age=:age), :used)\
-                    FROM blocks WHERE hash = :hash"))/* AND blockno IS NOT NULL */
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_op[j][i], "INSERT OR IGNORE INTO operations(blockid, tokenid, replica, op, ttl) SELECT id, :tokenid, :replica, :op, :ttl FROM blocks WHERE hash = :hash"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_reserve[j][i], "INSERT OR REPLACE INTO reservations(blockid, reserveid, ttl) SELECT id, :reserveid, :ttl FROM blocks WHERE hash = :hash"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_del_reserve[j][i], "DELETE FROM reservations WHERE reserveid=:reserveid AND blockid=(SELECT id FROM blocks WHERE hash=:hash)"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_get_meta[j][i], "SELECT replica, SUM(used) FROM use WHERE blockid=:blockid AND age < :current_age GROUP BY replica"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->rit.q[j][i], "SELECT id, hash FROM blocks WHERE hash > :prevhash AND blockno IS NOT NULL"))
-                goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_add_reserve[j][i], "INSERT OR IGNORE INTO blocks (hash) VALUES (:hash)"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_find_unused[j][i], "SELECT id, blockno, hash FROM blocks LEFT JOIN use ON use.blockid=id AND used<>0 LEFT JOIN reservations ON reservations.blockid=id WHERE id > :last AND reservations.blockid IS NULL GROUP BY id HAVING SUM(used)=0 OR COUNT(use.blockid)=0 ORDER BY id;"))
-		goto open_hashfs_fail;
-	    if(qprep(h->datadb[j][i], &h->qb_find_bad[j][i], "SELECT COUNT(blockid) FROM use GROUP BY blockid, replica HAVING SUM(used) < 0"))
-		goto open_hashfs_fail;
-            /* hash moved,
-             * hashes that are not moved don't have the old counters deleted,
-             * and must be taken into account when GCing!
-             * this is to avoid updating the entire table during rebalance
-             * */
-            if(qprep(h->datadb[j][i], &h->qb_deleteold[j][i], "DELETE FROM use WHERE blockid=(SELECT id FROM blocks WHERE hash=:hash AND blockno IS NOT NULL) AND age < :current_age"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_find_expired_reservation[j][i], "SELECT reserveid FROM reservations INNER JOIN blocks ON blockid=id AND created_at IS NOT NULL WHERE reserveid > :lastreserveid GROUP BY reserveid HAVING created_at < :expires OR created_at IS NULL ORDER BY reserveid LIMIT 1"))
-               goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_find_expired_reservation2[j][i], "SELECT ROWID from reservations WHERE ttl < :now AND ROWID>:lastrowid LIMIT 1"))
-               goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_find_expired_ops[j][i],"SELECT ROWID FROM operations WHERE ttl < :now LIMIT 1"))
-               goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_gc_reserve[j][i], "DELETE FROM reservations WHERE reserveid=:reserveid"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_gc_reserve2[j][i], "DELETE FROM reservations WHERE ROWID=:rowid"))
-                goto open_hashfs_fail;
-            if(qprep(h->datadb[j][i], &h->qb_gc_op[j][i], "DELETE FROM operations WHERE ROWID=:rowid"))
-                goto open_hashfs_fail;
+	    if(sqlite3_column_int(q, 0) < 3) {
+		INFO("Creating the GC queues on %s", dbitem);
+		if(create_gc_tables(h->datadb[j][i]))
+		    goto open_hashfs_fail;
+	    }
+	    qnullify(q);
 
 	    sprintf(dbitem, "datafile_%c_%08x", sizedirs[j], i);
 	    sqlite3_reset(h->q_getval);
@@ -1554,7 +1851,7 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
 
 	    h->datafd[j][i] = open(str, O_RDWR);
 	    if(h->datafd[j][i] < 0) {
-		perror("open");
+		PCRIT("Failed to open datafile %s", str);
 		goto open_hashfs_fail;
 	    }
 	    if(read_block(h->datafd[j][i], h->blockbuf, 0, bsz[j]))
@@ -1569,54 +1866,12 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
 	}
     }
 
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
 	sprintf(dbitem, "metadb_%08x", i);
 	OPEN_DB(dbitem, &h->metadb[i]);
 	if(qprep(h->metadb[i], &q, "PRAGMA foreign_keys = ON") || qstep_noret(q))
 	    goto open_hashfs_fail;
 	qnullify(q);
-	if(qprep(h->metadb[i], &h->qm_ins[i], "INSERT INTO files (volume_id, name, size, content, rev) VALUES (:volume, :name, :size, :hashes, :revision)"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_list[i], "SELECT name, size, rev FROM files WHERE volume_id = :volume AND name > :previous GROUP BY name HAVING rev = MAX(rev) ORDER BY name ASC LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_listrevs[i], "SELECT size, rev FROM files WHERE volume_id = :volume AND name = :name AND rev > :previous ORDER BY rev ASC LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_get[i], "SELECT fid, size, content, rev FROM files WHERE volume_id = :volume AND name = :name GROUP BY name HAVING rev = MAX(rev) LIMIT 1"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_listrevs_rev[i], "SELECT size, rev FROM files WHERE volume_id = :volume AND name = :name AND (:previous IS NULL OR rev < :previous) ORDER BY rev DESC LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_getrev[i], "SELECT fid, size, content, rev FROM files WHERE volume_id = :volume AND name = :name AND rev = :revision LIMIT 1"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_oldrevs[i], "SELECT rev, size, (SELECT COUNT(*) FROM files AS b WHERE b.volume_id = a.volume_id AND b.name = a.name), fid FROM files AS a WHERE a.volume_id = :volume AND a.name = :name ORDER BY rev ASC"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_metaget[i], "SELECT key, value FROM fmeta WHERE file_id = :file"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_metaset[i], "INSERT OR REPLACE INTO fmeta (file_id, key, value) VALUES (:file, :key, :value)"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_metadel[i], "DELETE FROM fmeta WHERE file_id = :file AND key = :key"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_delfile[i], "DELETE FROM files WHERE fid = :file"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_wiperelocs[i], "DELETE FROM relocs"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_addrelocs[i], "INSERT INTO relocs (file_id, dest) SELECT fid, :node FROM files WHERE volume_id = :volid"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_getreloc[i], "SELECT file_id, dest, volume_id, name, size, rev, content FROM relocs LEFT JOIN files ON relocs.file_id = files.fid WHERE file_id > :prev"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_delreloc[i], "DELETE FROM relocs WHERE file_id = :fileid"))
-	    goto open_hashfs_fail;
-	if(qprep(h->metadb[i], &h->qm_delbyvol[i], "DELETE FROM files WHERE volume_id = :volid"))
-	    goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_sumfilesizes[i], "SELECT SUM(x) FROM (SELECT files.size + LENGTH(files.name) + SUM(COALESCE(LENGTH(fmeta.key) + LENGTH(fmeta.value),0)) AS x FROM files LEFT JOIN fmeta ON files.fid = fmeta.file_id WHERE files.volume_id = :volid GROUP BY files.fid)"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_newest[i], "SELECT MAX(rev) FROM files WHERE volume_id = :volid"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_count[i], "SELECT COUNT(rev) FROM files WHERE volume_id = :volid"))
-	    goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_list_rev_dec[i], "SELECT size, rev, content FROM files WHERE volume_id=:volid AND name = :name AND rev < :maxrev ORDER BY rev DESC LIMIT 1"))
-            goto open_hashfs_fail;
-        if(qprep(h->metadb[i], &h->qm_list_file[i], "SELECT size, rev, content, name FROM files WHERE volume_id=:volid AND name > :previous AND rev < :maxrev ORDER BY name ASC, rev DESC LIMIT 1"))
-            goto open_hashfs_fail;
     }
 
     OPEN_DB("eventdb", &h->eventdb);
@@ -1672,6 +1927,11 @@ sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx) {
     qnullify(q);
     sqlite3_reset(h->q_getval);
 
+    gettimeofday(&tv1, NULL);
+    DEBUG("HashFS opened in %.3f sec: %u statements prepared, %u per shard statements deferred to first use",
+	  timediff(&tv0, &tv1), count_stmts(h->db) + count_stmts(h->tempdb) + count_stmts(h->eventdb) + count_stmts(h->xferdb),
+	  QB_STMTS * SIZES * h->hashdbs + QM_STMTS * h->metadbs);
+
     free(path);
     return h;
 
@@ -1753,6 +2013,7 @@ void sx_hashfs_close(sx_hashfs_t *h) {
     sx_nodelist_delete(h->nextprev_dist);
     sx_nodelist_delete(h->faulty_nodes);
 
+    DEBUG("%u per shard statements were prepared on demand in %.3f sec", h->lazy_preps, h->lazy_prep_time);
     close_all_dbs(h);
 
     free(h->blockbuf);
@@ -1862,18 +2123,26 @@ static int cmphash(const void *a, const void *b) {
     return memcmp(a, b, sizeof(sx_hash_t));
 }
 
-static unsigned int gethashdb(const sx_hash_t *hash) {
-    return MurmurHash64(hash, sizeof(*hash), MURMUR_SEED) & (HASHDBS-1);
+static unsigned int hashshard(const sx_hash_t *hash, unsigned int nshards) {
+    return MurmurHash64(hash, sizeof(*hash), MURMUR_SEED) % nshards;
 }
 
-static int getmetadb(const char *filename) {
+static unsigned int nameshard(const char *filename, unsigned int nshards) {
     sx_hash_t hash;
     if(hash_buf(NULL, 0, filename, strlen(filename), &hash)) {
         WARN("hash_buf failed");
 	return 0;
     }
 
-    return MurmurHash64(&hash, sizeof(hash), MURMUR_SEED) & (METADBS-1);
+    return hashshard(&hash, nshards);
+}
+
+static unsigned int gethashdb(const sx_hashfs_t *h, const sx_hash_t *hash) {
+    return hashshard(hash, h->hashdbs);
+}
+
+static int getmetadb(const sx_hashfs_t *h, const char *filename) {
+    return nameshard(filename, h->metadbs);
 }
 
 /* Returns 0 if the volume name is valid,
@@ -2162,7 +2431,7 @@ void sx_hashfs_stats(sx_hashfs_t *h)
     INFO("Volume#: %lld", get_count(h->db, "volumes"));
     INFO("Volume metadata#: %lld", get_count(h->db, "vmeta"));
     long long files = 0, fmeta = 0;
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
 	files += get_count(h->metadb[i], "files");
 	fmeta += get_count(h->metadb[i], "fmeta");
     }
@@ -2171,7 +2440,7 @@ void sx_hashfs_stats(sx_hashfs_t *h)
     INFO("Block counts:");
     for (j=0; j<SIZES; j++) {
 	long long blocks = 0;
-	for(i=0;i<HASHDBS;i++)
+	for(i=0;i<h->hashdbs;i++)
 	    blocks += get_count(h->datadb[j][i], "blocks");
 	INFO("\t%-8s (%8d byte) block#: %lld", sizelongnames[j], bsz[j], blocks);
     }
@@ -2256,13 +2525,13 @@ int sx_hashfs_analyze(sx_hashfs_t *h, int verbose)
         return -1;
     ret += r;
     unsigned i, j;
-    for(i=0; i<METADBS; i++)
+    for(i=0; i<h->metadbs; i++)
 	r = analyze_db(h->metadb[i], verbose);
         if(r == -1)
             return -1;
         ret += r;
     for (j=0; j<SIZES; j++) {
-	for(i=0;i<HASHDBS;i++) {
+	for(i=0;i<h->hashdbs;i++) {
 	    r = analyze_db(h->datadb[j][i], verbose);
             if(r == -1)
                 return -1;
@@ -2364,10 +2633,10 @@ static int check_file_hashes(sx_hashfs_t *h, int debug, const sx_hash_t *hashes,
 
     for(j = 0; j < hashes_count; j++) {
         const sx_hash_t* hash = hashes + j;
-        unsigned int ndb = gethashdb(hash);
+        unsigned int ndb = gethashdb(h, hash);
         int r;
         sxi_db_t *db = h->datadb[bs][ndb];
-        q = h->qb_get[bs][ndb];
+        q = qb_stmt(h, QB_GET, bs, ndb);
         char hex[SXI_SHA1_TEXT_LEN+1];
         sx_nodelist_t *hashnodes;
 
@@ -2445,8 +2714,8 @@ static int check_file_sizes(sx_hashfs_t *h, const sx_hashfs_volume_t *vol) {
         return 0;
 
     /* Sum up all files */
-    for(i = 0; i < METADBS; i++) {
-        q = h->qm_sumfilesizes[i];
+    for(i = 0; i < h->metadbs; i++) {
+        q = qm_stmt(h, QM_SUMFILESIZES, i);
 
         sqlite3_reset(q);
         if(qbind_int64(q, ":volid", vol->id)) {
@@ -2621,7 +2890,7 @@ static int check_files(sx_hashfs_t *h, int debug) {
     unsigned int i;
     const sx_hashfs_volume_t *vol = NULL;
 
-    for(i=0; i<METADBS; i++) {
+    for(i=0; i<h->metadbs; i++) {
         sqlite3_stmt *list = NULL;
         int rows = 0;
 
@@ -2633,7 +2902,7 @@ static int check_files(sx_hashfs_t *h, int debug) {
 
         if(debug) {
             rows = get_count(h->metadb[i], "files");
-            CHECK_INFO("Checking consistency of %lld files in metadata database %u / %u...", (long long int)rows, i+1, METADBS);
+            CHECK_INFO("Checking consistency of %lld files in metadata database %u / %u...", (long long int)rows, i+1, h->metadbs);
         }
 
         while(1) {
@@ -2727,7 +2996,7 @@ static int check_blocks_existence(sx_hashfs_t *h, int debug, unsigned int hs, un
     sqlite3_stmt *q = NULL;
     sxi_db_t *db;
 
-    if(hs >= SIZES || ndb >= HASHDBS) {
+    if(hs >= SIZES || ndb >= h->hashdbs) {
         ret = -1;
         goto check_blocks_existence_err;
     }
@@ -2736,7 +3005,7 @@ static int check_blocks_existence(sx_hashfs_t *h, int debug, unsigned int hs, un
 
     if(debug) {
         CHECK_INFO("Checking consistency of %lld blocks in %s hash database %u / %u...",
-             (long long int)get_count(db, "blocks"), sizelongnames[hs], ndb+1, HASHDBS);
+             (long long int)get_count(db, "blocks"), sizelongnames[hs], ndb+1, h->hashdbs);
     }
 
     if(qprep(db, &q, "SELECT id, hash, blockno FROM blocks WHERE blockno IS NOT NULL ORDER BY blockno ASC")) {
@@ -2804,23 +3073,23 @@ static int check_blocks_counters(sx_hashfs_t *h, int debug, unsigned int hs, uns
     sqlite3_stmt *q = NULL;
     int64_t counter = 0;
 
-    if(hs >= SIZES || ndb >= HASHDBS) {
+    if(hs >= SIZES || ndb >= h->hashdbs) {
         CHECK_FATAL("Failed to check negative counters: invalid argument");
         return -1;
     }
 
     if(debug) {
         CHECK_INFO("Checking negative counters within %lld rows in %s hash database %u / %u...",
-            (long long int)get_count(h->datadb[hs][ndb], "use"), sizelongnames[hs], ndb+1, HASHDBS);
+            (long long int)get_count(h->datadb[hs][ndb], "use"), sizelongnames[hs], ndb+1, h->hashdbs);
     }
 
-    q = h->qb_find_bad[hs][ndb];
+    q = qb_stmt(h, QB_FIND_BAD, hs, ndb);
     sqlite3_reset(q);
     while((r = qstep(q)) == SQLITE_ROW)
         counter += sqlite3_column_int64(q, 0);
 
     if (counter > 0 && !sx_hashfs_is_rebalancing(h)) {
-        CHECK_ERROR("Found %lld negative counters in %s hash database %u / %u", (long long)counter, sizelongnames[hs], ndb+1, HASHDBS);
+        CHECK_ERROR("Found %lld negative counters in %s hash database %u / %u", (long long)counter, sizelongnames[hs], ndb+1, h->hashdbs);
         ret = 1;
     }
 
@@ -2839,7 +3108,7 @@ static int check_blocks_dups(sx_hashfs_t *h, int debug, unsigned int hs, unsigne
     sqlite3_stmt *q = NULL;
     sxi_db_t *db;
 
-    if(hs >= SIZES || ndb >= HASHDBS) {
+    if(hs >= SIZES || ndb >= h->hashdbs) {
         ret = -1;
         goto check_blocks_dups_err;
     }
@@ -2848,7 +3117,7 @@ static int check_blocks_dups(sx_hashfs_t *h, int debug, unsigned int hs, unsigne
 
     if(debug) {
         CHECK_INFO("Checking duplicates within %lld blocks in %s hash database %u / %u...",
-            (long long int)get_count(db, "blocks"), sizelongnames[hs], ndb+1, HASHDBS);
+            (long long int)get_count(db, "blocks"), sizelongnames[hs], ndb+1, h->hashdbs);
     }
 
     if(qprep(db, &q, "SELECT b1.id, b1.hash, b2.id, b2.hash, b1.blockno FROM blocks AS b1 LEFT JOIN blocks AS b2 ON b1.id < b2.id WHERE b1.blockno = b2.blockno"))
@@ -2899,7 +3168,7 @@ static int check_blocks(sx_hashfs_t *h, int debug) {
     unsigned int i, j;
 
     for(j = 0; j < SIZES; j++) {
-        for(i = 0; i < HASHDBS; i++) {
+        for(i = 0; i < h->hashdbs; i++) {
             sqlite3_stmt *index = NULL;
 
             /* Create index on blockno field to prevent sqlite from doning this */
@@ -3097,7 +3366,7 @@ lock_db_err:
 
 int sx_hashfs_check(sx_hashfs_t *h, int debug) {
     int ret = -1, r, i, j;
-    sqlite3_stmt *locks[METADBS + SIZES * HASHDBS + 4], *unlocks[METADBS + SIZES * HASHDBS + 4];
+    sqlite3_stmt *locks[METADBS_MAX + SIZES * HASHDBS_MAX + 4], *unlocks[METADBS_MAX + SIZES * HASHDBS_MAX + 4];
 
     memset(locks, 0, sizeof(locks));
     memset(unlocks, 0, sizeof(unlocks));
@@ -3110,7 +3379,7 @@ int sx_hashfs_check(sx_hashfs_t *h, int debug) {
     }
 
     r = 4;
-    for(i = 0; i < METADBS; i++, r++) {
+    for(i = 0; i < h->metadbs; i++, r++) {
         if(lock_db(h->metadb[i], locks + r, unlocks + r)) {
             CHECK_FATAL("Failed to lock database meta database");
             goto sx_hashfs_check_err;
@@ -3118,7 +3387,7 @@ int sx_hashfs_check(sx_hashfs_t *h, int debug) {
     }
 
     for(i = 0; i < SIZES; i++) {
-        for(j = 0; j < HASHDBS; j++, r++)
+        for(j = 0; j < h->hashdbs; j++, r++)
         if(lock_db(h->datadb[i][j], locks + r, unlocks + r)) {
             CHECK_FATAL("Failed to lock database hash database");
             goto sx_hashfs_check_err;
@@ -3146,7 +3415,7 @@ int sx_hashfs_check(sx_hashfs_t *h, int debug) {
 sx_hashfs_check_err:
     CHECK_FINISH;
 
-    for(i = 0; i < SIZES * HASHDBS + METADBS + 4; i++) {
+    for(i = 0; i < SIZES * h->hashdbs + h->metadbs + 4; i++) {
         if(unlocks[i] && qstep_noret(unlocks[i]))
 	    CHECK_FATAL("Failed to unlock database");
         sqlite3_finalize(locks[i]);
@@ -3314,8 +3583,8 @@ static int extract_file(sx_hashfs_t *h, const char *destpath, const char *volnam
         /* Used for printing hash, can be remove if not needed */
         bin2hex(hash->b, sizeof(sx_hash_t), hex, SXI_SHA1_TEXT_LEN+1);
 
-        hdb = gethashdb(hash);
-        q = h->qb_get[hs][hdb];
+        hdb = gethashdb(h, hash);
+        q = qb_stmt(h, QB_GET, hs, hdb);
 
         sqlite3_reset(q);
         if(qbind_blob(q, ":hash", hash->b, sizeof(sx_hash_t))) {
@@ -3364,7 +3633,7 @@ extract_file_err:
 
 static int extract_volume_files(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const char *destpath, int64_t *restored, int64_t *nfiles) {
     int ret = -1, r, i;
-    sqlite3_stmt *list[METADBS];
+    sqlite3_stmt *list[METADBS_MAX];
 
     if(!vol || !destpath || !restored || !nfiles) {
         NULLARG();
@@ -3373,7 +3642,7 @@ static int extract_volume_files(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, c
 
     memset(list, 0, sizeof(list));
 
-    for(i = 0; i < METADBS; i++) {
+    for(i = 0; i < h->metadbs; i++) {
         if(qprep(h->metadb[i], &list[i], "SELECT name, size, content FROM files WHERE volume_id = :volid")
            || qbind_int64(list[i], ":volid", vol->id)) {
             WARN("Failed to prepare files list query for volume %s", vol->name);
@@ -3386,7 +3655,7 @@ static int extract_volume_files(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, c
     ret = 0; /* Start counting errors during extraction */
     *restored = 0;
     *nfiles = 0;
-    for(i = 0; i < METADBS; i++) {
+    for(i = 0; i < h->metadbs; i++) {
         while((r = qstep(list[i])) == SQLITE_ROW) {
             const char *name = (const char*)sqlite3_column_text(list[i], 0);
             int64_t size = sqlite3_column_int64(list[i], 1);
@@ -3410,12 +3679,12 @@ static int extract_volume_files(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, c
 
         if(r != SQLITE_DONE) {
             ret++;
-            WARN("Failed to list files from meta database %d / %d for volume %s", i, METADBS, vol->name);
+            WARN("Failed to list files from meta database %d / %d for volume %s", i, h->metadbs, vol->name);
         }
     }
 
 extract_volume_files_err:
-    for(i = 0; i < METADBS; i++)
+    for(i = 0; i < h->metadbs; i++)
         sqlite3_finalize(list[i]);
 
     return ret;
@@ -3423,7 +3692,7 @@ extract_volume_files_err:
 
 int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath) {
     int ret = -1, s, r, i;
-    sqlite3_stmt *locks[METADBS+1], *unlocks[METADBS+1];
+    sqlite3_stmt *locks[METADBS_MAX+1], *unlocks[METADBS_MAX+1];
     const sx_hashfs_volume_t *vol = NULL;
 
     if(!destpath || !*destpath) {
@@ -3435,7 +3704,7 @@ int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath) {
     memset(unlocks, 0, sizeof(unlocks));
 
     /* Lock meta databases */
-    for(i = 0; i < METADBS; i++) {
+    for(i = 0; i < h->metadbs; i++) {
         if(qprep(h->metadb[i], &locks[i], "BEGIN EXCLUSIVE TRANSACTION") || qprep(h->metadb[i], &unlocks[i], "ROLLBACK") || qstep_noret(locks[i])) {
             WARN("Failed to lock meta database at index %d", i);
             goto sx_hashfs_extract_err;
@@ -3443,7 +3712,7 @@ int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath) {
     }
 
     /* Lock hahsfs database */
-    if(qprep(h->db, &locks[METADBS], "BEGIN EXCLUSIVE TRANSACTION") || qprep(h->db, &unlocks[METADBS], "ROLLBACK") || qstep_noret(locks[METADBS])) {
+    if(qprep(h->db, &locks[h->metadbs], "BEGIN EXCLUSIVE TRANSACTION") || qprep(h->db, &unlocks[h->metadbs], "ROLLBACK") || qstep_noret(locks[h->metadbs])) {
         WARN("Failed to lock volumes database");
         goto sx_hashfs_extract_err;
     }
@@ -3468,46 +3737,976 @@ int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath) {
         }
         snprintf(partdir, len, "%s/.%s", destpath, vol->name);
 
-        /* Make needed directories */
-        if(access(partdir, R_OK) && sxi_mkdir_hier(h->sx, partdir, 0700)) {
-            WARN("Failed to create directory %s for volume %s files", partdir, vol->name);
-            free(partdir);
-            goto sx_hashfs_extract_err;
-        }
+        /* Make needed directories */
+        if(access(partdir, R_OK) && sxi_mkdir_hier(h->sx, partdir, 0700)) {
+            WARN("Failed to create directory %s for volume %s files", partdir, vol->name);
+            free(partdir);
+            goto sx_hashfs_extract_err;
+        }
+
+        if((r = extract_volume_files(h, vol, destpath, &restored, &nfiles)) < 0) {
+            WARN("Failed to restore files for volume %s", vol->name);
+        } else {
+            if(r > 0) {
+                WARN("Encountered %d error(s) during volume %s files extraction, restored %lld of %lld files ", r, vol->name,
+                    (long long)restored, (long long)nfiles);
+            } else if(nfiles > 0) {
+                INFO("All %lld files for volume %s were extracted successfully", (long long)nfiles, vol->name);
+            }
+        }
+
+        if(rmdir(partdir) && errno != EEXIST && errno != ENOTEMPTY)
+            WARN("Failed to remove part files directory: %s", partdir);
+
+        free(partdir);
+    }
+
+    if(s != ITER_NO_MORE) {
+        WARN("Failed to iterate volumes");
+        goto sx_hashfs_extract_err;
+    }
+
+    ret = 0;
+
+sx_hashfs_extract_err:
+    /* Unlock all databases */
+    for(i = h->metadbs; i >= 0; i--) {
+        if(unlocks[i] && qstep_noret(unlocks[i]))
+	    WARN("Failed to unlock database");
+        sqlite3_finalize(locks[i]);
+        sqlite3_finalize(unlocks[i]);
+    }
+
+    return ret;
+}
+
+#define COMPACT_BATCH 32
+
+/* Shrinks the datafile to next_blockno slots; must be called within a
+ * transaction so that no new slot can be handed out meanwhile */
+static int compact_truncate(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, int64_t *released) {
+    int fd = h->datafd[hs][ndb];
+    struct stat st;
+    int64_t next;
+    int r;
+
+    sqlite3_reset(h->qb[QB_NEXTALLOC][hs][ndb]);
+    r = qstep(qb_stmt(h, QB_NEXTALLOC, hs, ndb));
+    if(r != SQLITE_ROW) {
+	sqlite3_reset(h->qb[QB_NEXTALLOC][hs][ndb]);
+	return -1;
+    }
+    next = sqlite3_column_int64(qb_stmt(h, QB_NEXTALLOC, hs, ndb), 0);
+    sqlite3_reset(h->qb[QB_NEXTALLOC][hs][ndb]);
+
+    if(fstat(fd, &st)) {
+	WARN("Cannot stat datafile @%u/%u: %s", hs, ndb, strerror(errno));
+	return -1;
+    }
+    if(st.st_size <= next * bsz[hs])
+	return 0;
+    /* The moved blocks must hit the disk before their old copies go */
+    if(fdatasync(fd) || ftruncate(fd, next * bsz[hs])) {
+	WARN("Cannot truncate datafile @%u/%u: %s", hs, ndb, strerror(errno));
+	return -1;
+    }
+    *released += st.st_size - next * bsz[hs];
+    return 0;
+}
+
+/* Moves the blocks at the end of the datafile into the lowest free slots,
+ * a few at a time and at most rate blocks per second, while the node keeps
+ * running. Readers look up a slot and read it later without any lock, so
+ * they check that the block is still there once they are done (see
+ * sx_hashfs_block_get and fcgi_send_blocks) */
+static int compact_datafile(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, unsigned int rate, int64_t *moved, int64_t *released) {
+    sqlite3_stmt *q_isfree = NULL, *q_tail = NULL, *q_move = NULL, *q_setnext = NULL;
+    sxi_db_t *db = h->datadb[hs][ndb];
+    int fd = h->datafd[hs][ndb], done = 0, ret = -1, r;
+    unsigned int bs = bsz[hs], k, nmoved;
+    struct timeval tv0, tv1;
+
+    if(qprep(db, &q_isfree, "SELECT 1 FROM avail WHERE blocknumber = :blockno") ||
+       qprep(db, &q_tail, "SELECT id FROM blocks WHERE blockno = :blockno") ||
+       qprep(db, &q_move, "UPDATE blocks SET blockno = :new WHERE id = :id") ||
+       qprep(db, &q_setnext, "UPDATE hashfs SET value = :next WHERE key = 'next_blockno'"))
+	goto compact_datafile_err;
+
+    while(!done) {
+	gettimeofday(&tv0, NULL);
+	if(qbegin(db))
+	    goto compact_datafile_err;
+	if(compact_truncate(h, hs, ndb, released)) {
+	    qrollback(db);
+	    goto compact_datafile_err;
+	}
+	for(k = 0, nmoved = 0; k < COMPACT_BATCH * 4 && nmoved < COMPACT_BATCH; k++) {
+	    int64_t tail, low, id;
+
+	    sqlite3_reset(h->qb[QB_NEXTALLOC][hs][ndb]);
+	    if(qstep_ret(qb_stmt(h, QB_NEXTALLOC, hs, ndb)))
+		goto compact_batch_err;
+	    tail = sqlite3_column_int64(qb_stmt(h, QB_NEXTALLOC, hs, ndb), 0) - 1;
+	    sqlite3_reset(h->qb[QB_NEXTALLOC][hs][ndb]);
+	    if(tail < 1) {
+		done = 1;
+		break;
+	    }
+
+	    sqlite3_reset(q_isfree);
+	    if(qbind_int64(q_isfree, ":blockno", tail))
+		goto compact_batch_err;
+	    r = qstep(q_isfree);
+	    sqlite3_reset(q_isfree);
+	    if(r == SQLITE_ROW) {
+		/* Free slot at the tail: just drop it */
+		sqlite3_reset(h->qb[QB_BUMPAVAIL][hs][ndb]);
+		if(qbind_int64(qb_stmt(h, QB_BUMPAVAIL, hs, ndb), ":next", tail) || qstep_noret(qb_stmt(h, QB_BUMPAVAIL, hs, ndb)))
+		    goto compact_batch_err;
+	    } else if(r == SQLITE_DONE) {
+		sqlite3_reset(h->qb[QB_NEXTAVAIL][hs][ndb]);
+		r = qstep(qb_stmt(h, QB_NEXTAVAIL, hs, ndb));
+		low = r == SQLITE_ROW ? sqlite3_column_int64(qb_stmt(h, QB_NEXTAVAIL, hs, ndb), 0) : 0;
+		sqlite3_reset(h->qb[QB_NEXTAVAIL][hs][ndb]);
+		if(r != SQLITE_ROW && r != SQLITE_DONE)
+		    goto compact_batch_err;
+		if(r == SQLITE_DONE || low >= tail) {
+		    done = 1;
+		    break;
+		}
+
+		sqlite3_reset(q_tail);
+		if(qbind_int64(q_tail, ":blockno", tail))
+		    goto compact_batch_err;
+		r = qstep(q_tail);
+		id = r == SQLITE_ROW ? sqlite3_column_int64(q_tail, 0) : 0;
+		sqlite3_reset(q_tail);
+		if(r == SQLITE_DONE) {
+		    /* Slot allocated but not linked yet, an upload is in progress */
+		    DEBUG("Datafile @%u/%u has a pending block at %lld", hs, ndb, (long long)tail);
+		    done = 1;
+		    break;
+		}
+		if(r != SQLITE_ROW)
+		    goto compact_batch_err;
+
+		if(read_block(fd, h->blockbuf, tail * bs, bs) ||
+		   write_block(fd, h->blockbuf, low * bs, bs)) {
+		    WARN("Failed to move block %lld to %lld @%u/%u", (long long)tail, (long long)low, hs, ndb);
+		    goto compact_batch_err;
+		}
+		sqlite3_reset(q_move);
+		sqlite3_reset(h->qb[QB_BUMPAVAIL][hs][ndb]);
+		if(qbind_int64(q_move, ":new", low) || qbind_int64(q_move, ":id", id) || qstep_noret(q_move) ||
+		   qbind_int64(qb_stmt(h, QB_BUMPAVAIL, hs, ndb), ":next", low) || qstep_noret(qb_stmt(h, QB_BUMPAVAIL, hs, ndb)))
+		    goto compact_batch_err;
+		nmoved++;
+	    } else
+		goto compact_batch_err;
+
+	    sqlite3_reset(q_setnext);
+	    if(qbind_int64(q_setnext, ":next", tail) || qstep_noret(q_setnext))
+		goto compact_batch_err;
+	}
+	if(qcommit(db))
+	    goto compact_batch_err;
+	*moved += nmoved;
+
+	if(rate && nmoved) {
+	    double wait;
+	    gettimeofday(&tv1, NULL);
+	    wait = (double)nmoved / rate - timediff(&tv0, &tv1);
+	    if(wait > 0)
+		usleep(wait * 1000000);
+	}
+	continue;
+
+    compact_batch_err:
+	qrollback(db);
+	goto compact_datafile_err;
+    }
+
+    /* The old copies of the last batch are only dropped now */
+    if(qbegin(db))
+	goto compact_datafile_err;
+    if(compact_truncate(h, hs, ndb, released) || qcommit(db)) {
+	qrollback(db);
+	goto compact_datafile_err;
+    }
+    ret = 0;
+
+compact_datafile_err:
+    sqlite3_reset(h->qb[QB_NEXTALLOC][hs][ndb]);
+    sqlite3_reset(h->qb[QB_NEXTAVAIL][hs][ndb]);
+    sqlite3_reset(h->qb[QB_BUMPAVAIL][hs][ndb]);
+    sqlite3_finalize(q_isfree);
+    sqlite3_finalize(q_tail);
+    sqlite3_finalize(q_move);
+    sqlite3_finalize(q_setnext);
+    return ret;
+}
+
+int sx_hashfs_compact(sx_hashfs_t *h, unsigned int rate, int64_t *moved, int64_t *released) {
+    unsigned int i, j;
+    int lock, ret = -1;
+
+    if(!h || !moved || !released) {
+	NULLARG();
+	return -1;
+    }
+
+    /* Can run along with the node, not with offline maintenance */
+    if((lock = sx_storage_lock(h->dir, 0)) < 0)
+	return -1;
+    *moved = 0;
+    *released = 0;
+    for(j = 0; j < SIZES; j++) {
+	for(i = 0; i < h->hashdbs; i++) {
+	    int64_t m = 0, r = 0;
+	    if(compact_datafile(h, j, i, rate, &m, &r)) {
+		WARN("Failed to compact %s datafile %08x", sizelongnames[j], i);
+		goto compact_err;
+	    }
+	    if(m || r)
+		INFO("Compacted %s datafile %08x: %lld blocks moved, %lld bytes released", sizelongnames[j], i, (long long)m, (long long)r);
+	    *moved += m;
+	    *released += r;
+	}
+    }
+    ret = 0;
+
+compact_err:
+    sx_storage_unlock(lock);
+    return ret;
+}
+
+/* Rows hanging off a moved file or block: the parent id is bound as :id */
+static const struct {
+    const char *get, *put;
+    int ncols;
+} meta_refs[] = {
+    { "SELECT key, value FROM fmeta WHERE file_id = :id", "INSERT INTO fmeta (key, value, file_id) VALUES (:key, :value, :id)", 2 },
+    { "SELECT dest FROM relocs WHERE file_id = :id", "INSERT INTO relocs (dest, file_id) VALUES (:dest, :id)", 1 }
+}, block_refs[] = {
+    { "SELECT reserveid, ttl FROM reservations WHERE blockid = :id", "INSERT INTO reservations (reserveid, ttl, blockid) VALUES (:reserveid, :ttl, :id)", 2 },
+    { "SELECT tokenid, replica, op, ttl FROM operations WHERE blockid = :id", "INSERT INTO operations (tokenid, replica, op, ttl, blockid) VALUES (:tokenid, :replica, :op, :ttl, :id)", 4 },
+    { "SELECT replica, age, used FROM use WHERE blockid = :id", "INSERT INTO use (replica, age, used, blockid) VALUES (:replica, :age, :used, :id)", 3 },
+    { "SELECT blockid FROM gc_candidates WHERE blockid = :id", "INSERT OR IGNORE INTO gc_candidates (blockid) VALUES (:id)", 0 }
+};
+#define META_REFS (sizeof(meta_refs) / sizeof(meta_refs[0]))
+#define BLOCK_REFS (sizeof(block_refs) / sizeof(block_refs[0]))
+
+static int reshard_copy_cols(sqlite3_stmt *to, sqlite3_stmt *from, int first, int ncols) {
+    int i;
+    for(i = 0; i < ncols; i++) {
+	if(sqlite3_bind_value(to, i + 1, sqlite3_column_value(from, first + i)) != SQLITE_OK) {
+	    WARN("Failed to bind column %d: %s", first + i, sqlite3_errmsg(sqlite3_db_handle(to)));
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+static int reshard_copy_refs(sqlite3_stmt *get, sqlite3_stmt *put, int ncols, int64_t oldid, int64_t newid) {
+    int r;
+
+    sqlite3_reset(get);
+    if(qbind_int64(get, ":id", oldid))
+	return -1;
+    while((r = qstep(get)) == SQLITE_ROW) {
+	sqlite3_reset(put);
+	if(reshard_copy_cols(put, get, 0, ncols) || qbind_int64(put, ":id", newid) || qstep_noret(put))
+	    break;
+    }
+    sqlite3_reset(get);
+    return r == SQLITE_DONE ? 0 : -1;
+}
+
+static char *reshard_path(const char *dir, const char *name) {
+    char *path = wrap_malloc(strlen(dir) + strlen(name) + 2);
+    if(path)
+	sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+/* Drops a database together with its WAL and shared memory files */
+static void reshard_unlink(const char *path) {
+    static const char *sfx[] = { "", "-wal", "-shm" };
+    char *p = wrap_malloc(strlen(path) + 5);
+    unsigned int i;
+
+    if(!p)
+	return;
+    for(i = 0; i < sizeof(sfx) / sizeof(sfx[0]); i++) {
+	sprintf(p, "%s%s", path, sfx[i]);
+	if(unlink(p) && errno != ENOENT)
+	    PWARN("Failed to remove %s", p);
+    }
+    free(p);
+}
+
+/* Returns the full path to the file referenced by key in the hashfs kv table */
+static char *reshard_oldpath(sx_hashfs_t *h, const char *key) {
+    const char *str;
+    char *ret = NULL;
+
+    sqlite3_reset(h->q_getval);
+    if(qbind_text(h->q_getval, ":k", key) || qstep_ret(h->q_getval))
+	goto reshard_oldpath_err;
+    str = (const char *)sqlite3_column_text(h->q_getval, 0);
+    if(!str || !*str)
+	goto reshard_oldpath_err;
+    ret = *str == '/' ? wrap_strdup(str) : reshard_path(h->dir, str);
+
+reshard_oldpath_err:
+    sqlite3_reset(h->q_getval);
+    return ret;
+}
+
+/* Reads a single placement rule, *root is NULL if none is set */
+static int placement_get(sx_hashfs_t *h, const char *key, char **root) {
+    const char *str;
+    int r;
+
+    *root = NULL;
+    sqlite3_reset(h->q_getval);
+    if(qbind_text(h->q_getval, ":k", key))
+	return -1;
+    r = qstep(h->q_getval);
+    if(r == SQLITE_ROW && (str = (const char *)sqlite3_column_text(h->q_getval, 0)) && *str && !(*root = wrap_strdup(str)))
+	r = SQLITE_ERROR;
+    sqlite3_reset(h->q_getval);
+    return r == SQLITE_ROW || r == SQLITE_DONE ? 0 : -1;
+}
+
+/* The data root of a hash shard: per shard rules take precedence over per size rules;
+ * a per shard rule of "." pins the shard to the storage directory */
+static int placement_root(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, char **root) {
+    char key[64];
+
+    sprintf(key, "placement_%c_%08x", sizedirs[hs], ndb);
+    if(placement_get(h, key, root))
+	return -1;
+    if(*root)
+	return 0;
+    sprintf(key, "placement_%c", sizedirs[hs]);
+    return placement_get(h, key, root);
+}
+
+/* Returns where a file of a hash shard goes: the full path if abs is set, the kv value otherwise */
+static char *placement_path(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, const char *name, int abs) {
+    char *root, *ret;
+
+    if(placement_root(h, hs, ndb, &root))
+	return NULL;
+    if(root && strcmp(root, "."))
+	ret = reshard_path(root, name);
+    else
+	ret = abs ? reshard_path(h->dir, name) : wrap_strdup(name);
+    free(root);
+    return ret;
+}
+
+static int reshard_meta(sx_hashfs_t *h, unsigned int gen, unsigned int metadbs) {
+    sxi_db_t *db[METADBS_MAX];
+    sqlite3_stmt *q_ins[METADBS_MAX], *q_put[METADBS_MAX][META_REFS], *q_get[META_REFS], *q_list = NULL;
+    unsigned int i, k, n;
+    char name[64], *path;
+    int r, ret = -1;
+
+    memset(db, 0, sizeof(db));
+    memset(q_ins, 0, sizeof(q_ins));
+    memset(q_put, 0, sizeof(q_put));
+    memset(q_get, 0, sizeof(q_get));
+
+    for(k = 0; k < metadbs; k++) {
+	snprintf(name, sizeof(name), "f%08x-%u.db", k, gen);
+	if(!(path = reshard_path(h->dir, name)))
+	    goto reshard_meta_err;
+	reshard_unlink(path); /* Leftover of an aborted run */
+	r = create_metadb(path, k, &h->cluster_uuid, &db[k]);
+	free(path);
+	if(r)
+	    goto reshard_meta_err;
+	if(qprep(db[k], &q_ins[k], "INSERT INTO files (volume_id, name, size, rev, content) VALUES (:volume, :name, :size, :revision, :content)"))
+	    goto reshard_meta_err;
+	for(n = 0; n < META_REFS; n++)
+	    if(qprep(db[k], &q_put[k][n], meta_refs[n].put))
+		goto reshard_meta_err;
+	if(qbegin(db[k]))
+	    goto reshard_meta_err;
+    }
+
+    for(i = 0; i < h->metadbs; i++) {
+	int64_t nfiles = 0;
+
+	if(qprep(h->metadb[i], &q_list, "SELECT fid, volume_id, name, size, rev, content FROM files"))
+	    goto reshard_meta_err;
+	for(n = 0; n < META_REFS; n++)
+	    if(qprep(h->metadb[i], &q_get[n], meta_refs[n].get))
+		goto reshard_meta_err;
+
+	while((r = qstep(q_list)) == SQLITE_ROW) {
+	    const char *fname = (const char *)sqlite3_column_text(q_list, 2);
+	    int64_t fid = sqlite3_column_int64(q_list, 0), newfid;
+
+	    if(!fname) {
+		WARN("Bad file %lld in metadata database %u", (long long)fid, i);
+		goto reshard_meta_err;
+	    }
+	    k = nameshard(fname, metadbs);
+	    sqlite3_reset(q_ins[k]);
+	    if(reshard_copy_cols(q_ins[k], q_list, 1, 5) || qstep_noret(q_ins[k]))
+		goto reshard_meta_err;
+	    newfid = sqlite3_last_insert_rowid(sqlite3_db_handle(q_ins[k]));
+	    for(n = 0; n < META_REFS; n++)
+		if(reshard_copy_refs(q_get[n], q_put[k][n], meta_refs[n].ncols, fid, newfid))
+		    goto reshard_meta_err;
+	    nfiles++;
+	}
+	if(r != SQLITE_DONE)
+	    goto reshard_meta_err;
+
+	qnullify(q_list);
+	for(n = 0; n < META_REFS; n++)
+	    qnullify(q_get[n]);
+	INFO("Moved %lld files out of metadata database %u / %u", (long long)nfiles, i + 1, h->metadbs);
+    }
+
+    for(k = 0; k < metadbs; k++)
+	if(qcommit(db[k]))
+	    goto reshard_meta_err;
+    ret = 0;
+
+reshard_meta_err:
+    sqlite3_finalize(q_list);
+    for(n = 0; n < META_REFS; n++)
+	sqlite3_finalize(q_get[n]);
+    for(k = 0; k < metadbs; k++) {
+	sqlite3_finalize(q_ins[k]);
+	for(n = 0; n < META_REFS; n++)
+	    sqlite3_finalize(q_put[k][n]);
+	qclose(&db[k]);
+    }
+    return ret;
+}
+
+static int reshard_hash(sx_hashfs_t *h, unsigned int gen, unsigned int hashdbs, unsigned int hs) {
+    sxi_db_t *db[HASHDBS_MAX];
+    sqlite3_stmt *q_ins[HASHDBS_MAX], *q_put[HASHDBS_MAX][BLOCK_REFS], *q_get[BLOCK_REFS], *q_list = NULL, *q_setnext = NULL;
+    int64_t next[HASHDBS_MAX];
+    int fd[HASHDBS_MAX];
+    unsigned int i, k, n, bs = bsz[hs];
+    char name[64], *path;
+    int r, ret = -1;
+
+    memset(db, 0, sizeof(db));
+    memset(q_ins, 0, sizeof(q_ins));
+    memset(q_put, 0, sizeof(q_put));
+    memset(q_get, 0, sizeof(q_get));
+    memset(fd, -1, sizeof(fd));
+
+    for(k = 0; k < hashdbs; k++) {
+	snprintf(name, sizeof(name), "h%c%08x-%u.db", sizedirs[hs], k, gen);
+	if(!(path = placement_path(h, hs, k, name, 1)))
+	    goto reshard_hash_err;
+	reshard_unlink(path);
+	r = create_hashdb(path, hs, k, &h->cluster_uuid, &db[k]);
+	free(path);
+	if(r)
+	    goto reshard_hash_err;
+
+	snprintf(name, sizeof(name), "h%c%08x-%u.bin", sizedirs[hs], k, gen);
+	if(!(path = placement_path(h, hs, k, name, 1)))
+	    goto reshard_hash_err;
+	fd[k] = create_datafile(path, hs, k, &h->cluster_uuid);
+	free(path);
+	if(fd[k] < 0)
+	    goto reshard_hash_err;
+	next[k] = 1;
+
+	if(qprep(db[k], &q_ins[k], "INSERT INTO blocks (hash, created_at, blockno) VALUES (:hash, :created, :blockno)"))
+	    goto reshard_hash_err;
+	for(n = 0; n < BLOCK_REFS; n++)
+	    if(qprep(db[k], &q_put[k][n], block_refs[n].put))
+		goto reshard_hash_err;
+	if(qbegin(db[k]))
+	    goto reshard_hash_err;
+    }
+
+    for(i = 0; i < h->hashdbs; i++) {
+	int64_t nblocks = 0;
+
+	if(qprep(h->datadb[hs][i], &q_list, "SELECT id, hash, created_at, blockno FROM blocks"))
+	    goto reshard_hash_err;
+	for(n = 0; n < BLOCK_REFS; n++)
+	    if(qprep(h->datadb[hs][i], &q_get[n], block_refs[n].get))
+		goto reshard_hash_err;
+
+	while((r = qstep(q_list)) == SQLITE_ROW) {
+	    const sx_hash_t *hash = sqlite3_column_blob(q_list, 1);
+	    int64_t id = sqlite3_column_int64(q_list, 0), newid;
+
+	    if(!hash || sqlite3_column_bytes(q_list, 1) != sizeof(*hash)) {
+		WARN("Bad hash for block %lld in %s hash database %u", (long long)id, sizelongnames[hs], i);
+		goto reshard_hash_err;
+	    }
+	    k = hashshard(hash, hashdbs);
+	    sqlite3_reset(q_ins[k]);
+	    if(reshard_copy_cols(q_ins[k], q_list, 1, 2))
+		goto reshard_hash_err;
+	    if(sqlite3_column_type(q_list, 3) == SQLITE_NULL) {
+		/* Reserved but not yet uploaded */
+		if(qbind_null(q_ins[k], ":blockno"))
+		    goto reshard_hash_err;
+	    } else {
+		if(read_block(h->datafd[hs][i], h->blockbuf, sqlite3_column_int64(q_list, 3) * bs, bs) ||
+		   write_block(fd[k], h->blockbuf, next[k] * bs, bs)) {
+		    WARNHASH("Failed to move block", hash);
+		    goto reshard_hash_err;
+		}
+		if(qbind_int64(q_ins[k], ":blockno", next[k]))
+		    goto reshard_hash_err;
+		next[k]++;
+	    }
+	    if(qstep_noret(q_ins[k]))
+		goto reshard_hash_err;
+	    newid = sqlite3_last_insert_rowid(sqlite3_db_handle(q_ins[k]));
+	    for(n = 0; n < BLOCK_REFS; n++)
+		if(reshard_copy_refs(q_get[n], q_put[k][n], block_refs[n].ncols, id, newid))
+		    goto reshard_hash_err;
+	    nblocks++;
+	}
+	if(r != SQLITE_DONE)
+	    goto reshard_hash_err;
+
+	qnullify(q_list);
+	for(n = 0; n < BLOCK_REFS; n++)
+	    qnullify(q_get[n]);
+	INFO("Moved %lld blocks out of %s hash database %u / %u", (long long)nblocks, sizelongnames[hs], i + 1, h->hashdbs);
+    }
+
+    for(k = 0; k < hashdbs; k++) {
+	if(fdatasync(fd[k])) {
+	    PWARN("Failed to sync %s datafile %u", sizelongnames[hs], k);
+	    goto reshard_hash_err;
+	}
+	if(qprep(db[k], &q_setnext, "UPDATE hashfs SET value = :next WHERE key = 'next_blockno'") ||
+	   qbind_int64(q_setnext, ":next", next[k]) || qstep_noret(q_setnext) || qcommit(db[k]))
+	    goto reshard_hash_err;
+	qnullify(q_setnext);
+    }
+    ret = 0;
+
+reshard_hash_err:
+    sqlite3_finalize(q_setnext);
+    sqlite3_finalize(q_list);
+    for(n = 0; n < BLOCK_REFS; n++)
+	sqlite3_finalize(q_get[n]);
+    for(k = 0; k < hashdbs; k++) {
+	sqlite3_finalize(q_ins[k]);
+	for(n = 0; n < BLOCK_REFS; n++)
+	    sqlite3_finalize(q_put[k][n]);
+	qclose(&db[k]);
+	if(fd[k] >= 0)
+	    close(fd[k]);
+    }
+    return ret;
+}
+
+/* Points the hashfs kv table to the new shards, atomically */
+static int reshard_switch(sx_hashfs_t *h, unsigned int gen, unsigned int hashdbs, unsigned int metadbs) {
+    sqlite3_stmt *q_set = NULL, *q_del = NULL, *q;
+    unsigned int i, j, k, nmax;
+    char key[64], name[64], *val = NULL;
+    int ret = -1;
+
+    if(qprep(h->db, &q_set, "INSERT OR REPLACE INTO hashfs (key, value) VALUES (:k, :v)") ||
+       qprep(h->db, &q_del, "DELETE FROM hashfs WHERE key = :k"))
+	goto reshard_switch_err;
+    if(qbegin(h->db))
+	goto reshard_switch_err;
+
+    nmax = metadbs > h->metadbs ? metadbs : h->metadbs;
+    for(i = 0; i < nmax; i++) {
+	sprintf(key, "metadb_%08x", i);
+	sprintf(name, "f%08x-%u.db", i, gen);
+	q = i < metadbs ? q_set : q_del;
+	sqlite3_reset(q);
+	if(qbind_text(q, ":k", key) || (q == q_set && qbind_text(q, ":v", name)) || qstep_noret(q))
+	    goto reshard_switch_rollback;
+    }
+    nmax = hashdbs > h->hashdbs ? hashdbs : h->hashdbs;
+    for(j = 0; j < SIZES; j++) {
+	for(i = 0; i < nmax; i++) {
+	    q = i < hashdbs ? q_set : q_del;
+	    for(k = 0; k < 2; k++) {
+		sprintf(key, k ? "datafile_%c_%08x" : "hashdb_%c_%08x", sizedirs[j], i);
+		sprintf(name, k ? "h%c%08x-%u.bin" : "h%c%08x-%u.db", sizedirs[j], i, gen);
+		if(q == q_set && !(val = placement_path(h, j, i, name, 0)))
+		    goto reshard_switch_rollback;
+		sqlite3_reset(q);
+		if(qbind_text(q, ":k", key) || (q == q_set && qbind_text(q, ":v", val)) || qstep_noret(q))
+		    goto reshard_switch_rollback;
+		free(val);
+		val = NULL;
+	    }
+	}
+    }
+
+    sqlite3_reset(q_set);
+    if(qbind_text(q_set, ":k", "hashdbs") || qbind_int(q_set, ":v", hashdbs) || qstep_noret(q_set))
+	goto reshard_switch_rollback;
+    sqlite3_reset(q_set);
+    if(qbind_text(q_set, ":k", "metadbs") || qbind_int(q_set, ":v", metadbs) || qstep_noret(q_set))
+	goto reshard_switch_rollback;
+    sqlite3_reset(q_set);
+    if(qbind_text(q_set, ":k", "shard_generation") || qbind_int(q_set, ":v", gen) || qstep_noret(q_set))
+	goto reshard_switch_rollback;
+    sqlite3_reset(q_set);
+
+    if(qcommit(h->db))
+	goto reshard_switch_rollback;
+    ret = 0;
+    goto reshard_switch_err;
+
+reshard_switch_rollback:
+    qrollback(h->db);
+reshard_switch_err:
+    free(val);
+    sqlite3_finalize(q_set);
+    sqlite3_finalize(q_del);
+    return ret;
+}
+
+rc_ty sx_storage_reshard(const char *dir, sxc_client_t *sx, unsigned int hashdbs, unsigned int metadbs) {
+    unsigned int i, j, gen = 0, nold = 0;
+    char **old = NULL, key[64];
+    sx_hashfs_t *h = NULL;
+    rc_ty ret = FAIL_EINTERNAL;
+    int r, lock;
+
+    if(!dir) {
+	NULLARG();
+	return EFAULT;
+    }
+    if(!hashdbs || hashdbs > HASHDBS_MAX || !metadbs || metadbs > METADBS_MAX) {
+	msg_set_reason("Invalid number of database shards (must be between 1 and %u)", HASHDBS_MAX);
+	return EINVAL;
+    }
+
+    /* Files are replaced under the node's feet, it must be stopped */
+    if((lock = sx_storage_lock(dir, 1)) < 0)
+	return FAIL_LOCKED;
+    if(!(h = sx_hashfs_open(dir, sx))) {
+	sx_storage_unlock(lock);
+	return FAIL_EINIT;
+    }
+    if(h->hashdbs == hashdbs && h->metadbs == metadbs) {
+	INFO("Storage already uses %u hash and %u metadata databases", hashdbs, metadbs);
+	sx_hashfs_close(h);
+	sx_storage_unlock(lock);
+	return OK;
+    }
+
+    sqlite3_reset(h->q_getval);
+    if(qbind_text(h->q_getval, ":k", "shard_generation"))
+	goto reshard_err;
+    r = qstep(h->q_getval);
+    if(r == SQLITE_ROW)
+	gen = sqlite3_column_int(h->q_getval, 0);
+    else if(r != SQLITE_DONE)
+	goto reshard_err;
+    sqlite3_reset(h->q_getval);
+    gen++;
+
+    /* Remember where the current shards live, they are dropped once the switch is committed */
+    if(!(old = wrap_calloc(h->metadbs + SIZES * h->hashdbs * 2, sizeof(*old))))
+	goto reshard_err;
+    for(i = 0; i < h->metadbs; i++) {
+	sprintf(key, "metadb_%08x", i);
+	if(!(old[nold++] = reshard_oldpath(h, key)))
+	    goto reshard_err;
+    }
+    for(j = 0; j < SIZES; j++) {
+	for(i = 0; i < h->hashdbs; i++) {
+	    sprintf(key, "hashdb_%c_%08x", sizedirs[j], i);
+	    if(!(old[nold++] = reshard_oldpath(h, key)))
+		goto reshard_err;
+	    sprintf(key, "datafile_%c_%08x", sizedirs[j], i);
+	    if(!(old[nold++] = reshard_oldpath(h, key)))
+		goto reshard_err;
+	}
+    }
+
+    INFO("Resharding storage from %u/%u to %u/%u hash/metadata databases", h->hashdbs, h->metadbs, hashdbs, metadbs);
+    if(reshard_meta(h, gen, metadbs))
+	goto reshard_err;
+    for(j = 0; j < SIZES; j++)
+	if(reshard_hash(h, gen, hashdbs, j))
+	    goto reshard_err;
+    sync();
+    if(reshard_switch(h, gen, hashdbs, metadbs))
+	goto reshard_err;
+
+    sx_hashfs_close(h);
+    h = NULL;
+    for(i = 0; i < nold; i++)
+	reshard_unlink(old[i]);
+    ret = OK;
+
+reshard_err:
+    if(ret != OK)
+	msg_set_reason("Failed to reshard the storage, the node was left unchanged");
+    sx_hashfs_close(h);
+    sx_storage_unlock(lock);
+    if(old)
+	for(i = 0; i < nold; i++)
+	    free(old[i]);
+    free(old);
+    return ret;
+}
+
+/* Copies a shard file, leaving holes where the source has zeroed ranges */
+static int place_copy(const char *src, const char *dst) {
+    char buf[65536];
+    struct stat st;
+    int in, out = -1, ret = -1;
+    ssize_t r, w, i;
+
+    if((in = open(src, O_RDONLY)) < 0) {
+	PWARN("Failed to open %s", src);
+	return -1;
+    }
+    if(fstat(in, &st)) {
+	PWARN("Failed to stat %s", src);
+	goto place_copy_err;
+    }
+    if((out = open(dst, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777)) < 0) {
+	PWARN("Failed to create %s", dst);
+	goto place_copy_err;
+    }
+    while((r = read(in, buf, sizeof(buf)))) {
+	if(r < 0) {
+	    if(errno == EINTR)
+		continue;
+	    PWARN("Failed to read from %s", src);
+	    goto place_copy_err;
+	}
+	for(i = 0; i < r && !buf[i]; i++);
+	if(i == r) {
+	    if(lseek(out, r, SEEK_CUR) < 0) {
+		PWARN("Failed to seek in %s", dst);
+		goto place_copy_err;
+	    }
+	    continue;
+	}
+	for(i = 0; i < r; i += w) {
+	    if((w = write(out, buf + i, r - i)) < 0) {
+		if(errno == EINTR) {
+		    w = 0;
+		    continue;
+		}
+		PWARN("Failed to write to %s", dst);
+		goto place_copy_err;
+	    }
+	}
+    }
+    if(ftruncate(out, st.st_size) || fsync(out)) {
+	PWARN("Failed to sync %s", dst);
+	goto place_copy_err;
+    }
+    ret = 0;
+
+place_copy_err:
+    close(in);
+    if(out >= 0) {
+	if(close(out) && !ret) {
+	    PWARN("Failed to close %s", dst);
+	    ret = -1;
+	}
+	if(ret)
+	    unlink(dst);
+    }
+    return ret;
+}
+
+rc_ty sx_storage_place(const char *dir, sxc_client_t *sx, const char *rule) {
+    static const char *kinds[] = { "hashdb", "datafile" };
+    struct {
+	char key[64];
+	char *src, *dst;
+    } *mv = NULL;
+    char cls[32], key[64], *eq, *root = NULL, *realdir = NULL;
+    sqlite3_stmt *q_set = NULL, *q_rule = NULL;
+    unsigned int i, k, hs, nmv = 0, nmax = 0;
+    int shard = -1, lock = -1;
+    sx_hashfs_t *h = NULL;
+    struct stat st;
+    rc_ty ret = EINVAL;
 
-        if((r = extract_volume_files(h, vol, destpath, &restored, &nfiles)) < 0) {
-            WARN("Failed to restore files for volume %s", vol->name);
-        } else {
-            if(r > 0) {
-                WARN("Encountered %d error(s) during volume %s files extraction, restored %lld of %lld files ", r, vol->name,
-                    (long long)restored, (long long)nfiles);
-            } else if(nfiles > 0) {
-                INFO("All %lld files for volume %s were extracted successfully", (long long)nfiles, vol->name);
-            }
-        }
+    if(!dir || !rule) {
+	NULLARG();
+	return EFAULT;
+    }
 
-        if(rmdir(partdir) && errno != EEXIST && errno != ENOTEMPTY)
-            WARN("Failed to remove part files directory: %s", partdir);
+    /* CLASS[:SHARD]=DIR */
+    eq = strchr(rule, '=');
+    if(!eq || eq == rule || eq - rule >= sizeof(cls)) {
+	msg_set_reason("Invalid placement rule '%s' (expected CLASS[:SHARD]=DIR)", rule);
+	return EINVAL;
+    }
+    memcpy(cls, rule, eq - rule);
+    cls[eq - rule] = '\0';
+    if((eq = strchr(cls, ':'))) {
+	char *enumb;
+	*eq++ = '\0';
+	shard = strtol(eq, &enumb, 10);
+	if(!*eq || *enumb || shard < 0) {
+	    msg_set_reason("Invalid shard number '%s'", eq);
+	    return EINVAL;
+	}
+    }
+    for(hs = 0; hs < SIZES; hs++)
+	if(!strcmp(cls, sizelongnames[hs]) || (cls[0] == sizedirs[hs] && !cls[1]))
+	    break;
+    if(hs == SIZES) {
+	msg_set_reason("Invalid size class '%s' (must be small, medium or large)", cls);
+	return EINVAL;
+    }
 
-        free(partdir);
+    eq = strchr(rule, '=') + 1;
+    if(*eq != '/') {
+	msg_set_reason("The data root must be an absolute path");
+	return EINVAL;
+    }
+    if(!(root = realpath(eq, NULL))) {
+	msg_set_reason("Cannot use %s as a data root: %s", eq, strerror(errno));
+	goto place_err;
+    }
+    if(stat(root, &st) || !S_ISDIR(st.st_mode) || access(root, R_OK | W_OK | X_OK)) {
+	msg_set_reason("Cannot use %s as a data root: not a writable directory", root);
+	goto place_err;
+    }
+    if(!(realdir = realpath(dir, NULL))) {
+	msg_set_reason("Cannot resolve %s: %s", dir, strerror(errno));
+	goto place_err;
+    }
+    if(!strcmp(root, realdir)) {
+	/* Back to the storage directory */
+	free(root);
+	root = NULL;
     }
 
-    if(s != ITER_NO_MORE) {
-        WARN("Failed to iterate volumes");
-        goto sx_hashfs_extract_err;
+    /* Shard files are copied and removed, the node must be stopped */
+    if((lock = sx_storage_lock(dir, 1)) < 0) {
+	ret = FAIL_LOCKED;
+	goto place_err;
+    }
+    if(!(h = sx_hashfs_open(dir, sx))) {
+	ret = FAIL_EINIT;
+	goto place_err;
+    }
+    if(shard >= (int)h->hashdbs) {
+	msg_set_reason("Invalid shard number %d (the node has %u hash databases)", shard, h->hashdbs);
+	goto place_err;
     }
 
-    ret = 0;
+    ret = FAIL_EINTERNAL;
+    nmax = h->hashdbs * 2;
+    if(!(mv = wrap_calloc(nmax, sizeof(*mv))))
+	goto place_err;
+    for(i = 0; i < h->hashdbs; i++) {
+	if(shard >= 0 && i != shard)
+	    continue;
+	if(shard < 0) {
+	    /* Shards with a rule of their own stay where they are */
+	    char *own;
+	    sprintf(key, "placement_%c_%08x", sizedirs[hs], i);
+	    if(placement_get(h, key, &own))
+		goto place_err;
+	    free(own);
+	    if(own)
+		continue;
+	}
 
-sx_hashfs_extract_err:
-    /* Unlock all databases */
-    for(i = METADBS; i >= 0; i--) {
-        if(unlocks[i] && qstep_noret(unlocks[i]))
-	    WARN("Failed to unlock database");
-        sqlite3_finalize(locks[i]);
-        sqlite3_finalize(unlocks[i]);
+	/* Flush the WAL so that the database file alone is consistent */
+	if(sqlite3_wal_checkpoint_v2(h->datadb[hs][i]->handle, NULL, SQLITE_CHECKPOINT_FULL, NULL, NULL) != SQLITE_OK) {
+	    WARN("Failed to checkpoint %s hash database %u: %s", sizelongnames[hs], i, sqlite3_errmsg(h->datadb[hs][i]->handle));
+	    goto place_err;
+	}
+	for(k = 0; k < 2; k++) {
+	    sprintf(mv[nmv].key, "%s_%c_%08x", kinds[k], sizedirs[hs], i);
+	    if(!(mv[nmv].src = reshard_oldpath(h, mv[nmv].key)) ||
+	       !(mv[nmv].dst = reshard_path(root ? root : h->dir, strrchr(mv[nmv].src, '/') + 1)))
+		goto place_err;
+	    if(!strcmp(mv[nmv].src, mv[nmv].dst)) {
+		free(mv[nmv].src);
+		free(mv[nmv].dst);
+		mv[nmv].src = mv[nmv].dst = NULL;
+		continue;
+	    }
+	    INFO("Moving %s to %s", mv[nmv].src, mv[nmv].dst);
+	    if(place_copy(mv[nmv].src, mv[nmv].dst))
+		goto place_err;
+	    nmv++;
+	}
     }
 
+    /* Record the rule and the new locations at once */
+    if(shard >= 0)
+	sprintf(key, "placement_%c_%08x", sizedirs[hs], shard);
+    else
+	sprintf(key, "placement_%c", sizedirs[hs]);
+    /* A shard moved back to the storage directory keeps a rule of its own,
+     * so that it doesn't follow the class rule while its files stay here */
+    if(qprep(h->db, &q_set, "INSERT OR REPLACE INTO hashfs (key, value) VALUES (:k, :v)") ||
+       qprep(h->db, &q_rule, root || shard >= 0 ? "INSERT OR REPLACE INTO hashfs (key, value) VALUES (:k, :v)" : "DELETE FROM hashfs WHERE key = :k") ||
+       qbind_text(q_rule, ":k", key) || ((root || shard >= 0) && qbind_text(q_rule, ":v", root ? root : ".")))
+	goto place_err;
+    if(qbegin(h->db))
+	goto place_err;
+    if(qstep_noret(q_rule))
+	goto place_rollback;
+    for(i = 0; i < nmv; i++) {
+	sqlite3_reset(q_set);
+	if(qbind_text(q_set, ":k", mv[i].key) ||
+	   qbind_text(q_set, ":v", root ? mv[i].dst : strrchr(mv[i].dst, '/') + 1) ||
+	   qstep_noret(q_set))
+	    goto place_rollback;
+    }
+    if(qcommit(h->db))
+	goto place_rollback;
+    if(shard >= 0)
+	INFO("Placed %s shard %d in %s (%u files moved)", sizelongnames[hs], shard, root ? root : h->dir, nmv);
+    else
+	INFO("Placed %s shards in %s (%u files moved)", sizelongnames[hs], root ? root : h->dir, nmv);
+    ret = OK;
+    goto place_err;
+
+place_rollback:
+    qrollback(h->db);
+place_err:
+    sqlite3_finalize(q_set);
+    sqlite3_finalize(q_rule);
+    sx_hashfs_close(h);
+    if(mv) {
+	for(i = 0; i < nmax; i++) {
+	    /* Drop the originals on success, the copies otherwise */
+	    if(i < nmv) {
+		if(ret == OK)
+		    reshard_unlink(mv[i].src);
+		else
+		    unlink(mv[i].dst);
+	    }
+	    free(mv[i].src);
+	    free(mv[i].dst);
+	}
+	free(mv);
+    }
+    sx_storage_unlock(lock);
+    free(root);
+    free(realdir);
     return ret;
 }
 
@@ -3767,11 +4966,11 @@ rc_ty sx_hashfs_revision_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume,
 	return EINVAL;
     }
 
-    h->rev_ndb = getmetadb(name);
+    h->rev_ndb = getmetadb(h, name);
     if(h->rev_ndb < 0)
 	return FAIL_EINTERNAL;
 
-    q = (reversed ? h->qm_listrevs_rev[h->rev_ndb] : h->qm_listrevs[h->rev_ndb]);
+    q = (reversed ? qm_stmt(h, QM_LISTREVS_REV, h->rev_ndb) : qm_stmt(h, QM_LISTREVS, h->rev_ndb));
     sqlite3_reset(q);
 
     if(qbind_int64(q, ":volume", volume->id) ||
@@ -3787,7 +4986,7 @@ rc_ty sx_hashfs_revision_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume,
 
 
 rc_ty sx_hashfs_revision_next(sx_hashfs_t *h, int reversed) {
-    sqlite3_stmt *q = (reversed ? h->qm_listrevs_rev[h->rev_ndb] : h->qm_listrevs[h->rev_ndb]);
+    sqlite3_stmt *q = (reversed ? qm_stmt(h, QM_LISTREVS_REV, h->rev_ndb) : qm_stmt(h, QM_LISTREVS, h->rev_ndb));
     const char *revision;
     int r;
 
@@ -3828,6 +5027,272 @@ static inline int has_wildcard(const char *str)
     return strcspn(str, "*?[") < strlen(str);
 }
 
+/* Drops the built mark so that the index for the volume is rebuilt by the gc;
+ * this also makes any build in progress fail */
+static void listidx_invalidate(sx_hashfs_t *h, int64_t volume_id) {
+    sqlite3_reset(h->q_listidx_unbuilt);
+    if(qbind_int64(h->q_listidx_unbuilt, ":volume", volume_id) ||
+       qstep_noret(h->q_listidx_unbuilt))
+	WARN("Failed to invalidate listing index for volume %lld", (long long)volume_id);
+    sqlite3_reset(h->q_listidx_unbuilt);
+}
+
+/* Copies the current state of a file from its meta database into the index */
+static int listidx_sync(sx_hashfs_t *h, int64_t volume_id, const char *name, int mdb) {
+    sqlite3_stmt *q = qm_stmt(h, QM_LISTIDX_NAME, mdb), *qset;
+    int64_t revs;
+    int ret = -1;
+
+    sqlite3_reset(q);
+    if(qbind_int64(q, ":volume", volume_id) ||
+       qbind_text(q, ":name", name) ||
+       qstep_ret(q))
+	goto listidx_sync_err;
+
+    revs = sqlite3_column_int64(q, 2);
+    if(revs) {
+	qset = h->q_listidx_set;
+	sqlite3_reset(qset);
+	if(qbind_int64(qset, ":size", sqlite3_column_int64(q, 0)) ||
+	   qbind_text(qset, ":rev", (const char *)sqlite3_column_text(q, 1)) ||
+	   qbind_int64(qset, ":revs", revs))
+	    goto listidx_sync_err;
+    } else {
+	qset = h->q_listidx_del;
+	sqlite3_reset(qset);
+    }
+    if(qbind_int64(qset, ":volume", volume_id) ||
+       qbind_text(qset, ":name", name) ||
+       qstep_noret(qset))
+	goto listidx_sync_err;
+
+    ret = 0;
+
+ listidx_sync_err:
+    sqlite3_reset(q);
+    sqlite3_reset(h->q_listidx_set);
+    sqlite3_reset(h->q_listidx_del);
+    return ret;
+}
+
+/* Syncs the index entry for a file with its meta database: must be called
+ * after any change to the file revisions has been committed.
+ * The meta database is read with the hashfs db locked, so that when several
+ * processes change the same file the last one to get here reads (and writes)
+ * the latest state.
+ * While the volume index is being built the name is also logged, so that
+ * the build can redo it once it is done with its (possibly stale) scan */
+static void listidx_refresh(sx_hashfs_t *h, int64_t volume_id, const char *name, int mdb) {
+    int ret;
+
+    if(!h->have_listidx)
+	return;
+
+    if(qbegin(h->db)) {
+	WARN("Failed to update listing index for file %s on volume %lld", name, (long long)volume_id);
+	listidx_invalidate(h, volume_id);
+	return;
+    }
+    ret = listidx_sync(h, volume_id, name, mdb);
+    if(!ret) {
+	sqlite3_reset(h->q_listidx_dirty);
+	if(qbind_int64(h->q_listidx_dirty, ":volume", volume_id) ||
+	   qbind_text(h->q_listidx_dirty, ":name", name) ||
+	   qstep_noret(h->q_listidx_dirty))
+	    ret = -1;
+	sqlite3_reset(h->q_listidx_dirty);
+    }
+    if(!ret && qcommit(h->db))
+	ret = -1;
+    if(ret) {
+	qrollback(h->db);
+	WARN("Failed to update listing index for file %s on volume %lld", name, (long long)volume_id);
+	listidx_invalidate(h, volume_id);
+    }
+}
+
+static void listidx_wipe(sx_hashfs_t *h, int64_t volume_id) {
+    if(!h->have_listidx)
+	return;
+
+    sqlite3_reset(h->q_listidx_wipe);
+    if(qbind_int64(h->q_listidx_wipe, ":volume", volume_id) ||
+       qstep_noret(h->q_listidx_wipe))
+	WARN("Failed to wipe listing index for volume %lld", (long long)volume_id);
+    sqlite3_reset(h->q_listidx_wipe);
+    /* Wiped entries are not logged, so a build in progress must start over */
+    listidx_invalidate(h, volume_id);
+}
+
+#define LISTIDX_BATCH 1024
+
+/* Builds the index for a volume while listings keep using the meta databases.
+ * The volume is marked as being built, the meta databases are scanned into the
+ * index in short hashfs transactions and finally, in a single transaction, the
+ * files changed in the meantime are synced again and the volume is marked as
+ * built. The build fails if the volume is invalidated while it runs. */
+static rc_ty listidx_build(sx_hashfs_t *h, int64_t volume_id, const char *volume, int *terminate) {
+    sqlite3_stmt *q = NULL, *qmark = NULL, *qdone = NULL, *qclean = NULL;
+    int64_t nfiles = 0;
+    rc_ty ret = FAIL_EINTERNAL;
+    int i, r, intrans = 0;
+
+    INFO("Building listing index for volume %s", volume);
+    if(qprep(h->db, &qmark, "INSERT OR REPLACE INTO listvols (volume_id, built) VALUES (:volume, 0)") ||
+       qprep(h->db, &qdone, "UPDATE listvols SET built = 1 WHERE volume_id = :volume AND built = 0") ||
+       qprep(h->db, &qclean, "DELETE FROM listdirty WHERE volume_id = :volume") ||
+       qbind_int64(qmark, ":volume", volume_id) ||
+       qbind_int64(qdone, ":volume", volume_id) ||
+       qbind_int64(qclean, ":volume", volume_id))
+	goto listidx_build_err;
+
+    if(qbegin(h->db))
+	goto listidx_build_err;
+    intrans = 1;
+    sqlite3_reset(h->q_listidx_wipe);
+    if(qstep_noret(qmark) ||
+       qstep_noret(qclean) ||
+       qbind_int64(h->q_listidx_wipe, ":volume", volume_id) ||
+       qstep_noret(h->q_listidx_wipe) ||
+       qcommit(h->db))
+	goto listidx_build_err;
+    intrans = 0;
+    sqlite3_reset(h->q_listidx_wipe);
+
+    for(i=0; i<h->metadbs; i++) {
+	if(qprep(h->metadb[i], &q, "SELECT name, size, MAX(rev), COUNT(*) FROM files WHERE volume_id = :volume GROUP BY name") ||
+	   qbind_int64(q, ":volume", volume_id))
+	    goto listidx_build_err;
+	while((r = qstep(q)) == SQLITE_ROW) {
+	    if(!intrans) {
+		if(qbegin(h->db))
+		    goto listidx_build_err;
+		intrans = 1;
+	    }
+	    sqlite3_reset(h->q_listidx_set);
+	    if(qbind_int64(h->q_listidx_set, ":volume", volume_id) ||
+	       qbind_text(h->q_listidx_set, ":name", (const char *)sqlite3_column_text(q, 0)) ||
+	       qbind_int64(h->q_listidx_set, ":size", sqlite3_column_int64(q, 1)) ||
+	       qbind_text(h->q_listidx_set, ":rev", (const char *)sqlite3_column_text(q, 2)) ||
+	       qbind_int64(h->q_listidx_set, ":revs", sqlite3_column_int64(q, 3)) ||
+	       qstep_noret(h->q_listidx_set))
+		goto listidx_build_err;
+	    if(!(++nfiles % LISTIDX_BATCH)) {
+		if(qcommit(h->db))
+		    goto listidx_build_err;
+		intrans = 0;
+		if(terminate && *terminate)
+		    break;
+	    }
+	}
+	if(terminate && *terminate)
+	    goto listidx_build_err;
+	if(r != SQLITE_DONE)
+	    goto listidx_build_err;
+	qnullify(q);
+	if(intrans) {
+	    if(qcommit(h->db))
+		goto listidx_build_err;
+	    intrans = 0;
+	}
+    }
+
+    if(qbegin(h->db))
+	goto listidx_build_err;
+    intrans = 1;
+    if(qprep(h->db, &q, "SELECT name FROM listdirty WHERE volume_id = :volume") ||
+       qbind_int64(q, ":volume", volume_id))
+	goto listidx_build_err;
+    while((r = qstep(q)) == SQLITE_ROW) {
+	const char *name = (const char *)sqlite3_column_text(q, 0);
+	if(listidx_sync(h, volume_id, name, getmetadb(h, name)))
+	    goto listidx_build_err;
+    }
+    if(r != SQLITE_DONE)
+	goto listidx_build_err;
+    qnullify(q);
+    if(qstep_noret(qdone))
+	goto listidx_build_err;
+    if(sqlite3_changes(h->db->handle) != 1) {
+	INFO("Listing index for volume %s was invalidated while being built", volume);
+	ret = EAGAIN;
+	goto listidx_build_err;
+    }
+    sqlite3_reset(qclean);
+    if(qstep_noret(qclean) || qcommit(h->db))
+	goto listidx_build_err;
+    intrans = 0;
+
+    INFO("Listing index for volume %s built with %lld files", volume, (long long)nfiles);
+    ret = OK;
+
+ listidx_build_err:
+    sqlite3_finalize(q);
+    sqlite3_finalize(qmark);
+    sqlite3_finalize(qdone);
+    sqlite3_finalize(qclean);
+    sqlite3_reset(h->q_listidx_wipe);
+    sqlite3_reset(h->q_listidx_set);
+    if(intrans)
+	qrollback(h->db);
+    if(ret == FAIL_EINTERNAL && !(terminate && *terminate))
+	WARN("Failed to build listing index for volume %s", volume);
+    return ret;
+}
+
+/* Builds the listing index of every volume that doesn't have one yet.
+ * Runs from the gc, listings use the meta databases until a volume is done */
+rc_ty sx_hashfs_listidx_build(sx_hashfs_t *h, int *terminate) {
+    sqlite3_stmt *q = NULL;
+    int64_t volid = -1;
+    rc_ty ret = OK;
+
+    if(!list_index || !h->have_listidx)
+	return OK;
+
+    if(qprep(h->db, &q, "SELECT vid, volume FROM volumes WHERE vid > :previous AND vid NOT IN (SELECT volume_id FROM listvols WHERE built = 1) ORDER BY vid ASC LIMIT 1"))
+	return FAIL_EINTERNAL;
+    while(!(terminate && *terminate)) {
+	char volume[SXLIMIT_MAX_VOLNAME_LEN + 1];
+	int r;
+
+	sqlite3_reset(q);
+	if(qbind_int64(q, ":previous", volid)) {
+	    ret = FAIL_EINTERNAL;
+	    break;
+	}
+	r = qstep(q);
+	if(r == SQLITE_DONE)
+	    break;
+	if(r != SQLITE_ROW) {
+	    ret = FAIL_EINTERNAL;
+	    break;
+	}
+	volid = sqlite3_column_int64(q, 0);
+	sxi_strlcpy(volume, (const char *)sqlite3_column_text(q, 1), sizeof(volume));
+	sqlite3_reset(q);
+	if(listidx_build(h, volid, volume, terminate) == FAIL_EINTERNAL)
+	    ret = FAIL_EINTERNAL;
+    }
+    sqlite3_finalize(q);
+    return ret;
+}
+
+/* Returns 1 if listings of the volume can be served from the index */
+static int listidx_usable(sx_hashfs_t *h, const sx_hashfs_volume_t *volume) {
+    int r;
+
+    if(!list_index || !h->have_listidx)
+	return 0;
+
+    sqlite3_reset(h->q_listidx_built);
+    if(qbind_int64(h->q_listidx_built, ":volume", volume->id))
+	return 0;
+    r = qstep(h->q_listidx_built);
+    sqlite3_reset(h->q_listidx_built);
+    return r == SQLITE_ROW;
+}
+
 rc_ty sx_hashfs_list_etag(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const char *pattern, int8_t recurse, sx_hash_t *etag)
 {
     sxi_md_ctx *hash_ctx = sxi_md_init();
@@ -3835,6 +5300,7 @@ rc_ty sx_hashfs_list_etag(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, cons
     unsigned i;
     char *vol_newest;
     int64_t total = 0;
+    int fromidx = 0;
 
     if (!h || !volume || !pattern || !etag) {
         NULLARG();
@@ -3842,19 +5308,37 @@ rc_ty sx_hashfs_list_etag(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, cons
     }
     if (!(vol_newest = wrap_strdup("")))
         rc = ENOMEM;
-    for (i=0;i<METADBS && !rc;i++) {
-        sqlite3_reset(h->qm_newest[i]);
-        sqlite3_reset(h->qm_count[i]);
-        if (qbind_int(h->qm_newest[i], ":volid", volume->id) ||
-            qbind_int(h->qm_count[i], ":volid", volume->id) ||
-            qstep_ret(h->qm_newest[i]) ||
-            qstep_ret(h->qm_count[i])) {
+    if (!rc && listidx_usable(h, volume)) {
+        /* same values as the per database loop below, from a single query */
+        sqlite3_reset(h->q_listidx_etag);
+        if (qbind_int64(h->q_listidx_etag, ":volume", volume->id) ||
+            qstep_ret(h->q_listidx_etag)) {
+            rc = FAIL_EINTERNAL;
+        } else {
+            const char *newest = (const char*)sqlite3_column_text(h->q_listidx_etag, 0);
+            total = sqlite3_column_int64(h->q_listidx_etag, 1);
+            if (newest) {
+                free(vol_newest);
+                if (!(vol_newest = wrap_strdup(newest)))
+                    rc = ENOMEM;
+            }
+        }
+        sqlite3_reset(h->q_listidx_etag);
+        fromidx = 1;
+    }
+    for (i=0;i<h->metadbs && !rc && !fromidx;i++) {
+        sqlite3_reset(h->qm[QM_NEWEST][i]);
+        sqlite3_reset(h->qm[QM_COUNT][i]);
+        if (qbind_int(qm_stmt(h, QM_NEWEST, i), ":volid", volume->id) ||
+            qbind_int(qm_stmt(h, QM_COUNT, i), ":volid", volume->id) ||
+            qstep_ret(qm_stmt(h, QM_NEWEST, i)) ||
+            qstep_ret(qm_stmt(h, QM_COUNT, i))) {
             rc = FAIL_EINTERNAL;
         } else {
             /* detects newly created or updated files */
-            const char *newest = (const char*)sqlite3_column_text(h->qm_newest[i], 0);
+            const char *newest = (const char*)sqlite3_column_text(qm_stmt(h, QM_NEWEST, i), 0);
             /* detects deleted files */
-            total += sqlite3_column_int64(h->qm_count[i], 0);
+            total += sqlite3_column_int64(qm_stmt(h, QM_COUNT, i), 0);
             if (newest) {
                 if (strcmp(newest, vol_newest) > 0) {
                     free(vol_newest);
@@ -3863,8 +5347,8 @@ rc_ty sx_hashfs_list_etag(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, cons
                 }
             }
         }
-        sqlite3_reset(h->qm_newest[i]);
-        sqlite3_reset(h->qm_count[i]);
+        sqlite3_reset(h->qm[QM_NEWEST][i]);
+        sqlite3_reset(h->qm[QM_COUNT][i]);
     }
     if (!hash_ctx) {
         WARN("failed to initialize etag hash");
@@ -3984,10 +5468,11 @@ rc_ty sx_hashfs_list_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, con
     h->list_file.lastname[0] = '\0';
     h->list_recurse = recurse;
     h->list_volid = volume->id;
+    h->list_fromidx = listidx_usable(h, volume);
     if(file)
 	*file = &h->list_file;
 
-    memset(h->qm_list_done, 0, METADBS);
+    memset(h->qm_list_done, 0, h->metadbs);
 
     /* For debugging */
     h->qm_list_queries = 0;
@@ -3995,6 +5480,56 @@ rc_ty sx_hashfs_list_first(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, con
     return sx_hashfs_list_next(h);
 }
 
+/* Fetches the next entry from the listing index into list_file.
+ * Returns 1 if found, 0 when there are no more entries, -1 on error */
+static int list_next_fromidx(sx_hashfs_t *h) {
+    sqlite3_stmt *q = h->q_listidx_get;
+    const char *n, *revision;
+    int r, ret = -1;
+
+    sqlite3_reset(q);
+    if(qbind_int64(q, ":volume", h->list_volid) ||
+       qbind_text(q, ":previous", h->list_file.itername))
+	return -1;
+
+    h->qm_list_queries++;
+    r = qstep(q);
+    if(r == SQLITE_DONE) {
+	sqlite3_reset(q);
+	return 0;
+    }
+    if(r != SQLITE_ROW)
+	goto list_next_fromidx_err;
+
+    n = (const char *)sqlite3_column_text(q, 0);
+    if(!n) {
+	WARN("Cannot list NULL filename on listing index");
+	goto list_next_fromidx_err;
+    }
+
+    if(h->list_file.itername_limit[0] != '\0' && strncmp(n, h->list_file.itername_limit, h->list_file.itername_limit_len) >= 0) {
+	ret = 0;
+	goto list_next_fromidx_err;
+    }
+
+    h->list_file.name[0] = '/';
+    sxi_strlcpy(h->list_file.name+1, n, sizeof(h->list_file.name)-1);
+    h->list_file.file_size = sqlite3_column_int64(q, 1);
+    h->list_file.nblocks = size_to_blocks(h->list_file.file_size, NULL, &h->list_file.block_size);
+
+    revision = (const char *)sqlite3_column_text(q, 2);
+    if(!revision || parse_revision(revision, &h->list_file.created_at)) {
+	WARN("Bad revision found on file %s, volid %lld", h->list_file.name, (long long)h->list_volid);
+	goto list_next_fromidx_err;
+    }
+    sxi_strlcpy(h->list_file.revision, revision, sizeof(h->list_file.revision));
+    ret = 1;
+
+ list_next_fromidx_err:
+    sqlite3_reset(q);
+    return ret;
+}
+
 rc_ty sx_hashfs_list_next(sx_hashfs_t *h) {
     int found, list_ndb, match_failed;
     int ret = OK;
@@ -4003,18 +5538,25 @@ rc_ty sx_hashfs_list_next(sx_hashfs_t *h) {
 
     do {
 	found = 0;
-	for(list_ndb=0; list_ndb < METADBS; list_ndb++) {
+	if(h->list_fromidx) {
+	    found = list_next_fromidx(h);
+	    if(found < 0) {
+		ret = FAIL_EINTERNAL;
+		break;
+	    }
+	}
+	for(list_ndb=0; list_ndb < h->metadbs && !h->list_fromidx; list_ndb++) {
             if(h->qm_list_done[list_ndb])
                 continue;
 
-	    sqlite3_reset(h->qm_list[list_ndb]);
-	    if(qbind_int64(h->qm_list[list_ndb], ":volume", h->list_volid) ||
-	       qbind_text(h->qm_list[list_ndb], ":previous", h->list_file.itername)) {
+	    sqlite3_reset(h->qm[QM_LIST][list_ndb]);
+	    if(qbind_int64(qm_stmt(h, QM_LIST, list_ndb), ":volume", h->list_volid) ||
+	       qbind_text(qm_stmt(h, QM_LIST, list_ndb), ":previous", h->list_file.itername)) {
                 ret = FAIL_EINTERNAL;
                 break;
             }
 
-	    int r = qstep(h->qm_list[list_ndb]);
+	    int r = qstep(qm_stmt(h, QM_LIST, list_ndb));
 
             /* For debugging, can be removed */
             h->qm_list_queries++;
@@ -4027,7 +5569,7 @@ rc_ty sx_hashfs_list_next(sx_hashfs_t *h) {
                 break;
             }
 
-	    const char *n = (char *)sqlite3_column_text(h->qm_list[list_ndb], 0);
+	    const char *n = (char *)sqlite3_column_text(qm_stmt(h, QM_LIST, list_ndb), 0);
 	    if(!n) {
 		WARN("Cannot list NULL filename on meta database %u", list_ndb);
                 ret = FAIL_EINTERNAL;
@@ -4044,10 +5586,10 @@ rc_ty sx_hashfs_list_next(sx_hashfs_t *h) {
 		h->list_file.name[0] = '/';
 		sxi_strlcpy(h->list_file.name+1, n, sizeof(h->list_file.name)-1);
 
-		h->list_file.file_size = sqlite3_column_int64(h->qm_list[list_ndb], 1);
+		h->list_file.file_size = sqlite3_column_int64(qm_stmt(h, QM_LIST, list_ndb), 1);
 		h->list_file.nblocks = size_to_blocks(h->list_file.file_size, NULL, &h->list_file.block_size);
 
-		const char *revision = (const char *)sqlite3_column_text(h->qm_list[list_ndb], 2);
+		const char *revision = (const char *)sqlite3_column_text(qm_stmt(h, QM_LIST, list_ndb), 2);
 		if(!revision || parse_revision(revision, &h->list_file.created_at)) {
 		    WARN("Bad revision found on file %s, volid %lld", h->list_file.name, (long long)h->list_volid);
 		    ret = FAIL_EINTERNAL;
@@ -4056,7 +5598,7 @@ rc_ty sx_hashfs_list_next(sx_hashfs_t *h) {
 		    sxi_strlcpy(h->list_file.revision, revision, sizeof(h->list_file.revision));
 		}
 	    }
-	    sqlite3_reset(h->qm_list[list_ndb]);
+	    sqlite3_reset(h->qm[QM_LIST][list_ndb]);
 	}
         if (ret)
             break;
@@ -4103,8 +5645,8 @@ rc_ty sx_hashfs_list_next(sx_hashfs_t *h) {
         /* only continue if pattern matched, and it is a new file / directory */
     } while (match_failed || !strcmp(h->list_file.lastname, h->list_file.name));
 
-    for(list_ndb=0; list_ndb < METADBS; list_ndb++) {
-        sqlite3_reset(h->qm_list[list_ndb]);
+    for(list_ndb=0; list_ndb < h->metadbs; list_ndb++) {
+        sqlite3_reset(h->qm[QM_LIST][list_ndb]);
     }
     if (ret)
         return ret;
@@ -4892,7 +6434,7 @@ rc_ty sx_hashfs_volume_disable(sx_hashfs_t *h, const char *volume) {
 	ret = FAIL_EINTERNAL;
 	goto volume_disable_err;
     }
-    for(mdb=0; mdb<METADBS; mdb++) {
+    for(mdb=0; mdb<h->metadbs; mdb++) {
 	if(qbegin(h->metadb[mdb])) {
 	    ret = FAIL_EINTERNAL;
 	    goto volume_disable_err;
@@ -5171,9 +6713,9 @@ rc_ty sx_hashfs_volume_by_id(sx_hashfs_t *h, int64_t volid, const sx_hashfs_volu
 
 static void sx_hashfs_getfile_reset(sx_hashfs_t *h)
 {
-    if(h->get_ndb < METADBS) {
-	sqlite3_reset(h->qm_get[h->get_ndb]);
-	sqlite3_reset(h->qm_getrev[h->get_ndb]);
+    if(h->get_ndb < h->metadbs) {
+	sqlite3_reset(h->qm[QM_GET][h->get_ndb]);
+	sqlite3_reset(h->qm[QM_GETREV][h->get_ndb]);
     }
 }
 
@@ -5197,7 +6739,7 @@ rc_ty sx_hashfs_getfile_begin(sx_hashfs_t *h, const char *volume, const char *fi
 	return EINVAL;
     }
 
-    h->get_ndb = getmetadb(filename);
+    h->get_ndb = getmetadb(h, filename);
     if(h->get_ndb < 0)
 	return FAIL_EINTERNAL;
     /* reset current getfile queries */
@@ -5208,11 +6750,11 @@ rc_ty sx_hashfs_getfile_begin(sx_hashfs_t *h, const char *volume, const char *fi
 	    msg_set_reason("Invalid file name");
 	    return EINVAL;
 	}
-	q = h->qm_getrev[h->get_ndb];
+	q = qm_stmt(h, QM_GETREV, h->get_ndb);
 	if(qbind_text(q, ":revision", revision))
 	    return FAIL_EINTERNAL;
     } else
-	q = h->qm_get[h->get_ndb];
+	q = qm_stmt(h, QM_GET, h->get_ndb);
 
     if(qbind_int64(q, ":volume", vol->id) || qbind_text(q, ":name", filename))
 	return FAIL_EINTERNAL;
@@ -5294,64 +6836,108 @@ void sx_hashfs_getfile_end(sx_hashfs_t *h) {
     sx_hashfs_getfile_reset(h);
     h->get_content = NULL;
     h->get_nblocks = 0;
-    h->get_ndb = METADBS;
+    h->get_ndb = h->metadbs;
 }
 
-rc_ty sx_hashfs_block_get(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash, const uint8_t **block) {
-    unsigned int ndb = gethashdb(hash), hs;
-    uint64_t dboff;
+/* Finds the datafile slot of a block: on success sets the datafile indexes
+ * and, if offset is not NULL, the position of the block in the datafile */
+static rc_ty block_lookup(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash, unsigned int *hs, unsigned int *ndb, uint64_t *offset) {
+    sqlite3_stmt *q;
     int r;
 
-    for(hs = 0; hs < SIZES; hs++)
-	if(bsz[hs] == bs)
+    for(*hs = 0; *hs < SIZES; (*hs)++)
+	if(bsz[*hs] == bs)
 	    break;
-    if(hs == SIZES) {
+    if(*hs == SIZES) {
 	WARN("bad blocksize: %d", bs);
 	return FAIL_BADBLOCKSIZE;
     }
+    *ndb = gethashdb(h, hash);
 
-    sqlite3_reset(h->qb_get[hs][ndb]);
-    if(qbind_blob(h->qb_get[hs][ndb], ":hash", hash, sizeof(*hash)))
+    q = qb_stmt(h, QB_GET, *hs, *ndb);
+    sqlite3_reset(q);
+    if(qbind_blob(q, ":hash", hash, sizeof(*hash)))
 	return FAIL_EINTERNAL;
 
-    r = qstep(h->qb_get[hs][ndb]);
+    r = qstep(q);
+    if(r == SQLITE_ROW && offset)
+	*offset = sqlite3_column_int64(q, 0) * bs;
+    sqlite3_reset(q);
     if(r == SQLITE_DONE) {
-	char thash[41];
 	DEBUG("Hash not in database");
-	sqlite3_reset(h->qb_get[hs][ndb]);
-	bin2hex(hash->b, 20, thash, 41);
-/*        WARN("{%s}: hash %s missing",
-	     sx_node_internal_addr(sx_nodelist_get(h->nodes, h->thisnode)), thash);*/
 	return ENOENT;
     }
-    if(r != SQLITE_ROW) {
-	sqlite3_reset(h->qb_get[hs][ndb]);
+    if(r != SQLITE_ROW)
 	return FAIL_EINTERNAL;
-    }
-    if(!block) {
-	sqlite3_reset(h->qb_get[hs][ndb]);
+    return OK;
+}
+
+#define BLOCK_GET_RETRIES 4
+
+rc_ty sx_hashfs_block_get(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash, const uint8_t **block) {
+    unsigned int ndb, hs, tries;
+    uint64_t dboff, curoff;
+    rc_ty ret;
+    int err;
+
+    /* Presence checks always go to the database, only data is cached */
+    if(block && sx_blockcache_get(bs, hash, h->blockbuf)) {
+	*block = h->blockbuf;
 	return OK;
     }
-    dboff = sqlite3_column_int64(h->qb_get[hs][ndb], 0);
-    sqlite3_reset(h->qb_get[hs][ndb]);
-    dboff *= bs;
 
-    if(read_block(h->datafd[hs][ndb], h->blockbuf, dboff, bs))
+    ret = block_lookup(h, bs, hash, &hs, &ndb, block ? &dboff : NULL);
+    if(ret != OK || !block)
+	return ret;
+
+    /* Compaction may move the block to a lower slot, then truncate the file
+     * or hand the old slot out again, while it is being read: the data is
+     * only good if the block is still found at the same place afterwards */
+    for(tries = 0; ; tries++) {
+	err = read_block(h->datafd[hs][ndb], h->blockbuf, dboff, bs);
+	ret = block_lookup(h, bs, hash, &hs, &ndb, &curoff);
+	if(ret != OK)
+	    return ret;
+	if(curoff == dboff)
+	    break;
+	if(tries == BLOCK_GET_RETRIES) {
+	    WARN("Block keeps moving while being read");
+	    return FAIL_EINTERNAL;
+	}
+	dboff = curoff;
+    }
+    if(err)
 	return FAIL_EINTERNAL;
 
+    sx_blockcache_put(bs, hash, h->blockbuf);
     *block = h->blockbuf;
     return OK;
 }
 
+rc_ty sx_hashfs_block_locate(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash, int *fd, uint64_t *offset) {
+    unsigned int ndb, hs;
+    rc_ty ret;
+
+    if(!fd || !offset) {
+	NULLARG();
+	return EFAULT;
+    }
+
+    ret = block_lookup(h, bs, hash, &hs, &ndb, offset);
+    if(ret == OK)
+	*fd = h->datafd[hs][ndb];
+    return ret;
+}
+
 static rc_ty sx_hashfs_hashop_ishash(sx_hashfs_t *h, unsigned hs, const sx_hash_t *hash)
 {
     rc_ty ret;
     unsigned ndb;
-    ndb = gethashdb(hash);
-    sqlite3_reset(h->qb_get[hs][ndb]);
-    if(qbind_blob(h->qb_get[hs][ndb], ":hash", hash, sizeof(*hash)))
+    ndb = gethashdb(h, hash);
+    sqlite3_reset(h->qb[QB_GET][hs][ndb]);
+    if(qbind_blob(qb_stmt(h, QB_GET, hs, ndb), ":hash", hash, sizeof(*hash)))
         return FAIL_EINTERNAL;
-    switch (qstep(h->qb_get[hs][ndb])) {
+    switch (qstep(qb_stmt(h, QB_GET, hs, ndb))) {
         case SQLITE_ROW:
             ret = OK;
             break;
@@ -5362,20 +6948,12 @@ static rc_ty sx_hashfs_hashop_ishash(sx_hashfs_t *h, unsigned hs, const sx_hash_
             ret = FAIL_EINTERNAL;
             break;
     }
-    sqlite3_reset(h->qb_get[hs][ndb]);
+    sqlite3_reset(h->qb[QB_GET][hs][ndb]);
     return ret;
 }
 
-static rc_ty sx_hashfs_hashop_moduse(sx_hashfs_t *h, const char *id, unsigned int hs, const sx_hash_t *hash, unsigned replica, int64_t op, uint64_t op_expires_at)
+static rc_ty hashop_check_args(unsigned replica, int64_t op)
 {
-    unsigned ndb;
-    unsigned int age, n;
-    sx_hash_t reserveid, tokenid;
-    rc_ty ret = FAIL_EINTERNAL;
-    /* FIXME: maybe enable this
-    if(!is_hash_local(h, hash, replica_count))
-	return ENOENT;*/
-
     if (!replica) {
         if (op) {
             msg_set_reason("replica is zero is only valid for reservations");
@@ -5389,86 +6967,124 @@ static rc_ty sx_hashfs_hashop_moduse(sx_hashfs_t *h, const char *id, unsigned in
             return EINVAL;
         }
     }
+    return OK;
+}
+
+/* groupid = either the fileid, or a token.
+ * When there is no activity on the groupid, the reservations on all hashes
+ * from that groupid are dropped */
+static rc_ty hashop_parse_id(const char *id, sx_hash_t *reserveid, sx_hash_t *tokenid)
+{
+    unsigned int n;
 
     if (!id) {
         msg_set_reason("missing id");
         return EINVAL;
     }
-    ndb = gethashdb(hash);
-
-    sqlite3_reset(h->qb_moduse[hs][ndb]);
-    sqlite3_reset(h->qb_op[hs][ndb]);
-    sqlite3_reset(h->qb_reserve[hs][ndb]);
-    sqlite3_reset(h->qb_add_reserve[hs][ndb]);
     n = strlen(id);
     if (n != SXI_SHA1_TEXT_LEN && n != SXI_SHA1_TEXT_LEN * 2) {
         WARN("wrong id length: %d", n);
         return EINVAL;
     }
-    /* groupid = either the fileid, or a token.
-     * When there is no activity on the groupid, the reservations on all hashes
-     * from that groupid are dropped */
-    if (hex2bin(id, SXI_SHA1_TEXT_LEN, reserveid.b, sizeof(reserveid.b))) {
+    if (hex2bin(id, SXI_SHA1_TEXT_LEN, reserveid->b, sizeof(reserveid->b))) {
         WARN("Cannot decode hash id: %s", id);
         return FAIL_EINTERNAL;
     }
     if (n == SXI_SHA1_TEXT_LEN*2) {
-        if (hex2bin(id + SXI_SHA1_TEXT_LEN, SXI_SHA1_TEXT_LEN, tokenid.b, sizeof(tokenid.b))) {
+        if (hex2bin(id + SXI_SHA1_TEXT_LEN, SXI_SHA1_TEXT_LEN, tokenid->b, sizeof(tokenid->b))) {
             WARN("Cannot decode hash id: %s", id);
             return FAIL_EINTERNAL;
         }
     } else {
-        memcpy(tokenid.b, reserveid.b, sizeof(tokenid.b));
+        memcpy(tokenid->b, reserveid->b, sizeof(tokenid->b));
     }
-    DEBUG("moduse %lld, groupid: %s", (long long)op, id);
-    DEBUGHASH("reserveid", &reserveid);
-    DEBUGHASH("tokenid", &tokenid);
-    if (qbegin(h->datadb[hs][ndb]))
-        return FAIL_EINTERNAL;
+    return OK;
+}
+
+/* Applies a reservation (op == 0) or a use counter change to a hash; must be
+ * called within a transaction on the hash db */
+static rc_ty hashop_apply(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, const sx_hash_t *hash, const sx_hash_t *reserveid, const sx_hash_t *tokenid, unsigned replica, int64_t op, uint64_t op_expires_at)
+{
+    rc_ty ret = FAIL_EINTERNAL;
+    unsigned int age;
+
+    sqlite3_reset(h->qb[QB_MODUSE][hs][ndb]);
+    sqlite3_reset(h->qb[QB_OP][hs][ndb]);
+    sqlite3_reset(h->qb[QB_RESERVE][hs][ndb]);
+    sqlite3_reset(h->qb[QB_ADD_RESERVE][hs][ndb]);
+    sqlite3_reset(h->qb[QB_DEL_RESERVE][hs][ndb]);
     do {
-        if (qbind_blob(h->qb_add_reserve[hs][ndb], ":hash", hash, sizeof(*hash)) ||
-            qstep_noret(h->qb_add_reserve[hs][ndb]))
+        if (qbind_blob(qb_stmt(h, QB_ADD_RESERVE, hs, ndb), ":hash", hash, sizeof(*hash)) ||
+            qstep_noret(qb_stmt(h, QB_ADD_RESERVE, hs, ndb)))
             break;
-        sqlite3_reset(h->qb_add_reserve[hs][ndb]);
+        sqlite3_reset(h->qb[QB_ADD_RESERVE][hs][ndb]);
         if (op) { /* +N or -N */
-            if (qbind_blob(h->qb_del_reserve[hs][ndb], ":reserveid", &reserveid, sizeof(reserveid)) ||
-                qbind_blob(h->qb_del_reserve[hs][ndb], ":hash", hash, sizeof(*hash)) ||
-                qstep_noret(h->qb_del_reserve[hs][ndb]))
+            if (qbind_blob(qb_stmt(h, QB_DEL_RESERVE, hs, ndb), ":reserveid", reserveid, sizeof(*reserveid)) ||
+                qbind_blob(qb_stmt(h, QB_DEL_RESERVE, hs, ndb), ":hash", hash, sizeof(*hash)) ||
+                qstep_noret(qb_stmt(h, QB_DEL_RESERVE, hs, ndb)))
                 break;
-            if (qbind_blob(h->qb_op[hs][ndb], ":hash", hash, sizeof(*hash)) ||
-                qbind_blob(h->qb_op[hs][ndb], ":tokenid", &tokenid, sizeof(tokenid)) ||
-                qbind_int(h->qb_op[hs][ndb], ":replica",replica) ||
-                qbind_int64(h->qb_op[hs][ndb], ":op", op) ||
-                qbind_int64(h->qb_op[hs][ndb], ":ttl", op_expires_at) ||
-                qstep_noret(h->qb_op[hs][ndb]))
+            if (qbind_blob(qb_stmt(h, QB_OP, hs, ndb), ":hash", hash, sizeof(*hash)) ||
+                qbind_blob(qb_stmt(h, QB_OP, hs, ndb), ":tokenid", tokenid, sizeof(*tokenid)) ||
+                qbind_int(qb_stmt(h, QB_OP, hs, ndb), ":replica",replica) ||
+                qbind_int64(qb_stmt(h, QB_OP, hs, ndb), ":op", op) ||
+                qbind_int64(qb_stmt(h, QB_OP, hs, ndb), ":ttl", op_expires_at) ||
+                qstep_noret(qb_stmt(h, QB_OP, hs, ndb)))
                 break;
-            sqlite3_reset(h->qb_op[hs][ndb]);
+            sqlite3_reset(h->qb[QB_OP][hs][ndb]);
             age = sxi_hdist_version(h->hd);
             if (sqlite3_changes(h->datadb[hs][ndb]->handle)) {
                 /* apply only non-dup operations */
-                if (qbind_blob(h->qb_moduse[hs][ndb], ":hash", hash, sizeof(*hash)) ||
-                    qbind_int(h->qb_moduse[hs][ndb], ":replica", replica) ||
-                    qbind_int(h->qb_moduse[hs][ndb], ":age", age) ||
-                    qbind_int64(h->qb_moduse[hs][ndb], ":used", op) ||
-                    qstep_noret(h->qb_moduse[hs][ndb]))
+                if (qbind_blob(qb_stmt(h, QB_MODUSE, hs, ndb), ":hash", hash, sizeof(*hash)) ||
+                    qbind_int(qb_stmt(h, QB_MODUSE, hs, ndb), ":replica", replica) ||
+                    qbind_int(qb_stmt(h, QB_MODUSE, hs, ndb), ":age", age) ||
+                    qbind_int64(qb_stmt(h, QB_MODUSE, hs, ndb), ":used", op) ||
+                    qstep_noret(qb_stmt(h, QB_MODUSE, hs, ndb)))
                     break;
                 DEBUGHASH("moduse on", hash);
                 DEBUG("op: %ld, replica: %d, age: %d", op, replica, age);
             }
-            sqlite3_reset(h->qb_moduse[hs][ndb]);
+            sqlite3_reset(h->qb[QB_MODUSE][hs][ndb]);
         } else {
             /* reserve */
-            if (qbind_blob(h->qb_reserve[hs][ndb], ":hash", hash, sizeof(*hash)) ||
-                qbind_blob(h->qb_reserve[hs][ndb], ":reserveid", &reserveid, sizeof(reserveid)) ||
-                qbind_int64(h->qb_reserve[hs][ndb], ":ttl", op_expires_at) ||
-                qstep_noret(h->qb_reserve[hs][ndb]))
+            if (qbind_blob(qb_stmt(h, QB_RESERVE, hs, ndb), ":hash", hash, sizeof(*hash)) ||
+                qbind_blob(qb_stmt(h, QB_RESERVE, hs, ndb), ":reserveid", reserveid, sizeof(*reserveid)) ||
+                qbind_int64(qb_stmt(h, QB_RESERVE, hs, ndb), ":ttl", op_expires_at) ||
+                qstep_noret(qb_stmt(h, QB_RESERVE, hs, ndb)))
                 break;
-            sqlite3_reset(h->qb_reserve[hs][ndb]);
+            sqlite3_reset(h->qb[QB_RESERVE][hs][ndb]);
         }
-        if (qcommit(h->datadb[hs][ndb]))
-            break;
         ret = OK;
     } while(0);
+    sqlite3_reset(h->qb[QB_MODUSE][hs][ndb]);
+    sqlite3_reset(h->qb[QB_OP][hs][ndb]);
+    sqlite3_reset(h->qb[QB_RESERVE][hs][ndb]);
+    sqlite3_reset(h->qb[QB_ADD_RESERVE][hs][ndb]);
+    sqlite3_reset(h->qb[QB_DEL_RESERVE][hs][ndb]);
+    return ret;
+}
+
+static rc_ty sx_hashfs_hashop_moduse(sx_hashfs_t *h, const char *id, unsigned int hs, const sx_hash_t *hash, unsigned replica, int64_t op, uint64_t op_expires_at)
+{
+    unsigned ndb;
+    sx_hash_t reserveid, tokenid;
+    rc_ty ret;
+    /* FIXME: maybe enable this
+    if(!is_hash_local(h, hash, replica_count))
+	return ENOENT;*/
+
+    if ((ret = hashop_check_args(replica, op)) ||
+        (ret = hashop_parse_id(id, &reserveid, &tokenid)))
+        return ret;
+    ndb = gethashdb(h, hash);
+
+    DEBUG("moduse %lld, groupid: %s", (long long)op, id);
+    DEBUGHASH("reserveid", &reserveid);
+    DEBUGHASH("tokenid", &tokenid);
+    if (qbegin(h->datadb[hs][ndb]))
+        return FAIL_EINTERNAL;
+    ret = hashop_apply(h, hs, ndb, hash, &reserveid, &tokenid, replica, op, op_expires_at);
+    if (ret == OK && qcommit(h->datadb[hs][ndb]))
+        ret = FAIL_EINTERNAL;
     if (ret)
         qrollback(h->datadb[hs][ndb]);
     return ret;
@@ -5541,8 +7157,202 @@ rc_ty sx_hashfs_hashop_mod(sx_hashfs_t *h, const sx_hash_t *hash, const char *id
     return rc;
 }
 
-rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs, unsigned int replica_count, int propagate) {
+/* Applies a batch of hashops with one transaction per hash db: the entries
+ * are grouped by shard, and each entry gets OK (present), ENOENT (missing)
+ * or an error in its rc field. With a NULL id only the presence is checked */
+rc_ty sx_hashfs_hashop_batch(sx_hashfs_t *h, sx_hashop_entry_t *ops, unsigned int nops, const char *id, uint64_t op_expires_at)
+{
+    unsigned int i, shard, nshard[SIZES * HASHDBS_MAX + 1], *order = NULL, *pos = NULL;
+    sx_hash_t reserveid, tokenid;
+    rc_ty ret = OK;
+
+    if (!h || (nops && !ops)) {
+        NULLARG();
+        return EFAULT;
+    }
+    if (!nops)
+        return OK;
+    if (id && (ret = hashop_parse_id(id, &reserveid, &tokenid)))
+        return ret;
+
+    order = wrap_malloc(nops * sizeof(*order));
+    pos = wrap_malloc(nops * sizeof(*pos));
+    if (!order || !pos) {
+        free(order);
+        free(pos);
+        return ENOMEM;
+    }
+
+    /* Counting sort of the entries by shard; bad entries go to the last bucket */
+    memset(nshard, 0, sizeof(nshard));
+    for (i=0; i<nops; i++) {
+        unsigned int hs;
+        for (hs = 0; hs < SIZES; hs++)
+            if (bsz[hs] == ops[i].block_size)
+                break;
+        if (hs == SIZES)
+            ops[i].rc = FAIL_BADBLOCKSIZE;
+        else if (id)
+            ops[i].rc = hashop_check_args(ops[i].replica, ops[i].count);
+        else
+            ops[i].rc = OK;
+        pos[i] = ops[i].rc ? SIZES * h->hashdbs : hs * h->hashdbs + gethashdb(h, &ops[i].hash);
+        nshard[pos[i]]++;
+    }
+    for (shard=0, i=0; shard <= SIZES * h->hashdbs; shard++) {
+        unsigned int n = nshard[shard];
+        nshard[shard] = i;
+        i += n;
+    }
+    for (i=0; i<nops; i++)
+        order[nshard[pos[i]]++] = i;
+
+    for (i=0; i<nops && ops[order[i]].rc == OK; ) {
+        unsigned int start = i, hs, ndb;
+        sxi_db_t *db;
+        rc_ty rc = OK;
+
+        shard = pos[order[i]];
+        hs = shard / h->hashdbs;
+        ndb = shard % h->hashdbs;
+        db = h->datadb[hs][ndb];
+        if (id && qbegin(db))
+            rc = FAIL_EINTERNAL;
+        for (; i<nops && pos[order[i]] == shard && rc == OK; i++) {
+            sx_hashop_entry_t *e = &ops[order[i]];
+            if (id)
+                rc = hashop_apply(h, hs, ndb, &e->hash, &reserveid, &tokenid, e->replica, e->count, op_expires_at);
+            if (rc == OK)
+                rc = e->rc = sx_hashfs_hashop_ishash(h, hs, &e->hash);
+            if (rc == ENOENT)
+                rc = OK;
+        }
+        if (id && rc == OK && qcommit(db))
+            rc = FAIL_EINTERNAL;
+        if (rc != OK) {
+            /* Nothing in this shard was applied */
+            if (id)
+                qrollback(db);
+            for (i=start; i<nops && pos[order[i]] == shard; i++)
+                ops[order[i]].rc = rc;
+            ret = rc;
+        }
+    }
+
+    free(order);
+    free(pos);
+    return ret;
+}
+
+/* Picks the first free slot in the datafile, either from the avail list or by
+ * extending the file; must be called within a transaction on the hash db */
+static rc_ty block_alloc(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, int64_t *next) {
+    int r;
+
+    sqlite3_reset(h->qb[QB_NEXTAVAIL][hs][ndb]);
+    sqlite3_reset(h->qb[QB_NEXTALLOC][hs][ndb]);
+    sqlite3_reset(h->qb[QB_BUMPAVAIL][hs][ndb]);
+    sqlite3_reset(h->qb[QB_BUMPALLOC][hs][ndb]);
+
+    r = qstep(qb_stmt(h, QB_NEXTAVAIL, hs, ndb));
+    if(r == SQLITE_ROW) {
+	*next = sqlite3_column_int64(qb_stmt(h, QB_NEXTAVAIL, hs, ndb), 0);
+	sqlite3_reset(h->qb[QB_NEXTAVAIL][hs][ndb]);
+
+	if(qbind_int64(qb_stmt(h, QB_BUMPAVAIL, hs, ndb), ":next", *next) || qstep_noret(qb_stmt(h, QB_BUMPAVAIL, hs, ndb))) {
+	    WARN("bumpavail failed");
+	    return FAIL_EINTERNAL;
+	}
+    } else if(r == SQLITE_DONE) {
+	r = qstep(qb_stmt(h, QB_NEXTALLOC, hs, ndb));
+	if(r == SQLITE_ROW) {
+	    *next = sqlite3_column_int64(qb_stmt(h, QB_NEXTALLOC, hs, ndb), 0);
+	    sqlite3_reset(h->qb[QB_NEXTALLOC][hs][ndb]);
+
+	    if(qstep_noret(qb_stmt(h, QB_BUMPALLOC, hs, ndb))) {
+		WARN("bumpalloc failed");
+		return FAIL_EINTERNAL;
+	    }
+	}
+    }
+
+    if(r != SQLITE_ROW) {
+	WARN("nextavail failed");
+	return FAIL_EINTERNAL;
+    }
+    return OK;
+}
+
+/* Links the stored block to its hash; returns EAGAIN if someone beat us to it */
+static rc_ty block_link(sx_hashfs_t *h, unsigned int hs, unsigned int ndb, const sx_hash_t *hash, int64_t next) {
+    rc_ty ret;
+    int r;
+
+    sqlite3_reset(h->qb[QB_ADD][hs][ndb]);
+    if(qbind_blob(qb_stmt(h, QB_ADD, hs, ndb), ":hash", hash, sizeof(*hash)) ||
+       qbind_int64(qb_stmt(h, QB_ADD, hs, ndb), ":now", time(NULL)) ||
+       qbind_int64(qb_stmt(h, QB_ADD, hs, ndb), ":next", next)) {
+	WARN("add failed");
+	return FAIL_EINTERNAL;
+    }
+    r = qstep(qb_stmt(h, QB_ADD, hs, ndb));
+    DEBUG("r: %d, changes: %d", r, sqlite3_changes(h->datadb[hs][ndb]->handle));
+    if (r == SQLITE_DONE && !sqlite3_changes(h->datadb[hs][ndb]->handle)) {
+	DEBUG("checking for race condition");
+	/* race condition or missing reserve */
+	sqlite3_reset(h->qb[QB_GET][hs][ndb]);
+	if(qbind_blob(qb_stmt(h, QB_GET, hs, ndb), ":hash", hash, sizeof(*hash)))
+	    return FAIL_EINTERNAL;
+	r = qstep(qb_stmt(h, QB_GET, hs, ndb));
+	sqlite3_reset(h->qb[QB_GET][hs][ndb]);
+	if (r == SQLITE_ROW) {
+	    DEBUG("Race in block_store, falling back");
+	    ret = EAGAIN;
+	} else if (r == SQLITE_DONE) {
+	    WARNHASH("Hash was not reserved", hash);
+	    sqlite3_reset(h->qb[QB_ADD_RESERVE][hs][ndb]);
+	    if (qbind_blob(qb_stmt(h, QB_ADD_RESERVE, hs, ndb), ":hash", hash, sizeof(*hash)) ||
+		qstep_noret(qb_stmt(h, QB_ADD_RESERVE, hs, ndb)))
+		ret = FAIL_EINTERNAL;
+	    else {
+		sqlite3_reset(h->qb[QB_ADD][hs][ndb]);
+		r = qstep(qb_stmt(h, QB_ADD, hs, ndb));
+		DEBUG("r: %d, changes: %d", r, sqlite3_changes(h->datadb[hs][ndb]->handle));
+		if (r == SQLITE_DONE && sqlite3_changes(h->datadb[hs][ndb]->handle))
+		    ret = OK;
+		else {
+		    WARN("r:%d or 0 changes", r);
+		    ret = FAIL_EINTERNAL;
+		}
+	    }
+	    sqlite3_reset(h->qb[QB_ADD_RESERVE][hs][ndb]);
+	} else
+	    ret = FAIL_EINTERNAL;
+    } else if(r == SQLITE_DONE)
+	ret = OK;
+    else
+	ret = FAIL_EINTERNAL;
+    sqlite3_reset(h->qb[QB_ADD][hs][ndb]);
+    return ret;
+}
+
+/* Checks that the block belongs to this node */
+static rc_ty block_owned(sx_hashfs_t *h, const sx_hash_t *hash, unsigned int replica_count) {
     sx_nodelist_t *belongsto;
+    int r;
+
+    /* MODHDIST: lookup is strictly on bidx 0 */
+    belongsto = sxi_hdist_locate(h->hd, MurmurHash64(hash, sizeof(*hash), HDIST_SEED), replica_count, 0);
+    r = sx_nodelist_lookup(belongsto, &h->node_uuid) == NULL;
+    sx_nodelist_delete(belongsto);
+    if(r) {
+	DEBUGHASH("Block doesn't belong to this node", hash);
+	return ENOENT;
+    }
+    return OK;
+}
+
+rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs, unsigned int replica_count, int propagate) {
     unsigned int ndb, hs;
     sx_hash_t hash;
     rc_ty ret = FAIL_EINTERNAL;
@@ -5566,25 +7376,20 @@ rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs,
 
     DEBUGHASH("Block uploaded by user", &hash);
 
-    /* MODHDIST: lookup is strictly on bidx 0 */
-    belongsto = sxi_hdist_locate(h->hd, MurmurHash64(&hash, sizeof(hash), HDIST_SEED), replica_count, 0);
-    r = sx_nodelist_lookup(belongsto, &h->node_uuid) == NULL;
-    sx_nodelist_delete(belongsto);
-    if(r) {
-	DEBUGHASH("Block doesn't belong to this node", &hash);
-	return ENOENT;
-    }
+    ret = block_owned(h, &hash, replica_count);
+    if(ret != OK)
+	return ret;
 
-    ndb = gethashdb(&hash);
+    ndb = gethashdb(h, &hash);
 
-    sqlite3_reset(h->qb_get[hs][ndb]);
-    if(qbind_blob(h->qb_get[hs][ndb], ":hash", &hash, sizeof(hash))) {
+    sqlite3_reset(h->qb[QB_GET][hs][ndb]);
+    if(qbind_blob(qb_stmt(h, QB_GET, hs, ndb), ":hash", &hash, sizeof(hash))) {
 	WARN("binding hash failed");
 	return FAIL_EINTERNAL;
     }
 
-    r = qstep(h->qb_get[hs][ndb]);
-    sqlite3_reset(h->qb_get[hs][ndb]);
+    r = qstep(qb_stmt(h, QB_GET, hs, ndb));
+    sqlite3_reset(h->qb[QB_GET][hs][ndb]);
     if(r == SQLITE_DONE) {
 	int64_t dsto, next;
 
@@ -5593,39 +7398,8 @@ rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs,
 	    return FAIL_EINTERNAL;
 	}
 
-	sqlite3_reset(h->qb_nextavail[hs][ndb]);
-	sqlite3_reset(h->qb_nextalloc[hs][ndb]);
-	sqlite3_reset(h->qb_bumpavail[hs][ndb]);
-	sqlite3_reset(h->qb_bumpalloc[hs][ndb]);
-	sqlite3_reset(h->qb_add[hs][ndb]);
-
-	r = qstep(h->qb_nextavail[hs][ndb]);
-	if(r == SQLITE_ROW) {
-	    next = sqlite3_column_int64(h->qb_nextavail[hs][ndb], 0);
-	    sqlite3_reset(h->qb_nextavail[hs][ndb]);
-
-	    if(qbind_int64(h->qb_bumpavail[hs][ndb], ":next", next) || qstep_noret(h->qb_bumpavail[hs][ndb])) {
-		qrollback(h->datadb[hs][ndb]);
-		WARN("bumpavail failed");
-		return FAIL_EINTERNAL;
-	    }
-	} else if(r == SQLITE_DONE) {
-	    r = qstep(h->qb_nextalloc[hs][ndb]);
-	    if(r == SQLITE_ROW) {
-		next = sqlite3_column_int64(h->qb_nextalloc[hs][ndb], 0);
-		sqlite3_reset(h->qb_nextalloc[hs][ndb]);
-
-		if(qstep_noret(h->qb_bumpalloc[hs][ndb])) {
-		    qrollback(h->datadb[hs][ndb]);
-		    WARN("bumpalloc failed");
-		    return FAIL_EINTERNAL;
-		}
-	    }
-	}
-
-	if(r != SQLITE_ROW || qcommit(h->datadb[hs][ndb])) {
+	if(block_alloc(h, hs, ndb, &next) != OK || qcommit(h->datadb[hs][ndb])) {
 	    qrollback(h->datadb[hs][ndb]);
-	    WARN("nextavail failed");
 	    return FAIL_EINTERNAL;
 	}
 
@@ -5638,47 +7412,11 @@ rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs,
 	}
 
 	/* insert it now */
-	if(qbind_blob(h->qb_add[hs][ndb], ":hash", &hash, sizeof(hash)) ||
-           qbind_int64(h->qb_add[hs][ndb], ":now", time(NULL)) ||
-	   qbind_int64(h->qb_add[hs][ndb], ":next", next)) {
-	    WARN("add failed");
-	    return FAIL_EINTERNAL;
-	}
-	r = qstep(h->qb_add[hs][ndb]);
-        DEBUG("r: %d, changes: %d", r, sqlite3_changes(h->datadb[hs][ndb]->handle));
-        if (r == SQLITE_DONE && !sqlite3_changes(h->datadb[hs][ndb]->handle)) {
-            DEBUG("checking for race condition");
-            /* race condition or missing reserve */
-            r = qstep(h->qb_get[hs][ndb]);
-            sqlite3_reset(h->qb_get[hs][ndb]);
-            if (r == SQLITE_ROW) {
-		DEBUG("Race in block_store, falling back");
-                ret = EAGAIN;
-            } else if (r == SQLITE_DONE) {
-                WARNHASH("Hash was not reserved", &hash);
-                sqlite3_reset(h->qb_add_reserve[hs][ndb]);
-                if (qbind_blob(h->qb_add_reserve[hs][ndb], ":hash", &hash, sizeof(hash)) ||
-                    qstep_noret(h->qb_add_reserve[hs][ndb]))
-                    ret = FAIL_EINTERNAL;
-                else {
-                    sqlite3_reset(h->qb_add[hs][ndb]);
-                    r = qstep(h->qb_add[hs][ndb]);
-                    DEBUG("r: %d, changes: %d", r, sqlite3_changes(h->datadb[hs][ndb]->handle));
-                    if (r == SQLITE_DONE && sqlite3_changes(h->datadb[hs][ndb]->handle))
-                        ret = OK;
-                    else {
-                        WARN("r:%d or 0 changes", r);
-                        ret = FAIL_EINTERNAL;
-                    }
-                }
-                sqlite3_reset(h->qb_add[hs][ndb]);
-                sqlite3_reset(h->qb_add_reserve[hs][ndb]);
-            } else
-                ret = FAIL_EINTERNAL;
-        } else
-            ret = OK;
+	ret = block_link(h, hs, ndb, &hash, next);
     } else if(r == SQLITE_ROW)
         ret = EAGAIN;
+    else
+	ret = FAIL_EINTERNAL;
     if(ret != OK && ret != EAGAIN)
 	return FAIL_EINTERNAL;
 
@@ -5691,6 +7429,121 @@ rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs,
     return OK;
 }
 
+rc_ty sx_hashfs_block_put_batch(sx_hashfs_t *h, const uint8_t *data, unsigned int bs, unsigned int nblocks, unsigned int replica_count, int propagate) {
+    unsigned int i, ndb, hs;
+    unsigned int *dbs = NULL;
+    sx_hash_t *hashes = NULL;
+    const void **bufs = NULL;
+    rc_ty ret = FAIL_EINTERNAL;
+    int r;
+
+    if(!h->have_hd) {
+	WARN("Called before initialization");
+	return FAIL_EINIT;
+    }
+
+    for(hs = 0; hs < SIZES; hs++)
+	if(bsz[hs] == bs)
+	    break;
+    if(hs == SIZES)
+	return FAIL_BADBLOCKSIZE;
+
+    if(!nblocks)
+	return OK;
+
+    hashes = wrap_malloc(nblocks * sizeof(*hashes));
+    dbs = wrap_malloc(nblocks * sizeof(*dbs));
+    bufs = wrap_malloc(nblocks * sizeof(*bufs));
+    if(!hashes || !dbs || !bufs) {
+	ret = ENOMEM;
+	goto put_batch_out;
+    }
+
+    /* Hash and check everything before touching any db */
+    for(i=0; i<nblocks; i++)
+	bufs[i] = data + (uint64_t)i * bs;
+    if(sx_hashfs_hash_bufs(h->cluster_uuid.string, strlen(h->cluster_uuid.string), bufs, bs, nblocks, hashes)) {
+	WARN("hashing failed");
+	goto put_batch_out;
+    }
+    for(i=0; i<nblocks; i++) {
+	DEBUGHASH("Block uploaded by user", &hashes[i]);
+	ret = block_owned(h, &hashes[i], replica_count);
+	if(ret != OK)
+	    goto put_batch_out;
+	ret = FAIL_EINTERNAL;
+	dbs[i] = gethashdb(h, &hashes[i]);
+    }
+
+    /* One transaction per hash db covering allocation, write and link */
+    for(ndb=0; ndb<h->hashdbs; ndb++) {
+	int intrans = 0;
+
+	for(i=0; i<nblocks; i++) {
+	    int64_t next;
+	    rc_ty rc;
+
+	    if(dbs[i] != ndb)
+		continue;
+
+	    if(!intrans) {
+		if(qbegin(h->datadb[hs][ndb])) {
+		    WARN("begin failed");
+		    goto put_batch_out;
+		}
+		intrans = 1;
+	    }
+
+	    /* Also catches duplicates within the batch */
+	    sqlite3_reset(h->qb[QB_GET][hs][ndb]);
+	    if(qbind_blob(qb_stmt(h, QB_GET, hs, ndb), ":hash", &hashes[i], sizeof(hashes[i]))) {
+		WARN("binding hash failed");
+		break;
+	    }
+	    r = qstep(qb_stmt(h, QB_GET, hs, ndb));
+	    sqlite3_reset(h->qb[QB_GET][hs][ndb]);
+	    if(r == SQLITE_ROW)
+		continue;
+	    if(r != SQLITE_DONE || block_alloc(h, hs, ndb, &next) != OK)
+		break;
+
+	    DEBUG("Block stored @%d/%d/%lld", hs, ndb, (long long)next * bs);
+	    if(write_block(h->datafd[hs][ndb], data + (uint64_t)i * bs, next * bs, bs)) {
+		WARN("write failed");
+		break;
+	    }
+
+	    rc = block_link(h, hs, ndb, &hashes[i], next);
+	    if(rc != OK && rc != EAGAIN)
+		break;
+	}
+
+	if(!intrans)
+	    continue;
+	if(i < nblocks || qcommit(h->datadb[hs][ndb])) {
+	    qrollback(h->datadb[hs][ndb]);
+	    goto put_batch_out;
+	}
+    }
+
+    ret = OK;
+    if(propagate && replica_count > 1) {
+	for(i=0; i<nblocks; i++) {
+	    sx_nodelist_t *targets = sx_hashfs_hashnodes(h, NL_NEXT, &hashes[i], replica_count);
+	    ret = sx_hashfs_xfer_tonodes(h, &hashes[i], bs, targets);
+	    sx_nodelist_delete(targets);
+	    if(ret != OK)
+		break;
+	}
+    }
+
+ put_batch_out:
+    free(hashes);
+    free(dbs);
+    free(bufs);
+    return ret;
+}
+
 static void putfile_reinit(sx_hashfs_t *h) {
     if(!h)
 	return;
@@ -5739,7 +7592,7 @@ static rc_ty get_file_metasize(sx_hashfs_t *h, int64_t file_id, int64_t ndb, int
         return EFAULT;
     }
 
-    if(ndb >= METADBS) {
+    if(ndb >= h->metadbs) {
         msg_set_reason("Failed to compute file meta size: invalid argument");
         return EFAULT;
     }
@@ -5775,14 +7628,14 @@ rc_ty sx_hashfs_check_file_size(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, c
     if(vol->cursize <= vol->size - size)
 	return OK;
 
-    mdb = getmetadb(filename);
+    mdb = getmetadb(h, filename);
     if(mdb < 0) {
         WARN("Failed to get meta db for file name: %s", filename);
         msg_set_reason("Failed to get meta db for file name: %s", filename);
         return FAIL_EINTERNAL;
     }
 
-    q = h->qm_oldrevs[mdb];
+    q = qm_stmt(h, QM_OLDREVS, mdb);
     sqlite3_reset(q);
 
     if(qbind_int64(q, ":volume", vol->id) || qbind_text(q, ":name", filename))
@@ -6313,13 +8166,13 @@ static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const
 	return EFAULT;
     }
 
-    mdb = getmetadb(name);
+    mdb = getmetadb(h, name);
     if(mdb < 0) {
 	msg_set_reason("Failed to locate file database");
 	return FAIL_EINTERNAL;
     }
 
-    q = h->qm_getrev[mdb];
+    q = qm_stmt(h, QM_GETREV, mdb);
     sqlite3_reset(q);
     if(qbind_int64(q, ":volume", volume->id)
        || qbind_text(q, ":name", name)
@@ -6342,22 +8195,22 @@ static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const
     sqlite3_reset(q);
 
     /* Count current file revisions */
-    sqlite3_reset(h->qm_oldrevs[mdb]);
-    if(qbind_int64(h->qm_oldrevs[mdb], ":volume", volume->id) ||
-       qbind_text(h->qm_oldrevs[mdb], ":name", name))
+    sqlite3_reset(h->qm[QM_OLDREVS][mdb]);
+    if(qbind_int64(qm_stmt(h, QM_OLDREVS, mdb), ":volume", volume->id) ||
+       qbind_text(qm_stmt(h, QM_OLDREVS, mdb), ":name", name))
 	return FAIL_EINTERNAL;
 
-    r = qstep(h->qm_oldrevs[mdb]);
+    r = qstep(qm_stmt(h, QM_OLDREVS, mdb));
     if(r == SQLITE_ROW) {
-	int nrevs = sqlite3_column_int(h->qm_oldrevs[mdb], 2);
+	int nrevs = sqlite3_column_int(qm_stmt(h, QM_OLDREVS, mdb), 2);
 	rc_ty rc = OK;
 	job_t job = JOB_NOPARENT;
 
 	/* There are some revs */
 	while(nrevs >= volume->revisions) {
-	    const char *tooold_rev = (const char *)sqlite3_column_text(h->qm_oldrevs[mdb], 0);
+	    const char *tooold_rev = (const char *)sqlite3_column_text(qm_stmt(h, QM_OLDREVS, mdb), 0);
 	    
-	    if(strcmp(revision, (const char *)sqlite3_column_text(h->qm_oldrevs[mdb], 0)) < 0) {
+	    if(strcmp(revision, (const char *)sqlite3_column_text(qm_stmt(h, QM_OLDREVS, mdb), 0)) < 0) {
 		msg_set_reason("Newer copies of this file already exist");
 		rc = EINVAL;
 		break;
@@ -6375,7 +8228,7 @@ static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const
 	    if(!nrevs)
 		break;
 
-	    r = qstep(h->qm_oldrevs[mdb]);
+	    r = qstep(qm_stmt(h, QM_OLDREVS, mdb));
 	    if(r != SQLITE_ROW) {
 		msg_set_reason("There was a problem enumerating current revisions of the file");
 		rc = FAIL_EINTERNAL;
@@ -6383,38 +8236,38 @@ static rc_ty create_file(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, const
 	    }
 	}	
 
-        sqlite3_reset(h->qm_oldrevs[mdb]);
+        sqlite3_reset(h->qm[QM_OLDREVS][mdb]);
 	if(rc)
 	    return rc;
         /* Yay we have a slot now */
     } else {
-	sqlite3_reset(h->qm_oldrevs[mdb]);
+	sqlite3_reset(h->qm[QM_OLDREVS][mdb]);
 	if(r != SQLITE_DONE) /* Something didn't quite work */
 	    return FAIL_EINTERNAL;
 
 	/* There are no existing revs */
     }
 
-    sqlite3_reset(h->qm_ins[mdb]);
-    if(qbind_int64(h->qm_ins[mdb], ":volume", volume->id) ||
-       qbind_text(h->qm_ins[mdb], ":name", name) ||
-       qbind_text(h->qm_ins[mdb], ":revision", revision) ||
-       qbind_int64(h->qm_ins[mdb], ":size", size) ||
-       qbind_blob(h->qm_ins[mdb], ":hashes", nblocks ? (const void *)blocks : "", nblocks * sizeof(blocks[0]))) {
+    sqlite3_reset(h->qm[QM_INS][mdb]);
+    if(qbind_int64(qm_stmt(h, QM_INS, mdb), ":volume", volume->id) ||
+       qbind_text(qm_stmt(h, QM_INS, mdb), ":name", name) ||
+       qbind_text(qm_stmt(h, QM_INS, mdb), ":revision", revision) ||
+       qbind_int64(qm_stmt(h, QM_INS, mdb), ":size", size) ||
+       qbind_blob(qm_stmt(h, QM_INS, mdb), ":hashes", nblocks ? (const void *)blocks : "", nblocks * sizeof(blocks[0]))) {
 	WARN("Failed to create file '%s' on volume '%s'", name, volume->name);
-	sqlite3_reset(h->qm_ins[mdb]);
+	sqlite3_reset(h->qm[QM_INS][mdb]);
 	return FAIL_EINTERNAL;
     }
 
-    r = qstep(h->qm_ins[mdb]);
-    sqlite3_reset(h->qm_ins[mdb]);
+    r = qstep(qm_stmt(h, QM_INS, mdb));
+    sqlite3_reset(h->qm[QM_INS][mdb]);
     if(r != SQLITE_DONE) {
 	WARN("Failed to create file '%s' on volume '%s'", name, volume->name);
 	return FAIL_EINTERNAL;
     }
 
     if(file_id)
-	*file_id = sqlite3_last_insert_rowid(sqlite3_db_handle(h->qm_ins[mdb]));
+	*file_id = sqlite3_last_insert_rowid(sqlite3_db_handle(qm_stmt(h, QM_INS, mdb)));
 
     /* Update volume size counter only when size is positive and this node is not becoming a volnode */
     if(!is_new_volnode(h, volume) && sx_hashfs_update_volume_cursize(h, volume->id, totalsize)) {
@@ -6462,7 +8315,7 @@ rc_ty sx_hashfs_createfile_commit(sx_hashfs_t *h, const char *volume, const char
 	return ENOENT;
     }
 
-    mdb = getmetadb(name);
+    mdb = getmetadb(h, name);
     if(mdb < 0) {
 	msg_set_reason("Failed to locate file database");
 	return FAIL_EINTERNAL;
@@ -6484,20 +8337,21 @@ rc_ty sx_hashfs_createfile_commit(sx_hashfs_t *h, const char *volume, const char
     }
 
     for(i=0; i<h->nmeta; i++) {
-	sqlite3_reset(h->qm_metaset[mdb]);
-	if(qbind_int64(h->qm_metaset[mdb], ":file", file_id) ||
-	   qbind_text(h->qm_metaset[mdb], ":key", h->meta[i].key) ||
-	   qbind_blob(h->qm_metaset[mdb], ":value", h->meta[i].value, h->meta[i].value_len) ||
-	   qstep_noret(h->qm_metaset[mdb]))
+	sqlite3_reset(h->qm[QM_METASET][mdb]);
+	if(qbind_int64(qm_stmt(h, QM_METASET, mdb), ":file", file_id) ||
+	   qbind_text(qm_stmt(h, QM_METASET, mdb), ":key", h->meta[i].key) ||
+	   qbind_blob(qm_stmt(h, QM_METASET, mdb), ":value", h->meta[i].value, h->meta[i].value_len) ||
+	   qstep_noret(qm_stmt(h, QM_METASET, mdb)))
 	    break;
     }
-    sqlite3_reset(h->qm_metaset[mdb]);
+    sqlite3_reset(h->qm[QM_METASET][mdb]);
     if(i != h->nmeta)
 	goto cretatefile_rollback;
 
     if(qcommit(h->metadb[mdb]))
 	goto cretatefile_rollback;
 
+    listidx_refresh(h, vol->id, name, mdb);
     ret = OK;
 
  cretatefile_rollback:
@@ -6552,18 +8406,18 @@ static rc_ty are_blocks_available(sx_hashfs_t *h, sx_hash_t *hashes,
     /* hash is local */
     if(sx_nodelist_lookup_index(nodes, &h->node_uuid, &thisnode) && prevnode == thisnode) {
 	sx_hash_t *hash = &hashes[hashnos[check_item]];
-	unsigned int ndb = gethashdb(hash);
+	unsigned int ndb = gethashdb(h, hash);
 	int r;
         rc_ty rc;
 
-	sqlite3_reset(h->qb_get[hash_size][ndb]);
-	if(qbind_blob(h->qb_get[hash_size][ndb], ":hash", hash, sizeof(*hash))) {
+	sqlite3_reset(h->qb[QB_GET][hash_size][ndb]);
+	if(qbind_blob(qb_stmt(h, QB_GET, hash_size, ndb), ":hash", hash, sizeof(*hash))) {
 	    WARN("qbind_blob failed");
-	    sqlite3_reset(h->qb_get[hash_size][ndb]);
+	    sqlite3_reset(h->qb[QB_GET][hash_size][ndb]);
 	    return FAIL_EINTERNAL;
 	}
-	r = qstep(h->qb_get[hash_size][ndb]);
-	sqlite3_reset(h->qb_get[hash_size][ndb]);
+	r = qstep(qb_stmt(h, QB_GET, hash_size, ndb));
+	sqlite3_reset(h->qb[QB_GET][hash_size][ndb]);
 
 	*current = check_item+1;
         if (sxi_hashop_batch_flush(hdck))
@@ -7222,7 +9076,7 @@ rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing) {
 	return EFAULT;
     }
 
-    mdb = getmetadb(missing->name);
+    mdb = getmetadb(h, missing->name);
     if(mdb < 0) {
 	msg_set_reason("Failed to locate file database");
 	return FAIL_EINTERNAL;
@@ -7256,16 +9110,16 @@ rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing) {
 	const void *value = sqlite3_column_blob(h->qt_getmeta, 1);
 	int value_len = sqlite3_column_bytes(h->qt_getmeta, 1);
 
-	sqlite3_reset(h->qm_metaset[mdb]);
-	if(qbind_int64(h->qm_metaset[mdb], ":file", file_id) ||
-	   qbind_text(h->qm_metaset[mdb], ":key", key) ||
-	   qbind_blob(h->qm_metaset[mdb], ":value", value, value_len) ||
-	   qstep_noret(h->qm_metaset[mdb])) {
-	    sqlite3_reset(h->qm_metaset[mdb]);
+	sqlite3_reset(h->qm[QM_METASET][mdb]);
+	if(qbind_int64(qm_stmt(h, QM_METASET, mdb), ":file", file_id) ||
+	   qbind_text(qm_stmt(h, QM_METASET, mdb), ":key", key) ||
+	   qbind_blob(qm_stmt(h, QM_METASET, mdb), ":value", value, value_len) ||
+	   qstep_noret(qm_stmt(h, QM_METASET, mdb))) {
+	    sqlite3_reset(h->qm[QM_METASET][mdb]);
 	    goto tmp2file_rollback;
 	}
     }
-    sqlite3_reset(h->qm_metaset[mdb]);
+    sqlite3_reset(h->qm[QM_METASET][mdb]);
     sqlite3_reset(h->qt_getmeta);
     if(r != SQLITE_DONE)
 	goto tmp2file_rollback;
@@ -7273,6 +9127,7 @@ rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing) {
     if(qcommit(h->metadb[mdb]))
 	goto tmp2file_rollback;
 
+    listidx_refresh(h, volume->id, missing->name, mdb);
     sx_hashfs_tmp_delete(h, missing->tmpfile_id);
     ret = OK;
 
@@ -7280,7 +9135,7 @@ rc_ty sx_hashfs_tmp_tofile(sx_hashfs_t *h, const sx_hashfs_tmpinfo_t *missing) {
     if(ret != OK)
 	qrollback(h->metadb[mdb]);
 
-    sqlite3_reset(h->qm_metaset[mdb]);
+    sqlite3_reset(h->qm[QM_METASET][mdb]);
     sqlite3_reset(h->qt_getmeta);
 
     return ret;
@@ -7312,31 +9167,31 @@ static rc_ty file_totmp(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const cha
     }
     rev[REV_TIME_LEN] = '\0';
 
-    ndb = getmetadb(name);
+    ndb = getmetadb(h, name);
     if(ndb < 0) {
 	msg_set_reason("Failed to locate file database");
 	return FAIL_EINTERNAL;
     }
 
-    if(qbind_int64(h->qm_getrev[ndb], ":volume", vol->id) ||
-       qbind_text(h->qm_getrev[ndb], ":name", name) ||
-       qbind_text(h->qm_getrev[ndb], ":revision", revision))
+    if(qbind_int64(qm_stmt(h, QM_GETREV, ndb), ":volume", vol->id) ||
+       qbind_text(qm_stmt(h, QM_GETREV, ndb), ":name", name) ||
+       qbind_text(qm_stmt(h, QM_GETREV, ndb), ":revision", revision))
 	return FAIL_EINTERNAL;
 
-    r = qstep(h->qm_getrev[ndb]);
+    r = qstep(qm_stmt(h, QM_GETREV, ndb));
     if(r == SQLITE_DONE)
 	return ENOENT;
     if(r != SQLITE_ROW)
 	return FAIL_EINTERNAL;
 
-    size = sqlite3_column_int64(h->qm_getrev[ndb], 1);
+    size = sqlite3_column_int64(qm_stmt(h, QM_GETREV, ndb), 1);
     nblocks = size_to_blocks(size, NULL, &bsize);
-    content = sqlite3_column_blob(h->qm_getrev[ndb], 2);
-    content_len = sqlite3_column_bytes(h->qm_getrev[ndb], 2);
+    content = sqlite3_column_blob(qm_stmt(h, QM_GETREV, ndb), 2);
+    content_len = sqlite3_column_bytes(qm_stmt(h, QM_GETREV, ndb), 2);
     avail_len = nblocks * vol->replica_count;
     avail = malloc(avail_len);
     if(!avail) {
-	sqlite3_reset(h->qm_getrev[ndb]);
+	sqlite3_reset(h->qm[QM_GETREV][ndb]);
 	return ENOMEM;
     }
     memset(avail, 1, avail_len);
@@ -7351,13 +9206,13 @@ static rc_ty file_totmp(sx_hashfs_t *h, const sx_hashfs_volume_t *vol, const cha
        qbind_blob(h->qt_new4del, ":content", content, content_len) ||
        qbind_blob(h->qt_new4del, ":avail", avail, avail_len) ||
        qbind_int64(h->qt_new4del, ":expires", time(NULL) + *timeout)) {
-	sqlite3_reset(h->qm_getrev[ndb]);
+	sqlite3_reset(h->qm[QM_GETREV][ndb]);
 	free(avail);
 	return FAIL_EINTERNAL;
     }
 
     r = qstep(h->qt_new4del);
-    sqlite3_reset(h->qm_getrev[ndb]);
+    sqlite3_reset(h->qm[QM_GETREV][ndb]);
     free(avail);
 
     if(r == SQLITE_CONSTRAINT)
@@ -7644,7 +9499,7 @@ static rc_ty get_file_id(sx_hashfs_t *h, const char *volume, const char *filenam
     if(res)
 	return res;
 
-    ndb = getmetadb(filename);
+    ndb = getmetadb(h, filename);
     if(ndb < 0)
 	return FAIL_EINTERNAL;
 
@@ -7653,11 +9508,11 @@ static rc_ty get_file_id(sx_hashfs_t *h, const char *volume, const char *filenam
 	    msg_set_reason("Invalid revision");
 	    return EINVAL;
 	}
-	q = h->qm_getrev[ndb];
+	q = qm_stmt(h, QM_GETREV, ndb);
 	if(qbind_text(q, ":revision", revision))
 	    return FAIL_EINTERNAL;
     } else
-	q = h->qm_get[ndb];
+	q = qm_stmt(h, QM_GET, ndb);
 
     if(qbind_int64(q, ":volume", vol->id) || qbind_text(q, ":name", filename))
 	return FAIL_EINTERNAL;
@@ -7727,13 +9582,15 @@ rc_ty sx_hashfs_file_delete(sx_hashfs_t *h, const sx_hashfs_volume_t *volume, co
     if(ret)
         return ret;
 
-    if(qbind_int64(h->qm_delfile[mdb], ":file", file_id) ||
-       qstep_noret(h->qm_delfile[mdb])) {
+    if(qbind_int64(qm_stmt(h, QM_DELFILE, mdb), ":file", file_id) ||
+       qstep_noret(qm_stmt(h, QM_DELFILE, mdb))) {
 	msg_set_reason("Failed to delete file from database");
 	return FAIL_EINTERNAL;
     }
 
     deleted = sqlite3_changes(h->metadb[mdb]->handle);
+    if(deleted)
+	listidx_refresh(h, volume->id, file, mdb);
 
     /* Update counters only when file deletion succeeded and this node is not becoming a volnode */
     if(ret == OK && deleted && !is_new_volnode(h, volume) && sx_hashfs_update_volume_cursize(h, volume->id, -size)) {
@@ -7901,7 +9758,7 @@ rc_ty sx_hashfs_tmp_unbump(sx_hashfs_t *h, int64_t tmpfile_id) {
 
 
 static rc_ty fill_filemeta(sx_hashfs_t *h, unsigned int metadb, int64_t file_id) {
-    sqlite3_stmt *q = h->qm_metaget[metadb];
+    sqlite3_stmt *q = qm_stmt(h, QM_METAGET, metadb);
     rc_ty ret = FAIL_EINTERNAL;
     int r;
 
@@ -8713,6 +10570,29 @@ rc_ty sx_hashfs_xfer_tonode(sx_hashfs_t *h, sx_hash_t *block, unsigned int size,
     return ret;
 }
 
+/* Restricts the GC functions to the shards assigned to one of nworkers
+ * processes running GC side by side */
+void sx_hashfs_gc_shards(sx_hashfs_t *h, unsigned int worker, unsigned int nworkers)
+{
+    h->gc_worker = worker;
+    h->gc_nworkers = nworkers;
+}
+
+void sx_hashfs_gc_get_last(const sx_hashfs_t *h, sx_hashfs_gc_stats_t *stats)
+{
+    *stats = h->gc_last;
+}
+
+void sx_hashfs_gc_set_last(sx_hashfs_t *h, const sx_hashfs_gc_stats_t *stats)
+{
+    h->gc_last = *stats;
+}
+
+static int gc_skip_shard(const sx_hashfs_t *h, unsigned int hs, unsigned int ndb)
+{
+    return h->gc_nworkers > 1 && (hs * h->hashdbs + ndb) % h->gc_nworkers != h->gc_worker;
+}
+
 rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period)
 {
     unsigned i, j, k;
@@ -8727,13 +10607,17 @@ rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period)
         DEBUG("now set to: %lld", (long long)now);
     } else
         now = real_now;
-    if (qbind_int64(h->qt_gc_tokens, ":now", now) ||
-        qstep_noret(h->qt_gc_tokens))
-        return FAIL_EINTERNAL;
-    INFO("Deleted %d tokens", sqlite3_changes(h->tempdb->handle));
+    if (!h->gc_worker) {
+        if (qbind_int64(h->qt_gc_tokens, ":now", now) ||
+            qstep_noret(h->qt_gc_tokens))
+            return FAIL_EINTERNAL;
+        INFO("Deleted %d tokens", sqlite3_changes(h->tempdb->handle));
+    }
     for (j=0;j<SIZES && !ret1 && !ret2 && !*terminate;j++) {
-        for (i=0;i<HASHDBS && !ret1 && !ret2 && !*terminate;i++) {
-            if (qbind_blob(h->qb_find_expired_reservation[j][i], ":lastreserveid", "", 0)) {
+        for (i=0;i<h->hashdbs && !ret1 && !ret2 && !*terminate;i++) {
+            if (gc_skip_shard(h, j, i))
+                continue;
+            if (qbind_blob(qb_stmt(h, QB_FIND_EXPIRED_RESERVATION, j, i), ":lastreserveid", "", 0)) {
                 ret1 = -1;
                 break;
             }
@@ -8746,8 +10630,8 @@ rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period)
               }
               for (k=0;k<gc_max_batch && ret1 == SQLITE_ROW && !*terminate;k++) {
                 sx_hash_t last;
-                sqlite3_stmt *q = h->qb_find_expired_reservation[j][i];
-                sqlite3_stmt *q_gc = h->qb_gc_reserve[j][i];
+                sqlite3_stmt *q = qb_stmt(h, QB_FIND_EXPIRED_RESERVATION, j, i);
+                sqlite3_stmt *q_gc = qb_stmt(h, QB_GC_RESERVE, j, i);
                 sqlite3_reset(q);
                 sqlite3_reset(q_gc);
                 if (qbind_int64(q, ":expires", expires)) {
@@ -8789,7 +10673,7 @@ rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period)
                qrollback(h->datadb[j][i]);
                break;
             }
-            if (qbind_int64(h->qb_find_expired_reservation2[j][i], ":lastrowid", 0)) {
+            if (qbind_int64(qb_stmt(h, QB_FIND_EXPIRED_RESERVATION2, j, i), ":lastrowid", 0)) {
                 ret1 = -1;
                 break;
             }
@@ -8799,8 +10683,8 @@ rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period)
                     break;
               }
               for (k=0;k<gc_max_batch && ret1 == SQLITE_ROW && !*terminate;k++) {
-                sqlite3_stmt *q = h->qb_find_expired_reservation2[j][i];
-                sqlite3_stmt *q_gc = h->qb_gc_reserve2[j][i];
+                sqlite3_stmt *q = qb_stmt(h, QB_FIND_EXPIRED_RESERVATION2, j, i);
+                sqlite3_stmt *q_gc = qb_stmt(h, QB_GC_RESERVE2, j, i);
                 sqlite3_reset(q);
                 sqlite3_reset(q_gc);
                 if (qbind_int64(q, ":now", now)) {
@@ -8841,8 +10725,8 @@ rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period)
                     break;
               }
               for (k=0;k<gc_max_batch && ret2 == SQLITE_ROW && !*terminate;k++) {
-		sqlite3_stmt *q = h->qb_find_expired_ops[j][i];
-                sqlite3_stmt *q_gc = h->qb_gc_op[j][i];
+		sqlite3_stmt *q = qb_stmt(h, QB_FIND_EXPIRED_OPS, j, i);
+                sqlite3_stmt *q_gc = qb_stmt(h, QB_GC_OP, j, i);
                 sqlite3_reset(q);
                 sqlite3_reset(q_gc);
                 if (qbind_int64(q, ":now", real_now)) {
@@ -8870,31 +10754,38 @@ rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period)
                qrollback(h->datadb[j][i]);
                break;
             }
+            DEBUG("GC periodic: shard %c/%08x done, %lld reservations and %lld operations so far", sizedirs[j], i, (long long)gc, (long long)gcops);
         }
     }
     INFO("GCed %lld reservations, %lld operations", (long long)gc, (long long)gcops);
     return (ret1 || ret2) ? FAIL_EINTERNAL : OK;
 }
 
-rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate)
+rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate, int full)
 {
     unsigned i, j, k;
-    uint64_t gc = 0;
+    uint64_t gc = 0, checked = 0;
     int ret = 0;
     int64_t bad = 0;
+    struct timeval tv0, tv1;
+
+    gettimeofday(&tv0, NULL);
     for (j=0;j<SIZES && !ret && !*terminate; j++) {
-        for (i=0;i<HASHDBS && !ret && !*terminate;i++) {
-            sqlite3_reset(h->qb_find_bad[j][i]);
+        for (i=0;i<h->hashdbs && !ret && !*terminate;i++) {
+            if (gc_skip_shard(h, j, i))
+                continue;
+            sqlite3_stmt *q_bad = full ? qb_stmt(h, QB_FIND_BAD, j, i) : qb_stmt(h, QB_FIND_BAD_CAND, j, i);
+            sqlite3_reset(q_bad);
             do {
-                ret = qstep(h->qb_find_bad[j][i]);
+                ret = qstep(q_bad);
                 if (ret == SQLITE_ROW)
-                    bad += sqlite3_column_int64(h->qb_find_bad[j][i], 0);
+                    bad += sqlite3_column_int64(q_bad, 0);
             } while(ret == SQLITE_ROW);
             if (ret != SQLITE_DONE) {
                 WARN("Cannot query block counters");
                 return FAIL_EINTERNAL;
             }
-            sqlite3_reset(h->qb_find_bad[j][i]);
+            sqlite3_reset(q_bad);
         }
     }
     if (bad > 0) {
@@ -8908,15 +10799,22 @@ rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate)
     ret = 0;
 
     for (j=0;j<SIZES && !ret && !*terminate ;j++) {
-        for (i=0;i<HASHDBS && !ret && !*terminate;i++) {
+        for (i=0;i<h->hashdbs && !ret && !*terminate;i++) {
             int64_t last = 0;
-            sqlite3_stmt *q = h->qb_find_unused[j][i];
-            sqlite3_stmt *q_gc = h->qb_gc1[j][i];
-            sqlite3_stmt *q_setfree = h->qb_setfree[j][i];
+            uint64_t shard_gc = gc, shard_checked = checked;
+            struct timeval tvs;
+            if (gc_skip_shard(h, j, i))
+                continue;
+            gettimeofday(&tvs, NULL);
+            sqlite3_stmt *q = full ? qb_stmt(h, QB_FIND_UNUSED, j, i) : qb_stmt(h, QB_FIND_CAND, j, i);
+            sqlite3_stmt *q_gc = qb_stmt(h, QB_GC1, j, i);
+            sqlite3_stmt *q_setfree = qb_stmt(h, QB_SETFREE, j, i);
+            sqlite3_stmt *q_dequeue = qb_stmt(h, QB_GC_DEQUEUE, j, i);
             do {
                 sqlite3_reset(q);
                 sqlite3_reset(q_gc);
                 sqlite3_reset(q_setfree);
+                sqlite3_reset(q_dequeue);
                 if (qbind_int64(q, ":last", last))
                     break;
                 if (qbegin(h->datadb[j][i])) {
@@ -8927,6 +10825,17 @@ rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate)
                     int is_null = sqlite3_column_type(q, 1) == SQLITE_NULL;
                     last = sqlite3_column_int64(q, 0);
                     const sx_hash_t *hash = sqlite3_column_blob(q, 2);
+                    checked++;
+                    /* Block gone or back in use: drop it from the queue */
+                    if (!full && !sqlite3_column_int(q, 3)) {
+                        sqlite3_reset(q_dequeue);
+                        if (qbind_int64(q_dequeue, ":blockid", last) ||
+                            qstep_noret(q_dequeue)) {
+                            ret = -1;
+                            break;
+                        }
+                        continue;
+                    }
                     if (hash && sqlite3_column_bytes(q, 2) == sizeof(*hash)) {
                         if (sx_hashfs_blkrb_can_gc(h, hash, bsz[j]) != OK) {
                             DEBUGHASH("Hash is locked by rebalance", hash);
@@ -8944,16 +10853,24 @@ rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate)
                             break;
                         }
                     }
+                    sqlite3_reset(q_gc);
+                    sqlite3_reset(q_dequeue);
+                    /* Deleting the block requeues it through the cascades */
                     if (qbind_int64(q_gc, ":blockid", last) ||
-                        qstep_noret(q_gc)) {
+                        qstep_noret(q_gc) ||
+                        qbind_int64(q_dequeue, ":blockid", last) ||
+                        qstep_noret(q_dequeue)) {
                         ret = -1;
                         break;
                     }
+                    if (hash && sqlite3_column_bytes(q, 2) == sizeof(*hash))
+                        sx_blockcache_drop(bsz[j], hash);
                     gc++;
                 }
                 sqlite3_reset(q);
                 sqlite3_reset(q_gc);
                 sqlite3_reset(q_setfree);
+                sqlite3_reset(q_dequeue);
                 if (ret == SQLITE_DONE)
                     ret = 0;
                 if (!ret || ret == SQLITE_ROW) {
@@ -8964,9 +10881,89 @@ rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate)
                 } else
                     qrollback(h->datadb[j][i]);
             } while (ret == SQLITE_ROW);
+            gettimeofday(&tv1, NULL);
+            INFO("GC shard %c/%08x: freed %lld of %lld %s in %.1f sec", sizedirs[j], i,
+                 (long long)(gc - shard_gc), (long long)(checked - shard_checked),
+                 full ? "blocks" : "candidates", timediff(&tvs, &tv1));
+        }
+    }
+    gettimeofday(&tv1, NULL);
+    h->gc_last.full = full;
+    h->gc_last.checked = checked;
+    h->gc_last.freed = gc;
+    h->gc_last.elapsed = timediff(&tv0, &tv1);
+    INFO("GCed %lld hashes out of %lld %s", (long long)gc, (long long)checked, full ? "blocks" : "candidates");
+    return ret ? FAIL_EINTERNAL : OK;
+}
+
+static int punch_block(int fd, uint64_t off, unsigned int len) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+#else
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
+/* Releases the disk space of the slots freed by GC; the reclaim queue only
+ * holds slots which are in the avail list, so while the write lock is held
+ * nobody can be storing a block there */
+rc_ty sx_hashfs_gc_reclaim(sx_hashfs_t *h, int *terminate)
+{
+    unsigned i, j, k;
+    int64_t punched = 0;
+    int ret = 0;
+
+    for (j=0;j<SIZES && !ret && !*terminate; j++) {
+        for (i=0;i<h->hashdbs && !ret && !*terminate;i++) {
+            if (gc_skip_shard(h, j, i))
+                continue;
+            sqlite3_stmt *q = qb_stmt(h, QB_RECLAIM_LIST, j, i);
+            sqlite3_stmt *q_done = qb_stmt(h, QB_RECLAIM_DONE, j, i);
+            do {
+                int64_t last = -1;
+                if (qbegin(h->datadb[j][i])) {
+                    ret = -1;
+                    break;
+                }
+                sqlite3_reset(q);
+                for (k=0;k<gc_max_batch && (ret = qstep(q)) == SQLITE_ROW; k++) {
+                    last = sqlite3_column_int64(q, 0);
+                    if (h->nopunch)
+                        continue;
+                    if (punch_block(h->datafd[j][i], last * bsz[j], bsz[j])) {
+                        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+                            INFO("Hole punching is not supported, freed blocks will only be reused");
+                            h->nopunch = 1;
+                            continue;
+                        }
+                        WARN("Failed to release block %lld @%d/%d: %s", (long long)last, j, i, strerror(errno));
+                        ret = -1;
+                        break;
+                    }
+                    punched++;
+                }
+                sqlite3_reset(q);
+                if (ret == SQLITE_DONE)
+                    ret = 0;
+                if ((!ret || ret == SQLITE_ROW) && last >= 0) {
+                    sqlite3_reset(q_done);
+                    if (qbind_int64(q_done, ":last", last) || qstep_noret(q_done))
+                        ret = -1;
+                    sqlite3_reset(q_done);
+                }
+                if (!ret || ret == SQLITE_ROW) {
+                    if (qcommit(h->datadb[j][i])) {
+                        ret = -1;
+                        break;
+                    }
+                } else
+                    qrollback(h->datadb[j][i]);
+            } while (ret == SQLITE_ROW && !*terminate);
         }
     }
-    INFO("GCed %lld hashes", (long long)gc);
+    if (punched)
+        INFO("Released %lld free blocks", (long long)punched);
     return ret ? FAIL_EINTERNAL : OK;
 }
 
@@ -8979,7 +10976,7 @@ static rc_ty print_datadb_count(sx_hashfs_t *h, const char *table, int *terminat
     sqlite3_stmt *q = NULL;
     snprintf(query, sizeof(query), "SELECT COUNT(*) FROM %s", table);
     for (j=0;j<SIZES && !*terminate;j++) {
-        for (i=0;i<HASHDBS && !*terminate;i++) {
+        for (i=0;i<h->hashdbs && !*terminate;i++) {
             qnullify(q);
             if (qprep(h->datadb[j][i], &q, query) || qstep_ret(q)) {
                 WARN("print_count failed");
@@ -9001,8 +10998,14 @@ rc_ty sx_hashfs_gc_info(sx_hashfs_t *h, int *terminate)
 {
     rc_ty ret = OK;
     struct timeval tv0, tv1;
+    if (h->gc_last.elapsed > 0)
+        INFO("Last GC pass (%s): %lld blocks checked, %lld freed in %.1fs",
+             h->gc_last.full ? "full" : "incremental", (long long)h->gc_last.checked,
+             (long long)h->gc_last.freed, h->gc_last.elapsed);
     gettimeofday(&tv0, NULL);
-    if (print_datadb_count(h, "blocks", terminate) ||
+    if (print_datadb_count(h, "gc_candidates", terminate) ||
+        print_datadb_count(h, "reclaim", terminate) ||
+        print_datadb_count(h, "blocks", terminate) ||
         print_datadb_count(h, "reservations", terminate) ||
         print_datadb_count(h, "operations", terminate) ||
         print_datadb_count(h, "use", terminate) ||
@@ -10166,13 +12169,13 @@ void sx_storage_usage(sx_hashfs_t *h, int64_t *allocated, int64_t *committed) {
     al += dbfilesize(h->eventdb);
     al += dbfilesize(h->xferdb);
 
-    for(i=0; i<METADBS; i++)
+    for(i=0; i<h->metadbs; i++)
 	al += dbfilesize(h->metadb[i]);
 
     ci = al;
 
     for(j=0; j<SIZES; j++) {
-	for(i=0; i<HASHDBS; i++) {
+	for(i=0; i<h->hashdbs; i++) {
 	    int64_t rows = get_count(h->datadb[j][i], "blocks");
 	    int64_t dbsize = dbfilesize(h->datadb[j][i]);
 	    struct stat st;
@@ -10212,22 +12215,23 @@ static rc_ty sx_hashfs_blocks_restart(sx_hashfs_t *h, unsigned rebalance_version
     DEBUG("iteration reset with rebalance_version: %d", rebalance_version);
     unsigned i,j;
     for(j=0;j<SIZES;j++) {
-        for(i=0;i<HASHDBS;i++) {
-            sqlite3_reset(h->rit.q[j][i]);
-            sqlite3_reset(h->qb_get_meta[j][i]);
-            sqlite3_reset(h->qb_deleteold[j][i]);
-            sqlite3_clear_bindings(h->rit.q[j][i]);
-            sqlite3_clear_bindings(h->qb_get_meta[j][i]);
-            sqlite3_clear_bindings(h->qb_deleteold[j][i]);
-        }
-    }
-    for(j=0;j<SIZES;j++) {
-        for(i=0;i<HASHDBS;i++) {
-            if (qbind_blob(h->rit.q[j][i], ":prevhash", "", 0))
+        for(i=0;i<h->hashdbs;i++) {
+            sqlite3_stmt *qreb = qb_stmt(h, QB_REBALANCE, j, i);
+            sqlite3_stmt *qmeta = qb_stmt(h, QB_GET_META, j, i);
+            sqlite3_stmt *qdel = qb_stmt(h, QB_DELETEOLD, j, i);
+            if (!qreb || !qmeta || !qdel)
+                return FAIL_EINTERNAL;
+            sqlite3_reset(qreb);
+            sqlite3_reset(qmeta);
+            sqlite3_reset(qdel);
+            sqlite3_clear_bindings(qreb);
+            sqlite3_clear_bindings(qmeta);
+            sqlite3_clear_bindings(qdel);
+            if (qbind_blob(qreb, ":prevhash", "", 0))
                 return FAIL_EINTERNAL;
-            if (qbind_int(h->qb_get_meta[j][i], ":current_age", rebalance_version))
+            if (qbind_int(qmeta, ":current_age", rebalance_version))
                 return FAIL_EINTERNAL;
-            if (qbind_int(h->qb_deleteold[j][i], ":current_age", rebalance_version))
+            if (qbind_int(qdel, ":current_age", rebalance_version))
                 return FAIL_EINTERNAL;
         }
     }
@@ -10346,8 +12350,8 @@ static rc_ty sx_hashfs_blocks_retry_next(sx_hashfs_t *h, block_meta_t *blockmeta
         }
         const sx_hash_t* hash = sqlite3_column_blob(q, 1);
         DEBUGHASH("retry_next", hash);
-        unsigned int ndb = gethashdb(hash);
-        ret = sx_hashfs_blockmeta_get(h, ret, q, h->qb_get_meta[hs][ndb], bs, blockmeta);
+        unsigned int ndb = gethashdb(h, hash);
+        ret = sx_hashfs_blockmeta_get(h, ret, q, qb_stmt(h, QB_GET_META, hs, ndb), bs, blockmeta);
         return ret;
     }
     sqlite3_reset(q);
@@ -10360,9 +12364,9 @@ static rc_ty sx_hashfs_blocks_next(sx_hashfs_t *h, block_meta_t *blockmeta)
     int ret;
     memset(blockmeta, 0, sizeof(*blockmeta));
     for (;h->rit.sizeidx < SIZES; h->rit.sizeidx++) {
-        for (;h->rit.ndbidx < HASHDBS; h->rit.ndbidx++) {
-            sqlite3_stmt *q = h->rit.q[h->rit.sizeidx][h->rit.ndbidx];
-            sqlite3_stmt *qmeta = h->qb_get_meta[h->rit.sizeidx][h->rit.ndbidx];
+        for (;h->rit.ndbidx < h->hashdbs; h->rit.ndbidx++) {
+            sqlite3_stmt *q = qb_stmt(h, QB_REBALANCE, h->rit.sizeidx, h->rit.ndbidx);
+            sqlite3_stmt *qmeta = qb_stmt(h, QB_GET_META, h->rit.sizeidx, h->rit.ndbidx);
             sqlite3_reset(q);
             sqlite3_reset(qmeta);
             do {
@@ -10495,7 +12499,7 @@ rc_ty sx_hashfs_br_delete(sx_hashfs_t *h, const block_meta_t *blockmeta)
     }
     if ((ret = sx_hashfs_br_done(h, blockmeta)))
         return ret;
-    ndb = gethashdb(&blockmeta->hash);
+    ndb = gethashdb(h, &blockmeta->hash);
     for(hs = 0; hs < SIZES; hs++)
 	if(bsz[hs] == blockmeta->blocksize)
 	    break;
@@ -10503,7 +12507,7 @@ rc_ty sx_hashfs_br_delete(sx_hashfs_t *h, const block_meta_t *blockmeta)
 	WARN("bad blocksize: %d", blockmeta->blocksize);
 	return FAIL_BADBLOCKSIZE;
     }
-    sqlite3_stmt *q = h->qb_deleteold[hs][ndb];
+    sqlite3_stmt *q = qb_stmt(h, QB_DELETEOLD, hs, ndb);
     sqlite3_reset(q);
     if (qbind_blob(q, ":hash", blockmeta->hash.b, sizeof(blockmeta->hash.b)))
         return FAIL_EINTERNAL; 
@@ -10610,9 +12614,9 @@ rc_ty sx_hashfs_relocs_populate(sx_hashfs_t *h) {
     unsigned int i;
     rc_ty r;
 
-    for(i=0; i<METADBS; i++) {
-	sqlite3_reset(h->qm_wiperelocs[i]);
-	if(qstep_noret(h->qm_wiperelocs[i])) {
+    for(i=0; i<h->metadbs; i++) {
+	sqlite3_reset(h->qm[QM_WIPERELOCS][i]);
+	if(qstep_noret(qm_stmt(h, QM_WIPERELOCS, i))) {
 	    WARN("Failed to wipe relocation queue on db %u", i);
 	    return FAIL_EINTERNAL;
 	}
@@ -10655,11 +12659,11 @@ rc_ty sx_hashfs_relocs_populate(sx_hashfs_t *h) {
 		INFO("Setting files in volume %s to be relocated from here to %s(%s) for replica %u", vol->name, sx_node_uuid_str(next), sx_node_addr(next), i);
 		/* The upcoming i-th owner of this volume wans't already an owner:
 		 * all volume files are setup for relocation */
-		for(i=0; i<METADBS; i++) {
-		    sqlite3_reset(h->qm_addrelocs[i]);
-		    if(qbind_blob(h->qm_addrelocs[i], ":node", uuid->binary, sizeof(uuid->binary)) ||
-		       qbind_int64(h->qm_addrelocs[i], ":volid", vol->id) ||
-		       qstep_noret(h->qm_addrelocs[i])) {
+		for(i=0; i<h->metadbs; i++) {
+		    sqlite3_reset(h->qm[QM_ADDRELOCS][i]);
+		    if(qbind_blob(qm_stmt(h, QM_ADDRELOCS, i), ":node", uuid->binary, sizeof(uuid->binary)) ||
+		       qbind_int64(qm_stmt(h, QM_ADDRELOCS, i), ":volid", vol->id) ||
+		       qstep_noret(qm_stmt(h, QM_ADDRELOCS, i))) {
 			WARN("Failed to add relocation queue on db %u for volume %llu", i, (long long)vol->id);
 			sx_nodelist_delete(prevnodes);
 			sx_nodelist_delete(nextnodes);
@@ -10679,14 +12683,14 @@ rc_ty sx_hashfs_relocs_populate(sx_hashfs_t *h) {
 
 
 void sx_hashfs_relocs_begin(sx_hashfs_t *h) {
-    h->relocdb_start = h->relocdb_cur = sxi_rand() % METADBS;
+    h->relocdb_start = h->relocdb_cur = sxi_rand() % h->metadbs;
     h->relocid = 0;
 }
 
 static rc_ty relocs_delete(sx_hashfs_t *h, unsigned int relocdb, int64_t relocid) {
-    sqlite3_reset(h->qm_delreloc[relocdb]);
-    if(qbind_int64(h->qm_delreloc[relocdb], ":fileid", relocid) ||
-       qstep_noret(h->qm_delreloc[relocdb]))
+    sqlite3_reset(h->qm[QM_DELRELOC][relocdb]);
+    if(qbind_int64(qm_stmt(h, QM_DELRELOC, relocdb), ":fileid", relocid) ||
+       qstep_noret(qm_stmt(h, QM_DELRELOC, relocdb)))
 	return FAIL_EINTERNAL;
     return OK;
 }
@@ -10711,7 +12715,7 @@ rc_ty sx_hashfs_relocs_next(sx_hashfs_t *h, const sx_reloc_t **reloc) {
     *reloc = NULL;
     while(1) {
 	unsigned int ndb = h->relocdb_cur;
-	sqlite3_stmt *q = h->qm_getreloc[ndb];
+	sqlite3_stmt *q = qm_stmt(h, QM_GETRELOC, ndb);
 	const sx_hashfs_volume_t *volume;
     	const char *name, *rev;
 	const void *content;
@@ -10729,7 +12733,7 @@ rc_ty sx_hashfs_relocs_next(sx_hashfs_t *h, const sx_reloc_t **reloc) {
 	r = qstep(q);
 	if(r == SQLITE_DONE) {
 	    h->relocid = 0;
-	    h->relocdb_cur = (ndb + 1) % METADBS;
+	    h->relocdb_cur = (ndb + 1) % h->metadbs;
 	    if(h->relocdb_cur == h->relocdb_start)
 		return ITER_NO_MORE;
 	    continue;
@@ -10903,9 +12907,9 @@ rc_ty sx_hashfs_rb_cleanup(sx_hashfs_t *h) {
 	return FAIL_EINTERNAL;
     }
 
-    for(i=0; i<METADBS; i++) {
-	sqlite3_reset(h->qm_wiperelocs[i]);
-	if(qstep_noret(h->qm_wiperelocs[i])) {
+    for(i=0; i<h->metadbs; i++) {
+	sqlite3_reset(h->qm[QM_WIPERELOCS][i]);
+	if(qstep_noret(qm_stmt(h, QM_WIPERELOCS, i))) {
 	    WARN("Failed to wipe relocation queue on db %u", i);
 	    return FAIL_EINTERNAL;
 	}
@@ -10962,15 +12966,16 @@ rc_ty sx_hashfs_rb_cleanup(sx_hashfs_t *h) {
 
 	if(!sx_nodelist_lookup(volnodes, &selfuuid)) {
 	    INFO("Removing all files from %s which no longer belong in here", vol->name);
-	    for(i=0; i<METADBS; i++) {
-		sqlite3_reset(h->qm_delbyvol[i]);
-		if(qbind_int64(h->qm_delbyvol[i], ":volid", vol->id) ||
-		   qstep_noret(h->qm_delbyvol[i])) {
+	    for(i=0; i<h->metadbs; i++) {
+		sqlite3_reset(h->qm[QM_DELBYVOL][i]);
+		if(qbind_int64(qm_stmt(h, QM_DELBYVOL, i), ":volid", vol->id) ||
+		   qstep_noret(qm_stmt(h, QM_DELBYVOL, i))) {
                     WARN("Failed to delete relocated files on %u for volume %llu", i, (long long)vol->id);
                     sx_nodelist_delete(volnodes);
                     return FAIL_EINTERNAL;
                 }
 	    }
+            listidx_wipe(h, vol->id);
             if(sx_hashfs_reset_volume_cursize(h, vol->id, 0)) {
                 sx_nodelist_delete(volnodes);
                 return FAIL_EINTERNAL;
@@ -11084,9 +13089,9 @@ static rc_ty compute_volume_sizes(sx_hashfs_t *h) {
     const sx_hashfs_volume_t *vol = NULL;
     sqlite3_stmt *q = NULL;
     unsigned int i;
-    int locks[METADBS+1];
+    int locks[METADBS_MAX+1];
 
-    memset(locks, 0, sizeof(int) * (METADBS+1));
+    memset(locks, 0, sizeof(locks));
 
     /* Iterate over all volumes */
     for(s = sx_hashfs_volume_first(h, &vol, 0); s == OK; s = sx_hashfs_volume_next(h)) {
@@ -11098,17 +13103,17 @@ static rc_ty compute_volume_sizes(sx_hashfs_t *h) {
 
         if(qbegin(h->db))
             goto compute_volume_sizes_err;
-        locks[METADBS] = 1;
+        locks[h->metadbs] = 1;
 
-        for(i=0; i<METADBS; i++) {
+        for(i=0; i<h->metadbs; i++) {
             if(qbegin(h->metadb[i]))
                 goto compute_volume_sizes_err;
             locks[i] = 1;
         }
 
         /* Iterate over all meta databases */
-        for(i = 0; i < METADBS; i++) {
-            q = h->qm_sumfilesizes[i];
+        for(i = 0; i < h->metadbs; i++) {
+            q = qm_stmt(h, QM_SUMFILESIZES, i);
             int r;
 
             sqlite3_reset(q);
@@ -11136,10 +13141,10 @@ static rc_ty compute_volume_sizes(sx_hashfs_t *h) {
         if(qcommit(h->db))
             goto compute_volume_sizes_err;
         else
-            locks[METADBS] = 0;
+            locks[h->metadbs] = 0;
 
         /* Unlock meta dbs */
-        for(i = 0; i < METADBS; i++) {
+        for(i = 0; i < h->metadbs; i++) {
             qrollback(h->metadb[i]);
             locks[i] = 0;
         }
@@ -11154,10 +13159,10 @@ static rc_ty compute_volume_sizes(sx_hashfs_t *h) {
     ret = OK;
     compute_volume_sizes_err:
 
-    if(ret != OK && locks[METADBS])
+    if(ret != OK && locks[h->metadbs])
         qrollback(h->db);
 
-    for(i = 0; i < METADBS; i++)
+    for(i = 0; i < h->metadbs; i++)
         if(locks[i])
             qrollback(h->metadb[i]);
 
@@ -11379,9 +13384,9 @@ static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *
         NULLARG();
         return EFAULT;
     }
-    fdb = file->name[0] ? getmetadb(file->name) : 0;
+    fdb = file->name[0] ? getmetadb(h, file->name) : 0;
     if (file->revision[0]) {
-        q = h->qm_list_rev_dec[fdb];
+        q = qm_stmt(h, QM_LIST_REV_DEC, fdb);
         sqlite3_reset(q);
         if (qbind_int(q, ":volid", volume->id) ||
             qbind_text(q, ":name", file->name) ||
@@ -11408,7 +13413,7 @@ static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *
     }
 
     do {
-        q = h->qm_list_file[fdb];
+        q = qm_stmt(h, QM_LIST_FILE, fdb);
         DEBUG("previous:%s, maxrev:%s", file->name, maxrev);
         if (qbind_int(q, ":volid", volume->id) ||
             qbind_text(q, ":previous", file->name) ||
@@ -11437,7 +13442,7 @@ static rc_ty sx_hashfs_file_find_step(sx_hashfs_t *h, const sx_hashfs_volume_t *
         sqlite3_reset(q);
         if (rc != OK && rc != ITER_NO_MORE)
             return rc;
-        if (fdb >= METADBS)
+        if (fdb >= h->metadbs)
             return ITER_NO_MORE;
     } while (ret == SQLITE_DONE);
     return rc;
@@ -11488,7 +13493,7 @@ rc_ty sx_hashfs_br_find(sx_hashfs_t *h, const sx_block_meta_index_t *previous, u
     }
     *blockmetaptr = NULL;
     const sx_hash_t *hash = previous ? (const sx_hash_t*)&previous->b[1] : NULL;
-    unsigned int ndb = hash ? gethashdb(hash) : 0;
+    unsigned int ndb = hash ? gethashdb(h, hash) : 0;
     unsigned int sizeidx = previous ? previous->b[0] : 0;
     if (sizeidx >= SIZES) {
         WARN("bad size: %d", sizeidx);
@@ -11500,8 +13505,12 @@ rc_ty sx_hashfs_br_find(sx_hashfs_t *h, const sx_block_meta_index_t *previous, u
     DEBUG("rebalance_ver: %d", rebalance_ver);
     do {
         DEBUG("ndb: %d, sizeidx: %d", ndb, sizeidx);
-        sqlite3_stmt *q = h->rit.q[sizeidx][ndb];
-        sqlite3_stmt *qmeta = h->qb_get_meta[sizeidx][ndb];
+        sqlite3_stmt *q = qb_stmt(h, QB_REBALANCE, sizeidx, ndb);
+        sqlite3_stmt *qmeta = qb_stmt(h, QB_GET_META, sizeidx, ndb);
+        if (!q || !qmeta) {
+            rc = FAIL_EINTERNAL;
+            break;
+        }
         sqlite3_reset(q);
         sqlite3_reset(qmeta);
         sqlite3_clear_bindings(q);
@@ -11535,7 +13544,7 @@ rc_ty sx_hashfs_br_find(sx_hashfs_t *h, const sx_block_meta_index_t *previous, u
             }
         } while (ret == OK || ret == SQLITE_ROW);
         if (rc == ITER_NO_MORE) {
-            if (++ndb >= HASHDBS) {
+            if (++ndb >= h->hashdbs) {
                 ndb = 0;
                 if (++sizeidx >= SIZES) {
                     sx_hashfs_blockmeta_free(blockmetaptr);
@@ -87,13 +87,18 @@ typedef enum {
 typedef int64_t sx_uid_t;
 
 /* HashFS main actions */
-rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size);
+rc_ty sx_storage_create(const char *dir, sx_uuid_t *cluster, uint8_t *key, int key_size, unsigned int hashdbs, unsigned int metadbs);
+rc_ty sx_storage_reshard(const char *dir, sxc_client_t *sx, unsigned int hashdbs, unsigned int metadbs);
+rc_ty sx_storage_place(const char *dir, sxc_client_t *sx, const char *rule);
+int sx_storage_lock(const char *dir, int exclusive);
+void sx_storage_unlock(int fd);
 typedef struct _sx_hashfs_t sx_hashfs_t;
 sx_hashfs_t *sx_hashfs_open(const char *dir, sxc_client_t *sx);
 void sx_hashfs_checkpoint_passive(sx_hashfs_t *h);
 void sx_hashfs_checkpoint_gc(sx_hashfs_t *h);
 void sx_hashfs_checkpoint_eventdb(sx_hashfs_t *h);
 void sx_hashfs_checkpoint_xferdb(sx_hashfs_t *h);
+sxi_db_t *sx_hashfs_db_at(sx_hashfs_t *h, unsigned int idx, char *name, unsigned int namelen);
 int sx_storage_is_bare(sx_hashfs_t *h);
 int sx_hashfs_is_rebalancing(sx_hashfs_t *h);
 int sx_hashfs_is_orphan(sx_hashfs_t *h);
@@ -109,6 +114,7 @@ void sx_hashfs_set_triggers(sx_hashfs_t *h, int job_trigger, int xfer_trigger, i
 void sx_hashfs_close(sx_hashfs_t *h);
 int sx_hashfs_check(sx_hashfs_t *h, int debug);
 int sx_hashfs_extract(sx_hashfs_t *h, const char *destpath);
+int sx_hashfs_compact(sx_hashfs_t *h, unsigned int rate, int64_t *moved, int64_t *released);
 void sx_hashfs_stats(sx_hashfs_t *h);
 int sx_hashfs_analyze(sx_hashfs_t *h, int verbose);
 sx_nodelist_t *sx_hashfs_hashnodes(sx_hashfs_t *h, sx_hashfs_nl_t which, const sx_hash_t *hash, unsigned int replica_count);
@@ -121,6 +127,8 @@ sxi_db_t *sx_hashfs_xferdb(sx_hashfs_t *h);
 sxc_client_t *sx_hashfs_client(sx_hashfs_t *h);
 sxi_conns_t *sx_hashfs_conns(sx_hashfs_t *h);
 int sx_hashfs_hash_buf(const void *salt, unsigned int salt_len, const void *buf, unsigned int buf_len, sx_hash_t *hash);
+/* Hashes count equally sized buffers at once using the multi-buffer SHA1 */
+int sx_hashfs_hash_bufs(const void *salt, unsigned int salt_len, const void *const *bufs, unsigned int buf_len, unsigned int count, sx_hash_t *hashes);
 
 typedef struct _sx_hash_challenge_t {
     uint8_t challenge[TOKEN_RAND_BYTES];
@@ -265,13 +273,38 @@ rc_ty sx_hashfs_getfilemeta_next(sx_hashfs_t *h, const char **key, const void **
 
 /* Block xfer */
 rc_ty sx_hashfs_block_get(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash, const uint8_t **block);
+/* Returns the datafile descriptor and byte offset holding the block; the fd
+ * is owned by h and must not be closed by the caller */
+rc_ty sx_hashfs_block_locate(sx_hashfs_t *h, unsigned int bs, const sx_hash_t *hash, int *fd, uint64_t *offset);
 rc_ty sx_hashfs_block_put(sx_hashfs_t *h, const uint8_t *data, unsigned int bs, unsigned int replica_count, int propagate);
+/* Stores nblocks contiguous blocks using a single transaction per hash db */
+rc_ty sx_hashfs_block_put_batch(sx_hashfs_t *h, const uint8_t *data, unsigned int bs, unsigned int nblocks, unsigned int replica_count, int propagate);
 
 /* hash batch ops for GC */
 rc_ty sx_hashfs_hashop_perform(sx_hashfs_t *h, unsigned int block_size, unsigned replica_count, enum sxi_hashop_kind kind, const sx_hash_t *hash, const char *id, uint64_t op_expires_at, int *present);
 rc_ty sx_hashfs_hashop_mod(sx_hashfs_t *h, const sx_hash_t *hash, const char *id, unsigned int blocksize, unsigned replica, int count, uint64_t op_expires_at);
+/* A reservation (count == 0) or use counter change for sx_hashfs_hashop_batch */
+typedef struct {
+    sx_hash_t hash;
+    unsigned int block_size;
+    unsigned int replica;
+    int count;
+    rc_ty rc;
+} sx_hashop_entry_t;
+rc_ty sx_hashfs_hashop_batch(sx_hashfs_t *h, sx_hashop_entry_t *ops, unsigned int nops, const char *id, uint64_t op_expires_at);
 rc_ty sx_hashfs_gc_periodic(sx_hashfs_t *h, int *terminate, int grace_period);
-rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate);
+rc_ty sx_hashfs_gc_run(sx_hashfs_t *h, int *terminate, int full);
+rc_ty sx_hashfs_gc_reclaim(sx_hashfs_t *h, int *terminate);
+rc_ty sx_hashfs_listidx_build(sx_hashfs_t *h, int *terminate);
+void sx_hashfs_gc_shards(sx_hashfs_t *h, unsigned int worker, unsigned int nworkers);
+/* Totals of the last sx_hashfs_gc_run() pass, as logged by sx_hashfs_gc_info() */
+typedef struct {
+    int full;
+    int64_t checked, freed;
+    double elapsed;
+} sx_hashfs_gc_stats_t;
+void sx_hashfs_gc_get_last(const sx_hashfs_t *h, sx_hashfs_gc_stats_t *stats);
+void sx_hashfs_gc_set_last(sx_hashfs_t *h, const sx_hashfs_gc_stats_t *stats);
 rc_ty sx_hashfs_gc_info(sx_hashfs_t *h, int *terminate);
 rc_ty sx_hashfs_gc_expire_all_reservations(sx_hashfs_t *h);
 
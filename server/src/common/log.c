@@ -198,8 +198,8 @@ void log_setminlevel(sxc_client_t *sx, int prio)
         sxc_set_verbose(sx, 0);
 }
 
-static int64_t counter;
-static struct {
+static __thread int64_t counter;
+static __thread struct {
     char reason[65536];
     char details[65536];
     char id[128];
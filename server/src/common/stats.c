@@ -0,0 +1,198 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+#include "default.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+
+#include "stats.h"
+#include "utils.h"
+#include "log.h"
+#include "../libsx/src/misc.h"
+
+#define STATS_MAGIC 0x53585354
+#define STATS_VERSION 2
+
+static sx_stats_t *st;
+
+static char *stats_path(const char *dir) {
+    char *path = wrap_malloc(strlen(dir) + sizeof(SX_STATS_FILE) + 1);
+    if(path)
+	sprintf(path, "%s/%s", dir, SX_STATS_FILE);
+    return path;
+}
+
+int sx_stats_init(const char *dir) {
+    char *path;
+    int fd;
+
+    if(st) {
+	WARN("Server stats already initialized");
+	return -1;
+    }
+    if(!(path = stats_path(dir)))
+	return -1;
+    /* Counters restart from zero with the server */
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0 || ftruncate(fd, sizeof(*st))) {
+	PWARN("Failed to create the server stats file %s", path);
+	if(fd >= 0)
+	    close(fd);
+	free(path);
+	return -1;
+    }
+    st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(st == MAP_FAILED) {
+	PWARN("Failed to map the server stats file %s", path);
+	st = NULL;
+	free(path);
+	return -1;
+    }
+    free(path);
+    st->started = time(NULL);
+    st->version = STATS_VERSION;
+    st->magic = STATS_MAGIC;
+    return 0;
+}
+
+void sx_stats_done(void) {
+    if(!st)
+	return;
+    munmap(st, sizeof(*st));
+    st = NULL;
+}
+
+int sx_stats_get(sx_stats_t *stats) {
+    if(!st || !stats)
+	return -1;
+    /* Counters are updated independently, a snapshot may be slightly skewed */
+    memcpy(stats, st, sizeof(*stats));
+    return 0;
+}
+
+int sx_stats_read(const char *dir, sx_stats_t *stats) {
+    char *path;
+    int fd, ret = -1;
+
+    if(!dir || !stats || !(path = stats_path(dir)))
+	return -1;
+    fd = open(path, O_RDONLY);
+    if(fd >= 0) {
+	if(read(fd, stats, sizeof(*stats)) != sizeof(*stats))
+	    WARN("Cannot read the server stats from %s", path);
+	else if(stats->magic != STATS_MAGIC || stats->version != STATS_VERSION)
+	    WARN("Unknown server stats format in %s", path);
+	else
+	    ret = 0;
+	close(fd);
+    }
+    free(path);
+    return ret;
+}
+
+unsigned int sx_stats_bucket_ms(unsigned int bucket) {
+    return 1 << bucket;
+}
+
+/* Slot taken by a process that is still writing its name in: names are
+ * published by replacing this with the (always odd) key */
+#define STATS_CLAIMED 2
+
+/* Finds or claims the slot for name in a table of named counters */
+static void *stats_slot(void *table, unsigned int nslots, size_t slotsize, const char *name) {
+    uint64_t key = 14695981039346656037ULL, cur;
+    const char *c;
+    unsigned int i, n;
+
+    for(c = name; *c; c++)
+	key = (key ^ (unsigned char)*c) * 1099511628211ULL;
+    key |= 1;
+    for(n = 0, i = key % nslots; n < nslots; n++, i = (i + 1) % nslots) {
+	volatile uint64_t *slot = (uint64_t *)((char *)table + i * slotsize);
+	if(!*slot && __sync_bool_compare_and_swap(slot, 0, STATS_CLAIMED)) {
+	    /* Both the key and the name come right at the start of the slot */
+	    sxi_strlcpy((char *)(slot + 1), name, SX_STATS_NAMELEN);
+	    __sync_synchronize();
+	    *slot = key;
+	    return (void *)slot;
+	}
+	while((cur = *slot) == STATS_CLAIMED)
+	    sched_yield();
+	if(cur == key)
+	    return (void *)slot;
+    }
+    return NULL;
+}
+
+static void stats_max(uint64_t *max, uint64_t val) {
+    uint64_t cur;
+    while((cur = *max) < val && !__sync_bool_compare_and_swap(max, cur, val));
+}
+
+void sx_stats_request(const char *name, int status, uint64_t us, uint64_t bytes_in, uint64_t bytes_out) {
+    sx_stats_req_t *r;
+    unsigned int b;
+    uint64_t ms;
+
+    if(!st || !name)
+	return;
+    if(!(r = stats_slot(st->reqs, SX_STATS_REQS, sizeof(*r), name)))
+	return;
+    for(b = 0, ms = us / 1000; b < SX_STATS_BUCKETS - 1 && ms >= sx_stats_bucket_ms(b); b++);
+    __sync_fetch_and_add(&r->count, 1);
+    __sync_fetch_and_add(&r->hist[b], 1);
+    if(status >= 500)
+	__sync_fetch_and_add(&r->errors_5xx, 1);
+    else if(status >= 400)
+	__sync_fetch_and_add(&r->errors_4xx, 1);
+    __sync_fetch_and_add(&r->bytes_in, bytes_in);
+    __sync_fetch_and_add(&r->bytes_out, bytes_out);
+    __sync_fetch_and_add(&r->total_us, us);
+    stats_max(&r->max_us, us);
+}
+
+void sx_stats_busy(const char *dbname, unsigned int wait_ms, int timedout) {
+    sx_stats_db_t *d;
+
+    if(!st || !dbname)
+	return;
+    if(!(d = stats_slot(st->dbs, SX_STATS_DBS, sizeof(*d), dbname)))
+	return;
+    if(timedout)
+	__sync_fetch_and_add(&d->timeouts, 1);
+    else
+	__sync_fetch_and_add(&d->retries, 1);
+    __sync_fetch_and_add(&d->wait_ms, wait_ms);
+}
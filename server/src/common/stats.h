@@ -0,0 +1,82 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "default.h"
+#include <stdint.h>
+
+/* Request and database counters shared by all the processes forked after
+ * sx_stats_init(). The area is backed by a file in the storage directory
+ * so that offline tools can read the last values too. When no area was
+ * set up all the updates are no-ops. */
+
+#define SX_STATS_FILE "srvstats.bin"
+#define SX_STATS_NAMELEN 32
+#define SX_STATS_BUCKETS 20 /* Request latency: <1ms, <2ms, <4ms ... >=2^18ms */
+#define SX_STATS_REQS 256 /* Every verb with every name from request_name() */
+#define SX_STATS_DBS 192
+
+typedef struct {
+    uint64_t key; /* 0 if the slot is free, odd once the name is set */
+    char name[SX_STATS_NAMELEN];
+    uint64_t count;
+    uint64_t errors_4xx;
+    uint64_t errors_5xx;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t hist[SX_STATS_BUCKETS];
+} sx_stats_req_t;
+
+typedef struct {
+    uint64_t key;
+    char name[SX_STATS_NAMELEN];
+    uint64_t retries; /* Times a query found the database busy */
+    uint64_t timeouts; /* Times it gave up after db-busy-timeout */
+    uint64_t wait_ms;
+} sx_stats_db_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t started;
+    sx_stats_req_t reqs[SX_STATS_REQS];
+    sx_stats_db_t dbs[SX_STATS_DBS];
+} sx_stats_t;
+
+int sx_stats_init(const char *dir);
+void sx_stats_done(void);
+int sx_stats_get(sx_stats_t *stats);
+int sx_stats_read(const char *dir, sx_stats_t *stats);
+unsigned int sx_stats_bucket_ms(unsigned int bucket);
+void sx_stats_request(const char *name, int status, uint64_t us, uint64_t bytes_in, uint64_t bytes_out);
+void sx_stats_busy(const char *dbname, unsigned int wait_ms, int timedout);
+
+#endif
@@ -35,6 +35,7 @@
 #include "sxdbi.h"
 #include "utils.h"
 #include "log.h"
+#include "stats.h"
 
 static void qclose_db(sqlite3 **dbp)
 {
@@ -84,49 +85,68 @@ sxi_db_t *qnew(sqlite3 *handle)
     return db;
 }
 
-static void qcheckpoint_run(sxi_db_t *db, int kind)
+static int qcheckpoint_run(sxi_db_t *db, int kind, int *log, int *ckpt)
 {
     struct timeval tv0, tv1;
-    int log, ckpt, rc;
-    if (!db)
-        return;
+    int rc;
     gettimeofday(&tv0, NULL);
-    rc = sqlite3_wal_checkpoint_v2(db->handle, NULL, kind, &log, &ckpt);
+    rc = sqlite3_wal_checkpoint_v2(db->handle, NULL, kind, log, ckpt);
     gettimeofday(&tv1, NULL);
     if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) {
         WARN("Failed to checkpoint db '%s': %s", sqlite3_db_filename(db->handle, "main"), sqlite3_errmsg(db->handle));
-    } else if (ckpt > 0) {
-        DEBUG("WAL %s: %d frames, %d checkpointed: %s in %.1fs", sqlite3_db_filename(db->handle, "main"), log, ckpt, sqlite3_errmsg(db->handle),
+    } else if (*ckpt > 0) {
+        DEBUG("WAL %s: %d frames, %d checkpointed: %s in %.1fs", sqlite3_db_filename(db->handle, "main"), *log, *ckpt, sqlite3_errmsg(db->handle),
              timediff(&tv0, &tv1));
     }
     db->wal_pages = 0;
+    return rc;
 }
 
+/* With the checkpoint manager running, the other processes only
+ * checkpoint when it falls far behind, and never block on it */
+#define QCHECKPOINT_OWNED() (db_checkpoint_interval > 0)
+
 void qcheckpoint(sxi_db_t *db)
 {
+    int log, ckpt;
     if (!db)
         return;
+    if (QCHECKPOINT_OWNED()) {
+        if (db->wal_pages >= 2 * db_max_restart_wal_pages)
+            qcheckpoint_run(db, SQLITE_CHECKPOINT_PASSIVE, &log, &ckpt);
+        return;
+    }
     if (db->wal_pages >= db_max_restart_wal_pages)
-        qcheckpoint_run(db, SQLITE_CHECKPOINT_RESTART);
+        qcheckpoint_run(db, SQLITE_CHECKPOINT_RESTART, &log, &ckpt);
     else if (db->wal_pages >= db_max_passive_wal_pages)
-        qcheckpoint_run(db, SQLITE_CHECKPOINT_PASSIVE);
+        qcheckpoint_run(db, SQLITE_CHECKPOINT_PASSIVE, &log, &ckpt);
 }
 
 void qcheckpoint_restart(sxi_db_t *db)
 {
-    if (db && db->wal_pages >= db_min_passive_wal_pages)
-        qcheckpoint_run(db, SQLITE_CHECKPOINT_RESTART);
+    int log, ckpt;
+    if (db && !QCHECKPOINT_OWNED() && db->wal_pages >= db_min_passive_wal_pages)
+        qcheckpoint_run(db, SQLITE_CHECKPOINT_RESTART, &log, &ckpt);
+}
+
+int qcheckpoint_sched(sxi_db_t *db, int kind, int *log, int *ckpt)
+{
+    *log = *ckpt = 0;
+    if (!db)
+        return SQLITE_MISUSE;
+    return qcheckpoint_run(db, kind, log, ckpt);
 }
 
 void qcheckpoint_idle(sxi_db_t *db)
 {
-    if (db) {
+    if (db && !QCHECKPOINT_OWNED()) {
         int changes = sqlite3_total_changes(db->handle);
         if (changes != db->last_total_changes) {
             struct timeval tv;
             gettimeofday(&tv, NULL);
             if (timediff(&db->tv_last, &tv) >= db_idle_restart) {
-                qcheckpoint_run(db, SQLITE_CHECKPOINT_RESTART);
+                int log, ckpt;
+                qcheckpoint_run(db, SQLITE_CHECKPOINT_RESTART, &log, &ckpt);
                 memcpy(&db->tv_last, &tv, sizeof(tv));
                 db->last_total_changes = changes;
             }
@@ -212,44 +232,83 @@ int qprep(sxi_db_t *db, sqlite3_stmt **q, const char *query) {
 }
 
 
+static const unsigned int busy_delays[] = { 1, 2, 5, 10, 15, 20, 25, 25, 25, 50, 50, 100 };
+static const unsigned int busy_totals[] = { 0, 1, 3, 8, 18, 33, 53, 78, 103, 128, 178, 228 };
+#define NBUSY_DELAYS (sizeof(busy_delays) / sizeof(busy_delays[0]))
+
+static const char *qdbname(sqlite3 *handle)
+{
+    const char *name = sqlite3_db_filename(handle, "main"), *base;
+    if (!name || !*name)
+        return "memory";
+    base = strrchr(name, '/');
+    return base ? base + 1 : name;
+}
+
+/* Same backoff as the SQLite default busy handler, but accounted for */
+static int qbusy_handler(void *ctx, int count)
+{
+    sxi_db_t *db = ctx;
+    unsigned int delay, prior;
+
+    if (count < (int)NBUSY_DELAYS) {
+        delay = busy_delays[count];
+        prior = busy_totals[count];
+    } else {
+        delay = busy_delays[NBUSY_DELAYS - 1];
+        prior = busy_totals[NBUSY_DELAYS - 1] + delay * (count - (NBUSY_DELAYS - 1));
+    }
+    if (prior + delay > db->busy_ms) {
+        if (prior >= db->busy_ms) {
+            sx_stats_busy(qdbname(db->handle), 0, 1);
+            return 0;
+        }
+        delay = db->busy_ms - prior;
+    }
+    sx_stats_busy(qdbname(db->handle), delay, 0);
+    sqlite3_sleep(delay);
+    return 1;
+}
+
+int qbusy_timeout(sxi_db_t *db, unsigned int ms)
+{
+    if (!db)
+        return -1;
+    db->busy_ms = ms;
+    if (sqlite3_busy_handler(db->handle, ms ? qbusy_handler : NULL, db))
+        return -1;
+    return 0;
+}
+
 static int qstep_retry(sqlite3_stmt *q)
 {
-    static const unsigned int us_delays[] = {
-        1*1000, 2*1000, 5*1000, 10*1000, 15*1000, 20*1000, 25*1000, 25*1000,  25*1000,  50*1000,  50*1000, 100*1000
-    };
-    unsigned ms_timeout = 0, curdelay = 0;
+    const char *dbname = qdbname(sqlite3_db_handle(q));
+    unsigned ms_timeout = db_busy_timeout * 1000, curdelay = 0;
     struct timeval t1, t2;
     int ret;
 
     gettimeofday(&t1, NULL);
     while((ret = sqlite3_step(q)) == SQLITE_BUSY) {
-        unsigned int us_delay = us_delays[curdelay], ms_dt;
+        unsigned int ms_delay = busy_delays[curdelay], ms_dt;
 
         sqlite3_reset(q);
 
-        if(curdelay < (sizeof(us_delays) / sizeof(us_delays[0])) - 1)
+        if(curdelay < NBUSY_DELAYS - 1)
             curdelay++;
 
         gettimeofday(&t2, NULL);
-        if (!ms_timeout) {
-            sqlite3_stmt *q2 = NULL;
-            if(!qprep_db(sqlite3_db_handle(q), &q2, "PRAGMA busy_timeout") && !qstep_ret(q2))
-                ms_timeout = sqlite3_column_int(q2, 0);
-            else
-                ms_timeout = 25 * 1000;
-            sqlite3_finalize(q2);
-        }
-
         ms_dt = timediff(&t1, &t2) * 1000;
         if(ms_dt >= ms_timeout) {
             WARN("SQLite was busy on '%s' for more than %d ms", sqlite3_sql(q), ms_dt);
+            sx_stats_busy(dbname, 0, 1);
             msg_set_busy();
             ret = SQLITE_BUSY;
             break;
         }
-        if((ms_timeout - ms_dt) * 1000 < us_delay)
-            us_delay = (ms_timeout - ms_dt) * 1000;
-        usleep(us_delay);
+        if(ms_timeout - ms_dt < ms_delay)
+            ms_delay = ms_timeout - ms_dt;
+        sx_stats_busy(dbname, ms_delay, 0);
+        usleep(ms_delay * 1000);
     }
     return ret;
 }
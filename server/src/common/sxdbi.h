@@ -36,12 +36,15 @@ typedef struct {
     int wal_pages;
     int last_total_changes;
     struct timeval tv_last;
+    unsigned int busy_ms;
 } sxi_db_t;
 
 sxi_db_t* qnew(sqlite3 *handle);
+int qbusy_timeout(sxi_db_t *db, unsigned int ms);
 void qcheckpoint(sxi_db_t *db);
 void qcheckpoint_restart(sxi_db_t *db);
 void qcheckpoint_idle(sxi_db_t *db);
+int qcheckpoint_sched(sxi_db_t *db, int kind, int *log, int *ckpt);
 int qprep(sxi_db_t *db, sqlite3_stmt **q, const char *query);
 int qstep(sqlite3_stmt *q);
 int qstep_expect(sqlite3_stmt *q, int expect);
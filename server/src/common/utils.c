@@ -730,5 +730,13 @@ int db_max_passive_wal_pages=10000;
 int db_max_restart_wal_pages=20000;
 int db_idle_restart=60;
 int db_busy_timeout=20;
+int db_checkpoint_interval=0;
+int db_checkpoint_max_restarts=4;
 int worker_max_wait;
 int worker_max_requests;
+int worker_threads = 1;
+int download_zero_copy;
+int jobmgr_max_jobs = 1;
+int list_index;
+int gc_full_interval = 86400;
+int gc_workers = 1;
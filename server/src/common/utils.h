@@ -134,5 +134,13 @@ extern int db_max_passive_wal_pages;
 extern int db_max_restart_wal_pages;
 extern int db_idle_restart;
 extern int db_busy_timeout;
+extern int db_checkpoint_interval;
+extern int db_checkpoint_max_restarts;
 extern int worker_max_wait;
 extern int worker_max_requests;
+extern int worker_threads;
+extern int download_zero_copy;
+extern int jobmgr_max_jobs;
+extern int list_index;
+extern int gc_full_interval;
+extern int gc_workers;
@@ -34,6 +34,7 @@
 
 #include "hashfs.h"
 #include "log.h"
+#include "../libsx/src/curlevents.h"
 #include "blockmgr.h"
 
 static int terminate = 0;
@@ -73,7 +74,7 @@ static int hcb(const char *hash, unsigned int index, int code, void *context) {
 
 struct blockmgr_data_t {
     sx_hashfs_t *hashfs;
-    sqlite3_stmt *qprune, *qlist, *qdel, *qbump;
+    sqlite3_stmt *qprune, *qgroups, *qlist, *qdel, *qbump;
 };
 
 static void blockmgr_del_xfer(struct blockmgr_data_t *q, int64_t xfer_id) {
@@ -94,165 +95,353 @@ static void blockmgr_reschedule_xfer(struct blockmgr_data_t *q, int64_t xfer_id)
     sqlite3_reset(q->qbump);
 }
 
-static uint8_t upbuffer[UPLOAD_CHUNK_SIZE];
-void blockmgr_process_queue(struct blockmgr_data_t *q) {
-    sxc_client_t *sx = sx_hashfs_client(q->hashfs);
-    sxi_conns_t *clust = sx_hashfs_conns(q->hashfs);
-    const sx_node_t *me = sx_hashfs_self(q->hashfs);
-    sxi_hostlist_t uploadto;
+/* Transfer groups (i.e. distinct node and blocksize pairs) handled per pass */
+#define BLOCKMGR_MAX_GROUPS 8
+/* Oldest queued transfers looked at when picking the groups for a pass */
+#define BLOCKMGR_GROUP_SCAN 256
+/* Block uploads in flight to a single node */
+#define BLOCKMGR_NODE_INFLIGHT 2
+#define BLOCKMGR_MAX_UPLOADS (BLOCKMGR_MAX_GROUPS * BLOCKMGR_NODE_INFLIGHT)
+
+struct blockmgr_group_t {
+    struct blockmgr_hlist_t hlist;
+    sx_uuid_t node_uuid;
+    const char *host;
+    unsigned int bs;
+    unsigned int next; /* First block not yet handed to an upload */
+    int checked; /* Set once the presence check has completed */
+    sxi_hashop_t hc;
+};
+
+struct blockmgr_upload_t {
+    curlev_context_t *cbdata;
+    struct blockmgr_group_t *group;
+    uint8_t *buf;
+    unsigned int first, last; /* The blocks [first, last) of the group are in buf */
+};
+
+static struct blockmgr_group_t groups[BLOCKMGR_MAX_GROUPS];
+static struct blockmgr_upload_t uploads[BLOCKMGR_MAX_UPLOADS];
+
+static void blockmgr_del_group(struct blockmgr_data_t *q, const void *node, unsigned int bs) {
+    int64_t ids[DOWNLOAD_MAX_BLOCKS];
+    unsigned int i, n = 0;
 
-    sxi_hostlist_init(&uploadto);
     sqlite3_reset(q->qlist);
+    if(qbind_blob(q->qlist, ":node", node, sizeof(((sx_uuid_t *)0)->binary)) ||
+       qbind_int(q->qlist, ":size", bs))
+	return;
+    while(n < DOWNLOAD_MAX_BLOCKS && qstep(q->qlist) == SQLITE_ROW)
+	ids[n++] = sqlite3_column_int64(q->qlist, 0);
+    sqlite3_reset(q->qlist);
+    for(i=0; i<n; i++)
+	blockmgr_del_xfer(q, ids[i]);
+}
 
-    while(!terminate) {
-	struct blockmgr_hlist_t hlist;
-	int r = qstep(q->qlist), bs;
-	unsigned int hlen, nlen, i, j, trigger_jobmgr = 0;
+/* Picks up to BLOCKMGR_MAX_GROUPS (node, blocksize) pairs, oldest first */
+static unsigned int blockmgr_get_groups(struct blockmgr_data_t *q) {
+    const sx_node_t *me = sx_hashfs_self(q->hashfs);
+    unsigned int ngroups = 0, nrestarts = 0, i;
+    int r;
+
+    sqlite3_reset(q->qgroups);
+    while(ngroups < BLOCKMGR_MAX_GROUPS && (r = qstep(q->qgroups)) == SQLITE_ROW) {
+	int64_t xfer_id = sqlite3_column_int64(q->qgroups, 0);
+	const void *n = sqlite3_column_blob(q->qgroups, 1);
+	unsigned int nlen = sqlite3_column_bytes(q->qgroups, 1);
+	int bs = sqlite3_column_int(q->qgroups, 2);
 	const sx_node_t *node;
 	sx_uuid_t node_uuid;
-	const void *h, *n;
-	int64_t xfer_id;
-	sxi_hashop_t hc;
-	uint8_t *curb;
-        const char *token = NULL;
 
-	if(r == SQLITE_DONE) {
-	    DEBUG("No more pending transfers");
-	    break;
-	}
-	if(r != SQLITE_ROW) {
-	    WARN("Cannot list queued transfers");
-	    break;
-	}
-
-	xfer_id = sqlite3_column_int64(q->qlist, 0);
-	h = sqlite3_column_blob(q->qlist, 1);
-	hlen = sqlite3_column_bytes(q->qlist, 1);
-	bs = sqlite3_column_int(q->qlist, 2);
-        n = sqlite3_column_blob(q->qlist, 3);
-	nlen = sqlite3_column_bytes(q->qlist, 3);
-	if(!h || hlen != SXI_SHA1_BIN_LEN || /* Bad hash */
-	   !n || nlen != sizeof(node_uuid.binary) || /* Bad node */
+	if(!n || nlen != sizeof(node_uuid.binary) || /* Bad node */
 	   sx_hashfs_check_blocksize(bs)) { /* Bad blocksize */
 	    WARN("Removing bad transfer");
-	    sqlite3_reset(q->qlist);
+	    sqlite3_reset(q->qgroups);
 	    blockmgr_del_xfer(q, xfer_id);
-	    continue;
+	    if(++nrestarts > BLOCKMGR_GROUP_SCAN)
+		break;
+	    continue; /* Restart the scan */
 	}
 	uuid_from_binary(&node_uuid, n);
 
+	for(i=0; i<ngroups; i++)
+	    if(groups[i].bs == bs && !memcmp(groups[i].node_uuid.binary, node_uuid.binary, sizeof(node_uuid.binary)))
+		break;
+	if(i < ngroups)
+	    continue;
+
 	/* MODHDIST: no point in transfering to _prev set */
 	if(!(node = sx_nodelist_lookup(sx_hashfs_nodelist(q->hashfs, NL_NEXT), &node_uuid))) {
-	    WARN("Removing transfer to non existing node %s", node_uuid.string);
-	    sqlite3_reset(q->qlist);
-	    blockmgr_del_xfer(q, xfer_id);
+	    WARN("Removing transfers to non existing node %s", node_uuid.string);
+	    sqlite3_reset(q->qgroups);
+	    blockmgr_del_group(q, node_uuid.binary, bs);
+	    if(++nrestarts > BLOCKMGR_GROUP_SCAN)
+		break;
 	    continue;
 	}
-
 	if(!sx_node_cmp(node, me)) {
-	    WARN("Removing transfer to self");
-	    sqlite3_reset(q->qlist);
-	    blockmgr_del_xfer(q, xfer_id);
+	    WARN("Removing transfers to self");
+	    sqlite3_reset(q->qgroups);
+	    blockmgr_del_group(q, node_uuid.binary, bs);
+	    if(++nrestarts > BLOCKMGR_GROUP_SCAN)
+		break;
 	    continue;
 	}
 
-        const char *host = sx_node_internal_addr(node);
-	sxi_hostlist_empty(&uploadto);
-	if(sxi_hostlist_add_host(sx, &uploadto, host)) {
-	    WARN("Cannot generate hostlist");
+	memset(&groups[ngroups], 0, sizeof(groups[ngroups]));
+	memcpy(&groups[ngroups].node_uuid, &node_uuid, sizeof(node_uuid));
+	groups[ngroups].host = sx_node_internal_addr(node);
+	groups[ngroups].bs = bs;
+	ngroups++;
+    }
+    if(r != SQLITE_ROW && r != SQLITE_DONE)
+	WARN("Cannot list queued transfers");
+    sqlite3_reset(q->qgroups);
+    return ngroups;
+}
+
+/* Loads the transfers of a group and sends out its presence check */
+static int blockmgr_check_group(struct blockmgr_data_t *q, struct blockmgr_group_t *g) {
+    sxc_client_t *sx = sx_hashfs_client(q->hashfs);
+    struct blockmgr_hlist_t *hlist = &g->hlist;
+    unsigned int j;
+    int r;
+
+    sqlite3_reset(q->qlist);
+    if(qbind_blob(q->qlist, ":node", g->node_uuid.binary, sizeof(g->node_uuid.binary)) ||
+       qbind_int(q->qlist, ":size", g->bs))
+	return -1;
+    while(hlist->nblocks < DOWNLOAD_MAX_BLOCKS && (r = qstep(q->qlist)) == SQLITE_ROW) {
+	const void *h = sqlite3_column_blob(q->qlist, 1);
+	if(!h || sqlite3_column_bytes(q->qlist, 1) != SXI_SHA1_BIN_LEN) {
+	    /* Broken entries will be wiped on the next pass */
+	    WARN("Bad hash");
 	    break;
 	}
+	hlist->ids[hlist->nblocks] = sqlite3_column_int64(q->qlist, 0);
+	memcpy(&hlist->binhs[hlist->nblocks], h, SXI_SHA1_BIN_LEN);
+	hlist->nblocks++;
+    }
+    sqlite3_reset(q->qlist);
+    if(!hlist->nblocks) {
+	WARN("Failed to retrieve the transfer list");
+	return -1;
+    }
 
-	memset(&hlist, 0, sizeof(hlist));
-        if(sx_hashfs_make_token(q->hashfs, CLUSTER_USER, NULL, 0, time(NULL) + JOB_FILE_MAX_TIME, &token)) {
-            WARN("Cannot create blockmgr token");
-            break;
-        }
-        /* just check for presence, reservation was already done by the failed
-         * INUSE */
-	sxi_hashop_begin(&hc, clust, hcb, HASHOP_CHECK, 0, NULL, NULL, &hlist, 0);
-        for(hlist.nblocks = 0; r == SQLITE_ROW; hlist.nblocks++) {
-	    /* Some preliminary extra checks; broken entries will be wiped on the next (outer) loop */
-	    h = sqlite3_column_blob(q->qlist, 1);
-	    hlen = sqlite3_column_bytes(q->qlist, 1);
-	    n = sqlite3_column_blob(q->qlist, 3);
-	    nlen = sqlite3_column_bytes(q->qlist, 3);
-	    if(!h || hlen != SXI_SHA1_BIN_LEN) {
-                WARN("Bad hash");
-		break;
-            }
-	    if(!n || nlen != sizeof(node_uuid.binary)) {
-                WARN("Bad node");
-		break;
-            }
-	    if(memcmp(n, node_uuid.binary, sizeof(node_uuid.binary))) {
-                WARN("Inconsistent node");
-		break;
-            }
-	    if(bs != sqlite3_column_int(q->qlist, 2)) {
-                WARN("Inconsistent bs");
-		break;
-            }
+    /* just check for presence, reservation was already done by the failed
+     * INUSE */
+    sxi_hashop_begin(&g->hc, sx_hashfs_conns(q->hashfs), hcb, HASHOP_CHECK, 0, NULL, NULL, hlist, 0);
+    for(j=0; j<hlist->nblocks; j++) {
+	if(sxi_hashop_batch_add(&g->hc, g->host, j, hlist->binhs[j].b, g->bs) != 0) {
+	    WARN("Cannot verify block presence: %s", sxc_geterrmsg(sx));
+	    goto check_group_err;
+	}
+    }
+    /* Send the query now, its reply is collected along with the others */
+    if(sxi_hashop_batch_flush(&g->hc)) {
+	WARN("Cannot verify block presence on node %s: %s", g->node_uuid.string, sxc_geterrmsg(sx));
+	goto check_group_err;
+    }
+    return 0;
 
-	    hlist.ids[hlist.nblocks] = sqlite3_column_int64(q->qlist, 0);
-            memcpy(&hlist.binhs[hlist.nblocks], h, SXI_SHA1_BIN_LEN);
-            if(sxi_hashop_batch_add(&hc, host, hlist.nblocks, h, bs) != 0) {
-                WARN("Cannot verify block presence: %s", sxc_geterrmsg(sx));
-                blockmgr_reschedule_xfer(q, hlist.ids[hlist.nblocks]);
-            }
+ check_group_err:
+    /* Collect whatever was already sent, so that no callback can fire into
+     * hlist after the group is rescheduled and reused */
+    (void)sxi_hashop_end(&g->hc);
+    return -1;
+}
+
+static void blockmgr_reschedule_group(struct blockmgr_data_t *q, struct blockmgr_group_t *g) {
+    unsigned int j;
+    for(j=0; j<g->hlist.nblocks; j++)
+	blockmgr_reschedule_xfer(q, g->hlist.ids[j]);
+    g->hlist.nblocks = 0;
+}
+
+static unsigned int blockmgr_node_inflight(const struct blockmgr_group_t *g, unsigned int nuploads) {
+    unsigned int i, ret = 0;
+    for(i=0; i<nuploads; i++)
+	if(!memcmp(uploads[i].group->node_uuid.binary, g->node_uuid.binary, sizeof(g->node_uuid.binary)))
+	    ret++;
+    return ret;
+}
+
+/* Packs the next chunk of missing blocks of g and starts uploading it */
+static int blockmgr_start_upload(struct blockmgr_data_t *q, struct blockmgr_group_t *g, const char *token, struct blockmgr_upload_t *up) {
+    sxi_conns_t *clust = sx_hashfs_conns(q->hashfs);
+    struct blockmgr_hlist_t *hlist = &g->hlist;
+    uint8_t *curb = NULL;
+    unsigned int j;
+    char *url;
+    int r;
+
+    memset(up, 0, sizeof(*up));
+    up->group = g;
+    up->first = g->next;
+    for(; g->next < hlist->nblocks; g->next++) {
+	const uint8_t *b;
+	if(hlist->havehs[g->next])
+	    continue;
+	if(!up->buf) {
+	    if(!(up->buf = malloc(UPLOAD_CHUNK_SIZE))) {
+		WARN("Out of memory allocating upload buffer");
+		for(; g->next < hlist->nblocks; g->next++)
+		    if(!hlist->havehs[g->next])
+			blockmgr_reschedule_xfer(q, hlist->ids[g->next]);
+		return -1;
+	    }
+	    curb = up->buf;
+	}
+	if(UPLOAD_CHUNK_SIZE - (curb - up->buf) < g->bs)
+	    break;
+	if(sx_hashfs_block_get(q->hashfs, g->bs, &hlist->binhs[g->next], &b)) {
+	    INFO("Block %lld was not found locally", (long long)hlist->ids[g->next]);
+	    blockmgr_reschedule_xfer(q, hlist->ids[g->next]);
+	    hlist->havehs[g->next] = 1; /* Done with it for this pass */
+	    continue;
+	}
+	memcpy(curb, b, g->bs);
+	curb += g->bs;
+    }
+    up->last = g->next;
+    if(!up->buf)
+	return 1; /* Nothing left to upload */
+    if(curb == up->buf) {
+	free(up->buf);
+	return 1;
+    }
+
+    if(!(url = malloc(sizeof(".data/") + 32 + strlen(token) + 1))) {
+	WARN("Out of memory allocating upload url");
+	r = -1;
+    } else {
+	sprintf(url, ".data/%u/%s", g->bs, token);
+	if(!(up->cbdata = sxi_cbdata_create_generic(clust, NULL, NULL)))
+	    r = -1;
+	else
+	    r = sxi_cluster_query_ev(up->cbdata, clust, g->host, REQ_PUT, url, up->buf, curb - up->buf, NULL, NULL);
+	free(url);
+    }
+    if(r) {
+	WARN("Cannot start block transfer to %s", g->node_uuid.string);
+	for(j=up->first; j<up->last; j++)
+	    if(!hlist->havehs[j])
+		blockmgr_reschedule_xfer(q, hlist->ids[j]);
+	sxi_cbdata_unref(&up->cbdata);
+	free(up->buf);
+	return -1;
+    }
+    return 0;
+}
 
-	    r = qstep(q->qlist);
+/* Returns 1 if jobmgr should be triggered */
+static int blockmgr_finish_upload(struct blockmgr_data_t *q, struct blockmgr_upload_t *up) {
+    struct blockmgr_hlist_t *hlist = &up->group->hlist;
+    long status = 0;
+    unsigned int j;
+    int ret = 0;
+
+    if(sxi_cbdata_result(up->cbdata, NULL, NULL, &status) == -1 || status != 200) {
+	WARN("Block transfer to %s failed: %s", up->group->node_uuid.string, sxi_cbdata_geterrmsg(up->cbdata));
+	for(j=up->first; j<up->last; j++)
+	    if(!hlist->havehs[j])
+		blockmgr_reschedule_xfer(q, hlist->ids[j]);
+    } else {
+	for(j=up->first; j<up->last; j++) {
+	    char debughash[sizeof(sx_hash_t)*2+1];
+	    const sx_hash_t *hash = &hlist->binhs[j];
+	    if(hlist->havehs[j])
+		continue;
+	    bin2hex(hash->b, sizeof(hash->b), debughash, sizeof(debughash));
+	    DEBUG("Block %lld #%s# was transferred successfuly", (long long)hlist->ids[j], debughash);
+	    blockmgr_del_xfer(q, hlist->ids[j]);
+	    hlist->havehs[j] = 1;
+	    ret = 1;
 	}
+    }
+    sxi_cbdata_unref(&up->cbdata);
+    free(up->buf);
+    return ret;
+}
 
-	if(r != SQLITE_DONE || !hlist.nblocks) {
-	    WARN("Failed to retrieve the transfer list");
+/* Each pass takes the oldest transfer groups (up to BLOCKMGR_MAX_GROUPS):
+ * the presence checks for all of them are sent out at once, then the missing
+ * blocks are uploaded with up to BLOCKMGR_NODE_INFLIGHT requests in flight to
+ * each node. All the requests share the curlev multi handle. */
+void blockmgr_process_queue(struct blockmgr_data_t *q) {
+    sxc_client_t *sx = sx_hashfs_client(q->hashfs);
+    curl_events_t *ev = sxi_conns_get_curlev(sx_hashfs_conns(q->hashfs));
+
+    while(!terminate) {
+	unsigned int ngroups, nuploads = 0, i, j, trigger_jobmgr = 0;
+        const char *token = NULL;
+
+	ngroups = blockmgr_get_groups(q);
+	if(!ngroups) {
+	    DEBUG("No more pending transfers");
 	    break;
 	}
 
-	sqlite3_reset(q->qlist);
+        if(sx_hashfs_make_token(q->hashfs, CLUSTER_USER, NULL, 0, time(NULL) + JOB_FILE_MAX_TIME, &token)) {
+            WARN("Cannot create blockmgr token");
+            break;
+        }
 
-	if(sxi_hashop_end(&hc) == -1) {
-	    WARN("Cannot verify block presence on node %s: %s", node_uuid.string, sxc_geterrmsg(sx));
-	    for(j=0; j<hlist.nblocks; j++)
-		blockmgr_reschedule_xfer(q, hlist.ids[j]);
-	    continue;
+	for(i=0; i<ngroups; i++)
+	    groups[i].checked = !blockmgr_check_group(q, &groups[i]);
+
+	for(i=0; i<ngroups; i++) {
+	    struct blockmgr_group_t *g = &groups[i];
+	    if(!g->checked) {
+		blockmgr_reschedule_group(q, g);
+		continue;
+	    }
+	    if(sxi_hashop_end(&g->hc) == -1) {
+		WARN("Cannot verify block presence on node %s: %s", g->node_uuid.string, sxc_geterrmsg(sx));
+		blockmgr_reschedule_group(q, g);
+		continue;
+	    }
+	    for(j=0; j<g->hlist.nblocks; j++) {
+		if(g->hlist.havehs[j]) {
+		    /* TODO: print actual hash */
+		    DEBUG("Block %d was found remotely", j);
+		    blockmgr_del_xfer(q, g->hlist.ids[j]);
+		}
+	    }
 	}
 
-	curb = upbuffer;
-	for(i=0; i<hlist.nblocks; i++) {
-	    const uint8_t *b;
-	    if(hlist.havehs[i]) {
-                /* TODO: print actual hash */
-		DEBUG("Block %d was found remotely", i);
-		blockmgr_del_xfer(q, hlist.ids[i]);
-	    } else if(sx_hashfs_block_get(q->hashfs, bs, &hlist.binhs[i], &b)) {
-		INFO("Block %ld was not found locally", hlist.ids[i]);
-		blockmgr_reschedule_xfer(q, hlist.ids[i]);
-	    } else {
-		memcpy(curb, b, bs);
-		curb += bs;
+	while(1) {
+	    /* Fill the free upload slots, within the per node limit */
+	    for(i=0; i<ngroups && nuploads < BLOCKMGR_MAX_UPLOADS && !terminate; i++) {
+		struct blockmgr_group_t *g = &groups[i];
+		while(g->next < g->hlist.nblocks && nuploads < BLOCKMGR_MAX_UPLOADS &&
+		      blockmgr_node_inflight(g, nuploads) < BLOCKMGR_NODE_INFLIGHT) {
+		    if(!blockmgr_start_upload(q, g, token, &uploads[nuploads]))
+			nuploads++;
+		}
 	    }
-	    if(sizeof(upbuffer) - (curb - upbuffer) < bs || i == hlist.nblocks - 1) {
-		/* upload chunk */
-		if(sxi_upload_block_from_buf(clust, &uploadto, token, upbuffer, bs, curb-upbuffer)) {
-		    WARN("Block transfer failed");
-		    for(j=0; j<=i; j++)
-			if(!hlist.havehs[j])
-			    blockmgr_reschedule_xfer(q, hlist.ids[j]);
+	    if(!nuploads)
+		break;
+
+	    /* Wait for at least one upload to complete */
+	    for(i=0; i<nuploads; i++)
+		if(sxi_cbdata_is_finished(uploads[i].cbdata))
 		    break;
+	    if(i == nuploads && sxi_curlev_poll(ev)) {
+		WARN("Failed to wait for block transfers");
+		for(i=0; i<nuploads; i++) {
+		    sxi_cbdata_wait(uploads[i].cbdata, ev, NULL);
+		    trigger_jobmgr |= blockmgr_finish_upload(q, &uploads[i]);
 		}
-		curb = upbuffer;
-		for(j=0; j<=i; j++) {
-                    char debughash[sizeof(sx_hash_t)*2+1];
-                    const sx_hash_t *hash = &hlist.binhs[j];
-		    if(hlist.havehs[j])
-			continue;
-                    bin2hex(hash->b, sizeof(hash->b), debughash, sizeof(debughash));
-		    DEBUG("Block %ld #%s# was transferred successfuly", hlist.ids[j], debughash);
-		    blockmgr_del_xfer(q, hlist.ids[j]);
-		    hlist.havehs[j] = 1;
-		    trigger_jobmgr = 1;
+		break;
+	    }
+	    for(i=0; i<nuploads; ) {
+		if(!sxi_cbdata_is_finished(uploads[i].cbdata)) {
+		    i++;
+		    continue;
 		}
+		trigger_jobmgr |= blockmgr_finish_upload(q, &uploads[i]);
+		uploads[i] = uploads[--nuploads];
 	    }
 	}
 
@@ -260,8 +449,6 @@ void blockmgr_process_queue(struct blockmgr_data_t *q) {
 	    sx_hashfs_job_trigger(q->hashfs);
         sx_hashfs_checkpoint_passive(q->hashfs);
     }
-    sxi_hostlist_empty(&uploadto);
-    sqlite3_reset(q->qlist); /* Better safe than deadlocked */
 }
 
 int blockmgr(sxc_client_t *sx, const char *self, const char *dir, int pipe) {
@@ -294,7 +481,9 @@ int blockmgr(sxc_client_t *sx, const char *self, const char *dir, int pipe) {
 
     if(qprep(xferdb, &q.qprune, "DELETE FROM topush WHERE id IN (SELECT id FROM topush LEFT JOIN onhold ON block = hblock AND size = hsize AND node = hnode WHERE hid IS NULL) AND sched_time > expiry_time")) /* If you touch this query, please double check index usage! */
 	goto blockmgr_err;
-    if(qprep(xferdb, &q.qlist, "SELECT a.id, a.block, a.size, a.node FROM topush AS a LEFT JOIN (SELECT size, node FROM topush ORDER BY sched_time ASC LIMIT 1) AS b ON a.node = b.node AND a.size = b.size WHERE b.node IS NOT NULL AND b.size IS NOT NULL AND sched_time <= strftime('%Y-%m-%d %H:%M:%f') ORDER BY sched_time ASC LIMIT "STRIFY(DOWNLOAD_MAX_BLOCKS)))
+    if(qprep(xferdb, &q.qgroups, "SELECT id, node, size FROM topush WHERE sched_time <= strftime('%Y-%m-%d %H:%M:%f') ORDER BY sched_time ASC LIMIT "STRIFY(BLOCKMGR_GROUP_SCAN)))
+	goto blockmgr_err;
+    if(qprep(xferdb, &q.qlist, "SELECT id, block FROM topush WHERE node = :node AND size = :size AND sched_time <= strftime('%Y-%m-%d %H:%M:%f') ORDER BY sched_time ASC LIMIT "STRIFY(DOWNLOAD_MAX_BLOCKS)))
 	goto blockmgr_err;
     if(qprep(xferdb, &q.qdel, "DELETE FROM topush WHERE id = :id"))
 	goto blockmgr_err;
@@ -328,6 +517,7 @@ int blockmgr(sxc_client_t *sx, const char *self, const char *dir, int pipe) {
  blockmgr_err:
     sqlite3_finalize(q.qbump);
     sqlite3_finalize(q.qprune);
+    sqlite3_finalize(q.qgroups);
     sqlite3_finalize(q.qlist);
     sqlite3_finalize(q.qdel);
     sx_hashfs_close(q.hashfs);
@@ -57,6 +57,15 @@ const char *gengetopt_args_info_full_help[] = {
   "      --db-busy-timeout=sec     SQLite database busy timeout  (default=`20')",
   "      --worker-max-wait=sec     Maximum time to wait before killing a worker\n                                  (default=`300')",
   "      --worker-max-requests=N   Maximum number of requests / worker\n                                  (default=`5000')",
+  "      --block-cache-size=MB     Size of the block cache shared by the workers (0\n                                  disables)  (default=`64')",
+  "      --zero-copy-download      Stream downloaded blocks straight from the\n                                  datafiles to the web server  (default=off)",
+  "      --jobmgr-max-jobs=N       Maximum number of jobs run concurrently by the\n                                  job manager  (default=`1')",
+  "      --list-index              Serve file listings from a per-volume name index\n                                  (default=off)",
+  "      --gc-full-interval=sec    How often the GC scans all blocks rather than\n                                  just the queued candidates  (default=`86400')",
+  "      --gc-workers=N            Number of processes running GC on separate hash\n                                  database shards  (default=`1')",
+  "      --db-checkpoint-interval=MSEC\n                                Interval between the checkpoint manager rounds\n                                  in milliseconds, 0 lets every process\n                                  checkpoint on its own  (default=`1000')",
+  "      --db-checkpoint-max-restarts=N\n                                Maximum number of RESTART checkpoints per\n                                  checkpoint manager round  (default=`4')",
+  "      --worker-threads=N        Requests served concurrently by each worker, up\n                                  to 16: every thread opens its own copy of all\n                                  the databases and datafiles  (default=`1')",
     0
 };
 
@@ -154,6 +163,15 @@ void clear_given (struct gengetopt_args_info *args_info)
   args_info->db_busy_timeout_given = 0 ;
   args_info->worker_max_wait_given = 0 ;
   args_info->worker_max_requests_given = 0 ;
+  args_info->block_cache_size_given = 0 ;
+  args_info->zero_copy_download_given = 0 ;
+  args_info->jobmgr_max_jobs_given = 0 ;
+  args_info->list_index_given = 0 ;
+  args_info->gc_full_interval_given = 0 ;
+  args_info->gc_workers_given = 0 ;
+  args_info->db_checkpoint_interval_given = 0 ;
+  args_info->db_checkpoint_max_restarts_given = 0 ;
+  args_info->worker_threads_given = 0 ;
 }
 
 static
@@ -197,6 +215,22 @@ void clear_args (struct gengetopt_args_info *args_info)
   args_info->worker_max_wait_orig = NULL;
   args_info->worker_max_requests_arg = 5000;
   args_info->worker_max_requests_orig = NULL;
+  args_info->block_cache_size_arg = 64;
+  args_info->block_cache_size_orig = NULL;
+  args_info->zero_copy_download_flag = 0;
+  args_info->jobmgr_max_jobs_arg = 1;
+  args_info->jobmgr_max_jobs_orig = NULL;
+  args_info->list_index_flag = 0;
+  args_info->gc_full_interval_arg = 86400;
+  args_info->gc_full_interval_orig = NULL;
+  args_info->gc_workers_arg = 1;
+  args_info->gc_workers_orig = NULL;
+  args_info->db_checkpoint_interval_arg = 1000;
+  args_info->db_checkpoint_interval_orig = NULL;
+  args_info->db_checkpoint_max_restarts_arg = 4;
+  args_info->db_checkpoint_max_restarts_orig = NULL;
+  args_info->worker_threads_arg = 1;
+  args_info->worker_threads_orig = NULL;
   
 }
 
@@ -228,6 +262,15 @@ void init_args_info(struct gengetopt_args_info *args_info)
   args_info->db_busy_timeout_help = gengetopt_args_info_full_help[20] ;
   args_info->worker_max_wait_help = gengetopt_args_info_full_help[21] ;
   args_info->worker_max_requests_help = gengetopt_args_info_full_help[22] ;
+  args_info->block_cache_size_help = gengetopt_args_info_full_help[23] ;
+  args_info->zero_copy_download_help = gengetopt_args_info_full_help[24] ;
+  args_info->jobmgr_max_jobs_help = gengetopt_args_info_full_help[25] ;
+  args_info->list_index_help = gengetopt_args_info_full_help[26] ;
+  args_info->gc_full_interval_help = gengetopt_args_info_full_help[27] ;
+  args_info->gc_workers_help = gengetopt_args_info_full_help[28] ;
+  args_info->db_checkpoint_interval_help = gengetopt_args_info_full_help[29] ;
+  args_info->db_checkpoint_max_restarts_help = gengetopt_args_info_full_help[30] ;
+  args_info->worker_threads_help = gengetopt_args_info_full_help[31] ;
   
 }
 
@@ -344,6 +387,13 @@ cmdline_parser_release (struct gengetopt_args_info *args_info)
   free_string_field (&(args_info->db_busy_timeout_orig));
   free_string_field (&(args_info->worker_max_wait_orig));
   free_string_field (&(args_info->worker_max_requests_orig));
+  free_string_field (&(args_info->block_cache_size_orig));
+  free_string_field (&(args_info->jobmgr_max_jobs_orig));
+  free_string_field (&(args_info->gc_full_interval_orig));
+  free_string_field (&(args_info->gc_workers_orig));
+  free_string_field (&(args_info->db_checkpoint_interval_orig));
+  free_string_field (&(args_info->db_checkpoint_max_restarts_orig));
+  free_string_field (&(args_info->worker_threads_orig));
   
   
 
@@ -420,6 +470,24 @@ cmdline_parser_dump(FILE *outfile, struct gengetopt_args_info *args_info)
     write_into_file(outfile, "worker-max-wait", args_info->worker_max_wait_orig, 0);
   if (args_info->worker_max_requests_given)
     write_into_file(outfile, "worker-max-requests", args_info->worker_max_requests_orig, 0);
+  if (args_info->block_cache_size_given)
+    write_into_file(outfile, "block-cache-size", args_info->block_cache_size_orig, 0);
+  if (args_info->zero_copy_download_given)
+    write_into_file(outfile, "zero-copy-download", 0, 0 );
+  if (args_info->jobmgr_max_jobs_given)
+    write_into_file(outfile, "jobmgr-max-jobs", args_info->jobmgr_max_jobs_orig, 0);
+  if (args_info->list_index_given)
+    write_into_file(outfile, "list-index", 0, 0 );
+  if (args_info->gc_full_interval_given)
+    write_into_file(outfile, "gc-full-interval", args_info->gc_full_interval_orig, 0);
+  if (args_info->gc_workers_given)
+    write_into_file(outfile, "gc-workers", args_info->gc_workers_orig, 0);
+  if (args_info->db_checkpoint_interval_given)
+    write_into_file(outfile, "db-checkpoint-interval", args_info->db_checkpoint_interval_orig, 0);
+  if (args_info->db_checkpoint_max_restarts_given)
+    write_into_file(outfile, "db-checkpoint-max-restarts", args_info->db_checkpoint_max_restarts_orig, 0);
+  if (args_info->worker_threads_given)
+    write_into_file(outfile, "worker-threads", args_info->worker_threads_orig, 0);
   
 
   i = EXIT_SUCCESS;
@@ -723,6 +791,15 @@ cmdline_parser_internal (
         { "db-busy-timeout",	1, NULL, 0 },
         { "worker-max-wait",	1, NULL, 0 },
         { "worker-max-requests",	1, NULL, 0 },
+        { "block-cache-size",	1, NULL, 0 },
+        { "zero-copy-download",	0, NULL, 0 },
+        { "jobmgr-max-jobs",	1, NULL, 0 },
+        { "list-index",	0, NULL, 0 },
+        { "gc-full-interval",	1, NULL, 0 },
+        { "gc-workers",	1, NULL, 0 },
+        { "db-checkpoint-interval",	1, NULL, 0 },
+        { "db-checkpoint-max-restarts",	1, NULL, 0 },
+        { "worker-threads",	1, NULL, 0 },
         { 0,  0, 0, 0 }
       };
 
@@ -1034,6 +1111,128 @@ cmdline_parser_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Size of the block cache shared by the workers (0 disables).  */
+          else if (strcmp (long_options[option_index].name, "block-cache-size") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->block_cache_size_arg), 
+                 &(args_info->block_cache_size_orig), &(args_info->block_cache_size_given),
+                &(local_args_info.block_cache_size_given), optarg, 0, "64", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "block-cache-size", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Stream downloaded blocks straight from the datafiles to the web server.  */
+          else if (strcmp (long_options[option_index].name, "zero-copy-download") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->zero_copy_download_flag), 0, &(args_info->zero_copy_download_given),
+                &(local_args_info.zero_copy_download_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "zero-copy-download", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Maximum number of jobs run concurrently by the job manager.  */
+          else if (strcmp (long_options[option_index].name, "jobmgr-max-jobs") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->jobmgr_max_jobs_arg), 
+                 &(args_info->jobmgr_max_jobs_orig), &(args_info->jobmgr_max_jobs_given),
+                &(local_args_info.jobmgr_max_jobs_given), optarg, 0, "1", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "jobmgr-max-jobs", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Serve file listings from a per-volume name index.  */
+          else if (strcmp (long_options[option_index].name, "list-index") == 0)
+          {
+          
+          
+            if (update_arg((void *)&(args_info->list_index_flag), 0, &(args_info->list_index_given),
+                &(local_args_info.list_index_given), optarg, 0, 0, ARG_FLAG,
+                check_ambiguity, override, 1, 0, "list-index", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* How often the GC scans all blocks rather than just the queued candidates.  */
+          else if (strcmp (long_options[option_index].name, "gc-full-interval") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->gc_full_interval_arg), 
+                 &(args_info->gc_full_interval_orig), &(args_info->gc_full_interval_given),
+                &(local_args_info.gc_full_interval_given), optarg, 0, "86400", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "gc-full-interval", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Number of processes running GC on separate hash database shards.  */
+          else if (strcmp (long_options[option_index].name, "gc-workers") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->gc_workers_arg), 
+                 &(args_info->gc_workers_orig), &(args_info->gc_workers_given),
+                &(local_args_info.gc_workers_given), optarg, 0, "1", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "gc-workers", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Interval between the checkpoint manager rounds in milliseconds, 0 lets every process checkpoint on its own.  */
+          else if (strcmp (long_options[option_index].name, "db-checkpoint-interval") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->db_checkpoint_interval_arg), 
+                 &(args_info->db_checkpoint_interval_orig), &(args_info->db_checkpoint_interval_given),
+                &(local_args_info.db_checkpoint_interval_given), optarg, 0, "1000", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "db-checkpoint-interval", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Maximum number of RESTART checkpoints per checkpoint manager round.  */
+          else if (strcmp (long_options[option_index].name, "db-checkpoint-max-restarts") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->db_checkpoint_max_restarts_arg), 
+                 &(args_info->db_checkpoint_max_restarts_orig), &(args_info->db_checkpoint_max_restarts_given),
+                &(local_args_info.db_checkpoint_max_restarts_given), optarg, 0, "4", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "db-checkpoint-max-restarts", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Requests served concurrently by each worker, up to 16: every thread opens its own copy of all the databases and datafiles.  */
+          else if (strcmp (long_options[option_index].name, "worker-threads") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->worker_threads_arg), 
+                 &(args_info->worker_threads_orig), &(args_info->worker_threads_given),
+                &(local_args_info.worker_threads_given), optarg, 0, "1", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "worker-threads", '-',
+                additional_error))
+              goto failure;
+          
           }
           
           break;
@@ -98,6 +98,31 @@ struct gengetopt_args_info
   int worker_max_requests_arg;	/**< @brief Maximum number of requests / worker (default='5000').  */
   char * worker_max_requests_orig;	/**< @brief Maximum number of requests / worker original value given at command line.  */
   const char *worker_max_requests_help; /**< @brief Maximum number of requests / worker help description.  */
+  int block_cache_size_arg;	/**< @brief Size of the block cache shared by the workers (0 disables) (default='64').  */
+  char * block_cache_size_orig;	/**< @brief Size of the block cache shared by the workers (0 disables) original value given at command line.  */
+  const char *block_cache_size_help; /**< @brief Size of the block cache shared by the workers (0 disables) help description.  */
+  int zero_copy_download_flag;	/**< @brief Stream downloaded blocks straight from the datafiles to the web server (default=off).  */
+  const char *zero_copy_download_help; /**< @brief Stream downloaded blocks straight from the datafiles to the web server help description.  */
+  int jobmgr_max_jobs_arg;	/**< @brief Maximum number of jobs run concurrently by the job manager (default='1').  */
+  char * jobmgr_max_jobs_orig;	/**< @brief Maximum number of jobs run concurrently by the job manager original value given at command line.  */
+  const char *jobmgr_max_jobs_help; /**< @brief Maximum number of jobs run concurrently by the job manager help description.  */
+  int list_index_flag;	/**< @brief Serve file listings from a per-volume name index (default=off).  */
+  const char *list_index_help; /**< @brief Serve file listings from a per-volume name index help description.  */
+  int gc_full_interval_arg;	/**< @brief How often the GC scans all blocks rather than just the queued candidates (default='86400').  */
+  char * gc_full_interval_orig;	/**< @brief How often the GC scans all blocks rather than just the queued candidates original value given at command line.  */
+  const char *gc_full_interval_help; /**< @brief How often the GC scans all blocks rather than just the queued candidates help description.  */
+  int gc_workers_arg;	/**< @brief Number of processes running GC on separate hash database shards (default='1').  */
+  char * gc_workers_orig;	/**< @brief Number of processes running GC on separate hash database shards original value given at command line.  */
+  const char *gc_workers_help; /**< @brief Number of processes running GC on separate hash database shards help description.  */
+  int db_checkpoint_interval_arg;	/**< @brief Interval between the checkpoint manager rounds in milliseconds, 0 lets every process checkpoint on its own (default='1000').  */
+  char * db_checkpoint_interval_orig;	/**< @brief Interval between the checkpoint manager rounds in milliseconds, 0 lets every process checkpoint on its own original value given at command line.  */
+  const char *db_checkpoint_interval_help; /**< @brief Interval between the checkpoint manager rounds in milliseconds, 0 lets every process checkpoint on its own help description.  */
+  int db_checkpoint_max_restarts_arg;	/**< @brief Maximum number of RESTART checkpoints per checkpoint manager round (default='4').  */
+  char * db_checkpoint_max_restarts_orig;	/**< @brief Maximum number of RESTART checkpoints per checkpoint manager round original value given at command line.  */
+  const char *db_checkpoint_max_restarts_help; /**< @brief Maximum number of RESTART checkpoints per checkpoint manager round help description.  */
+  int worker_threads_arg;	/**< @brief Requests served concurrently by each worker, up to 16: every thread opens its own copy of all the databases and datafiles (default='1').  */
+  char * worker_threads_orig;	/**< @brief Requests served concurrently by each worker, up to 16: every thread opens its own copy of all the databases and datafiles original value given at command line.  */
+  const char *worker_threads_help; /**< @brief Requests served concurrently by each worker, up to 16: every thread opens its own copy of all the databases and datafiles help description.  */
   
   unsigned int help_given ;	/**< @brief Whether help was given.  */
   unsigned int full_help_given ;	/**< @brief Whether full-help was given.  */
@@ -122,6 +147,15 @@ struct gengetopt_args_info
   unsigned int db_busy_timeout_given ;	/**< @brief Whether db-busy-timeout was given.  */
   unsigned int worker_max_wait_given ;	/**< @brief Whether worker-max-wait was given.  */
   unsigned int worker_max_requests_given ;	/**< @brief Whether worker-max-requests was given.  */
+  unsigned int block_cache_size_given ;	/**< @brief Whether block-cache-size was given.  */
+  unsigned int zero_copy_download_given ;	/**< @brief Whether zero-copy-download was given.  */
+  unsigned int jobmgr_max_jobs_given ;	/**< @brief Whether jobmgr-max-jobs was given.  */
+  unsigned int list_index_given ;	/**< @brief Whether list-index was given.  */
+  unsigned int gc_full_interval_given ;	/**< @brief Whether gc-full-interval was given.  */
+  unsigned int gc_workers_given ;	/**< @brief Whether gc-workers was given.  */
+  unsigned int db_checkpoint_interval_given ;	/**< @brief Whether db-checkpoint-interval was given.  */
+  unsigned int db_checkpoint_max_restarts_given ;	/**< @brief Whether db-checkpoint-max-restarts was given.  */
+  unsigned int worker_threads_given ;	/**< @brief Whether worker-threads was given.  */
 
 } ;
 
@@ -0,0 +1,191 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#include "default.h"
+
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "ckptmgr.h"
+#include "log.h"
+#include "hashfs.h"
+
+static int terminate = 0;
+
+static void sighandler(int signum) {
+    if (signum == SIGHUP || signum == SIGUSR1) {
+	log_reopen();
+	return;
+    }
+    terminate = 1;
+}
+
+static ckptmgr_stats_t *cstats;
+
+int ckptmgr_stats_init(void) {
+    if(cstats) {
+	WARN("Checkpoint manager stats already initialized");
+	return -1;
+    }
+    cstats = mmap(NULL, sizeof(*cstats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(cstats == MAP_FAILED) {
+	PWARN("Failed to allocate the checkpoint manager stats");
+	cstats = NULL;
+	return -1;
+    }
+    return 0;
+}
+
+void ckptmgr_stats_done(void) {
+    if(!cstats)
+	return;
+    munmap(cstats, sizeof(*cstats));
+    cstats = NULL;
+}
+
+int ckptmgr_stats(ckptmgr_stats_t *stats) {
+    if(!cstats || !stats)
+	return -1;
+    /* Only the checkpoint manager writes, a snapshot may be slightly skewed */
+    memcpy(stats, cstats, sizeof(*stats));
+    return 0;
+}
+
+struct ckpt_db {
+    sxi_db_t *db;
+    ckptmgr_db_stats_t *st;
+    int wal_pages;
+};
+
+static int ckpt(struct ckpt_db *d, int kind) {
+    struct timeval tv0, tv1;
+    int log, done, rc;
+    uint64_t ms;
+
+    gettimeofday(&tv0, NULL);
+    rc = qcheckpoint_sched(d->db, kind, &log, &done);
+    gettimeofday(&tv1, NULL);
+    ms = timediff(&tv0, &tv1) * 1000.0;
+
+    d->wal_pages = log;
+    d->st->wal_pages = log;
+    if(kind == SQLITE_CHECKPOINT_PASSIVE && done <= 0)
+	return rc; /* Nothing to do, or nothing possible without blocking */
+    d->st->count++;
+    if(kind == SQLITE_CHECKPOINT_RESTART) {
+	d->st->restarts++;
+	if(rc != SQLITE_OK || done < log)
+	    d->st->busy++;
+	DEBUG("Checkpoint of %s: %d pages in WAL, %d checkpointed in %llu ms", d->st->name, log, done, (unsigned long long)ms);
+    }
+    d->st->total_ms += ms;
+    if(ms > d->st->max_ms)
+	d->st->max_ms = ms;
+    return rc;
+}
+
+static int ckpt_cmp(const void *a, const void *b) {
+    const struct ckpt_db *da = *(const struct ckpt_db * const *)a, *db = *(const struct ckpt_db * const *)b;
+    return db->wal_pages - da->wal_pages;
+}
+
+/* One scheduling round: a non blocking PASSIVE pass over all the databases,
+ * then RESTART on the largest WALs, at most db_checkpoint_max_restarts of them */
+static void ckpt_round(struct ckpt_db *dbs, unsigned int ndbs) {
+    struct ckpt_db *big[CKPTMGR_MAX_DBS];
+    unsigned int i, nbig = 0;
+
+    for(i=0; i<ndbs && !terminate; i++) {
+	ckpt(&dbs[i], SQLITE_CHECKPOINT_PASSIVE);
+	if(dbs[i].wal_pages >= db_max_restart_wal_pages)
+	    big[nbig++] = &dbs[i];
+    }
+    qsort(big, nbig, sizeof(*big), ckpt_cmp);
+    for(i=0; i<nbig && (int)i<db_checkpoint_max_restarts && !terminate; i++)
+	ckpt(big[i], SQLITE_CHECKPOINT_RESTART);
+    if(nbig > i)
+	DEBUG("%u checkpoints postponed to the next round", nbig - i);
+    cstats->rounds++;
+}
+
+int ckptmgr(sxc_client_t *sx, const char *self, const char *dir) {
+    struct ckpt_db dbs[CKPTMGR_MAX_DBS];
+    ckptmgr_stats_t localstats;
+    struct sigaction act;
+    sx_hashfs_t *hashfs;
+    unsigned int i;
+
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    act.sa_handler = sighandler;
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGUSR1, &act, NULL);
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGQUIT, &act, NULL);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    hashfs = sx_hashfs_open(dir, sx);
+    if (!hashfs) {
+        CRIT("Failed to initialize the hash server interface");
+        return EXIT_FAILURE;
+    }
+
+    if(!cstats) {
+	memset(&localstats, 0, sizeof(localstats));
+	cstats = &localstats;
+    }
+    memset(dbs, 0, sizeof(dbs));
+    for(i=0; i<CKPTMGR_MAX_DBS; i++) {
+	dbs[i].st = &cstats->dbs[i];
+	if(!(dbs[i].db = sx_hashfs_db_at(hashfs, i, dbs[i].st->name, sizeof(dbs[i].st->name))))
+	    break;
+    }
+    cstats->ndbs = i;
+    INFO("Checkpoint manager started for %u databases", cstats->ndbs);
+
+    while(!terminate) {
+	ckpt_round(dbs, cstats->ndbs);
+	if(!terminate) {
+	    struct timespec ts;
+	    ts.tv_sec = db_checkpoint_interval / 1000;
+	    ts.tv_nsec = (db_checkpoint_interval % 1000) * 1000000L;
+	    nanosleep(&ts, NULL);
+	}
+    }
+
+    sx_hashfs_close(hashfs);
+    if(cstats == &localstats)
+	cstats = NULL;
+    return EXIT_SUCCESS;
+}
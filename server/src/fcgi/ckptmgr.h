@@ -0,0 +1,60 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+#ifndef CKPTMGR_H
+#define CKPTMGR_H
+
+#include "sx.h"
+
+/* hashfs, tempdb, eventdb, xferdb and every metadata and hash shard */
+#define CKPTMGR_MAX_DBS 160
+
+/* Checkpoint counters, shared by all the processes forked after
+ * ckptmgr_stats_init() */
+typedef struct {
+    char name[24];
+    uint64_t wal_pages; /* WAL size at the last scan */
+    uint64_t count; /* Checkpoints run */
+    uint64_t restarts; /* ...of which RESTART */
+    uint64_t busy; /* Checkpoints cut short by readers or writers */
+    uint64_t total_ms;
+    uint64_t max_ms;
+} ckptmgr_db_stats_t;
+
+typedef struct {
+    uint64_t rounds;
+    unsigned int ndbs;
+    ckptmgr_db_stats_t dbs[CKPTMGR_MAX_DBS];
+} ckptmgr_stats_t;
+
+int ckptmgr_stats_init(void);
+void ckptmgr_stats_done(void);
+int ckptmgr_stats(ckptmgr_stats_t *stats);
+
+int ckptmgr(sxc_client_t *sx, const char *self, const char *dir);
+
+#endif
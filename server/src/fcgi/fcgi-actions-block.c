@@ -42,7 +42,9 @@ void fcgi_send_blocks(void) {
     sx_hash_t reqhash;
     const char *hpath;
     const char *cond;
-    int i, urlen;
+    int i, urlen, nranges = 0;
+    int range_fd[DOWNLOAD_MAX_BLOCKS], block_fd[DOWNLOAD_MAX_BLOCKS];
+    uint64_t range_off[DOWNLOAD_MAX_BLOCKS], range_len[DOWNLOAD_MAX_BLOCKS], block_off[DOWNLOAD_MAX_BLOCKS];
     rc_ty s;
 
     blocksize = strtol(path, (char **)&hpath, 10);
@@ -67,7 +69,25 @@ void fcgi_send_blocks(void) {
             msg_set_reason("Invalid hash %*.s", SXI_SHA1_TEXT_LEN, hpath + SXI_SHA1_TEXT_LEN * i);
             quit_errmsg(400,"invalid hash");
         }
-	s = sx_hashfs_block_get(hashfs, blocksize, &reqhash, NULL);
+	if(download_zero_copy) {
+	    int fd;
+	    uint64_t off;
+	    s = sx_hashfs_block_locate(hashfs, blocksize, &reqhash, &fd, &off);
+	    if(s == OK) {
+		block_fd[i] = fd;
+		block_off[i] = off;
+		/* Coalesce blocks stored back to back in the same datafile */
+		if(nranges && range_fd[nranges-1] == fd && range_off[nranges-1] + range_len[nranges-1] == off)
+		    range_len[nranges-1] += blocksize;
+		else {
+		    range_fd[nranges] = fd;
+		    range_off[nranges] = off;
+		    range_len[nranges] = blocksize;
+		    nranges++;
+		}
+	    }
+	} else
+	    s = sx_hashfs_block_get(hashfs, blocksize, &reqhash, NULL);
 	if(s == ENOENT || s == FAIL_BADBLOCKSIZE)
 	    quit_errmsg(404, "Block not found");
         else if(s != OK) {
@@ -97,6 +117,29 @@ void fcgi_send_blocks(void) {
     if(verb == VERB_HEAD)
 	return;
 
+    if(download_zero_copy) {
+	/* The slots were looked up before sending and may have been freed
+	 * and reused meanwhile: the last byte is held back until every
+	 * block is found again at the same place, otherwise the reply is
+	 * cut short so that the client never accepts the wrong data */
+	for(i=0; i<nranges; i++)
+	    if(send_file_range(range_fd[i], range_off[i], range_len[i] - (i == nranges - 1)))
+		return;
+	for(i=0; i<urlen; i++) {
+	    int fd;
+	    uint64_t off;
+	    if(hex2bin(hpath + SXI_SHA1_TEXT_LEN*i, SXI_SHA1_TEXT_LEN, reqhash.b, SXI_SHA1_BIN_LEN) ||
+	       sx_hashfs_block_locate(hashfs, blocksize, &reqhash, &fd, &off) != OK ||
+	       fd != block_fd[i] || off != block_off[i]) {
+		WARN("Block %.*s was moved while being sent, aborting the reply", SXI_SHA1_TEXT_LEN, hpath + SXI_SHA1_TEXT_LEN*i);
+		abort_reply();
+		return;
+	    }
+	}
+	send_file_range(range_fd[nranges-1], range_off[nranges-1] + range_len[nranges-1] - 1, 1);
+	return;
+    }
+
     for(i=0; i<urlen; i++) {
 	if(hex2bin(hpath + SXI_SHA1_TEXT_LEN*i, SXI_SHA1_TEXT_LEN, reqhash.b, SXI_SHA1_BIN_LEN))
 	    break;
@@ -114,16 +157,14 @@ void fcgi_send_blocks(void) {
     }\
     } while(0)
 void fcgi_hashop_blocks(enum sxi_hashop_kind kind) {
-    unsigned blocksize, n=0;
+    unsigned blocksize, n=0, i;
     const char *hpath;
-    sx_hash_t reqhash;
     rc_ty rc = OK;
-    unsigned missing = 0;
     const char *id, *expires;
     char *end = NULL;
-    int comma = 0;
-    unsigned idx = 0;
+    int comma = 0, count;
     uint64_t op_expires_at;
+    sx_hashop_entry_t *ops;
 
     auth_complete();
     quit_unless_authed();
@@ -139,6 +180,21 @@ void fcgi_hashop_blocks(enum sxi_hashop_kind kind) {
     } else
         op_expires_at = 0;
 
+    switch (kind) {
+        case HASHOP_CHECK:
+        case HASHOP_RESERVE:
+            count = 0;
+            break;
+        case HASHOP_INUSE:
+            count = 1;
+            break;
+        case HASHOP_DELETE:
+            count = -1;
+            break;
+        default:
+            quit_errmsg(400, "Invalid hashop");
+    }
+
     blocksize = strtol(path, (char **)&hpath, 10);
     if(*hpath != '/') {
         msg_set_reason("Path must begin with / after blocksize: %s", path);
@@ -146,40 +202,53 @@ void fcgi_hashop_blocks(enum sxi_hashop_kind kind) {
     }
     while(*hpath == '/')
 	hpath++;
-    CGI_PUTS("Content-type: application/json\r\n\r\n{\"presence\":[");
+
+    /* The whole batch is parsed first and applied with one transaction per hash db */
+    ops = wrap_malloc((strlen(hpath) / (SXI_SHA1_TEXT_LEN + 1) + 1) * sizeof(*ops));
+    if (!ops)
+        quit_errmsg(503, "Out of memory");
     while (*hpath) {
-	int present;
-        if(hex2bin(hpath, SXI_SHA1_TEXT_LEN, reqhash.b, SXI_SHA1_BIN_LEN)) {
-            msg_set_reason("Invalid hash %*.s", SXI_SHA1_TEXT_LEN, hpath);
-            rc = EINVAL;
-            break;
+        if(hex2bin(hpath, SXI_SHA1_TEXT_LEN, ops[n].hash.b, SXI_SHA1_BIN_LEN)) {
+            free(ops);
+            msg_set_reason("Invalid hash %.*s", SXI_SHA1_TEXT_LEN, hpath);
+            quit_errmsg(400, msg_get_reason());
         }
         hpath += SXI_SHA1_TEXT_LEN;
         if (*hpath++ != ',') {
-            CGI_PUTC(']');
-            quit_itererr("bad URL format for hashop", EINVAL);
+            free(ops);
+            quit_errmsg(400, "bad URL format for hashop");
         }
+        ops[n].block_size = blocksize;
+        ops[n].replica = 0;
+        ops[n].count = count;
         n++;
-        rc = sx_hashfs_hashop_perform(hashfs, blocksize, 0, kind, &reqhash, id, op_expires_at, &present);
+    }
+    rc = sx_hashfs_hashop_batch(hashfs, ops, n, kind == HASHOP_CHECK ? NULL : id, op_expires_at);
+
+    CGI_PUTS("Content-type: application/json\r\n\r\n{\"presence\":[");
+    for (i=0; i<n; i++) {
+        int present = ops[i].rc == OK;
         if (comma)
             CGI_PUTC(',');
         /* the presence callback wants an index not the actual hash...
          * */
         CGI_PUTS(present ? "true" : "false");
-        DEBUGHASH("Status sent for ", &reqhash);
-	DEBUG("Hash index %d, present: %d", idx, present);
+        DEBUGHASH("Status sent for ", &ops[i].hash);
+	DEBUG("Hash index %d, present: %d", i, present);
         comma = 1;
-        if (rc != OK)
-                break;
-        idx++;
+        if (ops[i].rc != OK && ops[i].rc != ENOENT) {
+            rc = ops[i].rc;
+            break;
+        }
     }
+    free(ops);
     if (rc != OK) {
         WARN("hashop: %s", rc2str(rc));
         CGI_PUTC(']');
         quit_itererr(msg_get_reason(), rc);
     }
     CGI_PUTS("]}");
-    DEBUG("hashop: missing %d, n: %d", missing, n);
+    DEBUG("hashop: n: %d", n);
 }
 
 static int meta_add(block_meta_t *meta, unsigned replica, int64_t count)
@@ -364,7 +433,8 @@ static const yajl_callbacks inuse_parser = {
 };
 
 void fcgi_hashop_inuse(void) {
-    unsigned i, j;
+    unsigned i, j, k, nops;
+    sx_hashop_entry_t *ops;
     rc_ty rc = FAIL_EINTERNAL;
     unsigned missing = 0;
     const char *id, *expires;
@@ -389,7 +459,7 @@ void fcgi_hashop_inuse(void) {
         quit_errmsg(500, "Cannot allocate json parser");
     }
     int len;
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0) {
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0) {
         DEBUG("parsing: %.*s", len, hashbuf);
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) {
             DEBUG("yajl_parse failed on chunk: %.*s", len, hashbuf);
@@ -415,15 +485,34 @@ void fcgi_hashop_inuse(void) {
 	return;
     }
 
+    /* One entry per (hash, replica) pair, all applied in a single batch */
+    for (i=0, nops=0; i<yctx.all.n; i++)
+        nops += yctx.all.all[i].count;
+    ops = wrap_malloc((nops + 1) * sizeof(*ops));
+    if (!ops) {
+        blocks_free(&yctx.all);
+        quit_errmsg(503, "Out of memory");
+    }
+    for (i=0, k=0; i<yctx.all.n; i++) {
+        const block_meta_t *m = &yctx.all.all[i];
+        for (j=0;j<m->count;j++) {
+            ops[k].hash = m->hash;
+            ops[k].block_size = m->blocksize;
+            ops[k].replica = m->entries[j].replica;
+            ops[k].count = m->entries[j].count;
+            k++;
+        }
+    }
+    rc = sx_hashfs_hashop_batch(hashfs, ops, nops, id, op_expires_at);
+
     CGI_PUTS("Content-type: application/json\r\n\r\n{\"presence\":[");
 
-    for (i=0;i<yctx.all.n;i++) {
+    for (i=0, k=0;i<yctx.all.n;i++) {
         int present;
         const block_meta_t *m = &yctx.all.all[i];
         rc = FAIL_EINTERNAL;
-        for (j=0;j<m->count;j++) {
-            const block_meta_entry_t *e = &m->entries[j];
-            rc = sx_hashfs_hashop_mod(hashfs, &m->hash, id, m->blocksize, e->replica, e->count, op_expires_at);
+        for (j=0;j<m->count;j++, k++) {
+            rc = ops[k].rc;
             if (rc && rc != ENOENT)
                 break;
         }
@@ -443,6 +532,7 @@ void fcgi_hashop_inuse(void) {
         }
         idx++;
     }
+    free(ops);
     blocks_free(&yctx.all);
     if (rc != OK) {
         WARN("hashop: %s", rc2str(rc));
@@ -475,7 +565,7 @@ void fcgi_save_blocks(void) {
     if(len & (blocksize-1))
 	quit_errmsg(400, "Wrong content length");
 
-    if(len > sizeof(hashbuf))
+    if(len > UPLOAD_CHUNK_SIZE)
 	quit_errnum(413);
 
     if(get_body_chunk(hashbuf, len) != len)
@@ -485,13 +575,10 @@ void fcgi_save_blocks(void) {
     if(!is_authed())
 	quit_errmsg(403, "Bad signature");
 
-    const uint8_t *end = hashbuf + len;
-    for(const uint8_t *src = hashbuf;src < end; src += blocksize) {
-        rc_ty rc;
-        if ((rc = sx_hashfs_block_put(hashfs, src, blocksize, replica_count, !has_priv(PRIV_CLUSTER)))) {
-            WARN("Cannot store block: %s", rc2str(rc));
-	    quit_errmsg(500, "Cannot store block");
-        }
+    rc_ty rc = sx_hashfs_block_put_batch(hashfs, hashbuf, blocksize, len / blocksize, replica_count, !has_priv(PRIV_CLUSTER));
+    if(rc != OK) {
+	WARN("Cannot store blocks: %s", rc2str(rc));
+	quit_errmsg(500, "Cannot store block");
     }
     if(replica_count > 1 && !has_priv(PRIV_CLUSTER))
 	sx_hashfs_xfer_trigger(hashfs);
@@ -627,7 +714,7 @@ void fcgi_push_blocks(void) {
     }
 
     int len;
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || yctx.state != CB_PB_COMPLETE) {
@@ -28,8 +28,12 @@
 #include "default.h"
 
 #include <string.h>
+#include <stdlib.h>
 
 #include "fcgi-utils.h"
+#include "jobmgr.h"
+#include "ckptmgr.h"
+#include "stats.h"
 
 static void send_distribution(const sx_nodelist_t *nodes) {
     unsigned int i, n = sx_nodelist_count(nodes);
@@ -53,11 +57,90 @@ static void send_distribution(const sx_nodelist_t *nodes) {
     CGI_PUTC(']');
 }
 
+static void send_stats(void) {
+    sx_stats_t *st = malloc(sizeof(*st));
+    ckptmgr_stats_t *ck = malloc(sizeof(*ck));
+    jobmgr_stats_t jm;
+    unsigned int i, j, comma = 0;
+
+    CGI_PUTS("\"stats\":{");
+    if(st && !sx_stats_get(st)) {
+	CGI_PRINTF("\"uptime\":%lld,\"histogramBoundsMs\":[", (long long)(time(NULL) - st->started));
+	for(i=0; i<SX_STATS_BUCKETS - 1; i++)
+	    CGI_PRINTF("%s%u", i ? "," : "", sx_stats_bucket_ms(i));
+	CGI_PUTS("],\"requests\":{");
+	for(i=0; i<SX_STATS_REQS; i++) {
+	    const sx_stats_req_t *r = &st->reqs[i];
+	    if(!(r->key & 1) || !r->count)
+		continue;
+	    if(comma)
+		CGI_PUTC(',');
+	    comma = 1;
+	    json_send_qstring(r->name);
+	    CGI_PRINTF(":{\"count\":%llu,\"errors4xx\":%llu,\"errors5xx\":%llu,\"bytesIn\":%llu,\"bytesOut\":%llu,\"avgUs\":%llu,\"maxUs\":%llu,\"histogram\":[",
+		       (unsigned long long)r->count, (unsigned long long)r->errors_4xx, (unsigned long long)r->errors_5xx,
+		       (unsigned long long)r->bytes_in, (unsigned long long)r->bytes_out,
+		       (unsigned long long)(r->total_us / r->count), (unsigned long long)r->max_us);
+	    for(j=0; j<SX_STATS_BUCKETS; j++)
+		CGI_PRINTF("%s%llu", j ? "," : "", (unsigned long long)r->hist[j]);
+	    CGI_PUTS("]}");
+	}
+	CGI_PUTS("},\"databases\":{");
+	for(i=0, comma=0; i<SX_STATS_DBS; i++) {
+	    const sx_stats_db_t *d = &st->dbs[i];
+	    if(!(d->key & 1))
+		continue;
+	    if(comma)
+		CGI_PUTC(',');
+	    comma = 1;
+	    json_send_qstring(d->name);
+	    CGI_PRINTF(":{\"busyRetries\":%llu,\"busyTimeouts\":%llu,\"busyWaitMs\":%llu}",
+		       (unsigned long long)d->retries, (unsigned long long)d->timeouts, (unsigned long long)d->wait_ms);
+	}
+	CGI_PUTC('}');
+	comma = 1;
+    } else
+	comma = 0;
+
+    if(ck && !ckptmgr_stats(ck)) {
+	CGI_PRINTF("%s\"checkpoints\":{\"rounds\":%llu,\"databases\":{", comma ? "," : "", (unsigned long long)ck->rounds);
+	for(i=0, j=0; i<ck->ndbs && i<CKPTMGR_MAX_DBS; i++) {
+	    const ckptmgr_db_stats_t *d = &ck->dbs[i];
+	    if(j)
+		CGI_PUTC(',');
+	    j = 1;
+	    json_send_qstring(d->name);
+	    CGI_PRINTF(":{\"count\":%llu,\"restarts\":%llu,\"busy\":%llu,\"totalMs\":%llu,\"maxMs\":%llu,\"walPages\":%llu}",
+		       (unsigned long long)d->count, (unsigned long long)d->restarts, (unsigned long long)d->busy,
+		       (unsigned long long)d->total_ms, (unsigned long long)d->max_ms, (unsigned long long)d->wal_pages);
+	}
+	CGI_PUTS("}}");
+	comma = 1;
+    }
+
+    if(!jobmgr_stats(&jm)) {
+	CGI_PRINTF("%s\"jobs\":{\"queueDepth\":%llu,\"running\":%llu,\"types\":{", comma ? "," : "",
+		   (unsigned long long)jm.queue_depth, (unsigned long long)jm.running);
+	for(i=0, j=0; i<JOBMGR_STATS_TYPES; i++) {
+	    if(!jm.types[i].count)
+		continue;
+	    CGI_PRINTF("%s\"%u\":{\"count\":%llu,\"totalMs\":%llu,\"maxMs\":%llu}", j ? "," : "", i,
+		       (unsigned long long)jm.types[i].count, (unsigned long long)jm.types[i].total_ms,
+		       (unsigned long long)jm.types[i].max_ms);
+	    j = 1;
+	}
+	CGI_PUTS("}}");
+    }
+    CGI_PUTC('}');
+    free(st);
+    free(ck);
+}
+
 void fcgi_handle_cluster_requests(void) {
     int comma = 0;
     rc_ty s;
 
-    if(has_arg("clusterStatus") && !has_priv(PRIV_ADMIN))
+    if((has_arg("clusterStatus") || has_arg("stats")) && !has_priv(PRIV_ADMIN))
 	quit_errnum(403);
 
     /* Allow caching of rarely changing hdist-based items but force
@@ -220,6 +303,11 @@ void fcgi_handle_cluster_requests(void) {
         json_send_qstring(self);
         comma |= 1;
     }
+    if(has_arg("stats")) {
+	if(comma) CGI_PUTC(',');
+	send_stats();
+	comma |= 1;
+    }
 
     /* MOAR COMMANDS HERE */
 
@@ -375,7 +375,7 @@ void fcgi_create_file(void) {
 	quit_errmsg(500, "Cannot allocate json parser");
     }
 
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || yctx.state != CB_NEWFILE_COMPLETE) {
@@ -422,7 +422,7 @@ static void create_or_extend_tempfile(const sx_hashfs_volume_t *vol, const char
 	quit_errmsg(500, "Cannot allocate json parser");
     }
 
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || yctx.state != CB_NEWFILE_COMPLETE) {
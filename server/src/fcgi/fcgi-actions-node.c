@@ -198,7 +198,7 @@ void fcgi_set_nodes(void) {
     }
 
     int len;
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || yctx.state != CB_NODES_COMPLETE) {
@@ -353,7 +353,7 @@ void fcgi_new_distribution(void) {
 	quit_errmsg(503, "Cannot allocate json parser");
     }
 
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || yctx.state != CB_UPDIST_COMPLETE || !yctx.cfg || !yctx.cfg_len) {
@@ -582,7 +582,7 @@ void fcgi_node_init(void) {
 	quit_errmsg(500, "Cannot allocate json parser");
 
     int len;
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || yctx.state != CB_NODEINIT_COMPLETE || !yctx.name || !yctx.have_uuid || yctx.ssl < 0) {
@@ -900,7 +900,7 @@ void fcgi_sync_globs(void) {
 
     /* MODHDIST: transaction starts here */
     int len;
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || yctx.state != CB_SYNC_COMPLETE) {
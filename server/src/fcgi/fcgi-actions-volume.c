@@ -805,7 +805,7 @@ void fcgi_create_volume(void) {
     }
 
     int len;
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
 	if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || !yctx.owner[0] || yctx.state != CB_VOL_COMPLETE) {
@@ -1140,7 +1140,7 @@ void fcgi_volsizes(void) {
     if(!yh)
         quit_errmsg(500, "Cannot allocate json parser");
 
-    while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+    while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
         if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
 
     if(len || yajl_complete_parse(yh) != yajl_status_ok || yctx.state != CB_VOLSIZES_COMPLETE) {
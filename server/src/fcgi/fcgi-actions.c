@@ -394,7 +394,7 @@ void job_2pc_handle_request(sxc_client_t *sx, const job_2pc_t *spec, void *yctx)
         if (!yh)
             quit_errmsg(500, "Cannot allocate json parser");
         int len;
-        while((len = get_body_chunk(hashbuf, sizeof(hashbuf))) > 0)
+        while((len = get_body_chunk(hashbuf, UPLOAD_CHUNK_SIZE)) > 0)
             if(yajl_parse(yh, hashbuf, len) != yajl_status_ok) break;
         if(len || yajl_complete_parse(yh) != yajl_status_ok)
             rc = EINVAL;
@@ -37,6 +37,8 @@
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include <fastcgi.h>
 #include <fcgiapp.h>
 
@@ -48,15 +50,20 @@
 #include "fcgi-utils.h"
 #include "jobmgr.h"
 #include "blockmgr.h"
+#include "ckptmgr.h"
 #include "cfgfile.h"
 #include "cmdline.h"
 #include "init.h"
 #include "gc.h"
 #include "utils.h"
-
-FCGX_Stream *fcgi_in, *fcgi_out, *fcgi_err;
-FCGX_ParamArray envp;
-sx_hashfs_t *hashfs;
+#include "blockcache.h"
+#include "stats.h"
+#include "../libsx/src/vcrypto.h"
+
+__thread FCGX_Stream *fcgi_in, *fcgi_out, *fcgi_err;
+__thread FCGX_ParamArray envp;
+__thread FCGX_Request *fcgi_req;
+__thread sx_hashfs_t *hashfs;
 int job_trigger, block_trigger, gc_trigger, gc_expire_trigger;
 static pid_t ownpid;
 
@@ -64,9 +71,10 @@ static pid_t ownpid;
 #define JOBMGR MAX_CHILDREN
 #define BLKMGR MAX_CHILDREN+1
 #define GCMGR MAX_CHILDREN+2
+#define CKPTMGR MAX_CHILDREN+3
 
 static int terminate = 0;
-static pid_t pids[MAX_CHILDREN+3];
+static pid_t pids[MAX_CHILDREN+4];
 
 static void killall(int signum) {
     int i;
@@ -95,7 +103,7 @@ static void child_sighandler(int signum)
     terminate = 1;
 }
 
-static int in_request;
+static __thread int in_request;
 static void fcgilog_log(void *ctx, const char *argv0, int prio, const char *msg)
 {
     char buf[65536];
@@ -129,10 +137,108 @@ static sxc_logger_t fcgilog = {
 
 void OS_LibShutdown(void);
 #include <sys/resource.h>
-static int accept_loop(sxc_client_t *sx, const char *self, const char *dir) {
-    struct sigaction act;
-    int i, rc = EXIT_SUCCESS;
+
+/* With worker-threads > 1 each worker runs that many request threads, each
+ * with its own hashfs handle and libsx client, all taking turns on the
+ * listening socket. A slow client or a long hashfs operation then only
+ * holds up its own thread instead of a whole worker.
+ * Every thread keeps all the databases and datafiles open and blocks in its
+ * own hashfs calls, so this scales to a few threads per worker, not to
+ * thousands of concurrent transfers: the limit keeps the file descriptors
+ * (MAX_FDS per thread) and SQLite connections within reason. */
+#define MAX_WORKER_THREADS 16
+
+struct accept_thread {
+    pthread_t tid;
+    sxc_client_t *sx;
+    sx_hashfs_t *hashfs;
+    volatile int accepting;
+    volatile int done;
+};
+
+static pthread_mutex_t accept_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int nserved;
+
+static void serve_requests(struct accept_thread *t) {
     FCGX_Request req;
+    struct timeval tv_start, tv_end;
+    char reqname[SX_STATS_NAMELEN];
+    sigset_t kick;
+    int r, err;
+
+    hashfs = t->hashfs;
+    sigemptyset(&kick);
+    sigaddset(&kick, SIGUSR2);
+    FCGX_InitRequest(&req, FCGI_LISTENSOCK_FILENO, FCGI_FAIL_ACCEPT_ON_INTR);
+    while(!terminate) {
+	pthread_mutex_lock(&accept_lock);
+	if(terminate || nserved >= worker_max_requests) {
+	    pthread_mutex_unlock(&accept_lock);
+	    break;
+	}
+	nserved++;
+	/* Request threads keep the kick signal blocked, except while they
+	 * wait in accept: a kick that comes late stays pending instead of
+	 * interrupting the request, and breaks the next accept instead */
+	t->accepting = 1;
+	if(worker_threads > 1)
+	    pthread_sigmask(SIG_UNBLOCK, &kick, NULL);
+	r = FCGX_Accept_r(&req);
+	err = errno;
+	if(worker_threads > 1)
+	    pthread_sigmask(SIG_BLOCK, &kick, NULL);
+	t->accepting = 0;
+	pthread_mutex_unlock(&accept_lock);
+	if(r < 0) {
+            if (err != EINTR)
+                break;
+            continue;
+        }
+        fcgi_in = req.in;
+        fcgi_out = req.out;
+        fcgi_err = req.err;
+        envp = req.envp;
+        fcgi_req = &req;
+        if (!fcgi_out || !fcgi_in || !fcgi_err || !envp) {
+            CRIT("NULL fcgi streams/env");
+            continue;
+        }
+        in_request = 1;
+	gettimeofday(&tv_start, NULL);
+	send_server_info();
+	handle_request();
+	gettimeofday(&tv_end, NULL);
+	request_name(reqname, sizeof(reqname));
+	sx_stats_request(reqname, reply_status,
+			 (uint64_t)(tv_end.tv_sec - tv_start.tv_sec) * 1000000 + tv_end.tv_usec - tv_start.tv_usec,
+			 MAX(content_len(), 0), reply_bytes);
+        sx_hashfs_checkpoint_passive(hashfs);
+        in_request = 0;
+	/* Finish here rather than in the next FCGX_Accept_r() so that
+	 * flushing to a slow client doesn't happen under accept_lock */
+	FCGX_Finish_r(&req);
+    }
+    FCGX_Finish_r(&req);
+}
+
+static void *accept_thread_main(void *ctx) {
+    struct accept_thread *t = ctx;
+
+    hashbuf = malloc(UPLOAD_CHUNK_SIZE);
+    if(hashbuf)
+	serve_requests(t);
+    else
+	CRIT("Out of memory allocating the request buffer");
+    free(hashbuf);
+    t->done = 1;
+    return NULL;
+}
+
+static int accept_loop(sxc_client_t *sx, const char *self, const char *dir, int debug) {
+    struct sigaction act;
+    struct accept_thread *threads;
+    sigset_t mask, oldmask;
+    int i, started = 0, rc = EXIT_SUCCESS;
 
     /* must use sigaction, because signal would set ERESTARTSYS
      * and we'd never break out of the accept loop */
@@ -149,45 +255,88 @@ static int accept_loop(sxc_client_t *sx, const char *self, const char *dir) {
     sigaction(SIGHUP, &act, NULL);
     sigaction(SIGUSR1, &act, NULL);
 
-    hashfs = sx_hashfs_open(dir, sx);
-    if(!hashfs) {
-	CRIT("Failed to initialize the hash server interface");
+    if(worker_threads > 1 && sxi_crypto_threads_init()) {
+	CRIT("Failed to set up the crypto library for threads");
+        rc = EXIT_FAILURE;
+	goto accept_loop_end;
+    }
+    threads = calloc(worker_threads, sizeof(*threads));
+    if(!threads) {
+	CRIT("Out of memory allocating worker threads");
         rc = EXIT_FAILURE;
 	goto accept_loop_end;
     }
-    sx_hashfs_set_triggers(hashfs, job_trigger, block_trigger, gc_trigger, gc_expire_trigger);
+    for(i=0; i<worker_threads; i++) {
+	if(!i)
+	    threads[i].sx = sx;
+	else if((threads[i].sx = sxc_init(src_version(), &fcgilog, NULL, NULL))) {
+	    sxc_set_verbose(threads[i].sx, 1);
+	    if(debug)
+		log_setminlevel(threads[i].sx, SX_LOG_DEBUG);
+	}
+	if(!threads[i].sx || !(threads[i].hashfs = sx_hashfs_open(dir, threads[i].sx))) {
+	    CRIT("Failed to initialize the hash server interface");
+	    rc = EXIT_FAILURE;
+	    goto accept_loop_close;
+	}
+	sx_hashfs_set_triggers(threads[i].hashfs, job_trigger, block_trigger, gc_trigger, gc_expire_trigger);
+    }
 
     ownpid = getpid();
     FCGX_Init();
-    FCGX_InitRequest(&req, FCGI_LISTENSOCK_FILENO, FCGI_FAIL_ACCEPT_ON_INTR);
-    for(i=0; !terminate && i < worker_max_requests; i++) {
-	if(FCGX_Accept_r(&req) < 0) {
-            if (errno != EINTR)
-                break;
-            continue;
-        }
-        fcgi_in = req.in;
-        fcgi_out = req.out;
-        fcgi_err = req.err;
-        envp = req.envp;
-        if (!fcgi_out || !fcgi_in || !fcgi_err || !envp) {
-            CRIT("NULL fcgi streams/env");
-            continue;
-        }
-        in_request = 1;
-	send_server_info();
-	handle_request();
-        sx_hashfs_checkpoint_passive(hashfs);
-        in_request = 0;
+    if(worker_threads == 1) {
+	accept_thread_main(&threads[0]);
+    } else {
+	/* Termination signals are only taken by this thread, which then
+	 * kicks the idle request threads out of FCGX_Accept_r() */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR2);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGQUIT);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	for(started=0; started<worker_threads; started++) {
+	    if((errno = pthread_create(&threads[started].tid, NULL, accept_thread_main, &threads[started]))) {
+		PCRIT("Failed to start request thread %d", started);
+		terminate = 1;
+		break;
+	    }
+	}
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	while(1) {
+	    struct timespec ts = { 0, 100 * 1000 * 1000 };
+	    int alive = 0;
+	    for(i=0; i<started; i++) {
+		if(threads[i].done)
+		    continue;
+		alive++;
+		if(terminate && threads[i].accepting)
+		    pthread_kill(threads[i].tid, SIGUSR2);
+	    }
+	    if(!alive)
+		break;
+	    nanosleep(&ts, NULL);
+	}
+	for(i=0; i<started; i++)
+	    pthread_join(threads[i].tid, NULL);
     }
-    FCGX_Finish_r(&req);
-    sx_hashfs_close(hashfs);
 
-    if(i!=worker_max_requests)
+    if(nserved < worker_max_requests)
 	INFO("Accept loop exiting upon request");
     else
         INFO("Accept loop exiting after %u requests", worker_max_requests);
 
+ accept_loop_close:
+    for(i=0; i<worker_threads; i++) {
+	sx_hashfs_close(threads[i].hashfs);
+	if(i && threads[i].sx)
+	    sxc_shutdown(threads[i].sx, 0);
+    }
+    free(threads);
+
  accept_loop_end:
     OS_LibShutdown();
     close(job_trigger);
@@ -232,7 +381,7 @@ void print_help(const char *prog)
 
 int main(int argc, char **argv) {
     int i, s, pidfd =-1, sockmode = -1, trig[2], inner_job_trigger, inner_block_trigger, inner_gc_trigger, inner_gc_expire_trigger, alive;
-    int debug, foreground, have_nodeid = 0;
+    int debug, foreground, have_nodeid = 0, storage_lock;
     sx_uuid_t cluster_uuid, node_uuid;
     char *pidfile = NULL;
     sx_hashfs_t *test_hashfs;
@@ -242,9 +391,13 @@ int main(int argc, char **argv) {
     struct cmdline_args_info cmdargs;
     struct cmdline_parser_params *params;
     struct rlimit rlim;
+    rlim_t max_fds;
     time_t wait_start;
     pid_t dead;
     sxc_client_t *sx = NULL;
+    sx_blockcache_stats_t bcstats;
+    jobmgr_stats_t jmstats;
+    ckptmgr_stats_t *ckstats;
 
     if(cmdline_args(argc, argv, &cmdargs))
 	return EXIT_FAILURE;
@@ -288,9 +441,11 @@ int main(int argc, char **argv) {
 	INFO("Using default config file %s", DEFAULT_FCGI_CFGFILE);
     cmdline_args_free(&cmdargs);
 
-    if(!getrlimit(RLIMIT_NOFILE, &rlim) && (rlim.rlim_cur < MAX_FDS || rlim.rlim_max < MAX_FDS)) {
+    /* Every request thread keeps its own set of databases open */
+    max_fds = MAX_FDS * MAX(MIN(args.worker_threads_arg, MAX_WORKER_THREADS), 1);
+    if(!getrlimit(RLIMIT_NOFILE, &rlim) && (rlim.rlim_cur < max_fds || rlim.rlim_max < max_fds)) {
 	unsigned int l_soft = rlim.rlim_cur, l_hard = rlim.rlim_max;
-	rlim.rlim_cur = rlim.rlim_max = MAX_FDS;
+	rlim.rlim_cur = rlim.rlim_max = max_fds;
 	if(setrlimit(RLIMIT_NOFILE, &rlim))
 	    WARN("Can't increase the limit for maximum number of open files (current: %u/%u)", l_soft, l_hard);
     }
@@ -338,6 +493,14 @@ int main(int argc, char **argv) {
     db_busy_timeout = args.db_busy_timeout_arg;
     worker_max_wait = args.worker_max_wait_arg;
     worker_max_requests = args.worker_max_requests_arg;
+    download_zero_copy = args.zero_copy_download_flag;
+    jobmgr_max_jobs = args.jobmgr_max_jobs_arg;
+    list_index = args.list_index_flag;
+    gc_full_interval = args.gc_full_interval_arg;
+    gc_workers = args.gc_workers_arg;
+    db_checkpoint_interval = args.db_checkpoint_interval_arg;
+    db_checkpoint_max_restarts = args.db_checkpoint_max_restarts_arg;
+    worker_threads = args.worker_threads_arg;
 
     if(args.children_arg <= 0 || args.children_arg > MAX_CHILDREN) {
 	CRIT("Invalid number of children");
@@ -346,6 +509,13 @@ int main(int argc, char **argv) {
 	return EXIT_FAILURE;
     }
 
+    if(worker_threads <= 0 || worker_threads > MAX_WORKER_THREADS) {
+	CRIT("Invalid number of worker threads");
+        cmdline_parser_free(&args);
+        sx_done(&sx);
+	return EXIT_FAILURE;
+    }
+
     if(args.pidfile_given)
 	pidfile = args.pidfile_arg;
 
@@ -563,6 +733,17 @@ int main(int argc, char **argv) {
 	close(s);
     }
 
+    /* Keep offline maintenance (sxadm node --compact, --reshard, --place) away
+     * from the storage while the node runs; all children inherit the lock */
+    storage_lock = sx_storage_lock(args.data_dir_arg, 0);
+    if(storage_lock < 0) {
+	CRIT("Failed to lock the storage: %s", msg_get_reason());
+	fprintf(stderr, "Failed to lock the storage: %s\n", msg_get_reason());
+        cmdline_parser_free(&args);
+        sx_done(&sx);
+	return EXIT_FAILURE;
+    }
+
     /* Just attempt to open the hashfs so we can alert about basic mistakes
      * earlier and while we are still attached to the terminal */
     test_hashfs = sx_hashfs_open(args.data_dir_arg, sx);
@@ -668,6 +849,19 @@ int main(int argc, char **argv) {
 	close(pidfd);
     }
 
+    /* Request and database stats are shared by all the children */
+    if(sx_stats_init(args.data_dir_arg))
+	WARN("Server stats disabled");
+
+    /* The job manager stats must be mapped before the job manager is forked */
+    if(jobmgr_stats_init())
+	WARN("Job manager stats disabled");
+
+    /* The block cache must be mapped before any child is forked, so that gc
+     * can drop the blocks it frees from the cache the workers read */
+    if(args.block_cache_size_arg < 0 || sx_blockcache_init((uint64_t)args.block_cache_size_arg * 1024 * 1024))
+	WARN("Block cache disabled");
+
     /* Spawn the job manager */
     pids[JOBMGR] = fork();
     if(pids[JOBMGR] < 0) {
@@ -760,6 +954,43 @@ int main(int argc, char **argv) {
     }
     close(inner_block_trigger);
 
+    /* Spawn the checkpoint manager, which takes over WAL checkpoints from everyone else */
+    if(db_checkpoint_interval > 0) {
+	if(ckptmgr_stats_init())
+	    WARN("Checkpoint manager stats disabled");
+	pids[CKPTMGR] = fork();
+	if(pids[CKPTMGR] < 0) {
+	    PCRIT("Cannot spawn the checkpoint manager");
+	    cmdline_parser_free(&args);
+	    free(pidfile);
+	    kill(pids[JOBMGR], SIGTERM);
+	    kill(pids[BLKMGR], SIGTERM);
+	    kill(pids[GCMGR], SIGTERM);
+	    sx_done(&sx);
+	    return EXIT_FAILURE;
+	} else if(!pids[CKPTMGR]) {
+	    int ret;
+	    sx_done(&sx);
+	    sx = sx_init(NULL, "checkpoint manager", args.logfile_arg, foreground, argc, argv);
+	    if (sx) {
+		if(debug)
+		    log_setminlevel(sx,SX_LOG_DEBUG);
+		ret = ckptmgr(sx, argv[0], args.data_dir_arg);
+	    } else {
+		ret = 1;
+	    }
+	    cmdline_parser_free(&args);
+	    free(pidfile);
+	    close(job_trigger);
+	    close(block_trigger);
+	    close(gc_trigger);
+	    close(gc_expire_trigger);
+	    OS_LibShutdown();
+	    sx_done(&sx);
+	    return ret;
+	}
+    }
+
     if(have_nodeid)
 	INFO("Node %s in cluster %s starting up", node_uuid.string, cluster_uuid.string);
     else
@@ -784,7 +1015,7 @@ int main(int argc, char **argv) {
                     if (sx) {
                         if(debug)
                             log_setminlevel(sx,SX_LOG_DEBUG);
-                        status = accept_loop(sx, argv[0], args.data_dir_arg);
+                        status = accept_loop(sx, argv[0], args.data_dir_arg, debug);
                     } else {
                         status = 1;
                     }
@@ -812,7 +1043,7 @@ int main(int argc, char **argv) {
 	    break;
 	}
 
-	if(dead == pids[JOBMGR] || dead == pids[BLKMGR] || dead == pids[GCMGR]) {
+	if(dead == pids[JOBMGR] || dead == pids[BLKMGR] || dead == pids[GCMGR] || dead == pids[CKPTMGR]) {
 	    /* Critical child died */
 	    if(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
                 if (!terminate)
@@ -825,6 +1056,8 @@ int main(int argc, char **argv) {
 		    deadproc = "Job manager";
 		else if(dead == pids[BLKMGR])
 		    deadproc = "Block manager";
+		else if(dead == pids[CKPTMGR])
+		    deadproc = "Checkpoint manager";
 		else
 		    deadproc = "Garbage collector";
 		if(WIFSIGNALED(status))
@@ -889,6 +1122,38 @@ int main(int argc, char **argv) {
     } else
 	INFO("All children have exited");
 
+    if(!sx_blockcache_stats(&bcstats))
+	INFO("Block cache: %llu hits, %llu misses, %llu inserts, %llu evictions",
+	     (unsigned long long)bcstats.hits, (unsigned long long)bcstats.misses,
+	     (unsigned long long)bcstats.inserts, (unsigned long long)bcstats.evictions);
+    sx_blockcache_done();
+
+    if(!jobmgr_stats(&jmstats)) {
+	for(i=0; i<JOBMGR_STATS_TYPES; i++) {
+	    if(!jmstats.types[i].count)
+		continue;
+	    INFO("Job type %d: %llu jobs, %llu ms average, %llu ms max", i,
+		 (unsigned long long)jmstats.types[i].count,
+		 (unsigned long long)(jmstats.types[i].total_ms / jmstats.types[i].count),
+		 (unsigned long long)jmstats.types[i].max_ms);
+	}
+    }
+    jobmgr_stats_done();
+
+    if((ckstats = malloc(sizeof(*ckstats))) && !ckptmgr_stats(ckstats)) {
+	for(i=0; i<(int)ckstats->ndbs; i++) {
+	    ckptmgr_db_stats_t *d = &ckstats->dbs[i];
+	    if(!d->count)
+		continue;
+	    INFO("Checkpoints of %s: %llu run (%llu restart, %llu busy), %llu ms average, %llu ms max, %llu pages in WAL",
+		 d->name, (unsigned long long)d->count, (unsigned long long)d->restarts, (unsigned long long)d->busy,
+		 (unsigned long long)(d->total_ms / d->count), (unsigned long long)d->max_ms, (unsigned long long)d->wal_pages);
+	}
+    }
+    free(ckstats);
+    ckptmgr_stats_done();
+    sx_stats_done();
+
     if(pidfile) {
 	unlink(pidfile);
 	free(pidfile);
@@ -899,6 +1164,7 @@ int main(int argc, char **argv) {
     close(block_trigger);
     close(gc_trigger);
     close(gc_expire_trigger);
+    sx_storage_unlock(storage_lock);
     cmdline_parser_free(&args);
     sx_done(&sx);
 
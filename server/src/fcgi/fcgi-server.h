@@ -31,8 +31,10 @@
 #include <fcgiapp.h>
 #include "hashfs.h"
 
-extern FCGX_Stream *fcgi_in, *fcgi_out, *fcgi_err;
-extern FCGX_ParamArray envp;
-extern sx_hashfs_t *hashfs;
+/* Request state is per thread, see worker-threads */
+extern __thread FCGX_Stream *fcgi_in, *fcgi_out, *fcgi_err;
+extern __thread FCGX_ParamArray envp;
+extern __thread FCGX_Request *fcgi_req;
+extern __thread sx_hashfs_t *hashfs;
 
 #endif
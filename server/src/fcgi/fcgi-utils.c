@@ -31,6 +31,14 @@
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <fastcgi.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "../libsx/src/vcrypto.h"
 
@@ -43,8 +51,8 @@
 
 #define MAX_CLOCK_DRIFT 10
 
-uint8_t hashbuf[UPLOAD_CHUNK_SIZE];
-time_t last_flush;
+__thread uint8_t *hashbuf;
+__thread time_t last_flush;
 void send_server_info(void) {
     last_flush = time(NULL);
     CGI_PRINTF("Server: Skylable SX\r\nSX-Cluster: %s (%s)%s\r\nSX-API-Version: %u\r\nVary: Accept-Encoding\r\n", src_version(), sx_hashfs_uuid(hashfs)->string, sx_hashfs_uses_secure_proto(hashfs) ? " ssl" : "", SRC_API_VERSION);
@@ -161,9 +169,10 @@ void send_partial_error(const char *message, rc_ty rc) {
     send_error_helper(',', 500, msg_get_reason());
 }
 
-static sxi_hmac_sha1_ctx *hmac_ctx;
-static sxi_md_ctx *body_ctx;
+static __thread sxi_hmac_sha1_ctx *hmac_ctx;
+static __thread sxi_md_ctx *body_ctx;
 void send_error(int errnum, const char *message) {
+    reply_status = errnum;
     sxi_hmac_sha1_cleanup(&hmac_ctx);
     sxi_md_cleanup(&body_ctx);
     if(!message || !*message)
@@ -197,11 +206,11 @@ int is_http_10(void) {
     return strcmp(proto, "HTTP/1.0") == 0;
 }
 
-uint8_t user[AUTH_UID_LEN], rhmac[20];
-sx_uid_t uid;
-static sx_priv_t role;
+__thread uint8_t user[AUTH_UID_LEN], rhmac[20];
+__thread sx_uid_t uid;
+static __thread sx_priv_t role;
 
-static enum authed_t { AUTH_NOTAUTH, AUTH_BODYCHECK, AUTH_BODYCHECKING, AUTH_OK } authed;
+static __thread enum authed_t { AUTH_NOTAUTH, AUTH_BODYCHECK, AUTH_BODYCHECKING, AUTH_OK } authed;
 
 int get_body_chunk(char *buf, int buflen) {
     int r = FCGX_GetStr(buf, buflen, fcgi_in);
@@ -317,9 +326,11 @@ static char *inplace_urldecode(char *s, char forbid, char dedup, int *has_forbid
 
 
 #define MAX_ARGS 256
-char *volume, *path, *args[MAX_ARGS];
-unsigned int nargs;
-verb_t verb;
+__thread char *volume, *path, *args[MAX_ARGS];
+__thread unsigned int nargs;
+__thread verb_t verb;
+__thread uint64_t reply_bytes;
+__thread int reply_status;
 
 int arg_num(const char *arg) {
     unsigned int i, len = strlen(arg);
@@ -359,12 +370,18 @@ int arg_is(const char *arg, const char *ref) {
  * max(VERB) = strlen(OPTIONS) = 7
  * max(URI) = 8174 
  */
-static char reqbuf[8174];
+static __thread char reqbuf[8174];
 void handle_request(void) {
     const char *param, *p_method, *p_uri;
     char *argp;
     unsigned int plen;
 
+    volume = path = NULL;
+    nargs = 0;
+    verb = VERB_UNSUP;
+    reply_bytes = 0;
+    reply_status = 200;
+
     if(sx_hashfs_distcheck(hashfs) < 0) {
 	CRIT("Failed to reload distribution");
 	quit_errmsg(503, "Internal error: failed to load distribution");
@@ -374,7 +391,6 @@ void handle_request(void) {
 	quit_errmsg(410, "This node is no longer a cluster member");
 
     msg_new_id();
-    verb = VERB_UNSUP;
     p_method = FCGX_GetParam("REQUEST_METHOD", envp);
     if(p_method) {
 	plen = strlen(p_method);
@@ -397,6 +413,7 @@ void handle_request(void) {
 	    break;
 	case 7:
 	    if(!memcmp(p_method, "OPTIONS", 8)) {
+		verb = VERB_OPTIONS;
 		CGI_PUTS("Allow: GET,HEAD,OPTIONS,PUT,DELETE\r\nContent-Length: 0\r\n\r\n");
 		return;
 	    }
@@ -621,6 +638,37 @@ void handle_request(void) {
     sxi_md_cleanup(&body_ctx);
 }
 
+/* Returns the entry of list matching the first len chars of name, or NULL */
+static const char *known_name(const char *name, unsigned int len, const char * const *list) {
+    for(; *list; list++)
+	if(strlen(*list) == len && !strncmp(*list, name, len))
+	    return *list;
+    return NULL;
+}
+
+/* Groups requests by what they hit, not by the exact object.
+ * Query and reserved volume names come from the client, so only the known
+ * ones get a name of their own: the stats table has room for a fixed set */
+void request_name(char *buf, unsigned int buflen) {
+    static const char *verbs[] = { "UNSUP", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS" };
+    static const char * const cluster_queries[] = { "clusterStatus", "nodeList", "stats", "volumeList", "volumeMeta", "whoami", NULL };
+    static const char * const reserved_volumes[] = { ".challenge", ".data", ".dist", ".faulty", ".gc", ".jlock", ".pushto", ".replblk",
+						     ".replfl", ".results", ".sync", ".upload", ".users", ".volsizes", NULL };
+    const char *v = verb < sizeof(verbs) / sizeof(verbs[0]) ? verbs[verb] : "UNSUP", *n;
+
+    if(!volume) {
+	if(nargs) {
+	    n = known_name(args[0], strcspn(args[0], "="), cluster_queries);
+	    snprintf(buf, buflen, "%s /?%s", v, n ? n : "other");
+	} else
+	    snprintf(buf, buflen, "%s /", v);
+    } else if(is_reserved()) {
+	n = known_name(volume, strlen(volume), reserved_volumes);
+	snprintf(buf, buflen, "%s /%s", v, n ? n : ".other");
+    } else
+	snprintf(buf, buflen, "%s %s", v, path ? "file" : "volume");
+}
+
 int64_t content_len(void) {
     const char *clen = FCGX_GetParam("CONTENT_LENGTH", envp);
     if(!clen)
@@ -734,8 +782,9 @@ void send_httpdate(time_t t) {
     const char *month[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
     const char *wkday[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
     char buf[32];
+    struct tm tm, *ts;
 
-    struct tm *ts = gmtime(&t);
+    ts = gmtime_r(&t, &tm);
     if(!ts)
 	return;
 
@@ -774,6 +823,108 @@ void send_keepalive(void) {
     }
 }
 
+static int write_all(int fd, const void *buf, unsigned int len) {
+    const uint8_t *ptr = buf;
+    while(len) {
+	ssize_t l = write(fd, ptr, len);
+	if(l < 0) {
+	    if(errno == EINTR)
+		continue;
+	    return -1;
+	}
+	ptr += l;
+	len -= l;
+    }
+    return 0;
+}
+
+static int copy_range(int outfd, int infd, uint64_t off, unsigned int len) {
+#ifdef __linux__
+    off_t pos = off;
+    while(len) {
+	ssize_t l = sendfile(outfd, infd, &pos, len);
+	if(l < 0) {
+	    if(errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if(!l) {
+	    errno = EIO;
+	    return -1;
+	}
+	len -= l;
+    }
+    return 0;
+#else
+    while(len) {
+	unsigned int todo = MIN(len, UPLOAD_CHUNK_SIZE);
+	ssize_t l = pread(infd, hashbuf, todo, off);
+	if(l < 0) {
+	    if(errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if(!l) {
+	    errno = EIO;
+	    return -1;
+	}
+	if(write_all(outfd, hashbuf, l))
+	    return -1;
+	off += l;
+	len -= l;
+    }
+    return 0;
+#endif
+}
+
+/* Largest FCGI_STDOUT record payload that keeps records 8-byte aligned */
+#define FCGI_MAX_PAYLOAD 65528
+
+/* Sends len bytes of fd starting at off as the response body, bypassing the
+ * FCGX buffers: the stream is flushed and the data is framed into raw
+ * FCGI_STDOUT records written with sendfile() onto the web server socket.
+ * On failure the response is truncated and must not be written to anymore */
+int send_file_range(int fd, uint64_t off, uint64_t len) {
+    FCGI_Header hdr;
+
+    if(!fcgi_req || fcgi_req->ipcFd < 0)
+	return -1;
+    if(FCGX_FFlush(fcgi_out) < 0) {
+	DEBUG("FCGX_FFlush() failed: %s", strerror(FCGX_GetError(fcgi_out)));
+	return -1;
+    }
+
+    hdr.version = FCGI_VERSION_1;
+    hdr.type = FCGI_STDOUT;
+    hdr.requestIdB1 = (fcgi_req->requestId >> 8) & 0xff;
+    hdr.requestIdB0 = fcgi_req->requestId & 0xff;
+    hdr.paddingLength = 0;
+    hdr.reserved = 0;
+    while(len) {
+	unsigned int chunk = MIN(len, FCGI_MAX_PAYLOAD);
+	hdr.contentLengthB1 = chunk >> 8;
+	hdr.contentLengthB0 = chunk & 0xff;
+	if(write_all(fcgi_req->ipcFd, &hdr, sizeof(hdr)) ||
+	   copy_range(fcgi_req->ipcFd, fd, off, chunk)) {
+	    WARN("Failed to send data to the web server: %s", strerror(errno));
+	    return -1;
+	}
+	reply_bytes += chunk;
+	off += chunk;
+	len -= chunk;
+    }
+    last_flush = time(NULL);
+    return 0;
+}
+
+/* Drops the connection to the web server in the middle of the response body,
+ * so that the client sees a truncated reply instead of a complete one */
+void abort_reply(void) {
+    if(!fcgi_req || fcgi_req->ipcFd < 0)
+	return;
+    shutdown(fcgi_req->ipcFd, SHUT_RDWR);
+}
+
 void send_nodes(const sx_nodelist_t *nodes) {
     unsigned int i, comma = 0, nnodes;
     CGI_PUTC('[');
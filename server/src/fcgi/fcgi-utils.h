@@ -39,26 +39,37 @@
 
 #define CGI_PUTD(data, len)			\
     do {					\
-	if(FCGX_PutStr((const char *)(data), len, fcgi_out) < 0)	\
+	int __put = FCGX_PutStr((const char *)(data), len, fcgi_out);	\
+	if(__put < 0)				\
 	    DEBUG("FCGX_PutStr() failed: %s", strerror(FCGX_GetError(fcgi_out)));	\
+	else					\
+	    reply_bytes += __put;		\
     } while(0)
 
 #define CGI_PUTS(s)				\
     do {					\
-	if(FCGX_PutS(s, fcgi_out) < 0)		\
+	int __put = FCGX_PutS(s, fcgi_out);	\
+	if(__put < 0)				\
 	    DEBUG("FCGX_PutS() failed");		\
+	else					\
+	    reply_bytes += __put;		\
     } while(0)
 
 #define CGI_PUTC(c)				\
     do {					\
 	if(FCGX_PutChar(c, fcgi_out) < 0)		\
 	    DEBUG("FCGX_PutChar() failed");	\
+	else					\
+	    reply_bytes++;			\
     } while(0)
 
 #define CGI_PRINTF(...)				\
     do {					\
-	if(FCGX_FPrintF(fcgi_out, __VA_ARGS__) < 0)	\
+	int __put = FCGX_FPrintF(fcgi_out, __VA_ARGS__);	\
+	if(__put < 0)				\
 	    DEBUG("FCGX_FPrintF() failed");	\
+	else					\
+	    reply_bytes += __put;		\
     } while(0)
 
 #define CGI_PUTLL(ll)				\
@@ -74,16 +85,19 @@
 #define MAX_ARGS 256
 #define REPLACEMENT_BATCH_SIZE (64*1024*1024)
 
-extern char *volume, *path, *args[MAX_ARGS];
-extern unsigned int nargs;
+extern __thread char *volume, *path, *args[MAX_ARGS];
+extern __thread uint64_t reply_bytes;
+extern __thread int reply_status;
+extern __thread unsigned int nargs;
 typedef enum { VERB_UNSUP, VERB_GET, VERB_HEAD, VERB_POST, VERB_PUT, VERB_DELETE, VERB_OPTIONS } verb_t;
-extern verb_t verb;
-extern uint8_t hashbuf[UPLOAD_CHUNK_SIZE];
-extern uint8_t user[AUTH_UID_LEN];
-extern sx_uid_t uid;
+extern __thread verb_t verb;
+extern __thread uint8_t *hashbuf; /* UPLOAD_CHUNK_SIZE bytes */
+extern __thread uint8_t user[AUTH_UID_LEN];
+extern __thread sx_uid_t uid;
 
 void send_server_info(void);
 void handle_request(void);
+void request_name(char *buf, unsigned int buflen);
 void send_error(int errnum, const char *message);
 void send_partial_error(const char *message, rc_ty rc);
 int64_t content_len(void);
@@ -110,6 +124,8 @@ int get_body_chunk(char *buf, int buflen);
 void auth_complete(void);
 #define MAX_KEEPALIVE_INTERVAL 10
 void send_keepalive(void);
+int send_file_range(int fd, uint64_t off, uint64_t len);
+void abort_reply(void);
 void send_nodes(const sx_nodelist_t *nodes);
 void send_nodes_randomised(const sx_nodelist_t *nodes);
 void send_job_info(job_t job);
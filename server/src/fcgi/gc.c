@@ -31,6 +31,10 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 
 #include "gc.h"
 #include "log.h"
@@ -47,11 +51,91 @@ static void sighandler(int signum) {
 }
 
 
+#define GC_MAX_WORKERS 48
+
+/* Runs one GC cycle in gc_workers forked processes, each with its own
+ * hashfs instance and a disjoint set of hash database shards.
+ * The workers report their gc run totals through a shared mapping; these
+ * are summed into *total, with the elapsed time of the slowest worker */
+static rc_ty gc_parallel(sxc_client_t *sx, const char *dir, int force_expire, int run, int full, sx_hashfs_gc_stats_t *total) {
+    pid_t pids[GC_MAX_WORKERS];
+    sx_hashfs_gc_stats_t *wstats;
+    unsigned int i, j, nworkers = gc_workers > GC_MAX_WORKERS ? GC_MAX_WORKERS : gc_workers;
+    int killed = 0;
+    rc_ty ret = OK;
+
+    memset(total, 0, sizeof(*total));
+    wstats = mmap(NULL, nworkers * sizeof(*wstats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(wstats == MAP_FAILED) {
+	PWARN("Failed to allocate the GC worker stats");
+	wstats = NULL;
+    }
+
+    for(i=0; i<nworkers; i++) {
+	pids[i] = fork();
+	if(pids[i] < 0) {
+	    PWARN("Cannot fork GC worker");
+	    ret = FAIL_EINTERNAL;
+	    break;
+	}
+	if(!pids[i]) {
+	    sx_hashfs_t *hashfs = sx_hashfs_open(dir, sx);
+	    rc_ty rc;
+
+	    if(!hashfs) {
+		CRIT("Failed to initialize the hash server interface");
+		_exit(EXIT_FAILURE);
+	    }
+	    sx_hashfs_gc_shards(hashfs, i, nworkers);
+	    rc = sx_hashfs_gc_periodic(hashfs, &terminate, force_expire ? -1 : GC_GRACE_PERIOD);
+	    if(rc == OK && run && !terminate) {
+		rc = sx_hashfs_gc_run(hashfs, &terminate, full);
+		if(wstats)
+		    sx_hashfs_gc_get_last(hashfs, &wstats[i]);
+		if(!terminate && sx_hashfs_gc_reclaim(hashfs, &terminate) != OK)
+		    WARN("Failed to release freed blocks");
+	    }
+	    sx_hashfs_close(hashfs);
+	    _exit(rc == OK ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+    }
+
+    for(j=0; j<i; j++) {
+	int status;
+	while(waitpid(pids[j], &status, 0) < 0) {
+	    if(errno != EINTR) {
+		PWARN("Cannot wait for GC worker %d", (int)pids[j]);
+		status = -1;
+		break;
+	    }
+	    if(terminate && !killed) {
+		unsigned int k;
+		for(k=j; k<i; k++)
+		    kill(pids[k], SIGTERM);
+		killed = 1;
+	    }
+	}
+	if(status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+	    ret = FAIL_EINTERNAL;
+	else if(wstats) {
+	    total->checked += wstats[j].checked;
+	    total->freed += wstats[j].freed;
+	    if(wstats[j].elapsed > total->elapsed)
+		total->elapsed = wstats[j].elapsed;
+	}
+    }
+    total->full = full;
+    if(wstats)
+	munmap(wstats, nworkers * sizeof(*wstats));
+    return ret;
+}
+
 int gc(sxc_client_t *sx, const char *self, const char *dir, int pipe, int pipe_expire) {
     struct sigaction act;
     sx_hashfs_t *hashfs;
     rc_ty rc;
-    struct timeval tv0, tv1, tv2;
+    struct timeval tv0, tv1, tv2, tvfull;
+    sx_hashfs_gc_stats_t gcstats;
 
     sigemptyset(&act.sa_mask);
     act.sa_flags = 0;
@@ -71,6 +155,7 @@ int gc(sxc_client_t *sx, const char *self, const char *dir, int pipe, int pipe_e
     }
 
     memset(&tv0, 0, sizeof(tv0));
+    memset(&tvfull, 0, sizeof(tvfull));
     while(!terminate) {
         int forced_awake = 0, force_expire = 0;
         /* this MUST run periodically even if we don't want to
@@ -88,6 +173,39 @@ int gc(sxc_client_t *sx, const char *self, const char *dir, int pipe, int pipe_e
 
 	gettimeofday(&tv1, NULL);
 	sx_hashfs_distcheck(hashfs);
+        if (sx_hashfs_listidx_build(hashfs, &terminate) != OK)
+            WARN("Failed to build the listing index");
+        if (terminate)
+            break;
+        if (gc_workers > 1) {
+            int run = timediff(&tv0, &tv1) > gc_interval || forced_awake;
+            int full = run && (forced_awake || !tvfull.tv_sec || timediff(&tvfull, &tv1) >= gc_full_interval);
+            /* The workers must not inherit our open databases */
+            sx_hashfs_close(hashfs);
+            rc = gc_parallel(sx, dir, force_expire, run, full, &gcstats);
+            hashfs = sx_hashfs_open(dir, sx);
+            if (!hashfs) {
+                CRIT("Failed to initialize the hash server interface");
+                return EXIT_FAILURE;
+            }
+            gettimeofday(&tv2, NULL);
+            INFO("GC %s completed in %.1f sec using %d workers", run ? "run" : "periodic", timediff(&tv1, &tv2), gc_workers);
+            if (rc)
+                WARN("GC error: %s", rc2str(rc));
+            else if (run) {
+                if (full)
+                    memcpy(&tvfull, &tv1, sizeof(tvfull));
+                /* The reopened hashfs has no record of the workers' pass */
+                sx_hashfs_gc_set_last(hashfs, &gcstats);
+                sx_hashfs_gc_info(hashfs, &terminate);
+                memcpy(&tv0, &tv1, sizeof(tv0));
+            }
+            if (terminate)
+                break;
+            sx_hashfs_checkpoint_gc(hashfs);
+            sx_hashfs_checkpoint_passive(hashfs);
+            continue;
+        }
         rc = sx_hashfs_gc_periodic(hashfs, &terminate, force_expire ? -1 : GC_GRACE_PERIOD);
         sx_hashfs_checkpoint_gc(hashfs);
         sx_hashfs_checkpoint_passive(hashfs);
@@ -102,7 +220,12 @@ int gc(sxc_client_t *sx, const char *self, const char *dir, int pipe, int pipe_e
                 sleep(1);
             gettimeofday(&tv1, NULL);
             if (timediff(&tv0, &tv1) > gc_interval || forced_awake) {
-                sx_hashfs_gc_run(hashfs, &terminate);
+                /* Full sweeps catch anything the candidate queue missed */
+                int full = forced_awake || !tvfull.tv_sec || timediff(&tvfull, &tv1) >= gc_full_interval;
+                if (sx_hashfs_gc_run(hashfs, &terminate, full) == OK && full)
+                    memcpy(&tvfull, &tv1, sizeof(tvfull));
+                if (!terminate && sx_hashfs_gc_reclaim(hashfs, &terminate) != OK)
+                    WARN("Failed to release freed blocks");
                 gettimeofday(&tv2, NULL);
                 INFO("GC run completed in %.1f sec", timediff(&tv1, &tv2));
                 sx_hashfs_gc_info(hashfs, &terminate);
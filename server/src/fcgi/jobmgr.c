@@ -51,7 +51,10 @@
 #include <sys/select.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
@@ -4166,6 +4169,49 @@ static job_data_t *make_jobdata(const void *data, unsigned int data_len, uint64_
     return ret;
 }
 
+static jobmgr_stats_t *jstats;
+
+int jobmgr_stats_init(void) {
+    if(jstats) {
+	WARN("Job manager stats already initialized");
+	return -1;
+    }
+    jstats = mmap(NULL, sizeof(*jstats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(jstats == MAP_FAILED) {
+	PWARN("Failed to allocate the job manager stats");
+	jstats = NULL;
+	return -1;
+    }
+    return 0;
+}
+
+void jobmgr_stats_done(void) {
+    if(!jstats)
+	return;
+    munmap(jstats, sizeof(*jstats));
+    jstats = NULL;
+}
+
+int jobmgr_stats(jobmgr_stats_t *stats) {
+    if(!jstats || !stats)
+	return -1;
+    /* Counters are updated independently, a snapshot may be slightly skewed */
+    memcpy(stats, jstats, sizeof(*stats));
+    return 0;
+}
+
+static void jobmgr_stats_job(jobtype_t type, uint64_t ms) {
+    jobmgr_type_stats_t *t;
+    uint64_t max;
+
+    if(!jstats || type < 0 || type >= JOBMGR_STATS_TYPES)
+	return;
+    t = &jstats->types[type];
+    __sync_fetch_and_add(&t->count, 1);
+    __sync_fetch_and_add(&t->total_ms, ms);
+    while((max = t->max_ms) < ms && !__sync_bool_compare_and_swap(&t->max_ms, max, ms));
+}
+
 static int terminate = 0;
 static void sighandler(int signum) {
     if (signum == SIGHUP || signum == SIGUSR1) {
@@ -4182,11 +4228,19 @@ static void sighandler(int signum) {
 
 #define BATCH_ACT_NUM 64
 
+/* Longest sleep between queue scans when no job is due: it bounds the delay
+ * in picking up jobs queued without a trigger and the housekeeping interval */
+#define JOBMGR_IDLE_WAKEUP 5.0
+
 struct jobmgr_data_t {
     /* The following items are filled in once by jobmgr() */
     sx_hashfs_t *hashfs;
     sxi_db_t *eventdb;
     sqlite3_stmt *qjob;
+    sqlite3_stmt *qjobid;
+    sqlite3_stmt *qready;
+    sqlite3_stmt *qdepth;
+    sqlite3_stmt *qnext;
     sqlite3_stmt *qact;
     sqlite3_stmt *qfail_children;
     sqlite3_stmt *qfail_parent;
@@ -4569,24 +4623,76 @@ static void check_version(struct jobmgr_data_t *q) {
 
 }
 
-static void jobmgr_process_queue(struct jobmgr_data_t *q, int forced) {
+static void jobmgr_update_depth(struct jobmgr_data_t *q) {
+    if(!jstats)
+	return;
+    sqlite3_reset(q->qdepth);
+    if(qstep(q->qdepth) == SQLITE_ROW)
+	jstats->queue_depth = sqlite3_column_int64(q->qdepth, 0);
+    sqlite3_reset(q->qdepth);
+}
+
+/* Returns the number of seconds until the next delayed job is due, capped
+ * at JOBMGR_IDLE_WAKEUP. Jobs which are due already are not considered:
+ * they are either being run or waiting for a running job to finish, and the
+ * completion wakes the job manager up anyway. */
+static float jobmgr_next_due(struct jobmgr_data_t *q) {
+    float wait = JOBMGR_IDLE_WAKEUP;
+
+    sqlite3_reset(q->qnext);
+    if(qstep(q->qnext) == SQLITE_ROW && sqlite3_column_type(q->qnext, 0) != SQLITE_NULL) {
+	double due = sqlite3_column_double(q->qnext, 0);
+	if(due < wait)
+	    wait = due > 0 ? due : 0;
+    }
+    sqlite3_reset(q->qnext);
+    return wait;
+}
+
+/* Fills in the job details from the current row of qj (a qjob or qjobid statement) */
+static int jobmgr_load_job(struct jobmgr_data_t *q, sqlite3_stmt *qj) {
+    const void *ptr;
+    unsigned int plen;
+
+    q->job_id = sqlite3_column_int64(qj, 0);
+    q->job_type = sqlite3_column_int(qj, 1);
+    ptr = sqlite3_column_blob(qj, 2);
+    plen = sqlite3_column_bytes(qj, 2);
+    q->job_expired = sqlite3_column_int(qj, 3);
+    q->job_failed = (sqlite3_column_int(qj, 4) != 0);
+    q->job_data = make_jobdata(ptr, plen, sqlite3_column_int(qj, 5));
+    sqlite3_reset(qj);
+
+    if(!q->job_data) {
+	WARN("Job %lld has got invalid data", (long long)q->job_id);
+	return -1;
+    }
+    return 0;
+}
+
+static void jobmgr_exec_job(struct jobmgr_data_t *q) {
+    struct timeval start, end;
+
+    DEBUG("Running job %lld (type %d, %s, %s)", (long long)q->job_id, q->job_type, q->job_expired?"expired":"not expired", q->job_failed?"failed":"not failed");
+    if(jstats)
+	__sync_fetch_and_add(&jstats->running, 1);
+    gettimeofday(&start, NULL);
+    jobmgr_run_job(q);
+    gettimeofday(&end, NULL);
+    if(jstats)
+	__sync_fetch_and_sub(&jstats->running, 1);
+    free(q->job_data);
+    q->job_data = NULL;
+    jobmgr_stats_job(q->job_type, timediff(&start, &end) * 1000.0);
+    DEBUG("Finished running job %lld", (long long)q->job_id);
+}
+
+static void jobmgr_process_queue(struct jobmgr_data_t *q) {
+    jobmgr_update_depth(q);
     while(!terminate) {
-	const void *ptr;
-	unsigned int plen;
 	int r;
 
 	r = qstep(q->qjob);
-	if(r == SQLITE_DONE && forced) {
-	    unsigned int waitus = 200000;
-	    do {
-		usleep(waitus);
-		waitus *= 2;
-		r = qstep(q->qjob);
-	    } while(r == SQLITE_DONE && waitus <= 800000);
-	    if(r == SQLITE_DONE)
-		DEBUG("Triggered run without jobs");
-	}
-        forced = 0;
 	if(r == SQLITE_DONE) {
 	    DEBUG("No more pending jobs");
 	    break; /* Stop processing jobs */
@@ -4596,24 +4702,10 @@ static void jobmgr_process_queue(struct jobmgr_data_t *q, int forced) {
 	    break; /* Stop processing jobs */
 	}
 
-	q->job_id = sqlite3_column_int64(q->qjob, 0);
-	q->job_type = sqlite3_column_int(q->qjob, 1);
-	ptr = sqlite3_column_blob(q->qjob, 2);
-	plen = sqlite3_column_bytes(q->qjob, 2);
-	q->job_expired = sqlite3_column_int(q->qjob, 3);
-	q->job_failed = (sqlite3_column_int(q->qjob, 4) != 0);
-	q->job_data = make_jobdata(ptr, plen, sqlite3_column_int(q->qjob, 5));
-	sqlite3_reset(q->qjob);
-
-	if(!q->job_data) {
-	    WARN("Job %lld has got invalid data", (long long)q->job_id);
+	if(jobmgr_load_job(q, q->qjob))
 	    continue; /* Process next job */
-	}
 
-	DEBUG("Running job %lld (type %d, %s, %s)", (long long)q->job_id, q->job_type, q->job_expired?"expired":"not expired", q->job_failed?"failed":"not failed");
-	jobmgr_run_job(q);
-	free(q->job_data);
-	DEBUG("Finished running job %lld", (long long)q->job_id);
+	jobmgr_exec_job(q);
 	/* Process next job */
         sx_hashfs_checkpoint_passive(q->hashfs);
     }
@@ -4622,9 +4714,332 @@ static void jobmgr_process_queue(struct jobmgr_data_t *q, int forced) {
 	check_version(q);
 }
 
+/* Jobs which alter the cluster layout: they are never run alongside other jobs */
+static int jobmgr_is_exclusive(jobtype_t type) {
+    switch(type) {
+    case JOBTYPE_DISTRIBUTION:
+    case JOBTYPE_STARTREBALANCE:
+    case JOBTYPE_FINISHREBALANCE:
+    case JOBTYPE_JLOCK:
+    case JOBTYPE_REBALANCE_BLOCKS:
+    case JOBTYPE_REBALANCE_FILES:
+    case JOBTYPE_REBALANCE_CLEANUP:
+    case JOBTYPE_REPLACE:
+    case JOBTYPE_REPLACE_BLOCKS:
+    case JOBTYPE_REPLACE_FILES:
+	return 1;
+    default:
+	return 0;
+    }
+}
 
-int jobmgr(sxc_client_t *sx, const char *self, const char *dir, int pipe) {
+struct jobmgr_worker_t {
+    pid_t pid;
+    int cmd; /* Job ids to run are written here */
+    int res; /* Job ids are read back from here once done */
+    job_t job; /* The job being run or JOB_FAILURE when idle */
+    int exclusive;
+    char *lock;
+};
+
+/* Pool worker: runs the jobs it is handed by the dispatcher, one at a time */
+static int jobmgr_worker(struct jobmgr_data_t *q, int cmd, int res) {
+    while(!terminate) {
+	job_t job;
+	ssize_t got = read(cmd, &job, sizeof(job));
+	int r;
+
+	if(got < 0 && errno == EINTR)
+	    continue;
+	if(got != sizeof(job))
+	    break; /* The dispatcher has gone away */
+
+	sqlite3_reset(q->qjobid);
+	if(qbind_int64(q->qjobid, ":job", job))
+	    r = SQLITE_ERROR;
+	else
+	    r = qstep(q->qjobid);
+	if(r == SQLITE_ROW) {
+	    if(!jobmgr_load_job(q, q->qjobid))
+		jobmgr_exec_job(q);
+	} else if(r != SQLITE_DONE)
+	    WARN("Failed to retrieve job %lld", (long long)job);
+	sqlite3_reset(q->qjobid);
+        sx_hashfs_checkpoint_passive(q->hashfs);
+
+	if(write(res, &job, sizeof(job)) != sizeof(job)) {
+	    PWARN("Failed to report completion of job %lld", (long long)job);
+	    break;
+	}
+    }
+    return terminate ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void jobmgr_dispatch(struct jobmgr_data_t *q, struct jobmgr_worker_t *w, unsigned int nworkers) {
+    unsigned int i, busy = 0;
+    int r;
+
+    jobmgr_update_depth(q);
+    for(i=0; i<nworkers; i++) {
+	if(w[i].job == JOB_FAILURE)
+	    continue;
+	if(w[i].exclusive)
+	    return;
+	busy++;
+    }
+    if(busy == nworkers)
+	return;
+
+    /* Running jobs and the ones sharing their locks are still listed here,
+     * so the queue is walked (lazily, via the jobs_status index) until all
+     * the free slots are filled rather than up to a fixed number of rows */
+    sqlite3_reset(q->qready);
+    while(busy < nworkers && (r = qstep(q->qready)) == SQLITE_ROW) {
+	job_t job = sqlite3_column_int64(q->qready, 0);
+	int exclusive = jobmgr_is_exclusive(sqlite3_column_int(q->qready, 1));
+	const char *lock = (const char *)sqlite3_column_text(q->qready, 2);
+	unsigned int idle = nworkers;
+
+	for(i=0; i<nworkers; i++) {
+	    if(w[i].job == JOB_FAILURE) {
+		if(idle == nworkers)
+		    idle = i;
+		continue;
+	    }
+	    if(w[i].job == job || (lock && w[i].lock && !strcmp(w[i].lock, lock)))
+		break;
+	}
+	if(i < nworkers)
+	    continue; /* Already running or locked by a running job */
+	if(exclusive && busy)
+	    break; /* Wait for the running jobs to drain; don't start anything else meanwhile */
+
+	if(lock && !(w[idle].lock = strdup(lock))) {
+	    WARN("Out of memory dispatching job %lld", (long long)job);
+	    break;
+	}
+	if(write(w[idle].cmd, &job, sizeof(job)) != sizeof(job)) {
+	    PWARN("Failed to dispatch job %lld", (long long)job);
+	    free(w[idle].lock);
+	    w[idle].lock = NULL;
+	    break;
+	}
+	DEBUG("Job %lld dispatched to worker %d", (long long)job, (int)w[idle].pid);
+	w[idle].job = job;
+	w[idle].exclusive = exclusive;
+	busy++;
+	if(exclusive)
+	    break;
+    }
+    sqlite3_reset(q->qready);
+}
+
+static int jobmgr_prepare(struct jobmgr_data_t *q, sxc_client_t *sx, const char *dir) {
     sqlite3_stmt *q_vcheck = NULL;
+
+    memset(q, 0, sizeof(*q));
+    q->hashfs = sx_hashfs_open(dir, sx);
+    if(!q->hashfs) {
+	CRIT("Failed to initialize the hash server interface");
+	return -1;
+    }
+
+    q->targets = sx_nodelist_new();
+    if(!q->targets) {
+	WARN("Cannot create target nodelist");
+	return -1;
+    }
+
+    q->eventdb = sx_hashfs_eventdb(q->hashfs);
+
+    if(qprep(q->eventdb, &q->qjob, "SELECT job, type, data, expiry_time < datetime('now'), result, strftime('%s',expiry_time) FROM jobs WHERE complete = 0 AND sched_time <= strftime('%Y-%m-%d %H:%M:%f') AND NOT EXISTS (SELECT 1 FROM jobs AS subjobs WHERE subjobs.job = jobs.parent AND subjobs.complete = 0) ORDER BY sched_time ASC LIMIT 1") ||
+       qprep(q->eventdb, &q->qjobid, "SELECT job, type, data, expiry_time < datetime('now'), result, strftime('%s',expiry_time) FROM jobs WHERE job = :job AND complete = 0") ||
+       qprep(q->eventdb, &q->qready, "SELECT job, type, lock FROM jobs WHERE complete = 0 AND sched_time <= strftime('%Y-%m-%d %H:%M:%f') AND NOT EXISTS (SELECT 1 FROM jobs AS subjobs WHERE subjobs.job = jobs.parent AND subjobs.complete = 0) ORDER BY sched_time ASC") ||
+       qprep(q->eventdb, &q->qdepth, "SELECT COUNT(*) FROM jobs WHERE complete = 0 AND sched_time <= strftime('%Y-%m-%d %H:%M:%f') AND NOT EXISTS (SELECT 1 FROM jobs AS subjobs WHERE subjobs.job = jobs.parent AND subjobs.complete = 0)") ||
+       qprep(q->eventdb, &q->qnext, "SELECT (julianday(MIN(sched_time)) - julianday('now')) * 86400.0 FROM jobs WHERE complete = 0 AND sched_time > strftime('%Y-%m-%d %H:%M:%f')") ||
+       qprep(q->eventdb, &q->qact, "SELECT id, phase, target, addr, internaladdr, capacity FROM actions WHERE job_id = :job AND phase < :maxphase ORDER BY phase") ||
+       qprep(q->eventdb, &q->qfail_children, "WITH RECURSIVE descendents_of(jb) AS (SELECT job FROM jobs WHERE parent = :job UNION SELECT job FROM jobs, descendents_of WHERE jobs.parent = descendents_of.jb) UPDATE jobs SET result = :res, reason = :reason, complete = 1, lock = NULL WHERE job IN (SELECT * FROM descendents_of) AND result = 0") ||
+       qprep(q->eventdb, &q->qfail_parent, "UPDATE jobs SET result = :res, reason = :reason WHERE job = :job AND result = 0") ||
+       qprep(q->eventdb, &q->qcpl, "UPDATE jobs SET complete = 1, lock = NULL WHERE job = :job") ||
+       qprep(q->eventdb, &q->qphs, "UPDATE actions SET phase = :phase WHERE id = :act") ||
+       qprep(q->eventdb, &q->qdly, "UPDATE jobs SET sched_time = strftime('%Y-%m-%d %H:%M:%f', 'now', :delay), reason = :reason WHERE job = :job") ||
+       qprep(q->eventdb, &q->qlfe, "WITH RECURSIVE descendents_of(jb) AS (VALUES(:job) UNION SELECT job FROM jobs, descendents_of WHERE jobs.parent = descendents_of.jb) UPDATE jobs SET expiry_time = datetime(expiry_time, :ttldiff)  WHERE job IN (SELECT * FROM descendents_of)") ||
+       qprep(q->eventdb, &q->qvbump, "INSERT OR REPLACE INTO hashfs (key, value) VALUES ('next_version_check', datetime(:next, 'unixepoch'))") ||
+       qprep(q->eventdb, &q_vcheck, "SELECT strftime('%s', value) FROM hashfs WHERE key = 'next_version_check'")) {
+	sqlite3_finalize(q_vcheck);
+	return -1;
+    }
+
+    if(qstep(q_vcheck) == SQLITE_ROW)
+	q->next_vcheck = sqlite3_column_int(q_vcheck, 0);
+    else
+	q->next_vcheck = time(NULL);
+    qnullify(q_vcheck);
+    return 0;
+}
+
+static void jobmgr_cleanup(struct jobmgr_data_t *q) {
+    sqlite3_finalize(q->qjob);
+    sqlite3_finalize(q->qjobid);
+    sqlite3_finalize(q->qready);
+    sqlite3_finalize(q->qdepth);
+    sqlite3_finalize(q->qnext);
+    sqlite3_finalize(q->qact);
+    sqlite3_finalize(q->qfail_children);
+    sqlite3_finalize(q->qfail_parent);
+    sqlite3_finalize(q->qcpl);
+    sqlite3_finalize(q->qphs);
+    sqlite3_finalize(q->qdly);
+    sqlite3_finalize(q->qlfe);
+    sqlite3_finalize(q->qvbump);
+    sx_nodelist_delete(q->targets);
+    sx_hashfs_close(q->hashfs);
+}
+
+static void jobmgr_housekeeping(struct jobmgr_data_t *q) {
+    sx_hashfs_checkpoint_eventdb(q->hashfs);
+    sx_hashfs_checkpoint_gc(q->hashfs);
+    sx_hashfs_checkpoint_passive(q->hashfs);
+    checkpoint_volume_sizes(q->hashfs);
+}
+
+/* Bounded pool mode: this process picks the ready jobs and hands them to
+ * nworkers forked processes, each with its own hashfs instance */
+static int jobmgr_pool(sxc_client_t *sx, const char *dir, int trigger, unsigned int nworkers) {
+    struct jobmgr_worker_t *w;
+    struct jobmgr_data_t q;
+    unsigned int i, j, nspawned = 0;
+    int ret = EXIT_FAILURE;
+
+    memset(&q, 0, sizeof(q));
+    w = calloc(nworkers, sizeof(*w));
+    if(!w) {
+	CRIT("Out of memory allocating the job manager workers");
+	return EXIT_FAILURE;
+    }
+
+    /* Workers are forked before any database is opened here */
+    for(i=0; i<nworkers; i++) {
+	int cmdp[2], resp[2];
+
+	if(pipe(cmdp)) {
+	    PCRIT("Failed to create the job manager worker pipes");
+	    goto pool_err;
+	}
+	if(pipe(resp)) {
+	    PCRIT("Failed to create the job manager worker pipes");
+	    close(cmdp[0]);
+	    close(cmdp[1]);
+	    goto pool_err;
+	}
+	w[i].job = JOB_FAILURE;
+	w[i].pid = fork();
+	if(w[i].pid < 0) {
+	    PCRIT("Cannot spawn job manager worker");
+	    close(cmdp[0]);
+	    close(cmdp[1]);
+	    close(resp[0]);
+	    close(resp[1]);
+	    goto pool_err;
+	}
+	if(!w[i].pid) {
+	    int wret = EXIT_FAILURE;
+	    for(j=0; j<i; j++) {
+		close(w[j].cmd);
+		close(w[j].res);
+	    }
+	    free(w);
+	    close(trigger);
+	    close(cmdp[1]);
+	    close(resp[0]);
+	    if(!jobmgr_prepare(&q, sx, dir))
+		wret = jobmgr_worker(&q, cmdp[0], resp[1]);
+	    jobmgr_cleanup(&q);
+	    close(cmdp[0]);
+	    close(resp[1]);
+	    return wret;
+	}
+	close(cmdp[0]);
+	close(resp[1]);
+	w[i].cmd = cmdp[1];
+	w[i].res = resp[0];
+	nspawned++;
+    }
+    INFO("Job manager running up to %u concurrent jobs", nworkers);
+
+    if(jobmgr_prepare(&q, sx, dir))
+	goto pool_err;
+
+    while(!terminate) {
+	struct timeval tv;
+	fd_set rfds;
+	int maxfd = trigger, sl;
+	float wait = jobmgr_next_due(&q);
+
+	FD_ZERO(&rfds);
+	FD_SET(trigger, &rfds);
+	for(i=0; i<nworkers; i++) {
+	    FD_SET(w[i].res, &rfds);
+	    if(w[i].res > maxfd)
+		maxfd = w[i].res;
+	}
+	tv.tv_sec = (int)wait;
+	tv.tv_usec = (wait - tv.tv_sec) * 1000000.0;
+	sl = select(maxfd + 1, &rfds, NULL, NULL, &tv);
+	if(sl < 0) {
+	    if(errno == EINTR)
+		continue;
+	    PCRIT("Failed to wait for triggers");
+	    break;
+	}
+	if(FD_ISSET(trigger, &rfds)) {
+	    char buf[256];
+	    if(read(trigger, buf, sizeof(buf)) < 0 && errno != EINTR) {
+		PCRIT("Error reading trigger");
+		break;
+	    }
+	}
+	for(i=0; i<nworkers; i++) {
+	    job_t job;
+	    if(!FD_ISSET(w[i].res, &rfds))
+		continue;
+	    if(read(w[i].res, &job, sizeof(job)) != sizeof(job)) {
+		CRIT("Job manager worker %d has died", (int)w[i].pid);
+		goto pool_err;
+	    }
+	    w[i].job = JOB_FAILURE;
+	    w[i].exclusive = 0;
+	    free(w[i].lock);
+	    w[i].lock = NULL;
+	}
+
+	jobmgr_dispatch(&q, w, nworkers);
+	if(terminate)
+	    break;
+	check_version(&q);
+	jobmgr_housekeeping(&q);
+    }
+    if(terminate)
+	ret = EXIT_SUCCESS;
+
+ pool_err:
+    for(i=0; i<nspawned; i++) {
+	kill(w[i].pid, SIGTERM);
+	close(w[i].cmd);
+	close(w[i].res);
+	free(w[i].lock);
+    }
+    for(i=0; i<nspawned; i++) {
+	int status;
+	while(waitpid(w[i].pid, &status, 0) < 0 && errno == EINTR);
+    }
+    free(w);
+    jobmgr_cleanup(&q);
+    close(trigger);
+    return ret;
+}
+
+int jobmgr(sxc_client_t *sx, const char *self, const char *dir, int pipe) {
     struct jobmgr_data_t q;
     struct sigaction act;
 
@@ -4641,67 +5056,24 @@ int jobmgr(sxc_client_t *sx, const char *self, const char *dir, int pipe) {
     sigaction(SIGUSR1, &act, NULL);
     sigaction(SIGHUP, &act, NULL);
 
-    memset(&q, 0, sizeof(q));
-    q.hashfs = sx_hashfs_open(dir, sx);
-    if(!q.hashfs) {
-	CRIT("Failed to initialize the hash server interface");
-	goto jobmgr_err;
-    }
-
-    q.targets = sx_nodelist_new();
-    if(!q.targets) {
-	WARN("Cannot create target nodelist");
-	goto jobmgr_err;
-    }
+    if(jobmgr_max_jobs > 1)
+	return jobmgr_pool(sx, dir, pipe, jobmgr_max_jobs);
 
-    q.eventdb = sx_hashfs_eventdb(q.hashfs);
-
-    if(qprep(q.eventdb, &q.qjob, "SELECT job, type, data, expiry_time < datetime('now'), result, strftime('%s',expiry_time) FROM jobs WHERE complete = 0 AND sched_time <= strftime('%Y-%m-%d %H:%M:%f') AND NOT EXISTS (SELECT 1 FROM jobs AS subjobs WHERE subjobs.job = jobs.parent AND subjobs.complete = 0) ORDER BY sched_time ASC LIMIT 1") ||
-       qprep(q.eventdb, &q.qact, "SELECT id, phase, target, addr, internaladdr, capacity FROM actions WHERE job_id = :job AND phase < :maxphase ORDER BY phase") ||
-       qprep(q.eventdb, &q.qfail_children, "WITH RECURSIVE descendents_of(jb) AS (SELECT job FROM jobs WHERE parent = :job UNION SELECT job FROM jobs, descendents_of WHERE jobs.parent = descendents_of.jb) UPDATE jobs SET result = :res, reason = :reason, complete = 1, lock = NULL WHERE job IN (SELECT * FROM descendents_of) AND result = 0") ||
-       qprep(q.eventdb, &q.qfail_parent, "UPDATE jobs SET result = :res, reason = :reason WHERE job = :job AND result = 0") ||
-       qprep(q.eventdb, &q.qcpl, "UPDATE jobs SET complete = 1, lock = NULL WHERE job = :job") ||
-       qprep(q.eventdb, &q.qphs, "UPDATE actions SET phase = :phase WHERE id = :act") ||
-       qprep(q.eventdb, &q.qdly, "UPDATE jobs SET sched_time = strftime('%Y-%m-%d %H:%M:%f', 'now', :delay), reason = :reason WHERE job = :job") ||
-       qprep(q.eventdb, &q.qlfe, "WITH RECURSIVE descendents_of(jb) AS (VALUES(:job) UNION SELECT job FROM jobs, descendents_of WHERE jobs.parent = descendents_of.jb) UPDATE jobs SET expiry_time = datetime(expiry_time, :ttldiff)  WHERE job IN (SELECT * FROM descendents_of)") ||
-       qprep(q.eventdb, &q.qvbump, "INSERT OR REPLACE INTO hashfs (key, value) VALUES ('next_version_check', datetime(:next, 'unixepoch'))") ||
-       qprep(q.eventdb, &q_vcheck, "SELECT strftime('%s', value) FROM hashfs WHERE key = 'next_version_check'"))
+    if(jobmgr_prepare(&q, sx, dir))
 	goto jobmgr_err;
 
-    if(qstep(q_vcheck) == SQLITE_ROW)
-	q.next_vcheck = sqlite3_column_int(q_vcheck, 0);
-    else
-	q.next_vcheck = time(NULL);
-    qnullify(q_vcheck);
-
     while(!terminate) {
-	int forced_awake = 0;
-
-        if (wait_trigger(pipe, JOBMGR_DELAY_MIN, &forced_awake))
+        if (wait_trigger(pipe, jobmgr_next_due(&q), NULL))
             break;
 
 	DEBUG("Start processing job queue");
-	jobmgr_process_queue(&q, forced_awake);
+	jobmgr_process_queue(&q);
 	DEBUG("Done processing job queue");
-        sx_hashfs_checkpoint_eventdb(q.hashfs);
-        sx_hashfs_checkpoint_gc(q.hashfs);
-        sx_hashfs_checkpoint_passive(q.hashfs);
-        checkpoint_volume_sizes(q.hashfs);
+	jobmgr_housekeeping(&q);
     }
 
  jobmgr_err:
-    sqlite3_finalize(q.qjob);
-    sqlite3_finalize(q.qact);
-    sqlite3_finalize(q.qfail_children);
-    sqlite3_finalize(q.qfail_parent);
-    sqlite3_finalize(q.qcpl);
-    sqlite3_finalize(q.qphs);
-    sqlite3_finalize(q.qdly);
-    sqlite3_finalize(q.qlfe);
-    sqlite3_finalize(q.qvbump);
-    sqlite3_finalize(q_vcheck);
-    sx_nodelist_delete(q.targets);
-    sx_hashfs_close(q.hashfs);
+    jobmgr_cleanup(&q);
     close(pipe);
     return terminate ? EXIT_SUCCESS : EXIT_FAILURE;
 }
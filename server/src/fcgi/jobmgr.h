@@ -28,6 +28,28 @@
 #ifndef JOBMGR_H
 #define JOBMGR_H
 
+#include "job_common.h"
+
+#define JOBMGR_STATS_TYPES (JOBTYPE_DUMMY + 1)
+
+/* Job manager counters, shared by all the processes forked after
+ * jobmgr_stats_init() */
+typedef struct {
+    uint64_t count;
+    uint64_t total_ms;
+    uint64_t max_ms;
+} jobmgr_type_stats_t;
+
+typedef struct {
+    uint64_t queue_depth; /* Jobs ready to run at the last queue scan */
+    uint64_t running; /* Jobs currently being executed */
+    jobmgr_type_stats_t types[JOBMGR_STATS_TYPES];
+} jobmgr_stats_t;
+
+int jobmgr_stats_init(void);
+void jobmgr_stats_done(void);
+int jobmgr_stats(jobmgr_stats_t *stats);
+
 int jobmgr(sxc_client_t *sx, const char *self, const char *dir, int pipe);
 
 #endif
@@ -41,13 +41,19 @@ const char *node_args_info_full_help[] = {
   "  -N, --new                 Creates a new local SX node in STORAGE_PATH",
   "  -I, --info                Print details about the local node in STORAGE_PATH",
   "  -C, --check               Perform sanity check on the local node in\n                              STORAGE_PATH",
+  "      --compact             Compact the datafiles of the local node in\n                              STORAGE_PATH",
+  "      --reshard=N           Redistribute the databases of the local node in\n                              STORAGE_PATH over N shards",
+  "      --place=RULE          Place the hash database shards of the local node\n                              in STORAGE_PATH according to RULE",
   "  -E, --extract=DESTPATH    Extract all files from the local node in\n                              STORAGE_PATH to DESTPATH",
   "\nNew node options:",
   "  -k, --cluster-key=FILE    File containing a pre-generated cluster\n                              authentication token or stdin if \"-\" is given\n                              (default autogenerate token).",
   "  -b, --batch-mode          Turn off interactive confirmations and assume yes\n                              for all questions",
   "      --owner=user[:group]  Set ownership of storage to user[:group]",
+  "      --db-shards=N         Number of hash and metadata database shards\n                              (default=`16')",
   "  -u, --cluster-uuid=UUID   The SX cluster UUID (default autogenerate UUID).",
   "NOTE: all nodes of an SX cluster must be created with the same UUID and the\nsame authentication token.",
+  "\nCompact options:",
+  "      --compact-rate=N      Maximum number of blocks moved per second\n                              (default=`256')",
   "\nCommon options:",
   "  -H, --human-readable      Print human readable sizes  (default=off)",
   "  -D, --debug               Enable debug messages  (default=off)",
@@ -64,23 +70,30 @@ init_help_array(void)
   node_args_info_help[4] = node_args_info_full_help[4];
   node_args_info_help[5] = node_args_info_full_help[5];
   node_args_info_help[6] = node_args_info_full_help[6];
-  node_args_info_help[7] = node_args_info_full_help[8];
-  node_args_info_help[8] = node_args_info_full_help[9];
-  node_args_info_help[9] = node_args_info_full_help[10];
+  node_args_info_help[7] = node_args_info_full_help[7];
+  node_args_info_help[8] = node_args_info_full_help[8];
+  node_args_info_help[9] = node_args_info_full_help[9];
   node_args_info_help[10] = node_args_info_full_help[11];
-  node_args_info_help[11] = node_args_info_full_help[13];
-  node_args_info_help[12] = node_args_info_full_help[14];
-  node_args_info_help[13] = node_args_info_full_help[15];
-  node_args_info_help[14] = node_args_info_full_help[16];
-  node_args_info_help[15] = 0; 
+  node_args_info_help[11] = node_args_info_full_help[12];
+  node_args_info_help[12] = node_args_info_full_help[13];
+  node_args_info_help[13] = node_args_info_full_help[14];
+  node_args_info_help[14] = node_args_info_full_help[15];
+  node_args_info_help[15] = node_args_info_full_help[17];
+  node_args_info_help[16] = node_args_info_full_help[18];
+  node_args_info_help[17] = node_args_info_full_help[19];
+  node_args_info_help[18] = node_args_info_full_help[20];
+  node_args_info_help[19] = node_args_info_full_help[21];
+  node_args_info_help[20] = node_args_info_full_help[22];
+  node_args_info_help[21] = 0; 
   
 }
 
-const char *node_args_info_help[16];
+const char *node_args_info_help[22];
 
 typedef enum {ARG_NO
   , ARG_FLAG
   , ARG_STRING
+  , ARG_INT
 } node_cmdline_parser_arg_type;
 
 static
@@ -107,11 +120,16 @@ void clear_given (struct node_args_info *args_info)
   args_info->new_given = 0 ;
   args_info->info_given = 0 ;
   args_info->check_given = 0 ;
+  args_info->compact_given = 0 ;
+  args_info->reshard_given = 0 ;
+  args_info->place_given = 0 ;
   args_info->extract_given = 0 ;
   args_info->cluster_key_given = 0 ;
   args_info->batch_mode_given = 0 ;
   args_info->owner_given = 0 ;
+  args_info->db_shards_given = 0 ;
   args_info->cluster_uuid_given = 0 ;
+  args_info->compact_rate_given = 0 ;
   args_info->human_readable_given = 0 ;
   args_info->debug_given = 0 ;
   args_info->MODE_group_counter = 0 ;
@@ -121,14 +139,21 @@ static
 void clear_args (struct node_args_info *args_info)
 {
   FIX_UNUSED (args_info);
+  args_info->reshard_orig = NULL;
+  args_info->place_arg = NULL;
+  args_info->place_orig = NULL;
   args_info->extract_arg = NULL;
   args_info->extract_orig = NULL;
   args_info->cluster_key_arg = NULL;
   args_info->cluster_key_orig = NULL;
   args_info->owner_arg = NULL;
   args_info->owner_orig = NULL;
+  args_info->db_shards_arg = 16;
+  args_info->db_shards_orig = NULL;
   args_info->cluster_uuid_arg = NULL;
   args_info->cluster_uuid_orig = NULL;
+  args_info->compact_rate_arg = 256;
+  args_info->compact_rate_orig = NULL;
   args_info->human_readable_flag = 0;
   args_info->debug_flag = 0;
   
@@ -145,13 +170,18 @@ void init_args_info(struct node_args_info *args_info)
   args_info->new_help = node_args_info_full_help[4] ;
   args_info->info_help = node_args_info_full_help[5] ;
   args_info->check_help = node_args_info_full_help[6] ;
-  args_info->extract_help = node_args_info_full_help[7] ;
-  args_info->cluster_key_help = node_args_info_full_help[9] ;
-  args_info->batch_mode_help = node_args_info_full_help[10] ;
-  args_info->owner_help = node_args_info_full_help[11] ;
-  args_info->cluster_uuid_help = node_args_info_full_help[12] ;
-  args_info->human_readable_help = node_args_info_full_help[15] ;
-  args_info->debug_help = node_args_info_full_help[16] ;
+  args_info->compact_help = node_args_info_full_help[7] ;
+  args_info->reshard_help = node_args_info_full_help[8] ;
+  args_info->place_help = node_args_info_full_help[9] ;
+  args_info->extract_help = node_args_info_full_help[10] ;
+  args_info->cluster_key_help = node_args_info_full_help[12] ;
+  args_info->batch_mode_help = node_args_info_full_help[13] ;
+  args_info->owner_help = node_args_info_full_help[14] ;
+  args_info->db_shards_help = node_args_info_full_help[15] ;
+  args_info->cluster_uuid_help = node_args_info_full_help[16] ;
+  args_info->compact_rate_help = node_args_info_full_help[19] ;
+  args_info->human_readable_help = node_args_info_full_help[21] ;
+  args_info->debug_help = node_args_info_full_help[22] ;
   
 }
 
@@ -247,14 +277,19 @@ static void
 node_cmdline_parser_release (struct node_args_info *args_info)
 {
   unsigned int i;
+  free_string_field (&(args_info->reshard_orig));
+  free_string_field (&(args_info->place_arg));
+  free_string_field (&(args_info->place_orig));
   free_string_field (&(args_info->extract_arg));
   free_string_field (&(args_info->extract_orig));
   free_string_field (&(args_info->cluster_key_arg));
   free_string_field (&(args_info->cluster_key_orig));
   free_string_field (&(args_info->owner_arg));
   free_string_field (&(args_info->owner_orig));
+  free_string_field (&(args_info->db_shards_orig));
   free_string_field (&(args_info->cluster_uuid_arg));
   free_string_field (&(args_info->cluster_uuid_orig));
+  free_string_field (&(args_info->compact_rate_orig));
   
   
   for (i = 0; i < args_info->inputs_num; ++i)
@@ -302,6 +337,12 @@ node_cmdline_parser_dump(FILE *outfile, struct node_args_info *args_info)
     write_into_file(outfile, "info", 0, 0 );
   if (args_info->check_given)
     write_into_file(outfile, "check", 0, 0 );
+  if (args_info->compact_given)
+    write_into_file(outfile, "compact", 0, 0 );
+  if (args_info->reshard_given)
+    write_into_file(outfile, "reshard", args_info->reshard_orig, 0);
+  if (args_info->place_given)
+    write_into_file(outfile, "place", args_info->place_orig, 0);
   if (args_info->extract_given)
     write_into_file(outfile, "extract", args_info->extract_orig, 0);
   if (args_info->cluster_key_given)
@@ -310,8 +351,12 @@ node_cmdline_parser_dump(FILE *outfile, struct node_args_info *args_info)
     write_into_file(outfile, "batch-mode", 0, 0 );
   if (args_info->owner_given)
     write_into_file(outfile, "owner", args_info->owner_orig, 0);
+  if (args_info->db_shards_given)
+    write_into_file(outfile, "db-shards", args_info->db_shards_orig, 0);
   if (args_info->cluster_uuid_given)
     write_into_file(outfile, "cluster-uuid", args_info->cluster_uuid_orig, 0);
+  if (args_info->compact_rate_given)
+    write_into_file(outfile, "compact-rate", args_info->compact_rate_orig, 0);
   if (args_info->human_readable_given)
     write_into_file(outfile, "human-readable", 0, 0 );
   if (args_info->debug_given)
@@ -372,6 +417,12 @@ reset_group_MODE(struct node_args_info *args_info)
   args_info->new_given = 0 ;
   args_info->info_given = 0 ;
   args_info->check_given = 0 ;
+  args_info->compact_given = 0 ;
+  args_info->reshard_given = 0 ;
+  free_string_field (&(args_info->reshard_orig));
+  args_info->place_given = 0 ;
+  free_string_field (&(args_info->place_arg));
+  free_string_field (&(args_info->place_orig));
   args_info->extract_given = 0 ;
   free_string_field (&(args_info->extract_arg));
   free_string_field (&(args_info->extract_orig));
@@ -448,11 +499,21 @@ node_cmdline_parser_required2 (struct node_args_info *args_info, const char *pro
       fprintf (stderr, "%s: '--batch-mode' ('-b') option depends on option 'new'%s\n", prog_name, (additional_error ? additional_error : ""));
       error_occurred = 1;
     }
+  if (args_info->db_shards_given && ! args_info->new_given)
+    {
+      fprintf (stderr, "%s: '--db-shards' option depends on option 'new'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
   if (args_info->cluster_uuid_given && ! args_info->new_given)
     {
       fprintf (stderr, "%s: '--cluster-uuid' ('-u') option depends on option 'new'%s\n", prog_name, (additional_error ? additional_error : ""));
       error_occurred = 1;
     }
+  if (args_info->compact_rate_given && ! args_info->compact_given)
+    {
+      fprintf (stderr, "%s: '--compact-rate' option depends on option 'compact'%s\n", prog_name, (additional_error ? additional_error : ""));
+      error_occurred = 1;
+    }
 
   return error_occurred;
 }
@@ -526,6 +587,9 @@ int update_arg(void *field, char **orig_field,
   case ARG_FLAG:
     *((int *)field) = !*((int *)field);
     break;
+  case ARG_INT:
+    if (val) *((int *)field) = strtol (val, &stop_char, 0);
+    break;
   case ARG_STRING:
     if (val) {
       string_field = (char **)field;
@@ -538,6 +602,17 @@ int update_arg(void *field, char **orig_field,
     break;
   };
 
+  /* check numeric conversion */
+  switch(arg_type) {
+  case ARG_INT:
+    if (val && !(stop_char && *stop_char == '\0')) {
+      fprintf(stderr, "%s: invalid numeric value: %s\n", package_name, val);
+      return 1; /* failure */
+    }
+    break;
+  default:
+    ;
+  };
 
   /* store the original value */
   switch(arg_type) {
@@ -603,11 +678,16 @@ node_cmdline_parser_internal (
         { "new",	0, NULL, 'N' },
         { "info",	0, NULL, 'I' },
         { "check",	0, NULL, 'C' },
+        { "compact",	0, NULL, 0 },
+        { "reshard",	1, NULL, 0 },
+        { "place",	1, NULL, 0 },
         { "extract",	1, NULL, 'E' },
         { "cluster-key",	1, NULL, 'k' },
         { "batch-mode",	0, NULL, 'b' },
         { "owner",	1, NULL, 0 },
+        { "db-shards",	1, NULL, 0 },
         { "cluster-uuid",	1, NULL, 'u' },
+        { "compact-rate",	1, NULL, 0 },
         { "human-readable",	0, NULL, 'H' },
         { "debug",	0, NULL, 'D' },
         { 0,  0, 0, 0 }
@@ -775,6 +855,85 @@ node_cmdline_parser_internal (
                 additional_error))
               goto failure;
           
+          }
+          /* Number of hash and metadata database shards.  */
+          else if (strcmp (long_options[option_index].name, "db-shards") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->db_shards_arg), 
+                 &(args_info->db_shards_orig), &(args_info->db_shards_given),
+                &(local_args_info.db_shards_given), optarg, 0, "16", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "db-shards", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Compact the datafiles of the local node in STORAGE_PATH.  */
+          else if (strcmp (long_options[option_index].name, "compact") == 0)
+          {
+          
+            if (args_info->MODE_group_counter && override)
+              reset_group_MODE (args_info);
+            args_info->MODE_group_counter += 1;
+          
+            if (update_arg( 0 , 
+                 0 , &(args_info->compact_given),
+                &(local_args_info.compact_given), optarg, 0, 0, ARG_NO,
+                check_ambiguity, override, 0, 0,
+                "compact", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Redistribute the databases of the local node in STORAGE_PATH over N shards.  */
+          else if (strcmp (long_options[option_index].name, "reshard") == 0)
+          {
+          
+            if (args_info->MODE_group_counter && override)
+              reset_group_MODE (args_info);
+            args_info->MODE_group_counter += 1;
+          
+            if (update_arg( (void *)&(args_info->reshard_arg), 
+                 &(args_info->reshard_orig), &(args_info->reshard_given),
+                &(local_args_info.reshard_given), optarg, 0, 0, ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "reshard", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Place the hash database shards of the local node in STORAGE_PATH according to RULE.  */
+          else if (strcmp (long_options[option_index].name, "place") == 0)
+          {
+          
+            if (args_info->MODE_group_counter && override)
+              reset_group_MODE (args_info);
+            args_info->MODE_group_counter += 1;
+          
+            if (update_arg( (void *)&(args_info->place_arg), 
+                 &(args_info->place_orig), &(args_info->place_given),
+                &(local_args_info.place_given), optarg, 0, 0, ARG_STRING,
+                check_ambiguity, override, 0, 0,
+                "place", '-',
+                additional_error))
+              goto failure;
+          
+          }
+          /* Maximum number of blocks moved per second.  */
+          else if (strcmp (long_options[option_index].name, "compact-rate") == 0)
+          {
+          
+          
+            if (update_arg( (void *)&(args_info->compact_rate_arg), 
+                 &(args_info->compact_rate_orig), &(args_info->compact_rate_given),
+                &(local_args_info.compact_rate_given), optarg, 0, "256", ARG_INT,
+                check_ambiguity, override, 0, 0,
+                "compact-rate", '-',
+                additional_error))
+              goto failure;
+          
           }
           
           break;
@@ -43,6 +43,13 @@ struct node_args_info
   const char *new_help; /**< @brief Creates a new local SX node in STORAGE_PATH help description.  */
   const char *info_help; /**< @brief Print details about the local node in STORAGE_PATH help description.  */
   const char *check_help; /**< @brief Perform sanity check on the local node in STORAGE_PATH help description.  */
+  const char *compact_help; /**< @brief Compact the datafiles of the local node in STORAGE_PATH help description.  */
+  int reshard_arg;	/**< @brief Redistribute the databases of the local node in STORAGE_PATH over N shards.  */
+  char * reshard_orig;	/**< @brief Redistribute the databases of the local node in STORAGE_PATH over N shards original value given at command line.  */
+  const char *reshard_help; /**< @brief Redistribute the databases of the local node in STORAGE_PATH over N shards help description.  */
+  char * place_arg;	/**< @brief Place the hash database shards of the local node in STORAGE_PATH according to RULE.  */
+  char * place_orig;	/**< @brief Place the hash database shards of the local node in STORAGE_PATH according to RULE original value given at command line.  */
+  const char *place_help; /**< @brief Place the hash database shards of the local node in STORAGE_PATH according to RULE help description.  */
   char * extract_arg;	/**< @brief Extract all files from the local node in STORAGE_PATH to DESTPATH.  */
   char * extract_orig;	/**< @brief Extract all files from the local node in STORAGE_PATH to DESTPATH original value given at command line.  */
   const char *extract_help; /**< @brief Extract all files from the local node in STORAGE_PATH to DESTPATH help description.  */
@@ -53,9 +60,15 @@ struct node_args_info
   char * owner_arg;	/**< @brief Set ownership of storage to user[:group].  */
   char * owner_orig;	/**< @brief Set ownership of storage to user[:group] original value given at command line.  */
   const char *owner_help; /**< @brief Set ownership of storage to user[:group] help description.  */
+  int db_shards_arg;	/**< @brief Number of hash and metadata database shards (default='16').  */
+  char * db_shards_orig;	/**< @brief Number of hash and metadata database shards original value given at command line.  */
+  const char *db_shards_help; /**< @brief Number of hash and metadata database shards help description.  */
   char * cluster_uuid_arg;	/**< @brief The SX cluster UUID (default autogenerate UUID)..  */
   char * cluster_uuid_orig;	/**< @brief The SX cluster UUID (default autogenerate UUID). original value given at command line.  */
   const char *cluster_uuid_help; /**< @brief The SX cluster UUID (default autogenerate UUID). help description.  */
+  int compact_rate_arg;	/**< @brief Maximum number of blocks moved per second (default='256').  */
+  char * compact_rate_orig;	/**< @brief Maximum number of blocks moved per second original value given at command line.  */
+  const char *compact_rate_help; /**< @brief Maximum number of blocks moved per second help description.  */
   int human_readable_flag;	/**< @brief Print human readable sizes (default=off).  */
   const char *human_readable_help; /**< @brief Print human readable sizes help description.  */
   int debug_flag;	/**< @brief Enable debug messages (default=off).  */
@@ -67,11 +80,16 @@ struct node_args_info
   unsigned int new_given ;	/**< @brief Whether new was given.  */
   unsigned int info_given ;	/**< @brief Whether info was given.  */
   unsigned int check_given ;	/**< @brief Whether check was given.  */
+  unsigned int compact_given ;	/**< @brief Whether compact was given.  */
+  unsigned int reshard_given ;	/**< @brief Whether reshard was given.  */
+  unsigned int place_given ;	/**< @brief Whether place was given.  */
   unsigned int extract_given ;	/**< @brief Whether extract was given.  */
   unsigned int cluster_key_given ;	/**< @brief Whether cluster-key was given.  */
   unsigned int batch_mode_given ;	/**< @brief Whether batch-mode was given.  */
   unsigned int owner_given ;	/**< @brief Whether owner was given.  */
+  unsigned int db_shards_given ;	/**< @brief Whether db-shards was given.  */
   unsigned int cluster_uuid_given ;	/**< @brief Whether cluster-uuid was given.  */
+  unsigned int compact_rate_given ;	/**< @brief Whether compact-rate was given.  */
   unsigned int human_readable_given ;	/**< @brief Whether human-readable was given.  */
   unsigned int debug_given ;	/**< @brief Whether debug was given.  */
 
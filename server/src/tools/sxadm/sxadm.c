@@ -173,6 +173,11 @@ static int create_node(struct node_args_info *args) {
     } else
 	uuid_generate(&cluster_uuid);
 
+    if(args->db_shards_arg < 1) {
+	CRIT("Invalid number of database shards %d", args->db_shards_arg);
+	return 1;
+    }
+
     if(read_or_gen_key(args->cluster_key_arg, ROLE_CLUSTER, &auth))
 	return 1;
 
@@ -203,7 +208,7 @@ static int create_node(struct node_args_info *args) {
 	    return 1;
     }
 
-    rc_ty create_fail = sx_storage_create(args->inputs[0], &cluster_uuid, auth.key, sizeof(auth.key));
+    rc_ty create_fail = sx_storage_create(args->inputs[0], &cluster_uuid, auth.key, sizeof(auth.key), args->db_shards_arg, args->db_shards_arg);
     if(create_fail) {
 	printf("Failed to create storage for new node: %s\n", rc2str(create_fail));
 	return 1;
@@ -1299,6 +1304,112 @@ check_node_err:
     return ret;
 }
 
+static int compact_node(sxc_client_t *sx, const char *path, int rate) {
+    int ret = -1;
+    int64_t moved = 0, released = 0;
+    sx_hashfs_t *h = NULL;
+
+    if(!sx || !path) {
+        fprintf(stderr, "ERROR: Failed to compact HashFS: NULL argument\n");
+        return 1;
+    }
+
+    if(rate < 0) {
+        fprintf(stderr, "ERROR: Invalid compaction rate %d\n", rate);
+        return 1;
+    }
+
+    if(access(path, R_OK | W_OK)) {
+        if(errno == EACCES)
+            fprintf(stderr, "ERROR: Can't access %s\n", path);
+        else if(errno == ENOENT)
+            fprintf(stderr, "ERROR: No valid SX storage found at %s\n", path);
+        else
+            fprintf(stderr, "ERROR: Can't open SX storage at %s\n", path);
+        goto compact_node_err;
+    }
+
+    h = sx_hashfs_open(path, sx);
+    if(!h)
+        goto compact_node_err;
+
+    ret = sx_hashfs_compact(h, rate, &moved, &released);
+
+compact_node_err:
+    sx_hashfs_close(h);
+    if(ret)
+        fprintf(stderr, "Failed to compact node %s: %s\n", path, msg_get_reason());
+    else
+        printf("Compaction finished: %lld blocks moved, %lld bytes released\n", (long long)moved, (long long)released);
+    return ret ? 1 : 0;
+}
+
+/* Files created in the storage must belong to its owner */
+static int storage_owner(const char *path) {
+    struct stat st;
+
+    if(stat(path, &st) || access(path, R_OK | W_OK)) {
+        if(errno == EACCES)
+            fprintf(stderr, "ERROR: Can't access %s\n", path);
+        else if(errno == ENOENT)
+            fprintf(stderr, "ERROR: No valid SX storage found at %s\n", path);
+        else
+            fprintf(stderr, "ERROR: Can't open SX storage at %s\n", path);
+        return 1;
+    }
+
+    if(!geteuid() && st.st_uid && (setgid(st.st_gid) || setuid(st.st_uid))) {
+        fprintf(stderr, "ERROR: Can't switch to the owner of %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int reshard_node(sxc_client_t *sx, const char *path, int nshards) {
+    rc_ty ret;
+
+    if(!sx || !path) {
+        fprintf(stderr, "ERROR: Failed to reshard HashFS: NULL argument\n");
+        return 1;
+    }
+
+    if(nshards < 1) {
+        fprintf(stderr, "ERROR: Invalid number of shards %d\n", nshards);
+        return 1;
+    }
+
+    if(storage_owner(path))
+        return 1;
+
+    ret = sx_storage_reshard(path, sx, nshards, nshards);
+    if(ret != OK) {
+        fprintf(stderr, "Failed to reshard node %s: %s\n", path, msg_get_reason());
+        return 1;
+    }
+    printf("Node %s now uses %d hash and metadata database shards\n", path, nshards);
+    return 0;
+}
+
+static int place_node(sxc_client_t *sx, const char *path, const char *rule) {
+    rc_ty ret;
+
+    if(!sx || !path || !rule) {
+        fprintf(stderr, "ERROR: Failed to place HashFS shards: NULL argument\n");
+        return 1;
+    }
+
+    if(storage_owner(path))
+        return 1;
+
+    ret = sx_storage_place(path, sx, rule);
+    if(ret != OK) {
+        fprintf(stderr, "Failed to apply placement rule %s to node %s: %s\n", rule, path, msg_get_reason());
+        return 1;
+    }
+    printf("Placement rule %s applied to node %s\n", rule, path);
+    return 0;
+}
+
 static int extract_node(sxc_client_t *sx, const char *path, const char *destpath) {
     int ret = -1;
     sx_hashfs_t *h = NULL;
@@ -1382,6 +1493,12 @@ int main(int argc, char **argv) {
 	    ret = info_node(sx, node_args.inputs[0], &node_args);
         else if(node_args.check_given)
             ret = check_node(sx, node_args.inputs[0], node_args.debug_flag);
+        else if(node_args.compact_given)
+            ret = compact_node(sx, node_args.inputs[0], node_args.compact_rate_arg);
+        else if(node_args.reshard_given)
+            ret = reshard_node(sx, node_args.inputs[0], node_args.reshard_arg);
+        else if(node_args.place_given)
+            ret = place_node(sx, node_args.inputs[0], node_args.place_arg);
         else if(node_args.extract_given)
             ret = extract_node(sx, node_args.inputs[0], node_args.extract_arg);
     node_out:
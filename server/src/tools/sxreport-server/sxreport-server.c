@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <yajl/yajl_version.h>
 #include <errno.h>
 
@@ -46,6 +47,7 @@
 #include "sqlite3.h"
 #include "hashfs.h"
 #include "init.h"
+#include "stats.h"
 #include "../../fcgi/cfgfile.h"
 #include "../../../libsx/src/sxreport.h"
 #include "../../../libsx/src/sxlog.h"
@@ -350,11 +352,53 @@ static void print_info(sxc_client_t *sx, const char *sysconfdir)
     print_mem();
 }
 
+static void print_stats(sxc_client_t *sx, const char *path)
+{
+    sx_stats_t *st;
+    unsigned int i, j;
+    char started[32];
+    time_t t;
+
+    sxi_report_section(sx, "Request and database statistics");
+    if (!(st = malloc(sizeof(*st))) || sx_stats_read(path, st)) {
+        INFO("\tN/A");
+        free(st);
+        return;
+    }
+    t = st->started;
+    strftime(started, sizeof(started), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    INFO("Collected since: %s", started);
+    for (i = 0; i < SX_STATS_REQS; i++) {
+        const sx_stats_req_t *r = &st->reqs[i];
+        char hist[SX_STATS_BUCKETS * 21];
+        unsigned int len = 0;
+        if (!(r->key & 1) || !r->count)
+            continue;
+        for (j = 0; j < SX_STATS_BUCKETS; j++)
+            len += snprintf(hist + len, sizeof(hist) - len, "%s%llu", j ? " " : "", (unsigned long long)r->hist[j]);
+        INFO("\t%-24s: %llu requests (%llu 4xx, %llu 5xx), %llu bytes in, %llu bytes out, %llu us average, %llu us max",
+             r->name, (unsigned long long)r->count, (unsigned long long)r->errors_4xx, (unsigned long long)r->errors_5xx,
+             (unsigned long long)r->bytes_in, (unsigned long long)r->bytes_out,
+             (unsigned long long)(r->total_us / r->count), (unsigned long long)r->max_us);
+        INFO("\t%-24s  latency histogram: %s", "", hist);
+    }
+    for (i = 0; i < SX_STATS_DBS; i++) {
+        const sx_stats_db_t *d = &st->dbs[i];
+        if (!(d->key & 1))
+            continue;
+        INFO("\t%-24s: %llu busy retries, %llu busy timeouts, %llu ms waited",
+             d->name, (unsigned long long)d->retries, (unsigned long long)d->timeouts, (unsigned long long)d->wait_ms);
+    }
+    free(st);
+}
+
 static void print_storage(sxc_client_t *sx)
 {
     sxi_report_section(sx, "Storage status");
-    if (fcgi_args.data_dir_given)
+    if (fcgi_args.data_dir_given) {
         print_hashfs(sx, fcgi_args.data_dir_arg);
+        print_stats(sx, fcgi_args.data_dir_arg);
+    }
 }
 
 static void print_logs(const char *sysconfdir)
@@ -0,0 +1,55 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Helpers shared by the benchmark programs */
+
+#include "default.h"
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "benchutil.h"
+
+double bench_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int bench_upload(sxc_client_t *sx, sxc_cluster_t *cluster, const char *volume, const char *local, const char *remote) {
+    sxc_file_t *src, *dest = NULL;
+    int ret = -1;
+
+    if(!(src = sxc_file_local(sx, local)) ||
+       !(dest = sxc_file_remote(cluster, volume, remote, NULL)) ||
+       sxc_copy(src, dest, 0, 0, 0, NULL))
+	fprintf(stderr, "Upload of %s failed: %s\n", remote, sxc_geterrmsg(sx));
+    else
+	ret = 0;
+    sxc_file_free(src);
+    sxc_file_free(dest);
+    return ret;
+}
@@ -0,0 +1,241 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Compares the two block download paths of fcgi_send_blocks(): the buffered
+ * one (pread into a block buffer, copy into the FastCGI stream buffer, write)
+ * and the zero-copy one (sendfile from the datafile to the socket).
+ * A child process drains the other end of a socketpair standing in for the
+ * web server. */
+
+#include "default.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "benchutil.h"
+
+#define FCGX_BUFSIZE 8192
+#define RECORD_PAYLOAD 65528
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *ptr = buf;
+    while(len) {
+	ssize_t l = write(fd, ptr, len);
+	if(l < 0) {
+	    if(errno == EINTR)
+		continue;
+	    return -1;
+	}
+	ptr += l;
+	len -= l;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len, off_t off) {
+    char *ptr = buf;
+    while(len) {
+	ssize_t l = pread(fd, ptr, len, off);
+	if(l < 0) {
+	    if(errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if(!l)
+	    return -1;
+	ptr += l;
+	len -= l;
+	off += l;
+    }
+    return 0;
+}
+
+static void fill_header(unsigned char *hdr, unsigned int len) {
+    hdr[0] = 1; /* FCGI_VERSION_1 */
+    hdr[1] = 6; /* FCGI_STDOUT */
+    hdr[2] = 0;
+    hdr[3] = 1;
+    hdr[4] = len >> 8;
+    hdr[5] = len & 0xff;
+    hdr[6] = 0;
+    hdr[7] = 0;
+}
+
+static int send_buffered(int sock, int fd, unsigned int bs, unsigned int nblocks, unsigned char *block) {
+    unsigned char stream[8 + FCGX_BUFSIZE];
+    unsigned int i, pos;
+
+    for(i=0; i<nblocks; i++) {
+	if(read_all(fd, block, bs, (off_t)i * bs))
+	    return -1;
+	for(pos = 0; pos < bs; ) {
+	    unsigned int todo = bs - pos;
+	    if(todo > FCGX_BUFSIZE)
+		todo = FCGX_BUFSIZE;
+	    memcpy(stream + 8, block + pos, todo);
+	    fill_header(stream, todo);
+	    if(write_all(sock, stream, todo + 8))
+		return -1;
+	    pos += todo;
+	}
+    }
+    return 0;
+}
+
+static int send_zerocopy(int sock, int fd, unsigned int bs, unsigned int nblocks, unsigned char *block) {
+    off_t off = 0, end = (off_t)bs * nblocks;
+    unsigned char hdr[8];
+
+    while(off < end) {
+	unsigned int todo = end - off > RECORD_PAYLOAD ? RECORD_PAYLOAD : end - off;
+	fill_header(hdr, todo);
+	if(write_all(sock, hdr, sizeof(hdr)))
+	    return -1;
+#ifdef __linux__
+	while(todo) {
+	    ssize_t l = sendfile(sock, fd, &off, todo);
+	    if(l < 0 && errno == EINTR)
+		continue;
+	    if(l <= 0)
+		return -1;
+	    todo -= l;
+	}
+#else
+	if(read_all(fd, block, todo, off) || write_all(sock, block, todo))
+	    return -1;
+	off += todo;
+#endif
+    }
+    return 0;
+}
+
+static void drain(int sock) {
+    char buf[65536];
+    while(read(sock, buf, sizeof(buf)) > 0);
+    _exit(0);
+}
+
+static double run(const char *name, int (*sender)(int, int, unsigned int, unsigned int, unsigned char *), int fd, unsigned int bs, unsigned int nblocks, unsigned int rounds, unsigned char *block) {
+    int sv[2], status;
+    unsigned int i;
+    double start, elapsed;
+    pid_t pid;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+	perror("socketpair");
+	return -1;
+    }
+    pid = fork();
+    if(pid < 0) {
+	perror("fork");
+	return -1;
+    }
+    if(!pid) {
+	close(sv[0]);
+	drain(sv[1]);
+    }
+    close(sv[1]);
+
+    start = bench_now();
+    for(i=0; i<rounds; i++)
+	if(sender(sv[0], fd, bs, nblocks, block)) {
+	    perror(name);
+	    break;
+	}
+    elapsed = bench_now() - start;
+    close(sv[0]);
+    waitpid(pid, &status, 0);
+    if(i != rounds)
+	return -1;
+
+    printf("%-10s %8.2f MB/s (%.3f s)\n", name, (double)bs * nblocks * rounds / elapsed / 1048576.0, elapsed);
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    unsigned int bs = 1048576, nblocks = 64, rounds = 16, i;
+    char tmpl[] = "/tmp/blockdl-bench.XXXXXX";
+    unsigned char *block;
+    int fd, ret = 0;
+
+    if(argc > 4) {
+	fprintf(stderr, "Usage: %s [blocksize] [blocks] [rounds]\n", argv[0]);
+	return 1;
+    }
+    if(argc > 1)
+	bs = atoi(argv[1]);
+    if(argc > 2)
+	nblocks = atoi(argv[2]);
+    if(argc > 3)
+	rounds = atoi(argv[3]);
+    if(!bs || !nblocks || !rounds) {
+	fprintf(stderr, "Invalid arguments\n");
+	return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if(!(block = malloc(bs))) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+    fd = mkstemp(tmpl);
+    if(fd < 0) {
+	perror("mkstemp");
+	free(block);
+	return 1;
+    }
+    unlink(tmpl);
+    for(i=0; i<nblocks; i++) {
+	memset(block, i & 0xff, bs);
+	if(write_all(fd, block, bs)) {
+	    perror("write");
+	    ret = 1;
+	    goto bench_out;
+	}
+    }
+
+    printf("Sending %u blocks of %u bytes, %u rounds\n", nblocks, bs, rounds);
+    /* Warm up the page cache so both paths read from memory */
+    if(run("warmup", send_buffered, fd, bs, nblocks, 1, block) < 0 ||
+       run("buffered", send_buffered, fd, bs, nblocks, rounds, block) < 0 ||
+       run("zero-copy", send_zerocopy, fd, bs, nblocks, rounds, block) < 0)
+	ret = 1;
+
+ bench_out:
+    close(fd);
+    free(block);
+    return ret;
+}
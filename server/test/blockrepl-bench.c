@@ -0,0 +1,134 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Measures block replication throughput through the block manager: files
+ * with fresh content are uploaded to a volume and each upload waits for its
+ * flush job, which only completes once every replica has got the blocks.
+ * Run it against a volume with replica > 1 and compare with a replica 1
+ * volume on the same cluster. */
+
+#include "default.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sx.h"
+#include "version.h"
+#include "benchutil.h"
+
+#define DEFAULT_FILES 8
+#define DEFAULT_SIZE_MB 64
+
+int main(int argc, char **argv) {
+    unsigned int i, nfiles = DEFAULT_FILES, size_mb = DEFAULT_SIZE_MB;
+    char local[] = "/tmp/blockrepl-bench-XXXXXX", remote[64];
+    double total = 0, start;
+    sxc_client_t *sx = NULL;
+    sxc_cluster_t *cluster = NULL;
+    sxc_uri_t *uri = NULL;
+    sxc_logger_t log;
+    uint32_t *data = NULL;
+    size_t size;
+    int fd = -1, ret = 1;
+
+    if(argc < 2 || argc > 4) {
+	fprintf(stderr, "Usage: %s sx://[profile@]cluster/volume [files [size_mb]]\n", argv[0]);
+	return 1;
+    }
+    if(argc > 2 && !(nfiles = atoi(argv[2]))) {
+	fprintf(stderr, "Invalid number of files\n");
+	return 1;
+    }
+    if(argc > 3 && !(size_mb = atoi(argv[3]))) {
+	fprintf(stderr, "Invalid file size\n");
+	return 1;
+    }
+    size = (size_t)size_mb * 1024 * 1024;
+
+    if(!(data = malloc(size))) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+
+    sx = sxc_init(SRC_VERSION, sxc_default_logger(&log, argv[0]), sxc_input_fn, NULL);
+    if(!sx) {
+	fprintf(stderr, "Cannot initialize SX\n");
+	goto bench_out;
+    }
+    uri = sxc_parse_uri(sx, argv[1]);
+    if(!uri || !uri->volume) {
+	fprintf(stderr, "Bad volume URI: %s\n", uri ? "no volume given" : sxc_geterrmsg(sx));
+	goto bench_out;
+    }
+    cluster = sxc_cluster_load_and_update(sx, uri->host, uri->profile);
+    if(!cluster) {
+	fprintf(stderr, "Cannot load cluster: %s\n", sxc_geterrmsg(sx));
+	goto bench_out;
+    }
+
+    fd = mkstemp(local);
+    if(fd < 0) {
+	perror("Cannot create the local file");
+	goto bench_out;
+    }
+
+    for(i=0; i<nfiles; i++) {
+	size_t j;
+	double t;
+
+	/* Fresh content each time so that every block needs replicating */
+	for(j=0; j<size / sizeof(*data); j++)
+	    data[j] = (j + ((size_t)i << 28) + getpid()) * 2654435761u;
+	if(pwrite(fd, data, size, 0) != size || ftruncate(fd, size)) {
+	    perror("Cannot write the local file");
+	    goto bench_out;
+	}
+	snprintf(remote, sizeof(remote), "blockrepl-bench/%d-%u", (int)getpid(), i);
+
+	start = bench_now();
+	if(bench_upload(sx, cluster, uri->volume, local, remote))
+	    goto bench_out;
+	t = bench_now() - start;
+	total += t;
+	printf("%s: %8.2f MB/s\n", remote, size_mb / t);
+    }
+
+    printf("%u files of %u MB: %.2f MB/s\n", nfiles, size_mb, nfiles * size_mb / total);
+    ret = 0;
+
+ bench_out:
+    if(fd >= 0) {
+	close(fd);
+	unlink(local);
+    }
+    sxc_cluster_free(cluster);
+    sxc_free_uri(uri);
+    sxc_shutdown(sx, 0);
+    free(data);
+    return ret;
+}
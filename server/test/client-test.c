@@ -2340,6 +2340,8 @@ int main(int argc, char **argv) {
         goto main_err;
     if(volume_test(sx, cluster, volname, filter_dir, "zcomp", "level:1", local_dir_path, remote_dir_path, &args, 3))
         goto main_err;
+    if(volume_test(sx, cluster, volname, filter_dir, "zcomp", "algo:zlib", local_dir_path, remote_dir_path, &args, 3))
+        goto main_err;
     if(volume_test(sx, cluster, volname, filter_dir, "attribs", NULL, local_dir_path, remote_dir_path, &args, 4))
         goto main_err;
     if(volume_test(sx, cluster, volname, filter_dir, "undelete", TRASH_NAME, local_dir_path, remote_dir_path, &args, 5))
@@ -0,0 +1,149 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Compares applying 1k-hash hashop batches one hash at a time
+ * (sx_hashfs_hashop_perform/sx_hashfs_hashop_mod, one transaction each)
+ * with sx_hashfs_hashop_batch (one transaction per hash db) on a scratch
+ * local storage */
+
+#include "default.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hashfs.h"
+#include "init.h"
+#include "utils.h"
+#include "../libsx/src/misc.h"
+#include "benchutil.h"
+
+#define BATCH_SIZE 1000
+#define DEFAULT_ROUNDS 10
+#define EXPIRES (time(NULL) + 3600)
+
+static void fill_batch(sx_hashop_entry_t *ops, unsigned int round, unsigned int replica, int count) {
+    unsigned int i, seed[2];
+
+    for(i=0; i<BATCH_SIZE; i++) {
+	seed[0] = round;
+	seed[1] = i;
+	sx_hashfs_hash_buf(NULL, 0, seed, sizeof(seed), &ops[i].hash);
+	ops[i].block_size = SX_BS_SMALL;
+	ops[i].replica = replica;
+	ops[i].count = count;
+    }
+}
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/hashop-bench-XXXXXX", id[SXI_SHA1_TEXT_LEN + 1];
+    unsigned int i, r, rounds = DEFAULT_ROUNDS;
+    double t_single[2] = { 0, 0 }, t_batch[2] = { 0, 0 }, start;
+    sx_hashop_entry_t ops[BATCH_SIZE];
+    uint8_t key[AUTH_KEY_LEN];
+    sxc_client_t *sx = NULL;
+    sx_hashfs_t *h = NULL;
+    sxc_logger_t log;
+    sx_uuid_t uuid;
+    sx_hash_t idhash;
+    int present, created = 0, ret = 1;
+
+    if(argc > 2) {
+	fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+	return 1;
+    }
+    if(argc > 1 && !(rounds = atoi(argv[1]))) {
+	fprintf(stderr, "Invalid number of rounds\n");
+	return 1;
+    }
+
+    sx = sx_init(sxc_default_logger(&log, argv[0]), NULL, NULL, 0, argc, argv);
+    if(!sx) {
+	fprintf(stderr, "Cannot initialize SX\n");
+	return 1;
+    }
+    if(!mkdtemp(dir)) {
+	perror("Cannot create the storage directory");
+	goto bench_out;
+    }
+    created = 1;
+    uuid_generate(&uuid);
+    memset(key, 0x5a, sizeof(key));
+    if(sx_storage_create(dir, &uuid, key, sizeof(key), 16, 16) != OK || !(h = sx_hashfs_open(dir, sx))) {
+	fprintf(stderr, "Cannot create the scratch storage in %s\n", dir);
+	goto bench_out;
+    }
+    sx_hashfs_hash_buf(NULL, 0, dir, strlen(dir), &idhash);
+    bin2hex(idhash.b, sizeof(idhash.b), id, sizeof(id));
+
+    /* Odd rounds go through the old path, even ones through the batch so
+     * that both see a database of about the same size */
+    for(r=0; r<rounds * 2; r++) {
+	int single = r & 1;
+
+	fill_batch(ops, r, 0, 0);
+	start = bench_now();
+	if(single) {
+	    for(i=0; i<BATCH_SIZE; i++)
+		if(sx_hashfs_hashop_perform(h, SX_BS_SMALL, 0, HASHOP_RESERVE, &ops[i].hash, id, EXPIRES, &present) != OK)
+		    break;
+	} else
+	    i = sx_hashfs_hashop_batch(h, ops, BATCH_SIZE, id, EXPIRES) == OK ? BATCH_SIZE : 0;
+	if(i != BATCH_SIZE) {
+	    fprintf(stderr, "Reserve failed: %s\n", msg_get_reason());
+	    goto bench_out;
+	}
+	(single ? t_single : t_batch)[0] += bench_now() - start;
+
+	fill_batch(ops, r, 1, 1);
+	start = bench_now();
+	if(single) {
+	    for(i=0; i<BATCH_SIZE; i++) {
+		rc_ty rc = sx_hashfs_hashop_mod(h, &ops[i].hash, id, SX_BS_SMALL, 1, 1, EXPIRES);
+		if(rc != OK && rc != ENOENT)
+		    break;
+	    }
+	} else
+	    i = sx_hashfs_hashop_batch(h, ops, BATCH_SIZE, id, EXPIRES) == OK ? BATCH_SIZE : 0;
+	if(i != BATCH_SIZE) {
+	    fprintf(stderr, "Inuse failed: %s\n", msg_get_reason());
+	    goto bench_out;
+	}
+	(single ? t_single : t_batch)[1] += bench_now() - start;
+    }
+
+    printf("reserve: single %8.2f ms/batch, batched %8.2f ms/batch\n", t_single[0] * 1000 / rounds, t_batch[0] * 1000 / rounds);
+    printf("inuse:   single %8.2f ms/batch, batched %8.2f ms/batch\n", t_single[1] * 1000 / rounds, t_batch[1] * 1000 / rounds);
+    ret = 0;
+
+ bench_out:
+    sx_hashfs_close(h);
+    if(created && sxi_rmdirs(dir))
+	fprintf(stderr, "Cannot remove %s\n", dir);
+    sx_done(&sx);
+    return ret;
+}
@@ -0,0 +1,179 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Measures the end-to-end latency of the job manager as seen by a client:
+ * each round uploads a small file (PUT and wait for the flush job) and then
+ * deletes it (wait for the delete job). Needs a running cluster and a
+ * writable volume. */
+
+#include "default.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sx.h"
+#include "version.h"
+#include "benchutil.h"
+
+#define DEFAULT_ROUNDS 50
+#define DEFAULT_SIZE 1024
+
+static int cmpdbl(const void *a, const void *b) {
+    double da = *(const double *)a, db = *(const double *)b;
+    return da < db ? -1 : da > db;
+}
+
+static void report(const char *what, double *ms, unsigned int n) {
+    double total = 0;
+    unsigned int i;
+
+    qsort(ms, n, sizeof(*ms), cmpdbl);
+    for(i=0; i<n; i++)
+	total += ms[i];
+    printf("%-8s min %8.1f ms, avg %8.1f ms, p50 %8.1f ms, p99 %8.1f ms, max %8.1f ms\n", what,
+	   ms[0], total / n, ms[n / 2], ms[(n * 99) / 100], ms[n - 1]);
+}
+
+static int delete(sxc_client_t *sx, sxc_cluster_t *cluster, const char *volume, const char *remote) {
+    sxc_file_list_t *lst;
+    sxc_file_t *file;
+    int ret = -1;
+
+    if(!(lst = sxc_file_list_new(sx, 0)))
+	return -1;
+    if(!(file = sxc_file_remote(cluster, volume, remote, NULL)))
+	goto delete_out;
+    if(sxc_file_list_add(lst, file, 0)) {
+	sxc_file_free(file);
+	goto delete_out;
+    }
+    if(!sxc_rm(lst))
+	ret = 0;
+
+ delete_out:
+    if(ret)
+	fprintf(stderr, "Delete of %s failed: %s\n", remote, sxc_geterrmsg(sx));
+    sxc_file_list_free(lst);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    unsigned int i, rounds = DEFAULT_ROUNDS, size = DEFAULT_SIZE;
+    char local[] = "/tmp/jobflush-bench-XXXXXX", remote[64];
+    double *put_ms = NULL, *del_ms = NULL, start;
+    sxc_client_t *sx = NULL;
+    sxc_cluster_t *cluster = NULL;
+    sxc_uri_t *uri = NULL;
+    sxc_logger_t log;
+    uint8_t *data = NULL;
+    int fd = -1, ret = 1;
+
+    if(argc < 2 || argc > 4) {
+	fprintf(stderr, "Usage: %s sx://[profile@]cluster/volume [rounds [size]]\n", argv[0]);
+	return 1;
+    }
+    if(argc > 2 && !(rounds = atoi(argv[2]))) {
+	fprintf(stderr, "Invalid number of rounds\n");
+	return 1;
+    }
+    if(argc > 3 && !(size = atoi(argv[3]))) {
+	fprintf(stderr, "Invalid file size\n");
+	return 1;
+    }
+
+    put_ms = malloc(rounds * sizeof(*put_ms));
+    del_ms = malloc(rounds * sizeof(*del_ms));
+    data = malloc(size);
+    if(!put_ms || !del_ms || !data) {
+	fprintf(stderr, "Out of memory\n");
+	goto bench_out;
+    }
+
+    sx = sxc_init(SRC_VERSION, sxc_default_logger(&log, argv[0]), sxc_input_fn, NULL);
+    if(!sx) {
+	fprintf(stderr, "Cannot initialize SX\n");
+	goto bench_out;
+    }
+    uri = sxc_parse_uri(sx, argv[1]);
+    if(!uri || !uri->volume) {
+	fprintf(stderr, "Bad volume URI: %s\n", uri ? "no volume given" : sxc_geterrmsg(sx));
+	goto bench_out;
+    }
+    cluster = sxc_cluster_load_and_update(sx, uri->host, uri->profile);
+    if(!cluster) {
+	fprintf(stderr, "Cannot load cluster: %s\n", sxc_geterrmsg(sx));
+	goto bench_out;
+    }
+
+    fd = mkstemp(local);
+    if(fd < 0) {
+	perror("Cannot create the local file");
+	goto bench_out;
+    }
+
+    for(i=0; i<rounds; i++) {
+	unsigned int j;
+
+	/* Fresh content each round so no upload is short-circuited by dedup */
+	for(j=0; j<size; j++)
+	    data[j] = ((j + i * size + getpid()) * 2654435761u) >> 24;
+	if(pwrite(fd, data, size, 0) != size || ftruncate(fd, size)) {
+	    perror("Cannot write the local file");
+	    goto bench_out;
+	}
+	snprintf(remote, sizeof(remote), "jobflush-bench/%d-%u", (int)getpid(), i);
+
+	start = bench_now();
+	if(bench_upload(sx, cluster, uri->volume, local, remote))
+	    goto bench_out;
+	put_ms[i] = (bench_now() - start) * 1000.0;
+
+	start = bench_now();
+	if(delete(sx, cluster, uri->volume, remote))
+	    goto bench_out;
+	del_ms[i] = (bench_now() - start) * 1000.0;
+    }
+
+    printf("%u rounds, %u byte files\n", rounds, size);
+    report("PUT", put_ms, rounds);
+    report("DELETE", del_ms, rounds);
+    ret = 0;
+
+ bench_out:
+    if(fd >= 0) {
+	close(fd);
+	unlink(local);
+    }
+    sxc_cluster_free(cluster);
+    sxc_free_uri(uri);
+    sxc_shutdown(sx, 0);
+    free(put_ms);
+    free(del_ms);
+    free(data);
+    return ret;
+}
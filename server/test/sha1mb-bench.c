@@ -0,0 +1,117 @@
+/*
+ *  Copyright (C) 2012-2014 Skylable Ltd. <info-copyright@skylable.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *  Special exception for linking this software with OpenSSL:
+ *
+ *  In addition, as a special exception, Skylable Ltd. gives permission to
+ *  link the code of this program with the OpenSSL library and distribute
+ *  linked combinations including the two. You must obey the GNU General
+ *  Public License in all respects for all of the code used other than
+ *  OpenSSL. You may extend this exception to your version of the program,
+ *  but you are not obligated to do so. If you do not wish to do so, delete
+ *  this exception statement from your version.
+ */
+
+/* Compares hashing blocks one by one (sx_hashfs_hash_buf) with the
+ * multi-buffer SHA1 (sx_hashfs_hash_bufs) for each block size */
+
+#include "default.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashfs.h"
+#include "benchutil.h"
+
+#define TOTAL_SIZE (64*1024*1024)
+#define SALT "c9ccb5a4-5b4b-4e15-94c7-4f9b7d1de0a6"
+
+int main(int argc, char **argv) {
+    const unsigned int sizes[] = { SX_BS_SMALL, SX_BS_MEDIUM, SX_BS_LARGE };
+    unsigned int i, j, total = TOTAL_SIZE, nblocks, rounds = 4, r;
+    sx_hash_t *single = NULL, *multi = NULL;
+    const void **bufs = NULL;
+    uint8_t *data;
+    int ret = 1;
+
+    if(argc > 2) {
+	fprintf(stderr, "Usage: %s [rounds]\n", argv[0]);
+	return 1;
+    }
+    if(argc > 1 && !(rounds = atoi(argv[1]))) {
+	fprintf(stderr, "Invalid number of rounds\n");
+	return 1;
+    }
+
+    if(!(data = malloc(total))) {
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+    }
+    for(i=0; i<total; i++)
+	data[i] = (i * 2654435761u) >> 24;
+
+    for(i=0; i<sizeof(sizes)/sizeof(*sizes); i++) {
+	double t_single = 0, t_multi = 0, start;
+
+	nblocks = total / sizes[i];
+	free(single);
+	free(multi);
+	free(bufs);
+	single = malloc(nblocks * sizeof(*single));
+	multi = malloc(nblocks * sizeof(*multi));
+	bufs = malloc(nblocks * sizeof(*bufs));
+	if(!single || !multi || !bufs) {
+	    fprintf(stderr, "Out of memory\n");
+	    goto bench_out;
+	}
+	for(j=0; j<nblocks; j++)
+	    bufs[j] = data + (uint64_t)j * sizes[i];
+
+	for(r=0; r<rounds; r++) {
+	    start = bench_now();
+	    for(j=0; j<nblocks; j++)
+		if(sx_hashfs_hash_buf(SALT, strlen(SALT), bufs[j], sizes[i], &single[j])) {
+		    fprintf(stderr, "Hashing failed\n");
+		    goto bench_out;
+		}
+	    t_single += bench_now() - start;
+
+	    start = bench_now();
+	    if(sx_hashfs_hash_bufs(SALT, strlen(SALT), bufs, sizes[i], nblocks, multi)) {
+		fprintf(stderr, "Multi-buffer hashing failed\n");
+		goto bench_out;
+	    }
+	    t_multi += bench_now() - start;
+	}
+
+	if(memcmp(single, multi, nblocks * sizeof(*single))) {
+	    fprintf(stderr, "Hash mismatch for block size %u\n", sizes[i]);
+	    goto bench_out;
+	}
+
+	printf("%8u: single %8.2f MB/s, multi %8.2f MB/s\n", sizes[i],
+	       (double)total * rounds / t_single / 1048576.0,
+	       (double)total * rounds / t_multi / 1048576.0);
+    }
+    ret = 0;
+
+ bench_out:
+    free(single);
+    free(multi);
+    free(bufs);
+    free(data);
+    return ret;
+}
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Compares small file upload throughput over HTTP/1.1 and multiplexed HTTP/2.
+# Run from the server directory against a local nginx + sx.fcgi cluster
+# started with test/start-nginx-ssl.sh. HTTP/2 is only negotiated over SSL,
+# so the nodes need it enabled in sxhttpd.conf (e.g. "listen ... ssl http2;")
+# and nginx built with the http_v2 module, otherwise both runs use HTTP/1.1.
+set -e
+
+CLUSTER=${1-localhost}
+NFILES=${2-1000}
+FILESIZE=${3-4096}
+ROUNDS=${ROUNDS-3}
+SXVOL=`pwd`/../client/src/tools/vol/sxvol
+SXCP=`pwd`/../client/src/tools/cp/sxcp
+SXRM=`pwd`/../client/src/tools/rm/sxrm
+VOLUME=uploadbench
+
+now() {
+    perl -MTime::HiRes=time -e 'printf "%.3f\n", time'
+}
+
+# Each round gets new contents, so that deduplication doesn't skip the uploads
+gen_files() {
+    rm -rf "$DIR/files"
+    mkdir "$DIR/files"
+    i=0
+    while [ $i -lt $NFILES ]; do
+        test/randgen $FILESIZE $FILESIZE `printf "%x%08x" $1 $i` >"$DIR/files/$i" 2>/dev/null
+        i=$((i+1))
+    done
+}
+
+DIR=`mktemp -d ${TMPDIR:-/tmp}/upload-bench.XXXXXX`
+trap 'rm -rf "$DIR"' EXIT
+
+echo "Uploading $ROUNDS x $NFILES files of $FILESIZE bytes in each mode"
+gen_files 1
+$SXVOL create -o admin -r 1 -s 10G sx://$CLUSTER/$VOLUME || true
+
+if $SXCP -v --http2 "$DIR/files/0" sx://$CLUSTER/$VOLUME/probe 2>&1 | grep -q "over HTTP/2"; then
+    echo "Cluster negotiated HTTP/2"
+else
+    echo "WARNING: cluster did not negotiate HTTP/2, --http2 will fall back to HTTP/1.1"
+fi
+$SXRM sx://$CLUSTER/$VOLUME/probe
+
+seed=2
+for mode in http1 http2; do
+    opt=
+    [ $mode = http2 ] && opt=--http2
+    r=1
+    while [ $r -le $ROUNDS ]; do
+        gen_files $seed
+        seed=$((seed+1))
+        start=`now`
+        $SXCP -q -r $opt "$DIR/files/" sx://$CLUSTER/$VOLUME/$mode/
+        end=`now`
+        perl -e "printf \"%s round %d: %.2fs, %.1f files/s, %.2f MB/s\n\", '$mode', $r, $end - $start, $NFILES / ($end - $start), $NFILES * $FILESIZE / ($end - $start) / 1048576"
+        $SXRM -r sx://$CLUSTER/$VOLUME/$mode/
+        r=$((r+1))
+    done
+done